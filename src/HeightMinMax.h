@@ -0,0 +1,15 @@
+#pragma once
+
+// per quadtree node bounds, shared by the runtime and the offline tools (no Ogre dependency)
+struct HeightMinMax
+{
+	unsigned short minY;
+	unsigned short maxY;
+	// max height deviation of this node's patch from the heightmap, in the same units as minY/maxY
+	unsigned short maxError;
+	// normal cone of the node in world space: axis x/z in [-127, 127] (y is always up),
+	// half angle in 1/255 of 90 degrees, 255 for none (can face any direction)
+	signed char coneX;
+	signed char coneZ;
+	unsigned char coneSpread;
+};
@@ -3,10 +3,12 @@
 #include "OgreMaterialManager.h"
 #include "OgreTechnique.h"
 #include "OgreCamera.h"
+#include "TerrainStartup.h"
 
 void LOD_getMorphConsts(int lodLevel, float consts[]);
 const MapDimensions& LOD_getMapInfo();
-Ogre::MaterialPtr& GetMaterial();
+const Ogre::MaterialPtr& LOD_getNodeMaterial(const NodeInfo& ni);
+void LOD_getNodeCoeff(const NodeInfo& ni, float coeff[]);
 
 namespace Ogre
 {
@@ -22,31 +24,27 @@ namespace Ogre
 
 	const MaterialPtr& OgreGridRenderable::getMaterial(void) const
 	{
-		return GetMaterial();
+		return LOD_getNodeMaterial(nodeInfo);
 	}
 
-	void OgreGridRenderable::initOgreGridRenderable(int gridDimension)
+	// CPU side of the grid mesh shared by all the nodes, built off the render thread at startup
+	struct GridGeometry
 	{
-		// TODO: considering multiple/dynamic initialization,
-		// maybe need to free the existing vertex/index buffer
-
-		vertexData = new VertexData();
-		vertexData->vertexCount = gridDimension * gridDimension;
-
-		// vertex declaration
-		VertexDeclaration* decl = vertexData->vertexDeclaration;
-		size_t offset = 0;
-		decl->addElement(0, offset, VET_FLOAT3, VES_POSITION);
-		offset += VertexElement::getTypeSize(VET_FLOAT3);
-		decl->addElement(0, offset, VET_FLOAT3, VES_NORMAL);
-		offset += VertexElement::getTypeSize(VET_FLOAT3);
+		std::vector<float> vertices;
+		std::vector<unsigned short> indices;
+		int childNodeIndexCount;
+		int indexEndTL;
+		int indexEndTR;
+		int indexEndBL;
+	};
+	static GridGeometry _gridGeometry;
 
-		HardwareBufferManager& hbm = HardwareBufferManager::getSingleton();
-		HardwareVertexBufferSharedPtr vbuf = hbm.createVertexBuffer(
-				offset, vertexData->vertexCount, HardwareBuffer::HBU_STATIC_WRITE_ONLY);
-		VertexBufferBinding* bind = vertexData->vertexBufferBinding;
-		bind->setBinding(0, vbuf);
-		float* pVertex = static_cast<float*>(vbuf->lock(HardwareBuffer::HBL_DISCARD));
+	void OgreGridRenderable::buildGridGeometry(int gridDimension)
+	{
+		GridGeometry& g = _gridGeometry;
+		// position, normal
+		g.vertices.resize(gridDimension * gridDimension * 6);
+		float* pVertex = &g.vertices[0];
 		float scale = 1.0f / (gridDimension - 1);
 		for (int z = 0; z < gridDimension; z++)
 		{
@@ -63,11 +61,10 @@ namespace Ogre
 				*pVertex++ = 0;
 			}
 		}
-		vbuf->unlock();
 
 		const int ibufCount = (gridDimension - 1) * (gridDimension - 1) * 6;
-		unsigned short* indexBuffer = new unsigned short[ibufCount];
-		unsigned short* pIndices = indexBuffer;
+		g.indices.resize(ibufCount);
+		unsigned short* pIndices = &g.indices[0];
 
 	#define ICOORD(x,z)	((x) + (z)*gridDimension)
 #if 0
@@ -152,11 +149,48 @@ namespace Ogre
 		}
 		indexEndBR = index;
 #endif
+		g.childNodeIndexCount = childNodeIndexCount;
+		g.indexEndTL = indexEndTL;
+		g.indexEndTR = indexEndTR;
+		g.indexEndBL = indexEndBL;
+	}
+
+	void OgreGridRenderable::createGridBuffers(int gridDimension)
+	{
+		// TODO: considering multiple/dynamic initialization,
+		// maybe need to free the existing vertex/index buffer
+		GridGeometry& g = _gridGeometry;
+
+		vertexData = new VertexData();
+		vertexData->vertexCount = gridDimension * gridDimension;
+
+		// vertex declaration
+		VertexDeclaration* decl = vertexData->vertexDeclaration;
+		size_t offset = 0;
+		decl->addElement(0, offset, VET_FLOAT3, VES_POSITION);
+		offset += VertexElement::getTypeSize(VET_FLOAT3);
+		decl->addElement(0, offset, VET_FLOAT3, VES_NORMAL);
+		offset += VertexElement::getTypeSize(VET_FLOAT3);
+
+		HardwareBufferManager& hbm = HardwareBufferManager::getSingleton();
+		HardwareVertexBufferSharedPtr vbuf = hbm.createVertexBuffer(
+				offset, vertexData->vertexCount, HardwareBuffer::HBU_STATIC_WRITE_ONLY);
+		VertexBufferBinding* bind = vertexData->vertexBufferBinding;
+		bind->setBinding(0, vbuf);
+		vbuf->writeData(0, g.vertices.size() * sizeof(float), &g.vertices[0], true);
+
+		const int ibufCount = (int)g.indices.size();
+		const unsigned short* indexBuffer = &g.indices[0];
+		const int childNodeIndexCount = g.childNodeIndexCount;
+		const int indexEndTL = g.indexEndTL;
+		const int indexEndTR = g.indexEndTR;
+		const int indexEndBL = g.indexEndBL;
+
 		const int sizeUS = sizeof(unsigned short);
 		const size_t sizeInBytes = childNodeIndexCount * sizeUS;
 		const HardwareBuffer::Usage hbu = HardwareBuffer::HBU_STATIC_WRITE_ONLY;
 		const HardwareIndexBuffer::IndexType itype = HardwareIndexBuffer::IT_16BIT;
-		HardwareIndexBufferSharedPtr ibuf[5];
+		HardwareIndexBufferSharedPtr ibuf[6];
 
 		// All
 		ibuf[0] = hbm.createIndexBuffer(itype, ibufCount, hbu);
@@ -190,7 +224,15 @@ namespace Ogre
 		// copy BL, BR
 		ibuf[4]->writeData(sizeInBytes, 2 * sizeInBytes, indexBuffer + indexEndTR);
 
-		delete[] indexBuffer;
+		// TL, BR: with holes a patch can lose two opposite quadrants
+		ibuf[5] = hbm.createIndexBuffer(itype, childNodeIndexCount * 2, hbu);
+		// copy TL
+		ibuf[5]->writeData(0, sizeInBytes, indexBuffer);
+		// copy BR
+		ibuf[5]->writeData(sizeInBytes, sizeInBytes, indexBuffer + indexEndBL);
+
+		std::vector<float>().swap(g.vertices);
+		std::vector<unsigned short>().swap(g.indices);
 
 		for (int i = 0; i < 16; i++)
 			indexData[i] = new IndexData();
@@ -240,8 +282,8 @@ namespace Ogre
 		indexData[8]->indexStart = indexEndBL;
 		indexData[8]->indexCount = childNodeIndexCount;
 
-		// TL, BR - possible?
-		indexData[9]->indexBuffer = ibuf[2];
+		// TL, BR
+		indexData[9]->indexBuffer = ibuf[5];
 		indexData[9]->indexStart = 0;
 		indexData[9]->indexCount = childNodeIndexCount * 2;
 
@@ -276,6 +318,20 @@ namespace Ogre
 		indexData[15]->indexCount = ibufCount;
 	}
 
+	void OgreGridRenderable::initOgreGridRenderable(int gridDimension)
+	{
+		buildGridGeometry(gridDimension);
+		createGridBuffers(gridDimension);
+	}
+
+	void OgreGridRenderable::addInitTasks(StartupGraph& graph, int gridDimension)
+	{
+		StartupGraph::TaskId geometry = graph.add("grid geometry", StartupGraph::WorkerThread,
+			[gridDimension]() { buildGridGeometry(gridDimension); });
+		graph.add("grid buffers", StartupGraph::RenderThread,
+			[gridDimension]() { createGridBuffers(gridDimension); }, std::vector<StartupGraph::TaskId>(1, geometry));
+	}
+
 	void OgreGridRenderable::deinitOgreGridRenderable()
 	{
 	}
@@ -299,15 +355,9 @@ namespace Ogre
 			params->_writeRawConstants(constantEntry.physicalIndex, f, 4);
 			break;
 		case 12: // nodeCoeff
-		{
-			const MapDimensions& mapInfo = LOD_getMapInfo();
-			f[0] = (float)nodeInfo.X / mapInfo.nGridX;
-			f[1] = (float)nodeInfo.Z / mapInfo.nGridZ;
-			f[2] = (float)nodeInfo.Size / mapInfo.nGridX;
-			f[3] = (float)nodeInfo.Size / mapInfo.nGridZ;
+			LOD_getNodeCoeff(nodeInfo, f);
 			params->_writeRawConstants(constantEntry.physicalIndex, f, 4);
 			break;
-		}
 		default:
 			Renderable::_updateCustomGpuParameter(constantEntry, params);
 		}
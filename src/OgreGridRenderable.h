@@ -2,6 +2,8 @@
 #include "OgreMovableObject.h"
 #include "OgreAxisAlignedBox.h"
 
+class StartupGraph;
+
 struct MapDimensions
 {
 	float	MinX;
@@ -36,10 +38,12 @@ struct NodeInfo
 	bool           BL;
 	bool           BR;
 	int            LODLevel;
+	// GPU slot of the heightmap tile to sample, -1 for the whole heightmap
+	int            TileSlot;
 
 	NodeInfo()      {}
-	NodeInfo( unsigned int x, unsigned int z, unsigned short size, unsigned short minY, unsigned short maxY, int LODLevel, bool tl, bool tr, bool bl, bool br )
-		: X(x), Z(z), Size((unsigned short)size), MinY(minY), MaxY(maxY), LODLevel(LODLevel), TL(tl), TR(tr), BL(bl), BR(br)
+	NodeInfo( unsigned int x, unsigned int z, unsigned short size, unsigned short minY, unsigned short maxY, int LODLevel, bool tl, bool tr, bool bl, bool br, int tileSlot = -1 )
+		: X(x), Z(z), Size((unsigned short)size), MinY(minY), MaxY(maxY), LODLevel(LODLevel), TL(tl), TR(tr), BL(bl), BR(br), TileSlot(tileSlot)
 	{}
 };
 
@@ -57,6 +61,9 @@ namespace Ogre
 		static IndexData* indexData[16];
 		static LightList lightList;
 
+		static void buildGridGeometry(int gridDimension);
+		static void createGridBuffers(int gridDimension);
+
 	public:
 		// pure virtual functions of Renderable
 		virtual const MaterialPtr& getMaterial(void) const;
@@ -97,6 +104,8 @@ namespace Ogre
 		void setNodeInfo(const NodeInfo& ni);
 
 		static void initOgreGridRenderable(int gridDimension);
+		// the same as initOgreGridRenderable, split into a worker and a render thread step
+		static void addInitTasks(StartupGraph& graph, int gridDimension);
 		static void deinitOgreGridRenderable();
 	};
 }
\ No newline at end of file
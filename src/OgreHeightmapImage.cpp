@@ -0,0 +1,179 @@
+#include "OgreHeightmapImage.h"
+#include "OgreResourceGroupManager.h"
+#include "OgreException.h"
+#include "OgreStringConverter.h"
+#include <cmath>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include "windows.h"
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const Ogre::String& path)
+{
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (!mapping)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	void* data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	if (!data)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	m_file = file;
+	m_mapping = mapping;
+	m_size = (size_t)size.QuadPart;
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+	void* data = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	m_size = (size_t)st.st_size;
+#endif
+	m_data = data;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (!m_data)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(m_data);
+	CloseHandle((HANDLE)m_mapping);
+	CloseHandle((HANDLE)m_file);
+#else
+	munmap(m_data, m_size);
+#endif
+	m_data = 0;
+	m_size = 0;
+	m_file = 0;
+	m_mapping = 0;
+}
+
+void MappedFile::swap(MappedFile& other)
+{
+	std::swap(m_data, other.m_data);
+	std::swap(m_size, other.m_size);
+	std::swap(m_file, other.m_file);
+	std::swap(m_mapping, other.m_mapping);
+}
+
+bool HeightmapImage::isRaw(const Ogre::String& name)
+{
+	return Ogre::StringUtil::endsWith(name, ".r16");
+}
+
+Ogre::String HeightmapImage::resolvePath(const Ogre::String& name, const Ogre::String& group)
+{
+	Ogre::FileInfoListPtr files = Ogre::ResourceGroupManager::getSingleton().findResourceFileInfo(group, name);
+	if (files.isNull() || files->empty())
+		return name;
+	const Ogre::FileInfo& fi = files->front();
+	return fi.archive->getName() + "/" + fi.filename;
+}
+
+void HeightmapImage::load(const Ogre::String& name, const Ogre::String& group)
+{
+	if (isRaw(name))
+	{
+		loadRaw(resolvePath(name, group));
+		return;
+	}
+	unload();
+	m_image->load(name, group);
+	if (m_image->getFormat() != Ogre::PF_L16)
+	{
+		unload();
+		OGRE_EXCEPT(Ogre::Exception::ERR_INVALIDPARAMS, name + " is not a 16-bit grayscale heightmap", "HeightmapImage::load");
+	}
+}
+
+void HeightmapImage::load(Ogre::DataStreamPtr& stream, const Ogre::String& type)
+{
+	unload();
+	m_image->load(stream, type);
+	if (m_image->getFormat() != Ogre::PF_L16)
+	{
+		unload();
+		OGRE_EXCEPT(Ogre::Exception::ERR_INVALIDPARAMS, "Not a 16-bit grayscale heightmap", "HeightmapImage::load");
+	}
+}
+
+void HeightmapImage::loadRaw(const Ogre::String& path)
+{
+	unload();
+	if (!m_mapping.open(path))
+		OGRE_EXCEPT(Ogre::Exception::ERR_FILE_NOT_FOUND, "Cannot map " + path, "HeightmapImage::loadRaw");
+
+	const unsigned char* data = (const unsigned char *)m_mapping.getData();
+	const size_t size = m_mapping.getSize();
+	size_t width, height, offset;
+	const R16Header* header = (const R16Header *)data;
+	const bool hasHeader = size >= sizeof(R16Header) && memcmp(header->magic, "R16H", 4) == 0;
+	if (hasHeader)
+	{
+		width = header->width;
+		height = header->height;
+		offset = header->dataOffset;
+	}
+	else
+	{
+		// headerless, has to be square
+		width = height = (size_t)(sqrt((double)(size / 2)) + 0.5);
+		offset = 0;
+	}
+
+	// the pixels are read in place as unsigned short, never over the header
+	if (width < 2 || height < 2 || offset % 2 != 0 || offset > size || (size - offset) / 2 < width * height ||
+		(hasHeader && offset < sizeof(R16Header)) || (!hasHeader && width * height * 2 != size))
+	{
+		m_mapping.close();
+		OGRE_EXCEPT(Ogre::Exception::ERR_INVALIDPARAMS, path + " is not a valid R16 heightmap", "HeightmapImage::loadRaw");
+	}
+
+	m_image->loadDynamicImage((Ogre::uchar *)m_mapping.getData() + offset, width, height, 1, Ogre::PF_L16, false);
+}
+
+void HeightmapImage::unload()
+{
+	delete m_image;
+	m_image = new Ogre::Image();
+	m_mapping.close();
+}
+
+void HeightmapImage::swap(HeightmapImage& other)
+{
+	std::swap(m_image, other.m_image);
+	m_mapping.swap(other.m_mapping);
+}
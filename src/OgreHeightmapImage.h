@@ -0,0 +1,72 @@
+#pragma once
+
+#include "OgreImage.h"
+
+// Read-only file mapped into memory; the pages are copy-on-write so the contents can be edited in place
+class MappedFile
+{
+private:
+	void* m_data;
+	size_t m_size;
+	void* m_file;
+	void* m_mapping;
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+public:
+	MappedFile() : m_data(0), m_size(0), m_file(0), m_mapping(0) {}
+	~MappedFile() { close(); }
+
+	bool open(const Ogre::String& path);
+	void close();
+	void swap(MappedFile& other);
+
+	void* getData() { return m_data; }
+	const void* getData() const { return m_data; }
+	size_t getSize() const { return m_size; }
+};
+
+// Raw R16 heightmap (*.r16): little-endian 16-bit heights, either headerless and square,
+// or starting with this header
+struct R16Header
+{
+	char magic[4];				// "R16H"
+	unsigned int width;
+	unsigned int height;
+	unsigned int dataOffset;	// from the start of the file
+};
+
+// 16-bit heightmap pixels, either decoded by Ogre::Image or memory-mapped from a raw R16 file.
+// A mapped heightmap is read in place: Ogre::Image only wraps the mapping, no copy is made.
+class HeightmapImage
+{
+private:
+	// a pointer so that swapping never copies the pixels
+	Ogre::Image* m_image;
+	MappedFile m_mapping;
+
+	HeightmapImage(const HeightmapImage&);
+	HeightmapImage& operator=(const HeightmapImage&);
+public:
+	HeightmapImage() : m_image(new Ogre::Image()) {}
+	~HeightmapImage() { delete m_image; }
+
+	static bool isRaw(const Ogre::String& name);
+	// file system path of a resource, for mapping it
+	static Ogre::String resolvePath(const Ogre::String& name, const Ogre::String& group);
+
+	// main thread only, it goes through the resource system
+	void load(const Ogre::String& name, const Ogre::String& group);
+	// safe on any thread
+	void load(Ogre::DataStreamPtr& stream, const Ogre::String& type);
+	void loadRaw(const Ogre::String& path);
+	void unload();
+	void swap(HeightmapImage& other);
+
+	unsigned short* getData() { return (unsigned short *)m_image->getData(); }
+	const unsigned short* getData() const { return (const unsigned short *)m_image->getData(); }
+	size_t getWidth() const { return m_image->getWidth(); }
+	size_t getHeight() const { return m_image->getHeight(); }
+	Ogre::PixelBox getPixelBox() const { return m_image->getPixelBox(); }
+	const Ogre::Image& getImage() const { return *m_image; }
+};
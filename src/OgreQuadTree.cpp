@@ -1,8 +1,23 @@
 #include "OgreAxisAlignedBox.h"
 #include "OgreCamera.h"
 #include "OgreSceneManager.h"
-#include "OgreGridRenderable.h"
-#include "OgreImage.h"
+#include "OgreQuadTree.h"
+#include "OgreHeightmapImage.h"
+#include "OgreTextureManager.h"
+#include "OgreHardwarePixelBuffer.h"
+#include "OgreResourceGroupManager.h"
+#include "TerrainUploadScheduler.h"
+#include "TerrainStartup.h"
+#include "TerrainHoles.h"
+#include "TerrainQuery.h"
+#include "TerrainHorizon.h"
+#include "TerrainOcclusion.h"
+#include "TerrainObjects.h"
+#include "TerrainPVS.h"
+#include "OgreLogManager.h"
+#include <memory>
+#include <map>
+#include <algorithm>
 
 enum LODSelectResult
 {
@@ -26,12 +41,8 @@ static unsigned short _nMaxLODSize;
 
 static std::vector<float> _lodRangeDistRatios;
 static std::vector<float> _lodSqRanges;
-
-struct HeightMinMax
-{
-	unsigned short minY;
-	unsigned short maxY;
-};
+// the ranges by the distance alone, before the geometric error shrinks them
+static std::vector<float> _lodDistanceSqRanges;
 
 struct MorphConstants
 {
@@ -43,6 +54,8 @@ struct MorphConstants
 static std::vector<MorphConstants> _morphConsts;
 static float _morphStartRatio = 0.66f;
 
+static LODSelectStats _selectStats;
+
 static const int _maxSelectionCount = 4096;
 static int _ogreGridRenderableCount = 0;
 static Ogre::OgreGridRenderable _ogreGridRenderables[_maxSelectionCount];
@@ -50,11 +63,139 @@ static Ogre::OgreGridRenderable _ogreGridRenderables[_maxSelectionCount];
 static const char* _baseMaterialName = "OgreGridRenderableMaterial";
 static Ogre::MaterialPtr _material;
 static size_t _nMaterial = 0;
+// every clone of the base material, _material included
+static std::vector<Ogre::MaterialPtr> _materials;
 
 static unsigned int _heightmap_width;
 static unsigned int _heightmap_height;
+// heightmap pixels covered by one unit grid (neighboring grids share the border pixels)
+static int _nPixelX;
+static int _nPixelZ;
+static int _gridDim;
+static TerrainPyramidParams _pyramidParams;
+
+// error-driven refinement
+static float _errorThreshold = 0.0f;
+static float _errorViewportHeight = 1080.0f;
+// (world size of one pixel at distance 1) * threshold
+static float _errorDistanceScale = 0.0f;
+
+// CPU copies of hmap1 and hmap2, kept for runtime edits
+struct HeightmapLayer
+{
+	HeightmapImage image;
+	Ogre::String textureName;
+	// pixel rectangles edited since the last flush
+	std::vector<Ogre::Box> dirtyRects;
+	// flushed edits still uploading; their nodes keep the widened min/max until the texture shows the new heights
+	std::vector<Ogre::Box> uploadingRects;
+};
+static HeightmapLayer _heightmaps[2];
+// hmap1 is a tiled package, there is no hmap2 then
+static bool _tiled = false;
+
+// where hmap1 has data; pixels of the no-data height are holes, the nodes without any data are not drawn
+static int _noDataHeight = -1;
+static TerrainHoleTree _holes;
+
+static const HeightMinMax& getHeightMinMax(int layer, int lodLevel, int x, int z, bool shrink);
+static HeightMinMax getBlendedHeightMinMax(int lodLevel, int x, int z);
+static void getLevelErrorBounds(int lodLevel, float& maxError, float& maxExtent);
+
+// blend ratio of hmap1 against hmap2 as set to the shaders
+static float _heightBlendRatio = 1.0f;
+
+// Horizon occlusion culling: the nodes are visited front to back, each selected node raises the horizon
+// by the terrain it surely has, and the nodes whose max height stays under it are culled
+static bool _horizonCulling = false;
+static TerrainHorizon _horizon;
+// occluders are refined until they span this many bins of the horizon
+static const float _horizonOccluderBins = 16.0f;
+
+// Software occlusion culling: the designated occluders and columns under the terrain are rasterized into a
+// small depth buffer before the selection, and the nodes behind it are culled
+static std::unique_ptr<OcclusionBuffer> _occlusionBuffer;
+struct OccluderMesh
+{
+	std::vector<float> vertices;
+	std::vector<unsigned int> indices;
+};
+static std::map<int, OccluderMesh> _occluders;
+static int _nextOccluderId = 1;
+// terrain columns are split down to this times their distance
+static const float _terrainOccluderSplitRatio = 0.25f;
+static const size_t _maxTerrainOccluders = 4096;
+
+static bool getQuerySource(TerrainQuerySource& src);
+
+// objects placed on the terrain, culled with the nodes they are in
+static TerrainObjectIndex _objects;
+static std::vector<TerrainObjectIndex::ObjectId> _visibleObjects;
+
+// The selection of this and the previous frame sorted by node, diffed into the delta for the listeners
+struct SelectedNode
+{
+	unsigned long long key;
+	NodeInfo info;
+
+	bool operator<(const SelectedNode& other) const { return key < other.key; }
+};
+static std::vector<SelectedNode> _selectedNodes;
+static std::vector<SelectedNode> _prevSelectedNodes;
+static LODSelectionDelta _selectionDelta;
+static std::map<int, LODSelectionListener> _selectionListeners;
+static int _nextSelectionListener = 1;
+
+// Precomputed visibility: the states of the nodes for the camera's cell, empty off the cells, and the visible
+// nodes of the tile levels for the prefetcher, of the camera's cell and of the one it is about to cut to
+static TerrainPVS _pvs;
+static int _pvsCell = -1;
+static std::vector<unsigned char> _pvsStates;
+struct PVSTile
+{
+	int lodLevel;
+	unsigned int x;
+	unsigned int z;
+};
+static std::vector<PVSTile> _pvsTiles;
+static int _pvsHintCell = -1;
+static Ogre::Vector3 _pvsHintPosition;
+static std::vector<PVSTile> _pvsHintTiles;
 
-static const HeightMinMax& getHeightMinMax(int lodLevel, int x, int z, bool shrink);
+static TerrainObjectIndex::Visibility toObjectVisibility(IntersectType it)
+{
+	switch (it)
+	{
+	case Outside:
+		return TerrainObjectIndex::Outside;
+	case Inside:
+		return TerrainObjectIndex::Inside;
+	default:
+		return TerrainObjectIndex::Intersect;
+	}
+}
+
+// CPU height queries and ray casts may come from any thread; what they read is changed under the write lock
+static TerrainQueryLock _queryLock;
+// bumped whenever the heights the queries see change
+static unsigned int _heightmapVersion = 0;
+
+// texture updates after LOD_init go through the scheduler, within a per-frame budget
+class OgreUploadBackend : public UploadBackend
+{
+public:
+	virtual void upload(void* texture, const unsigned short* src, size_t pitch, const UploadRect& rect)
+	{
+		Ogre::Box box(rect.left, rect.top, rect.right, rect.bottom);
+		Ogre::PixelBox image(pitch, rect.bottom, 1, Ogre::PF_L16, (void *)src);
+		((Ogre::Texture *)texture)->getBuffer()->blitFromMemory(image.getSubVolume(box), box);
+	}
+};
+static OgreUploadBackend _uploadBackend;
+static UploadScheduler _uploadScheduler(&_uploadBackend);
+// edits first as they are small and the user waits for them, then whole layers, then the streamed tiles
+static const float _editUploadPriority = 0.0f;
+static const float _layerUploadPriority = 1.0f;
 
 const MapDimensions& LOD_getMapInfo()
 {
@@ -126,7 +267,7 @@ void GetCornerPoints(Ogre::Vector3 corners[], const Ogre::AxisAlignedBox& aabb)
 	corners[8] = aabb.getCenter();
 }
 
-IntersectType TestInBoundingPlanes(const Ogre::AxisAlignedBox& aabb, const Ogre::Camera& cam)
+IntersectType TestInBoundingPlanes(const Ogre::AxisAlignedBox& aabb, const Ogre::Plane* planes)
 {
 	Ogre::Vector3 corners[9];
 	GetCornerPoints(corners, aabb);
@@ -134,8 +275,6 @@ IntersectType TestInBoundingPlanes(const Ogre::AxisAlignedBox& aabb, const Ogre:
 	Ogre::Vector3 boxSize = aabb.getSize();
 	float size = boxSize.length();
 
-	const Ogre::Plane* planes = cam.getFrustumPlanes();
-
 	// test box's bounding sphere against all planes - removes many false tests, adds one more check
 	for(int p = 0; p < 6; p++) 
 	{
@@ -182,67 +321,447 @@ IntersectType TestInBoundingPlanes(const Ogre::AxisAlignedBox& aabb, const Ogre:
 	return Intersect;
 }
 
-LODSelectResult LOD_select(const Ogre::Camera& cam, bool parentInFrustum, unsigned int x, unsigned int z, unsigned short size, int LODLevel)
+IntersectType TestInBoundingPlanes(const Ogre::AxisAlignedBox& aabb, const Ogre::Camera& cam)
+{
+	return TestInBoundingPlanes(aabb, cam.getFrustumPlanes());
+}
+
+// true if every normal of the node faces away from the camera, wherever on the node it is
+static bool IsBackFacing(const HeightMinMax& h, const Ogre::AxisAlignedBox& aabb, const Ogre::Vector3& camPos)
+{
+	float coneAxis[3];
+	float spread;
+	if (!decodeNormalCone(h, coneAxis, spread))
+		return false;
+	Ogre::Vector3 axis(coneAxis[0], coneAxis[1], coneAxis[2]);
+
+	// cone of the directions from the camera to the box
+	Ogre::Vector3 toNode = aabb.getCenter() - camPos;
+	float dist = toNode.length();
+	float radius = aabb.getHalfSize().length();
+	if (dist <= radius)
+		return false;
+	float viewSpread = asinf(radius / dist);
+	float angle = acosf(std::max(-1.0f, std::min(1.0f, toNode.dotProduct(axis) / dist)));
+	return angle + viewSpread + spread < Ogre::Math::HALF_PI;
+}
+
+// lowest blended height of the heightmap pixels in the rectangle, inclusive
+static unsigned short getBlendedPixelMin(unsigned int left, unsigned int top, unsigned int right, unsigned int bottom)
+{
+	unsigned short layerMin[2] = { 65535, 65535 };
+	const bool blend = _heightBlendRatio < 1.0f && _heightmaps[1].image.getData();
+	for (int layer = 0; layer < (blend ? 2 : 1); layer++)
+	{
+		const unsigned short* pixels = (const unsigned short *)_heightmaps[layer].image.getData();
+		for (unsigned int iz = top; iz <= bottom; iz++)
+		{
+			const unsigned short* row = pixels + (size_t)iz * _heightmap_width;
+			for (unsigned int ix = left; ix <= right; ix++)
+				layerMin[layer] = std::min(layerMin[layer], row[ix]);
+		}
+	}
+	if (!blend || _heightBlendRatio >= 1.0f)
+		return layerMin[0];
+	if (_heightBlendRatio <= 0.0f)
+		return layerMin[1];
+	return (unsigned short)floorf(layerMin[1] + (layerMin[0] - layerMin[1]) * _heightBlendRatio);
+}
+
+// Raises the horizon by the terrain a selected node surely draws: the footprint at its min height, split up
+// through the pyramid and into pixel blocks where it looks wide from the camera, as a single min hides the ridges.
+// The pieces are never finer than two cells of the node's mesh (minPixels), since a morphing vertex moves
+// by a cell and the triangles span the cells, so the drawn surface within a piece stays above its min.
+static void addHorizonOccluders(const Ogre::Camera& cam, unsigned int x, unsigned int z, unsigned short size, int LODLevel, float minPixels)
+{
+	// a hole may be cut anywhere
+	if (_noDataHeight >= 0)
+		return;
+	const Ogre::Vector3& eye = cam.getPosition();
+	const float x0 = _mapInfo.MinX + x * _mapInfo.gridSizeX, x1 = x0 + size * _mapInfo.gridSizeX;
+	const float z0 = _mapInfo.MinZ + z * _mapInfo.gridSizeZ, z1 = z0 + size * _mapInfo.gridSizeZ;
+	const float dx = std::max(std::max(x0 - eye.x, eye.x - x1), 0.0f);
+	const float dz = std::max(std::max(z0 - eye.z, eye.z - z1), 0.0f);
+	const float dist = sqrtf(dx * dx + dz * dz);
+	// what is nearer than the near plane is clipped away
+	if (dist <= cam.getNearClipDistance())
+		return;
+	const float maxWidth = _horizonOccluderBins * Ogre::Math::TWO_PI * dist / _horizon.getBinCount();
+	const float width = size * std::max(_mapInfo.gridSizeX, _mapInfo.gridSizeZ);
+	if (width > maxWidth && LODLevel > 0 && size / 2 * _nPixelX >= minPixels)
+	{
+		const unsigned short halfSize = size / 2;
+		for (int q = 0; q < 4; q++)
+			addHorizonOccluders(cam, x + (q & 1) * halfSize, z + (q >> 1) * halfSize, halfSize, LODLevel - 1, minPixels);
+		return;
+	}
+	// the pixels of pending uploads are not drawn yet, the pyramid is widened by the edits at once
+	if (width > maxWidth && LODLevel == 0 && !_tiled && _heightmaps[0].image.getData() &&
+		LOD_getUploadScheduler().getStats().pendingBytes == 0)
+	{
+		// the widest power of 2 blocks narrow enough, one pixel around for the filtering
+		const float pixelWidth = width / _nPixelX;
+		int block = 1;
+		while (block < _nPixelX && (block < minPixels || block * 2 * pixelWidth <= maxWidth))
+			block *= 2;
+		if (block < _nPixelX)
+		{
+			const unsigned int left = x * _nPixelX, top = z * _nPixelZ;
+			const float blockX = _mapInfo.gridSizeX * block / _nPixelX, blockZ = _mapInfo.gridSizeZ * block / _nPixelZ;
+			for (int bz = 0; bz < _nPixelZ; bz += block)
+			{
+				for (int bx = 0; bx < _nPixelX; bx += block)
+				{
+					const unsigned short minY = getBlendedPixelMin(
+						left + bx > 0 ? left + bx - 1 : 0, top + bz > 0 ? top + bz - 1 : 0,
+						std::min(left + bx + block + 1, _heightmap_width - 1), std::min(top + bz + block + 1, _heightmap_height - 1));
+					const float bx0 = x0 + bx / block * blockX, bz0 = z0 + bz / block * blockZ;
+					_horizon.addOccluder(bx0, bz0, bx0 + blockX, bz0 + blockZ, getWorldHeight(minY));
+				}
+			}
+			return;
+		}
+	}
+	const HeightMinMax h = getBlendedHeightMinMax(LODLevel, x, z);
+	_horizon.addOccluder(x0, z0, x1, z1, getWorldHeight(h.minY));
+}
+
+LODSelectResult LOD_select(const Ogre::Camera& cam, bool parentInFrustum, unsigned int x, unsigned int z, unsigned short size, int LODLevel,
+	TerrainHoleTree::Node holes)
 {
 	Ogre::AxisAlignedBox aabb;
 
-	const HeightMinMax& h = getHeightMinMax(LODLevel, x, z, true);
+	const HeightMinMax h = getBlendedHeightMinMax(LODLevel, x, z);
 	float minY = getWorldHeight(h.minY);
 	float maxY = getWorldHeight(h.maxY);
 	GetWorldAABB(aabb, _mapInfo, LODLevel, x, z, size, minY, maxY);
 
-	IntersectType frustumIt = (parentInFrustum)?(Inside):TestInBoundingPlanes(aabb, cam);
-	if( frustumIt == Outside )
+	const unsigned int ix = x >> LODLevel, iz = z >> LODLevel;
+	// hidden from anywhere in the camera's cell, whatever the frustum; the objects above it are tested on their own
+	if (!_pvsStates.empty() && _pvsStates[getPVSNodeIndex(_LODLevelCount, LODLevel, ix, iz)] == TerrainPVS::Hidden)
+	{
+		_selectStats.pvsCulledNodes++;
+		return OutOfFrustum;
+	}
+
+	// the objects below the node widen its box for the frustum test, so the result holds for them too
+	const bool hasObjects = _objects.hasObjects(LODLevel, ix, iz);
+	IntersectType frustumIt = Inside;
+	bool terrainOutside = false;
+	if (!parentInFrustum && hasObjects)
+	{
+		const float* b = _objects.getNodeBounds(LODLevel, ix, iz);
+		Ogre::AxisAlignedBox objectsAabb(aabb);
+		objectsAabb.merge(Ogre::AxisAlignedBox(b[0], b[1], b[2], b[3], b[4], b[5]));
+		frustumIt = TestInBoundingPlanes(objectsAabb, cam);
+		terrainOutside = frustumIt == Intersect && TestInBoundingPlanes(aabb, cam) == Outside;
+	}
+	else if (!parentInFrustum)
+		frustumIt = TestInBoundingPlanes(aabb, cam);
+	if (hasObjects)
+		_objects.record(LODLevel, ix, iz, toObjectVisibility(frustumIt));
+	if( frustumIt == Outside || terrainOutside )
+	{
+		_selectStats.frustumCulledNodes++;
+		return OutOfFrustum;
+	}
+
+	// as invisible as out of frustum
+	if (IsBackFacing(h, aabb, cam.getPosition()))
+	{
+		_selectStats.backFacingNodes++;
+		return OutOfFrustum;
+	}
+
+	// hidden behind the nearer terrain, as invisible too
+	if (_horizonCulling && _horizon.isOccluded(aabb.getMinimum().x, aabb.getMinimum().z, aabb.getMaximum().x, aabb.getMaximum().z, maxY))
+	{
+		_selectStats.horizonCulledNodes++;
+		return OutOfFrustum;
+	}
+	if (_occlusionBuffer && _occlusionBuffer->isOccluded(aabb.getMinimum().ptr(), aabb.getMaximum().ptr()))
+	{
+		_selectStats.occlusionCulledNodes++;
 		return OutOfFrustum;
+	}
 
 	if (aabb.squaredDistance(cam.getPosition()) > _lodSqRanges[LODLevel])
 		return OutOfRange;
 
-	LODSelectResult subTLSelRes = Undefined;
-	LODSelectResult subTRSelRes = Undefined;
-	LODSelectResult subBLSelRes = Undefined;
-	LODSelectResult subBRSelRes = Undefined;
+	// without its tile the node can't be drawn; as if out of range, the parent covers it meanwhile
+	int tileSlot = -1;
+	if (_tiled)
+	{
+		tileSlot = LOD_requestTile(LODLevel, x, z, aabb.squaredDistance(cam.getPosition()));
+		if (tileSlot < 0)
+			return OutOfRange;
+	}
+
+	LODSelectResult subSelRes[4] = { Undefined, Undefined, Undefined, Undefined };
+	// quadrants without data are never drawn, their subtrees are not visited
+	const int quadrants = _holes.getQuadrantMask(holes);
 
 	if (LODLevel > 0)
 	{
 		int nextLODLevel = LODLevel - 1;
-		if (aabb.squaredDistance(cam.getPosition()) <= _lodSqRanges[nextLODLevel])
+		float sqDist = aabb.squaredDistance(cam.getPosition());
+		bool refine = sqDist <= _lodSqRanges[nextLODLevel];
+		// the range by the distance alone would have refined it
+		if (!refine && sqDist <= _lodDistanceSqRanges[nextLODLevel])
+			_selectStats.errorTerminatedNodes++;
+		if (refine)
 		{
 			bool weAreInFrustum = frustumIt == Inside;
-			//bool subTLExists, subTRExists, subBLExists, subBRExists;
-			//lodSelectInfo.MinMaxMap[LODLevel-1].GetSubNodesExist( minMaxMapX, minMaxMapY, subTLExists, subTRExists, subBLExists, subBRExists );
-
 			unsigned short halfSize = size / 2;
-			subTLSelRes = LOD_select( cam, weAreInFrustum, x,            z,            halfSize, nextLODLevel);
-			subTRSelRes = LOD_select( cam, weAreInFrustum, x + halfSize, z,            halfSize, nextLODLevel);
-			subBLSelRes = LOD_select( cam, weAreInFrustum, x,            z + halfSize, halfSize, nextLODLevel);
-			subBRSelRes = LOD_select( cam, weAreInFrustum, x + halfSize, z + halfSize, halfSize, nextLODLevel);
+			// TL, TR, BL, BR; the horizon wants the nearest quadrant first and the farthest last
+			int nearest = 0;
+			if (_horizonCulling)
+			{
+				const Ogre::Vector3 center = aabb.getCenter();
+				nearest = (cam.getPosition().x >= center.x ? 1 : 0) | (cam.getPosition().z >= center.z ? 2 : 0);
+			}
+			for (int i = 0; i < 4; i++)
+			{
+				const int q = nearest ^ i;
+				if (quadrants & (1 << q))
+					subSelRes[q] = LOD_select( cam, weAreInFrustum, x + (q & 1) * halfSize, z + (q >> 1) * halfSize, halfSize, nextLODLevel, _holes.getChild(holes, q));
+			}
 		}
 	}
+	if (quadrants != 15)
+		_selectStats.holeMaskedNodes++;
 	// We don't want to select sub nodes that are invisible (out of frustum) or are selected;
 	// (we DO want to select if they are out of range, since we are in range)
-	bool bRemoveSubTL = (subTLSelRes == OutOfFrustum) || (subTLSelRes == Selected);
-	bool bRemoveSubTR = (subTRSelRes == OutOfFrustum) || (subTRSelRes == Selected);
-	bool bRemoveSubBL = (subBLSelRes == OutOfFrustum) || (subBLSelRes == Selected);
-	bool bRemoveSubBR = (subBRSelRes == OutOfFrustum) || (subBRSelRes == Selected);
+	bool bRemoveSub[4];
+	for (int q = 0; q < 4; q++)
+		bRemoveSub[q] = (subSelRes[q] == OutOfFrustum) || (subSelRes[q] == Selected) || !(quadrants & (1 << q));
 
 	// select (whole or in part) unless all sub nodes are selected by child nodes, either as parts of this or lower LOD levels
-	if (!(bRemoveSubTL && bRemoveSubTR && bRemoveSubBL && bRemoveSubBR))
+	if (!(bRemoveSub[0] && bRemoveSub[1] && bRemoveSub[2] && bRemoveSub[3]))
 	{
 		// add this node information
 		if (_ogreGridRenderableCount < _maxSelectionCount)
 		{
-			_ogreGridRenderables[_ogreGridRenderableCount++].setNodeInfo(NodeInfo(x, z, size, h.minY, h.maxY, LODLevel, !bRemoveSubTL, !bRemoveSubTR, !bRemoveSubBL, !bRemoveSubBR));
+			_selectStats.selectedNodes++;
+			_ogreGridRenderables[_ogreGridRenderableCount++].setNodeInfo(NodeInfo(x, z, size, h.minY, h.maxY, LODLevel, !bRemoveSub[0], !bRemoveSub[1], !bRemoveSub[2], !bRemoveSub[3], tileSlot));
 		}
+		if (_horizonCulling)
+			addHorizonOccluders(cam, x, z, size, LODLevel, 2.0f * size * _nPixelX / (_gridDim - 1));
 		return Selected;
 	}
 	// if any of child nodes are selected, then return selected - otherwise all of them are out of frustum, so we're out of frustum too
-	if( (subTLSelRes == Selected) || (subTRSelRes == Selected) || (subBLSelRes == Selected) || (subBRSelRes == Selected) )
+	if( (subSelRes[0] == Selected) || (subSelRes[1] == Selected) || (subSelRes[2] == Selected) || (subSelRes[3] == Selected) )
 		return Selected;
 	else
 		return OutOfFrustum;
 }
 
+// Range-only selection from a predicted camera position for the tile prefetcher: no frustum, and the nodes
+// behind the position along the heading are skipped. It stops at the tile base level, finer nodes share its tile.
+static void LOD_selectAhead(const Ogre::Vector3& position, const Ogre::Vector3& heading, unsigned int x, unsigned int z, unsigned short size, int LODLevel,
+	TerrainHoleTree::Node holes)
+{
+	if (holes == TerrainHoleTree::Empty)
+		return;
+	Ogre::AxisAlignedBox aabb;
+	const HeightMinMax& h = getHeightMinMax(0, LODLevel, x, z, true);
+	GetWorldAABB(aabb, _mapInfo, LODLevel, x, z, size, getWorldHeight(h.minY), getWorldHeight(h.maxY));
+
+	float sqDist = aabb.squaredDistance(position);
+	if (sqDist > _lodSqRanges[LODLevel])
+		return;
+	if ((aabb.getCenter() - position).dotProduct(heading) < -aabb.getHalfSize().length())
+		return;
+
+	LOD_prefetchTile(LODLevel, x, z, sqDist);
+	if (LODLevel > LOD_getTileBaseLODLevel() && sqDist <= _lodSqRanges[LODLevel-1])
+	{
+		unsigned short halfSize = size / 2;
+		LOD_selectAhead(position, heading, x,            z,            halfSize, LODLevel-1, _holes.getChild(holes, 0));
+		LOD_selectAhead(position, heading, x + halfSize, z,            halfSize, LODLevel-1, _holes.getChild(holes, 1));
+		LOD_selectAhead(position, heading, x,            z + halfSize, halfSize, LODLevel-1, _holes.getChild(holes, 2));
+		LOD_selectAhead(position, heading, x + halfSize, z + halfSize, halfSize, LODLevel-1, _holes.getChild(holes, 3));
+	}
+}
+
+void LOD_selectAhead(const Ogre::Vector3& position, const Ogre::Vector3& heading)
+{
+	LOD_selectAhead(position, heading, 0, 0, _nMaxLODSize, _LODLevelCount-1, _holes.getRoot());
+}
+
+// LOD_select from a snapshot of the ranges, for any thread: the nodes away from all the spheres are left out
+// the way those out of the frustum are, and nothing is culled for facing away or requested from the tiles
+static LODSelectResult LOD_selectInSpheres(const LODRanges& ranges, const LODSphere* spheres, size_t sphereCount,
+	unsigned int x, unsigned int z, unsigned short size, int LODLevel, TerrainHoleTree::Node holes, std::vector<NodeInfo>& nodes)
+{
+	Ogre::AxisAlignedBox aabb;
+	const HeightMinMax h = getBlendedHeightMinMax(LODLevel, x, z);
+	GetWorldAABB(aabb, _mapInfo, LODLevel, x, z, size, getWorldHeight(h.minY), getWorldHeight(h.maxY));
+
+	bool nearSphere = false;
+	for (size_t i = 0; i < sphereCount && !nearSphere; i++)
+		nearSphere = aabb.squaredDistance(spheres[i].center) <= spheres[i].radius * spheres[i].radius;
+	if (!nearSphere)
+		return OutOfFrustum;
+
+	const float sqDist = aabb.squaredDistance(ranges.cameraPos);
+	if (sqDist > ranges.sqRanges[LODLevel])
+		return OutOfRange;
+
+	LODSelectResult subSelRes[4] = { Undefined, Undefined, Undefined, Undefined };
+	const int quadrants = _holes.getQuadrantMask(holes);
+	if (LODLevel > 0)
+	{
+		if (sqDist <= ranges.sqRanges[LODLevel - 1])
+		{
+			unsigned short halfSize = size / 2;
+			for (int q = 0; q < 4; q++)
+			{
+				if (quadrants & (1 << q))
+					subSelRes[q] = LOD_selectInSpheres(ranges, spheres, sphereCount, x + (q & 1) * halfSize, z + (q >> 1) * halfSize,
+						halfSize, LODLevel - 1, _holes.getChild(holes, q), nodes);
+			}
+		}
+	}
+	bool bRemoveSub[4];
+	for (int q = 0; q < 4; q++)
+		bRemoveSub[q] = subSelRes[q] == OutOfFrustum || subSelRes[q] == Selected || !(quadrants & (1 << q));
+	if (!(bRemoveSub[0] && bRemoveSub[1] && bRemoveSub[2] && bRemoveSub[3]))
+	{
+		nodes.push_back(NodeInfo(x, z, size, h.minY, h.maxY, LODLevel, !bRemoveSub[0], !bRemoveSub[1], !bRemoveSub[2], !bRemoveSub[3]));
+		return Selected;
+	}
+	for (int q = 0; q < 4; q++)
+		if (subSelRes[q] == Selected)
+			return Selected;
+	return OutOfFrustum;
+}
+
+// a cascade of LOD_selectShadowCascades with its ranges, or the view of LOD_selectWithClipPlanes
+struct CascadeRanges
+{
+	const Ogre::Plane* planes;
+	const Ogre::Plane* clipPlanes;
+	size_t clipPlaneCount;
+	std::vector<float> sqRanges;
+};
+
+// true if the box is wholly on the negative side of any of the planes
+static bool IsClipped(const Ogre::AxisAlignedBox& aabb, const Ogre::Plane* planes, size_t count)
+{
+	const Ogre::Vector3& min = aabb.getMinimum();
+	const Ogre::Vector3& max = aabb.getMaximum();
+	for (size_t p = 0; p < count; p++)
+	{
+		// the corner farthest along the normal
+		const Ogre::Vector3& n = planes[p].normal;
+		const Ogre::Vector3 corner(n.x >= 0 ? max.x : min.x, n.y >= 0 ? max.y : min.y, n.z >= 0 ? max.z : min.z);
+		if (n.dotProduct(corner) + planes[p].d < 0)
+			return true;
+	}
+	return false;
+}
+
+// the ranges of a cascade scaled as a whole, which keeps the CDLOD invariants with the morph areas shrunk alike
+static void initCascadeRanges(const LODRanges& ranges, const Ogre::Plane* planes, float scale, bool morph,
+	CascadeRanges& cascade, LODCascadeSelection& selection)
+{
+	cascade.planes = planes;
+	cascade.clipPlanes = 0;
+	cascade.clipPlaneCount = 0;
+	cascade.sqRanges = ranges.sqRanges;
+	for (size_t i = 0; i < ranges.sqRanges.size(); i++)
+		cascade.sqRanges[i] *= scale * scale;
+	selection.nodes.clear();
+	selection.morphConsts = ranges.morphConsts;
+	for (size_t i = 0; i + 1 < ranges.morphConsts.size(); i += 2)
+	{
+		// const1 - distance * const2 >= 1 everywhere: no vertex morphs
+		selection.morphConsts[i] = morph ? ranges.morphConsts[i] : 1.0f;
+		selection.morphConsts[i + 1] = morph ? ranges.morphConsts[i + 1] / scale : 0.0f;
+	}
+}
+
+// LOD_selectInSpheres for the frustums of several cascades at once, the bits of which are in the masks: those the node
+// is selected for and those it is out of the frustum for; it is out of range for the others or was not visited
+static void LOD_selectCascades(const Ogre::Vector3& cameraPos, const std::vector<CascadeRanges>& cascades, unsigned int active, unsigned int inside,
+	unsigned int x, unsigned int z, unsigned short size, int LODLevel, TerrainHoleTree::Node holes,
+	LODCascadeSelection* selections, unsigned int& selected, unsigned int& culled)
+{
+	selected = culled = 0;
+	Ogre::AxisAlignedBox aabb;
+	const HeightMinMax h = getBlendedHeightMinMax(LODLevel, x, z);
+	GetWorldAABB(aabb, _mapInfo, LODLevel, x, z, size, getWorldHeight(h.minY), getWorldHeight(h.maxY));
+	const float sqDist = aabb.squaredDistance(cameraPos);
+
+	// the cascades the node is in range for, and those of them to refine it
+	unsigned int inRange = 0, refine = 0;
+	for (size_t c = 0; c < cascades.size(); c++)
+	{
+		const unsigned int bit = 1u << c;
+		if (!(active & bit))
+			continue;
+		if (IsClipped(aabb, cascades[c].clipPlanes, cascades[c].clipPlaneCount))
+		{
+			culled |= bit;
+			continue;
+		}
+		if (!(inside & bit))
+		{
+			const IntersectType it = TestInBoundingPlanes(aabb, cascades[c].planes);
+			if (it == Outside)
+			{
+				culled |= bit;
+				continue;
+			}
+			if (it == Inside)
+				inside |= bit;
+		}
+		if (sqDist > cascades[c].sqRanges[LODLevel])
+			continue;
+		inRange |= bit;
+		if (LODLevel > 0 && sqDist <= cascades[c].sqRanges[LODLevel - 1])
+			refine |= bit;
+	}
+	if (!inRange)
+		return;
+
+	unsigned int subSelected[4] = { 0, 0, 0, 0 }, subCulled[4] = { 0, 0, 0, 0 };
+	const int quadrants = _holes.getQuadrantMask(holes);
+	if (refine)
+	{
+		unsigned short halfSize = size / 2;
+		for (int q = 0; q < 4; q++)
+		{
+			if (quadrants & (1 << q))
+				LOD_selectCascades(cameraPos, cascades, refine, inside & refine, x + (q & 1) * halfSize, z + (q >> 1) * halfSize,
+					halfSize, LODLevel - 1, _holes.getChild(holes, q), selections, subSelected[q], subCulled[q]);
+		}
+	}
+	for (size_t c = 0; c < cascades.size(); c++)
+	{
+		const unsigned int bit = 1u << c;
+		if (!(inRange & bit))
+			continue;
+		bool bRemoveSub[4];
+		bool anySelected = false;
+		for (int q = 0; q < 4; q++)
+		{
+			bRemoveSub[q] = ((subSelected[q] | subCulled[q]) & bit) || !(quadrants & (1 << q));
+			anySelected |= (subSelected[q] & bit) != 0;
+		}
+		if (!(bRemoveSub[0] && bRemoveSub[1] && bRemoveSub[2] && bRemoveSub[3]))
+		{
+			selections[c].nodes.push_back(NodeInfo(x, z, size, h.minY, h.maxY, LODLevel, !bRemoveSub[0], !bRemoveSub[1], !bRemoveSub[2], !bRemoveSub[3]));
+			selected |= bit;
+		}
+		else if (anySelected)
+			selected |= bit;
+		else
+			culled |= bit;
+	}
+}
+
 static Ogre::SceneNode* _LOD_node = 0;
 static const Ogre::String _objBaseName("OGR");
 
@@ -254,24 +773,229 @@ void LOD_getMorphConsts(int lodLevel, float consts[])
 
 static void LOD_updateCustomGpuParams(Ogre::SceneManager* scnMgr, const Ogre::Camera& cam)
 {
-	Ogre::Pass* pass = _material->getTechnique(0)->getPass(0);
-	Ogre::GpuProgramParametersSharedPtr vProgram = pass->getVertexProgramParameters();
-	vProgram->setNamedConstant("cameraPos", cam.getPosition());
+	for(size_t i = 0; i < _materials.size(); i++)
+	{
+		Ogre::Pass* pass = _materials[i]->getTechnique(0)->getPass(0);
+		Ogre::GpuProgramParametersSharedPtr vProgram = pass->getVertexProgramParameters();
+		vProgram->setNamedConstant("cameraPos", cam.getPosition());
+	}
 }
 
 // For adding a SceneNode to each grid
 #define USE_SAPARATED_NODE
 
+static void LOD_flushHeightmapEdits();
+
+static void LOD_rasterizeOccluders(const Ogre::Camera& cam)
+{
+	const Ogre::Matrix4 viewProj = cam.getProjectionMatrix() * cam.getViewMatrix();
+	float m[16];
+	for (int i = 0; i < 16; i++)
+		m[i] = (float)viewProj[i / 4][i % 4];
+	_occlusionBuffer->begin(m, cam.getNearClipDistance());
+	for (std::map<int, OccluderMesh>::const_iterator it = _occluders.begin(); it != _occluders.end(); ++it)
+		_occlusionBuffer->addTriangles(&it->second.vertices[0], &it->second.indices[0], it->second.indices.size() / 3);
+	// the columns need the heights in RAM, and no holes to see through
+	TerrainQuerySource src;
+	if (_noDataHeight < 0 && getQuerySource(src))
+	{
+		TerrainOccluderParams params;
+		params.eye[0] = cam.getPosition().x;
+		params.eye[1] = cam.getPosition().y;
+		params.eye[2] = cam.getPosition().z;
+		params.nearDistance = cam.getNearClipDistance();
+		params.sqRanges = &_lodSqRanges[0];
+		params.splitRatio = _terrainOccluderSplitRatio;
+		params.maxBoxes = _maxTerrainOccluders;
+		addTerrainOccluders(*_occlusionBuffer, src, params);
+	}
+	_occlusionBuffer->end();
+	_selectStats.occluderTriangles = (int)_occlusionBuffer->getStats().triangles;
+}
+
+static void LOD_collectObjects(const Ogre::Camera& cam)
+{
+	if (_objects.getObjectCount() == 0)
+	{
+		_visibleObjects.clear();
+		return;
+	}
+	TerrainObjectIndex::CullParams params;
+	const Ogre::Plane* planes = cam.getFrustumPlanes();
+	for (int p = 0; p < 6; p++)
+	{
+		params.planes[p][0] = planes[p].normal.x;
+		params.planes[p][1] = planes[p].normal.y;
+		params.planes[p][2] = planes[p].normal.z;
+		params.planes[p][3] = planes[p].d;
+	}
+	params.eye[0] = cam.getPosition().x;
+	params.eye[1] = cam.getPosition().y;
+	params.eye[2] = cam.getPosition().z;
+	// no farther than the terrain is drawn
+	params.sqRange = _lodSqRanges[_LODLevelCount - 1];
+	_objects.collect(params, _visibleObjects);
+	_selectStats.visibleObjects = (int)_visibleObjects.size();
+	_selectStats.objectBoxTests = (int)(_objects.getStats().testedNodes + _objects.getStats().testedObjects);
+}
+
+static unsigned long long getSelectedNodeKey(const NodeInfo& node)
+{
+	return ((unsigned long long)node.LODLevel << 48) | ((unsigned long long)node.X << 24) | node.Z;
+}
+
+static int getQuadrantMask(const NodeInfo& node)
+{
+	return (node.TL ? 1 : 0) | (node.TR ? 2 : 0) | (node.BL ? 4 : 0) | (node.BR ? 8 : 0);
+}
+
+// Merges the sorted selections of this and the previous frame into the delta, linear in the selected nodes
+// besides the sort, and passes it to the listeners
+static void LOD_publishSelectionDelta()
+{
+	_prevSelectedNodes.swap(_selectedNodes);
+	_selectedNodes.resize(_ogreGridRenderableCount);
+	for (int i = 0; i < _ogreGridRenderableCount; i++)
+	{
+		_selectedNodes[i].info = _ogreGridRenderables[i].getNodeInfo();
+		_selectedNodes[i].key = getSelectedNodeKey(_selectedNodes[i].info);
+	}
+	std::sort(_selectedNodes.begin(), _selectedNodes.end());
+
+	_selectionDelta.added.clear();
+	_selectionDelta.removed.clear();
+	_selectionDelta.changed.clear();
+	size_t i = 0, j = 0;
+	while (i < _selectedNodes.size() || j < _prevSelectedNodes.size())
+	{
+		if (j == _prevSelectedNodes.size() || (i < _selectedNodes.size() && _selectedNodes[i].key < _prevSelectedNodes[j].key))
+			_selectionDelta.added.push_back(_selectedNodes[i++].info);
+		else if (i == _selectedNodes.size() || _prevSelectedNodes[j].key < _selectedNodes[i].key)
+			_selectionDelta.removed.push_back(_prevSelectedNodes[j++].info);
+		else
+		{
+			if (getQuadrantMask(_selectedNodes[i].info) != getQuadrantMask(_prevSelectedNodes[j].info))
+				_selectionDelta.changed.push_back(_selectedNodes[i].info);
+			i++;
+			j++;
+		}
+	}
+	if (_selectionDelta.empty())
+		return;
+	// a listener may remove itself or others
+	const std::map<int, LODSelectionListener> listeners(_selectionListeners);
+	for (std::map<int, LODSelectionListener>::const_iterator it = listeners.begin(); it != listeners.end(); ++it)
+		it->second(_selectionDelta);
+}
+
+// the visible nodes from the tile base level up, each with the tile it samples
+static void collectPVSTiles(const std::vector<unsigned char>& states, std::vector<PVSTile>& tiles)
+{
+	tiles.clear();
+	if (states.empty())
+		return;
+	for (int level = LOD_getTileBaseLODLevel(); level < _LODLevelCount; level++)
+	{
+		const unsigned int n = _nMaxLODSize >> level;
+		for (unsigned int iz = 0; iz < n; iz++)
+		{
+			for (unsigned int ix = 0; ix < n; ix++)
+			{
+				const unsigned char state = states[getPVSNodeIndex(_LODLevelCount, level, ix, iz)];
+				if (state == TerrainPVS::Visible || state == TerrainPVS::VisibleRefined)
+				{
+					PVSTile tile = { level, ix << level, iz << level };
+					tiles.push_back(tile);
+				}
+			}
+		}
+	}
+}
+
+// decodes the cell the camera has moved into
+static void LOD_updatePVS(const Ogre::Camera& cam)
+{
+	if (!_pvs.isLoaded())
+		return;
+	if (_pvs.getHeader().lodLevelCount != (unsigned int)_LODLevelCount)
+	{
+		Ogre::LogManager::getSingleton().logMessage("The PVS was baked for " +
+			Ogre::StringConverter::toString(_pvs.getHeader().lodLevelCount) + " LOD levels, not used");
+		LOD_unloadPVS();
+		return;
+	}
+	const int cell = _pvs.findCell(cam.getPosition().x, cam.getPosition().z);
+	if (cell == _pvsCell)
+		return;
+	_pvsCell = cell;
+	if (cell < 0)
+		_pvsStates.clear();
+	else
+		_pvs.decodeCell(cell, _pvsStates);
+	if (_tiled)
+		collectPVSTiles(_pvsStates, _pvsTiles);
+}
+
+// the tiles of the visible nodes in range of the position, nearest first along with the other prefetches
+static void LOD_prefetchPVSTiles(const Ogre::Vector3& position, const std::vector<PVSTile>& tiles)
+{
+	for (size_t i = 0; i < tiles.size(); i++)
+	{
+		const PVSTile& tile = tiles[i];
+		Ogre::AxisAlignedBox aabb;
+		const HeightMinMax& h = getHeightMinMax(0, tile.lodLevel, tile.x, tile.z, true);
+		GetWorldAABB(aabb, _mapInfo, tile.lodLevel, tile.x, tile.z, 1 << tile.lodLevel, getWorldHeight(h.minY), getWorldHeight(h.maxY));
+		const float sqDist = aabb.squaredDistance(position);
+		if (sqDist <= _lodSqRanges[tile.lodLevel])
+			LOD_prefetchTile(tile.lodLevel, tile.x, tile.z, sqDist);
+	}
+}
+
 void LOD_frameStarted(Ogre::SceneManager* scnMgr, const Ogre::Camera& cam)
 {
 	_ogreGridRenderableCount = 0;
+	memset(&_selectStats, 0, sizeof(_selectStats));
+
+	if (_tiled)
+		LOD_beginTileFrame();
+	LOD_updateKeyframes();
+	LOD_flushHeightmapEdits();
+
+	if (cam.getViewport())
+		_errorViewportHeight = (float)cam.getViewport()->getActualHeight();
+	_errorDistanceScale = _errorThreshold * 2.0f * Ogre::Math::Tan(cam.getFOVy() * 0.5f) / _errorViewportHeight;
 	
 	float LODNear = cam.getNearClipDistance();
 	float LODRange = cam.getFarClipDistance() * 1.5f + LODNear;
 	float prevPos = LODNear;
+	float prevRange = LODNear;
 	for( int i = 0; i < _LODLevelCount; i++ ) 
 	{
-		float range = LODNear + _lodRangeDistRatios[i] * LODRange;
+		float distance = LODNear + _lodRangeDistRatios[i] * LODRange;
+		_lodDistanceSqRanges[i] = distance * distance;
+		float range = distance;
+		if (_errorDistanceScale > 0)
+		{
+			// The nodes of the next level are refined into this one only where their error projects over the
+			// threshold; as the range of the whole level, all the neighbors get the same ranges and morphs.
+			float maxError, maxExtent;
+			float errorRange = distance;
+			if (i + 1 < _LODLevelCount)
+			{
+				getLevelErrorBounds(i + 1, maxError, maxExtent);
+				errorRange = maxError / _errorDistanceScale;
+			}
+			// A finer neighbor is fully morphed where it borders this level, so this level must not have started
+			// to morph there yet: its morph starts a node diagonal of the finer level past that level's range.
+			getLevelErrorBounds(std::max(i - 1, 0), maxError, maxExtent);
+			const int nodeSize = 1 << std::max(i - 1, 0);
+			const float sizeX = _mapInfo.SizeX / _mapInfo.nGridX * nodeSize;
+			const float sizeZ = _mapInfo.SizeZ / _mapInfo.nGridZ * nodeSize;
+			const float diagonal = sqrtf(sizeX * sizeX + sizeZ * sizeZ + maxExtent * maxExtent);
+			const float minRange = prevPos + (prevRange + diagonal - prevPos) / _morphStartRatio;
+			range = std::min(distance, std::max(errorRange, minRange));
+		}
+		prevRange = range;
 		float morphEnd = _morphConsts[i].morphEnd = range;
 		_lodSqRanges[i] = range * range;
 		_morphConsts[i].morphStart = prevPos + (morphEnd - prevPos) * _morphStartRatio;
@@ -284,7 +1008,25 @@ void LOD_frameStarted(Ogre::SceneManager* scnMgr, const Ogre::Camera& cam)
 #endif
 	}
 
-	LOD_select(cam, false, 0, 0, _nMaxLODSize, _LODLevelCount-1);
+	if (_horizonCulling)
+		_horizon.reset(cam.getPosition().x, cam.getPosition().y, cam.getPosition().z);
+	if (_occlusionBuffer)
+		LOD_rasterizeOccluders(cam);
+	LOD_updatePVS(cam);
+	_objects.beginFrame();
+	LOD_select(cam, false, 0, 0, _nMaxLODSize, _LODLevelCount-1, _holes.getRoot());
+	LOD_publishSelectionDelta();
+	LOD_collectObjects(cam);
+	LOD_updateCollision(cam.getPosition());
+	LOD_updateScatter(cam.getPosition());
+	if (_tiled)
+	{
+		LOD_prefetchTiles(cam);
+		LOD_prefetchPVSTiles(cam.getPosition(), _pvsTiles);
+		if (_pvsHintCell >= 0)
+			LOD_prefetchPVSTiles(_pvsHintPosition, _pvsHintTiles);
+		LOD_updateTiles();
+	}
 
 	if (_LOD_node == 0)
 	{
@@ -307,20 +1049,112 @@ void LOD_frameStarted(Ogre::SceneManager* scnMgr, const Ogre::Camera& cam)
 	}
 
 	LOD_updateCustomGpuParams(scnMgr, cam);
+	_uploadScheduler.update();
 }
 
 const float _LODLevelDistanceRatio = 2.0f;
 
-static std::vector<HeightMinMax *> _heightMinMax;
+// min/max pyramids of hmap1 and hmap2
+static HeightMinMaxPyramid _heightMinMax[2];
 
-static const HeightMinMax& getHeightMinMax(int lodLevel, int x, int z, bool shrink = false)
+static const HeightMinMax& getHeightMinMax(int layer, int lodLevel, int x, int z, bool shrink = false)
 {
 	int nX = _nMaxLODSize >> lodLevel;
-	assert((size_t)lodLevel < _heightMinMax.size());
+	assert((size_t)lodLevel < _heightMinMax[layer].size());
 	int ix = shrink ? (x * nX / _nMaxLODSize) : x;
 	int iz = shrink ? (z * nX / _nMaxLODSize) : z;
 	assert(ix < nX && iz < nX);
-	return _heightMinMax[lodLevel][iz*nX + ix];
+	return _heightMinMax[layer][lodLevel][iz*nX + ix];
+}
+
+// the shaders lerp between hmap2 and hmap1 by heightBlendRatio,
+// so the min/max lerped by the same ratio bound the rendered heights
+static HeightMinMax getBlendedHeightMinMax(int lodLevel, int x, int z)
+{
+	const HeightMinMax& h1 = getHeightMinMax(0, lodLevel, x, z, true);
+	if (_heightMinMax[1].empty())
+	{
+		// compressed tiles render within their error bound of the pyramid's heights
+		const int error = (int)ceilf(LOD_getTileHeightError());
+		if (error == 0)
+			return h1;
+		HeightMinMax h = h1;
+		h.minY = (unsigned short)std::max((int)h1.minY - error, 0);
+		h.maxY = (unsigned short)std::min((int)h1.maxY + error, 65535);
+		return h;
+	}
+	if (_heightBlendRatio >= 1.0f)
+		return h1;
+	const HeightMinMax& h2 = getHeightMinMax(1, lodLevel, x, z, true);
+	if (_heightBlendRatio <= 0.0f)
+		return h2;
+
+	HeightMinMax h;
+	h.minY = (unsigned short)floorf(h2.minY + (h1.minY - h2.minY) * _heightBlendRatio);
+	h.maxY = (unsigned short)ceilf(h2.maxY + (h1.maxY - h2.maxY) * _heightBlendRatio);
+	h.maxError = (unsigned short)ceilf(h2.maxError + (h1.maxError - h2.maxError) * _heightBlendRatio);
+	// the gradients of the blended surface lie between those of both
+	const HeightMinMax* cones[2] = { &h1, &h2 };
+	mergeNormalCones(&h, cones, 2);
+	return h;
+}
+
+// the largest geometric error and height extent of the nodes of each level of hmap1 and hmap2, for the
+// error-driven LOD ranges; emptied whenever the pyramid changes
+struct LevelBounds
+{
+	unsigned short maxError;
+	unsigned short maxExtent;
+};
+static std::vector<LevelBounds> _levelBounds[2];
+
+static const LevelBounds& getLevelBounds(int layer, int lodLevel)
+{
+	std::vector<LevelBounds>& bounds = _levelBounds[layer];
+	if (bounds.empty())
+	{
+		bounds.resize(_LODLevelCount);
+		for (int level = 0; level < _LODLevelCount; level++)
+		{
+			const size_t nX = _nMaxLODSize >> level;
+			const HeightMinMax* h = _heightMinMax[layer][level];
+			LevelBounds b = { 0, 0 };
+			for (size_t i = 0; i < nX * nX; i++)
+			{
+				b.maxError = std::max(b.maxError, h[i].maxError);
+				b.maxExtent = std::max(b.maxExtent, (unsigned short)(h[i].maxY - h[i].minY));
+			}
+			bounds[level] = b;
+		}
+	}
+	return bounds[lodLevel];
+}
+
+// the bounds of getBlendedHeightMinMax over a whole level, in world units
+static void getLevelErrorBounds(int lodLevel, float& maxError, float& maxExtent)
+{
+	const LevelBounds& b1 = getLevelBounds(0, lodLevel);
+	int error = b1.maxError;
+	int extent = b1.maxExtent;
+	if (_heightMinMax[1].empty())
+		extent += 2 * (int)ceilf(LOD_getTileHeightError());
+	else if (_heightBlendRatio < 1.0f)
+	{
+		const LevelBounds& b2 = getLevelBounds(1, lodLevel);
+		if (_heightBlendRatio <= 0.0f)
+		{
+			error = b2.maxError;
+			extent = b2.maxExtent;
+		}
+		else
+		{
+			// a lerp of two nodes is within the larger of both, give or take the rounding
+			error = std::max(error, (int)b2.maxError) + 1;
+			extent = std::max(extent, (int)b2.maxExtent) + 2;
+		}
+	}
+	maxError = error * _mapInfo.SizeY / 65535.0f;
+	maxExtent = extent * _mapInfo.SizeY / 65535.0f;
 }
 
 void save_h()
@@ -338,7 +1172,7 @@ void save_h()
 		{
 			for(size_t ix=0; ix<nGridX; ix++)
 			{
-				const HeightMinMax& h = getHeightMinMax(lodLevel, ix,   iz);
+				const HeightMinMax& h = getHeightMinMax(0, lodLevel, ix,   iz);
 				fprintf(fp, "[%02d %02d] %05d %05d\n", ix, iz, h.minY, h.maxY);
 			}
 		}
@@ -346,71 +1180,484 @@ void save_h()
 	fclose(fp);
 }
 
-void ConstructLODfromHeightmap(const MapDimensions& mapInfo, const char* heightmapName)
+static void initPyramidParams()
 {
-	// height map analysis
-	Ogre::Image heightmapSrc;
-	heightmapSrc.load(heightmapName, "General");
+	_pyramidParams.nGridX = _mapInfo.nGridX;
+	_pyramidParams.nGridZ = _mapInfo.nGridZ;
+	_pyramidParams.lodLevelCount = _LODLevelCount;
+	_pyramidParams.nPixelX = _nPixelX;
+	_pyramidParams.nPixelZ = _nPixelZ;
+	_pyramidParams.gridDim = _gridDim;
+	_pyramidParams.slopeX = _mapInfo.SizeY / 65535.0f / (_mapInfo.gridSizeX / _nPixelX);
+	_pyramidParams.slopeZ = _mapInfo.SizeY / 65535.0f / (_mapInfo.gridSizeZ / _nPixelZ);
+}
+
+// a heightmap file on its way from the resource system to a decoded image
+struct HeightmapSource
+{
+	Ogre::String name;
+	Ogre::DataStreamPtr stream;	// opened on the render thread, decoded by a worker
+	Ogre::String type;
+	Ogre::String rawPath;		// raw R16 heightmaps are mapped instead
+};
+
+static void openHeightmapSource(HeightmapSource& src)
+{
+	if (HeightmapImage::isRaw(src.name))
+	{
+		src.rawPath = HeightmapImage::resolvePath(src.name, "General");
+		return;
+	}
+	size_t dot = src.name.find_last_of('.');
+	src.type = (dot == Ogre::String::npos) ? Ogre::String() : src.name.substr(dot + 1);
+	src.stream = Ogre::ResourceGroupManager::getSingleton().openResource(src.name, "General");
+}
+
+static void decodeHeightmapSource(HeightmapSource& src, HeightmapImage& image)
+{
+	if (src.rawPath.empty())
+	{
+		image.load(src.stream, src.type);
+		src.stream.setNull();
+	}
+	else
+		image.loadRaw(src.rawPath);
+}
+
+// the first heightmap sets the resolution of the unit grids
+static void initHeightmapLayout(const MapDimensions& mapInfo)
+{
+	const HeightmapImage& heightmapSrc = _heightmaps[0].image;
 	const unsigned int width = heightmapSrc.getWidth();
 	const unsigned int height = heightmapSrc.getHeight();
-	const unsigned short* pImgSrc = (unsigned short *)(heightmapSrc.getData());
-	const int nPixelX = (width - 1) / mapInfo.nGridX;
-	const int nPixelZ = (height - 1) / mapInfo.nGridZ;
+	_nPixelX = (width - 1) / mapInfo.nGridX;
+	_nPixelZ = (height - 1) / mapInfo.nGridZ;
+	initPyramidParams();
+	_heightmap_width = width;
+	_heightmap_height = height;
+}
+
+// height map analysis
+static void ConstructLODfromHeightmap(int layer, const char* heightmapName)
+{
+	HeightmapImage& heightmapSrc = _heightmaps[layer].image;
+	const unsigned int width = heightmapSrc.getWidth();
+	const unsigned int height = heightmapSrc.getHeight();
+	if (width != _heightmap_width || height != _heightmap_height)
+	{
+		OGRE_EXCEPT(Ogre::Exception::ERR_INVALIDPARAMS,
+			Ogre::String(heightmapName) + " does not match the size of the first heightmap",
+			"ConstructLODfromHeightmap");
+	}
+	LOD_buildHeightMinMax((unsigned short *)(heightmapSrc.getData()), width, _heightMinMax[layer]);
+	_levelBounds[layer].clear();
+	//save_h();
+}
+
+void LOD_buildHeightMinMax(const unsigned short* pImgSrc, unsigned int width, HeightMinMaxPyramid& pyramid)
+{
+	buildHeightMinMax(_pyramidParams, pImgSrc, width, pyramid);
+}
+
+void LOD_freeHeightMinMax(HeightMinMaxPyramid& pyramid)
+{
+	freeHeightMinMax(pyramid);
+}
+
+// recompute the min/max of the grids touching the given pixel rectangle and propagate them up the pyramid
+static void UpdateLODfromHeightmap(int layer, const Ogre::Box& rect)
+{
+	const unsigned short* pImgSrc = (unsigned short *)(_heightmaps[layer].image.getData());
+
+	// a border pixel belongs to both neighboring grids
+	size_t ixStart = (rect.left > 0 ? rect.left - 1 : 0) / _nPixelX;
+	size_t izStart = (rect.top > 0 ? rect.top - 1 : 0) / _nPixelZ;
+	size_t ixEnd = std::min<size_t>((rect.right - 1) / _nPixelX, _mapInfo.nGridX - 1);
+	size_t izEnd = std::min<size_t>((rect.bottom - 1) / _nPixelZ, _mapInfo.nGridZ - 1);
+
+	std::vector<float> scratch;
+	for(size_t iz=izStart; iz<=izEnd; iz++)
+	{
+		HeightMinMax* h = _heightMinMax[layer][0] + iz * _mapInfo.nGridX;
+		for(size_t ix=ixStart; ix<=ixEnd; ix++)
+		{
+			computeHeightMinMax(_pyramidParams, h + ix, pImgSrc, _heightmap_width, ix, iz, scratch);
+		}
+	}
 
-	// check all the raw data for LOD level 0
-	HeightMinMax* h = new HeightMinMax[mapInfo.nGridX * mapInfo.nGridZ];
-	_heightMinMax.push_back(h);
-	for(size_t iz=0; iz<mapInfo.nGridZ; iz++)
+	for(int lodLevel=1; lodLevel <_LODLevelCount; lodLevel++)
 	{
-		for(size_t ix=0; ix<mapInfo.nGridX; ix++, h++)
+		ixStart >>= 1; izStart >>= 1;
+		ixEnd >>= 1; izEnd >>= 1;
+		unsigned int nGridX = _mapInfo.nGridX >> lodLevel;
+		for(size_t iz=izStart; iz<=izEnd; iz++)
 		{
-			unsigned short minY = 65535;
-			unsigned short maxY = 0;
-			for(int z=0; z<=nPixelZ; z++)
+			HeightMinMax* h = _heightMinMax[layer][lodLevel] + iz * nGridX;
+			for(size_t ix=ixStart; ix<=ixEnd; ix++)
 			{
-				const unsigned short *pSrc = pImgSrc + (iz * nPixelZ + z) * width + ix * nPixelX;
-				for(int x=0; x<=nPixelX; x++, pSrc++)
-				{
-					if (*pSrc < minY) minY = *pSrc;
-					if (*pSrc > maxY) maxY = *pSrc;
-				}
+				mergeHeightMinMax(_pyramidParams, h + ix, _heightMinMax[layer], pImgSrc, _heightmap_width, lodLevel, ix, iz, scratch);
 			}
-			h->minY = minY;
-			h->maxY = maxY;
 		}
 	}
+	_levelBounds[layer].clear();
+}
 
-	for(int lodLevel=1; lodLevel <_LODLevelCount; lodLevel++)
+// widen the min/max of the nodes over the pixel rectangle to the edited heights at once, so that the culling and
+// the ray casts stay conservative for both the old and the new heights until the edit is uploaded; the normal cones
+// are dropped and the geometric error raised to the min/max meanwhile, the texture may show either
+static void WidenLODforEdit(int layer, const Ogre::Box& rect, unsigned short minY, unsigned short maxY)
+{
+	size_t ixStart = (rect.left > 0 ? rect.left - 1 : 0) / _nPixelX;
+	size_t izStart = (rect.top > 0 ? rect.top - 1 : 0) / _nPixelZ;
+	size_t ixEnd = std::min<size_t>((rect.right - 1) / _nPixelX, _mapInfo.nGridX - 1);
+	size_t izEnd = std::min<size_t>((rect.bottom - 1) / _nPixelZ, _mapInfo.nGridZ - 1);
+	for(int lodLevel = 0; lodLevel < (int)_heightMinMax[layer].size(); lodLevel++)
 	{
-		unsigned int divider = 1 << lodLevel;
-		unsigned int nGridX = mapInfo.nGridX / divider;
-		unsigned int nGridZ = mapInfo.nGridZ / divider;
-		h = new HeightMinMax[nGridX * nGridZ];
-		_heightMinMax.push_back(h);
-		for(size_t iz=0; iz<nGridZ; iz++)
+		unsigned int nGridX = _mapInfo.nGridX >> lodLevel;
+		for(size_t iz=izStart; iz<=izEnd; iz++)
 		{
-			for(size_t ix=0; ix<nGridX; ix++, h++)
+			HeightMinMax* h = _heightMinMax[layer][lodLevel] + iz * nGridX;
+			for(size_t ix=ixStart; ix<=ixEnd; ix++)
 			{
-				const HeightMinMax& lower0 = getHeightMinMax(lodLevel-1, ix*2,   iz*2);
-				const HeightMinMax& lower1 = getHeightMinMax(lodLevel-1, ix*2+1, iz*2);
-				const HeightMinMax& lower2 = getHeightMinMax(lodLevel-1, ix*2,   iz*2+1);
-				const HeightMinMax& lower3 = getHeightMinMax(lodLevel-1, ix*2+1, iz*2+1);
-				unsigned short minY = lower0.minY;
-				unsigned short maxY = lower0.maxY;
-				if (minY > lower1.minY) minY = lower1.minY;
-				if (minY > lower2.minY) minY = lower2.minY;
-				if (minY > lower3.minY) minY = lower3.minY;
-				h->minY = minY;
-				if (maxY < lower1.maxY) maxY = lower1.maxY;
-				if (maxY < lower2.maxY) maxY = lower2.maxY;
-				if (maxY < lower3.maxY) maxY = lower3.maxY;
-				h->maxY = maxY;
+				h[ix].minY = std::min(h[ix].minY, minY);
+				h[ix].maxY = std::max(h[ix].maxY, maxY);
+				// the patch and the heights are both within the min/max
+				h[ix].maxError = std::max(h[ix].maxError, (unsigned short)(h[ix].maxY - h[ix].minY));
+				h[ix].coneX = h[ix].coneZ = 0;
+				h[ix].coneSpread = NoNormalCone;
 			}
 		}
+		ixStart >>= 1; izStart >>= 1;
+		ixEnd >>= 1; izEnd >>= 1;
 	}
-	_heightmap_width = width;
-	_heightmap_height = height;
-	//save_h();
+	_levelBounds[layer].clear();
+}
+
+static void UploadHeightmapRect(HeightmapLayer& layer, const Ogre::Box& rect, float priority)
+{
+	Ogre::TexturePtr tex = Ogre::TextureManager::getSingleton().getByName(layer.textureName);
+	if (tex.isNull())
+		return;
+	// the texture units for VP and FP share the same texture, so one upload updates both
+	UploadRect r = { (unsigned int)rect.left, (unsigned int)rect.top, (unsigned int)rect.right, (unsigned int)rect.bottom };
+	_uploadScheduler.submit(tex.get(), layer.image.getData(), layer.image.getWidth(), r, priority);
+}
+
+UploadScheduler& LOD_getUploadScheduler()
+{
+	return _uploadScheduler;
+}
+
+void LOD_setUploadBudget(size_t bytesPerFrame, float msPerFrame)
+{
+	_uploadScheduler.setBudget(bytesPerFrame, msPerFrame);
+}
+
+bool LOD_isHeightmapUploadPending(int layer)
+{
+	assert(layer >= 0 && layer < 2);
+	Ogre::TexturePtr tex = Ogre::TextureManager::getSingleton().getByName(_heightmaps[layer].textureName);
+	return !tex.isNull() && _uploadScheduler.isPending(tex.get());
+}
+
+static void addDirtyRect(std::vector<Ogre::Box>& rects, Ogre::Box rect)
+{
+	// merge with the overlapping rectangles so that the batched edits are processed only once
+	for(size_t i = 0; i < rects.size(); )
+	{
+		const Ogre::Box& r = rects[i];
+		if (r.left <= rect.right && rect.left <= r.right && r.top <= rect.bottom && rect.top <= r.bottom)
+		{
+			rect.left = std::min(rect.left, r.left);
+			rect.top = std::min(rect.top, r.top);
+			rect.right = std::max(rect.right, r.right);
+			rect.bottom = std::max(rect.bottom, r.bottom);
+			rects[i] = rects.back();
+			rects.pop_back();
+			i = 0;
+		}
+		else
+			i++;
+	}
+	rects.push_back(rect);
+}
+
+const unsigned short* LOD_getHeightmapData(int layer, unsigned int* width, unsigned int* height)
+{
+	assert(layer >= 0 && layer < 2);
+	const HeightmapImage& image = _heightmaps[layer].image;
+	if (width) *width = (unsigned int)image.getWidth();
+	if (height) *height = (unsigned int)image.getHeight();
+	return (const unsigned short *)image.getData();
+}
+
+// overwrite a w x h pixel rectangle of hmap1 (layer 0) or hmap2 (layer 1)
+// the texture upload starts on the next LOD_frameStarted; the min/max pyramid bounds the old and the new heights
+// until it is done and is made exact then
+void LOD_editHeightmap(int layer, unsigned int x, unsigned int z, unsigned int w, unsigned int h, const unsigned short* heights)
+{
+	assert(layer >= 0 && layer < 2);
+	HeightmapLayer& hmap = _heightmaps[layer];
+	const unsigned int width = (unsigned int)hmap.image.getWidth();
+	const unsigned int height = (unsigned int)hmap.image.getHeight();
+	if (x >= width || z >= height)
+		return;
+	const unsigned int rowLen = std::min(w, width - x);
+	const unsigned int rows = std::min(h, height - z);
+	if (rowLen == 0 || rows == 0)
+		return;
+
+	TerrainQueryLock::Writer lock(_queryLock);
+	unsigned short* pDst = (unsigned short *)(hmap.image.getData()) + z * width + x;
+	unsigned short minY = 65535, maxY = 0;
+	for(unsigned int iz = 0; iz < rows; iz++, pDst += width, heights += w)
+	{
+		memcpy(pDst, heights, rowLen * sizeof(unsigned short));
+		for(unsigned int ix = 0; ix < rowLen; ix++)
+		{
+			minY = std::min(minY, heights[ix]);
+			maxY = std::max(maxY, heights[ix]);
+		}
+	}
+	const Ogre::Box rect(x, z, x + rowLen, z + rows);
+	WidenLODforEdit(layer, rect, minY, maxY);
+	addDirtyRect(hmap.dirtyRects, rect);
+	_heightmapVersion++;
+}
+
+// add delta * weights[] to both heightmaps, e.g. for craters or erosion
+void LOD_stampHeightmap(unsigned int x, unsigned int z, unsigned int w, unsigned int h, const float* weights, float delta)
+{
+	TerrainQueryLock::Writer lock(_queryLock);
+	for(int layer = 0; layer < 2; layer++)
+	{
+		HeightmapLayer& hmap = _heightmaps[layer];
+		const unsigned int width = (unsigned int)hmap.image.getWidth();
+		const unsigned int height = (unsigned int)hmap.image.getHeight();
+		if (x >= width || z >= height)
+			continue;
+		const unsigned int rowLen = std::min(w, width - x);
+		const unsigned int rows = std::min(h, height - z);
+		if (rowLen == 0 || rows == 0)
+			continue;
+
+		unsigned short* pDst = (unsigned short *)(hmap.image.getData()) + z * width + x;
+		unsigned short minY = 65535, maxY = 0;
+		for(unsigned int iz = 0; iz < rows; iz++, pDst += width)
+		{
+			const float* pWeight = weights + iz * w;
+			for(unsigned int ix = 0; ix < rowLen; ix++)
+			{
+				float y = pDst[ix] + pWeight[ix] * delta;
+				pDst[ix] = (unsigned short)(y < 0 ? 0 : (y > 65535 ? 65535 : y + 0.5f));
+				minY = std::min(minY, pDst[ix]);
+				maxY = std::max(maxY, pDst[ix]);
+			}
+		}
+		const Ogre::Box rect(x, z, x + rowLen, z + rows);
+		WidenLODforEdit(layer, rect, minY, maxY);
+		addDirtyRect(hmap.dirtyRects, rect);
+		_heightmapVersion++;
+	}
+}
+
+void LOD_swapHeightmapLayer(int layer, HeightmapImage& image, HeightMinMaxPyramid& pyramid)
+{
+	assert(layer >= 0 && layer < 2);
+	assert(image.getWidth() == _heightmap_width && image.getHeight() == _heightmap_height);
+	HeightmapLayer& hmap = _heightmaps[layer];
+	{
+		TerrainQueryLock::Writer lock(_queryLock);
+		hmap.image.swap(image);
+		std::swap(_heightMinMax[layer], pyramid);
+		_levelBounds[layer].clear();
+		_heightmapVersion++;
+	}
+	// the whole texture is replaced, pending edits and uploads of the old image are obsolete
+	hmap.dirtyRects.clear();
+	hmap.uploadingRects.clear();
+	Ogre::TexturePtr tex = Ogre::TextureManager::getSingleton().getByName(hmap.textureName);
+	if (!tex.isNull())
+		_uploadScheduler.cancel(tex.get());
+	UploadHeightmapRect(hmap, Ogre::Box(0, 0, _heightmap_width, _heightmap_height), _layerUploadPriority);
+}
+
+// the pixels UpdateLODfromHeightmap reads for the rectangle: the unit grids touching it
+static UploadRect getRefitRect(const Ogre::Box& rect)
+{
+	const size_t ixStart = (rect.left > 0 ? rect.left - 1 : 0) / _nPixelX;
+	const size_t izStart = (rect.top > 0 ? rect.top - 1 : 0) / _nPixelZ;
+	const size_t ixEnd = std::min<size_t>((rect.right - 1) / _nPixelX, _mapInfo.nGridX - 1);
+	const size_t izEnd = std::min<size_t>((rect.bottom - 1) / _nPixelZ, _mapInfo.nGridZ - 1);
+	UploadRect r = { (unsigned int)(ixStart * _nPixelX), (unsigned int)(izStart * _nPixelZ),
+		(unsigned int)((ixEnd + 1) * _nPixelX + 1), (unsigned int)((izEnd + 1) * _nPixelZ + 1) };
+	return r;
+}
+
+// the edits are uploaded first; the exact min/max of a rectangle are computed once none of the pixels they are
+// computed from is still on its way to the texture, until then the nodes keep the widened bounds
+static void LOD_flushHeightmapEdits()
+{
+	for(int layer = 0; layer < 2; layer++)
+	{
+		HeightmapLayer& hmap = _heightmaps[layer];
+		for(size_t i = 0; i < hmap.dirtyRects.size(); i++)
+		{
+			UploadHeightmapRect(hmap, hmap.dirtyRects[i], _editUploadPriority);
+			addDirtyRect(hmap.uploadingRects, hmap.dirtyRects[i]);
+		}
+		hmap.dirtyRects.clear();
+		if (hmap.uploadingRects.empty())
+			continue;
+
+		Ogre::TexturePtr tex = Ogre::TextureManager::getSingleton().getByName(hmap.textureName);
+		TerrainQueryLock::Writer lock(_queryLock);
+		for(size_t i = 0; i < hmap.uploadingRects.size(); )
+		{
+			const Ogre::Box& rect = hmap.uploadingRects[i];
+			if (!tex.isNull() && _uploadScheduler.isPending(tex.get(), getRefitRect(rect)))
+			{
+				i++;
+				continue;
+			}
+			UpdateLODfromHeightmap(layer, rect);
+			hmap.uploadingRects[i] = hmap.uploadingRects.back();
+			hmap.uploadingRects.pop_back();
+		}
+	}
+}
+
+// what the queries read, false if the heightmaps are not in RAM
+static bool getQuerySource(TerrainQuerySource& src)
+{
+	if (_tiled || !_heightmaps[0].image.getData() || _heightMinMax[0].empty())
+		return false;
+	const bool blend = _heightBlendRatio < 1.0f && _heightmaps[1].image.getData() && !_heightMinMax[1].empty();
+	src.heights[0] = (const unsigned short *)_heightmaps[0].image.getData();
+	src.heights[1] = blend ? (const unsigned short *)_heightmaps[1].image.getData() : 0;
+	src.pyramids[0] = &_heightMinMax[0];
+	src.pyramids[1] = blend ? &_heightMinMax[1] : 0;
+	src.width = _heightmap_width;
+	src.height = _heightmap_height;
+	src.params = _pyramidParams;
+	src.minX = _mapInfo.MinX;
+	src.minY = _mapInfo.MinY;
+	src.minZ = _mapInfo.MinZ;
+	src.gridSizeX = _mapInfo.gridSizeX;
+	src.gridSizeZ = _mapInfo.gridSizeZ;
+	src.sizeY = _mapInfo.SizeY;
+	src.blendRatio = blend ? _heightBlendRatio : 1.0f;
+	return true;
+}
+
+bool LOD_getHeights(const float* x, const float* z, float* y, size_t count)
+{
+	TerrainQueryLock::Reader lock(_queryLock);
+	TerrainQuerySource src;
+	if (!getQuerySource(src))
+		return false;
+	terrainHeightAt(src, x, z, y, count);
+	return true;
+}
+
+size_t LOD_raycast(const TerrainRay* rays, TerrainRayHit* hits, size_t count)
+{
+	TerrainQueryLock::Reader lock(_queryLock);
+	TerrainQuerySource src;
+	if (!getQuerySource(src))
+	{
+		for (size_t i = 0; i < count; i++)
+			hits[i].hit = false;
+		return 0;
+	}
+	return terrainRaycast(src, rays, hits, count);
+}
+
+unsigned int LOD_getHeightmapVersion()
+{
+	TerrainQueryLock::Reader lock(_queryLock);
+	return _heightmapVersion;
+}
+
+void LOD_getRanges(const Ogre::Vector3& cameraPos, LODRanges& ranges)
+{
+	ranges.cameraPos = cameraPos;
+	ranges.sqRanges = _lodSqRanges;
+	ranges.morphConsts.resize(_morphConsts.size() * 2);
+	for (size_t i = 0; i < _morphConsts.size(); i++)
+	{
+		ranges.morphConsts[i * 2] = _morphConsts[i].const1;
+		ranges.morphConsts[i * 2 + 1] = _morphConsts[i].const2;
+	}
+}
+
+void LOD_selectInSpheres(const LODRanges& ranges, const LODSphere* spheres, size_t sphereCount, std::vector<NodeInfo>& nodes)
+{
+	nodes.clear();
+	TerrainQueryLock::Reader lock(_queryLock);
+	// the tiles are streamed for the camera, only the whole heightmap can be selected from anywhere
+	if (_tiled || _heightMinMax[0].empty() || ranges.sqRanges.size() != (size_t)_LODLevelCount || sphereCount == 0)
+		return;
+	LOD_selectInSpheres(ranges, spheres, sphereCount, 0, 0, _nMaxLODSize, _LODLevelCount-1, _holes.getRoot(), nodes);
+}
+
+void LOD_selectShadowCascades(const LODRanges& ranges, const LODShadowCascade* cascades, size_t cascadeCount,
+	std::vector<LODCascadeSelection>& selections)
+{
+	cascadeCount = std::min(cascadeCount, (size_t)32);
+	selections.resize(cascadeCount);
+	std::vector<CascadeRanges> cascadeRanges(cascadeCount);
+	for (size_t c = 0; c < cascadeCount; c++)
+		initCascadeRanges(ranges, cascades[c].planes, powf(0.5f, std::max(cascades[c].lodBias, 0.0f)), cascades[c].morph,
+			cascadeRanges[c], selections[c]);
+	TerrainQueryLock::Reader lock(_queryLock);
+	if (_tiled || _heightMinMax[0].empty() || ranges.sqRanges.size() != (size_t)_LODLevelCount || cascadeCount == 0)
+		return;
+	unsigned int selected, culled;
+	LOD_selectCascades(ranges.cameraPos, cascadeRanges, (unsigned int)((1ull << cascadeCount) - 1), 0, 0, 0, _nMaxLODSize, _LODLevelCount-1,
+		_holes.getRoot(), &selections[0], selected, culled);
+}
+
+void LOD_selectWithClipPlanes(const LODRanges& ranges, const Ogre::Plane* frustumPlanes, const Ogre::Plane* clipPlanes, size_t clipPlaneCount,
+	float lodDistanceScale, LODCascadeSelection& selection)
+{
+	std::vector<CascadeRanges> view(1);
+	initCascadeRanges(ranges, frustumPlanes, 1.0f / std::max(lodDistanceScale, 1.0f), true, view[0], selection);
+	view[0].clipPlanes = clipPlanes;
+	view[0].clipPlaneCount = clipPlaneCount;
+	TerrainQueryLock::Reader lock(_queryLock);
+	if (_tiled || _heightMinMax[0].empty() || ranges.sqRanges.size() != (size_t)_LODLevelCount)
+		return;
+	unsigned int selected, culled;
+	LOD_selectCascades(ranges.cameraPos, view, 1, 0, 0, 0, _nMaxLODSize, _LODLevelCount-1, _holes.getRoot(), &selection, selected, culled);
+}
+
+void LOD_getSelectedNodes(std::vector<NodeInfo>& nodes)
+{
+	nodes.resize(_ogreGridRenderableCount);
+	for (int i = 0; i < _ogreGridRenderableCount; i++)
+		nodes[i] = _ogreGridRenderables[i].getNodeInfo();
+}
+
+const LODSelectionDelta& LOD_getSelectionDelta()
+{
+	return _selectionDelta;
+}
+
+int LOD_addSelectionListener(const LODSelectionListener& listener)
+{
+	_selectionListeners[_nextSelectionListener] = listener;
+	return _nextSelectionListener++;
+}
+
+void LOD_removeSelectionListener(int id)
+{
+	_selectionListeners.erase(id);
+}
+
+int LOD_getGridDim()
+{
+	return _gridDim;
 }
 
 Ogre::MaterialPtr& GetMaterial()
@@ -418,36 +1665,79 @@ Ogre::MaterialPtr& GetMaterial()
 	return _material;
 }
 
-void OgreMaterialInit(const MapDimensions& map, int gridDimension, const char* heightmapName, const char* hmap2Name)
+void LOD_setHeightmapTexelSize(const Ogre::MaterialPtr& material, unsigned int texWidth, unsigned int texHeight, float sizeX, float sizeZ)
+{
+	Ogre::GpuProgramParametersSharedPtr fProgram = material->getTechnique(0)->getPass(0)->getFragmentProgramParameters();
+	float f[4];
+	f[0] = 1.0f/texWidth;
+	f[1] = 1.0f/texHeight;
+	f[2] = (texHeight-1)/sizeX;
+	f[3] = (texWidth-1)/sizeZ;
+	fProgram->setNamedConstant("texelSize", f, 1);
+}
+
+void LOD_setHeightmapRange(const Ogre::MaterialPtr& material, float minY, float sizeY)
+{
+	Ogre::Pass* pass = material->getTechnique(0)->getPass(0);
+	float f[4];
+	f[0] = (_gridDim-1) * 0.5f;
+	f[1] = 1.0f / f[0];
+	f[2] = minY;
+	f[3] = sizeY;
+	pass->getVertexProgramParameters()->setNamedConstant("gridDim", f, 1);
+	pass->getFragmentProgramParameters()->setNamedConstant("gridDim", f, 1);
+}
+
+Ogre::MaterialPtr LOD_createHeightmapMaterial(const Ogre::String& hmapName, const Ogre::String& hmap2Name, unsigned int texWidth, unsigned int texHeight, float sizeX, float sizeZ)
 {
+	const MapDimensions& map = _mapInfo;
 	Ogre::MaterialPtr baseMaterial = Ogre::MaterialManager::getSingleton().getByName(_baseMaterialName);
-	_material = baseMaterial->clone(_baseMaterialName + Ogre::StringConverter::toString(_nMaterial++));
-	Ogre::Pass* pass = _material->getTechnique(0)->getPass(0);
+	Ogre::MaterialPtr material = baseMaterial->clone(_baseMaterialName + Ogre::StringConverter::toString(_nMaterial++));
+	Ogre::Pass* pass = material->getTechnique(0)->getPass(0);
 	Ogre::GpuProgramParametersSharedPtr vProgram = pass->getVertexProgramParameters();
 	float f[4] = {map.MinX, map.MinZ, map.gridSizeX, map.gridSizeZ};
 	vProgram->setNamedConstant("mapDimensions", f, 1);
-	f[0] = (gridDimension-1) * 0.5f;
+	f[0] = (_gridDim-1) * 0.5f;
 	f[1] = 1.0f / f[0];
 	f[2] = map.MinY;
 	f[3] = map.SizeY;
 	vProgram->setNamedConstant("gridDim", f, 1);
+	vProgram->setNamedConstant("heightBlendRatio", _heightBlendRatio);
 
 	Ogre::GpuProgramParametersSharedPtr fProgram = pass->getFragmentProgramParameters();
 	fProgram->setNamedConstant("gridDim", f, 1);
-	f[0] = 1.0f/_heightmap_width;
-	f[1] = 1.0f/_heightmap_height;
-	f[2] = (_heightmap_height-1)/map.SizeX;
-	f[3] = (_heightmap_width-1)/map.SizeZ;
-	fProgram->setNamedConstant("texelSize", f, 1);
+	fProgram->setNamedConstant("heightBlendRatio", _heightBlendRatio);
+	LOD_setHeightmapTexelSize(material, texWidth, texHeight, sizeX, sizeZ);
 
-	pass->getTextureUnitState(0)->setTextureName(heightmapName);
+	pass->getTextureUnitState(0)->setTextureName(hmapName);
 	pass->getTextureUnitState(1)->setTextureName(hmap2Name);
-	pass->getTextureUnitState(2)->setTextureName(heightmapName);
+	pass->getTextureUnitState(2)->setTextureName(hmapName);
 	pass->getTextureUnitState(3)->setTextureName(hmap2Name);
+	_materials.push_back(material);
+	return material;
+}
+
+// upload straight from the decoded or mapped heightmap instead of loading the file again
+static void OgreTextureInit(int layer)
+{
+	Ogre::TextureManager& textureMgr = Ogre::TextureManager::getSingleton();
+	if (textureMgr.getByName(_heightmaps[layer].textureName).isNull())
+		textureMgr.loadImage(_heightmaps[layer].textureName, "General", _heightmaps[layer].image.getImage());
+}
+
+static void OgreMaterialInit(const MapDimensions& map)
+{
+	_material = LOD_createHeightmapMaterial(_heightmaps[0].textureName, _heightmaps[1].textureName, _heightmap_width, _heightmap_height, map.SizeX, map.SizeZ);
 }
 
 void OgreUpdateHeightmapBlendRatio(float ratio)
 {
+	{
+		TerrainQueryLock::Writer lock(_queryLock);
+		if (_heightBlendRatio != ratio)
+			_heightmapVersion++;
+		_heightBlendRatio = ratio;
+	}
 	for (size_t i = 0; i < _nMaterial; ++i)
 	{
 		Ogre::MaterialPtr matPtr = Ogre::MaterialManager::getSingleton().getByName(_baseMaterialName + Ogre::StringConverter::toString(i));
@@ -462,14 +1752,24 @@ void OgreUpdateHeightmapBlendRatio(float ratio)
 
 void LOD_init(const MapDimensions& mapInfo, int lodLevelCount, int gridDim, float morphStartRatio, const char* heightmapName, const char* hmap2Name)
 {
+	StartupGraph graph;
+	LOD_addInitTasks(graph, mapInfo, lodLevelCount, gridDim, morphStartRatio, heightmapName, hmap2Name);
+	graph.run(StartupGraph::defaultThreadCount());
+}
+
+void LOD_addInitTasks(StartupGraph& graph, const MapDimensions& mapInfo, int lodLevelCount, int gridDim, float morphStartRatio, const char* heightmapName, const char* hmap2Name)
+{
+	typedef std::vector<StartupGraph::TaskId> TaskIds;
 	float currentDetailBalance = 1.0f;
 
 	_LODLevelCount = lodLevelCount;
+	_gridDim = gridDim;
 	_morphStartRatio = morphStartRatio;
 
 	_lodRangeDistRatios.reserve(lodLevelCount);
 	_lodSqRanges.reserve(lodLevelCount);
 	_lodSqRanges.resize(lodLevelCount);
+	_lodDistanceSqRanges.resize(lodLevelCount);
 
 	_morphConsts.reserve(lodLevelCount);
 	_morphConsts.resize(lodLevelCount);
@@ -477,6 +1777,7 @@ void LOD_init(const MapDimensions& mapInfo, int lodLevelCount, int gridDim, floa
 	_nMaxLODSize = 1 << (lodLevelCount-1);
 
 	_mapInfo = mapInfo;
+	_objects.init(lodLevelCount, mapInfo.MinX, mapInfo.MinZ, mapInfo.SizeX / mapInfo.nGridX, mapInfo.SizeZ / mapInfo.nGridZ);
 
 	// this is a hack to work around morphing problems with the first two LOD levels
 	// (makes the zero LOD level a bit shorter)
@@ -494,19 +1795,222 @@ void LOD_init(const MapDimensions& mapInfo, int lodLevelCount, int gridDim, floa
 		_lodRangeDistRatios[i] /= currentDetailBalance;
 	}
 
-	// do this for hmap1 only for now
-	ConstructLODfromHeightmap(mapInfo, heightmapName);
-	OgreMaterialInit(mapInfo, gridDim, heightmapName, hmap2Name);
+	_tiled = LOD_isTiledHeightmap(heightmapName);
+	if (_tiled)
+	{
+		// hmap2, the whole-map textures and the runtime edits are not available
+		const Ogre::String name = heightmapName;
+		graph.add("open tiled heightmap", StartupGraph::RenderThread, [name, mapInfo]()
+		{
+			LOD_openTiledHeightmap(name.c_str(), _heightMinMax[0], &_nPixelX);
+			_nPixelZ = _nPixelX;
+			initPyramidParams();
+			_heightmap_width = mapInfo.nGridX * _nPixelX + 1;
+			_heightmap_height = mapInfo.nGridZ * _nPixelZ + 1;
+			_heightBlendRatio = 1.0f;
+		});
+		return;
+	}
+
+	// the resource system and the textures on the render thread, decoding and analysis on the workers
+	_heightmaps[0].textureName = heightmapName;
+	_heightmaps[1].textureName = hmap2Name;
+	StartupGraph::TaskId decode[2], texture[2];
+	for(int layer = 0; layer < 2; layer++)
+	{
+		std::shared_ptr<HeightmapSource> src(new HeightmapSource());
+		src->name = _heightmaps[layer].textureName;
+		StartupGraph::TaskId open = graph.add("open " + src->name, StartupGraph::RenderThread,
+			[src]() { openHeightmapSource(*src); });
+		decode[layer] = graph.add("decode " + src->name, StartupGraph::WorkerThread,
+			[src, layer]() { decodeHeightmapSource(*src, _heightmaps[layer].image); }, TaskIds(1, open));
+		texture[layer] = graph.add("texture " + src->name, StartupGraph::RenderThread,
+			[layer]() { OgreTextureInit(layer); }, TaskIds(1, decode[layer]));
+	}
+	StartupGraph::TaskId layout = graph.add("heightmap layout", StartupGraph::WorkerThread,
+		[mapInfo]() { initHeightmapLayout(mapInfo); }, TaskIds(1, decode[0]));
+	for(int layer = 0; layer < 2; layer++)
+	{
+		TaskIds deps;
+		deps.push_back(layout);
+		deps.push_back(decode[layer]);
+		const Ogre::String name = _heightmaps[layer].textureName;
+		graph.add("min/max pyramid " + name, StartupGraph::WorkerThread,
+			[layer, name]() { ConstructLODfromHeightmap(layer, name.c_str()); }, deps);
+	}
+	if (_noDataHeight >= 0)
+	{
+		TaskIds deps;
+		deps.push_back(layout);
+		deps.push_back(decode[0]);
+		graph.add("hole tree", StartupGraph::WorkerThread, []()
+		{
+			_holes.build(_pyramidParams, (const unsigned short *)_heightmaps[0].image.getData(), _heightmap_width, (unsigned short)_noDataHeight);
+		}, deps);
+	}
+	TaskIds materialDeps;
+	materialDeps.push_back(layout);
+	materialDeps.push_back(texture[0]);
+	materialDeps.push_back(texture[1]);
+	graph.add("material", StartupGraph::RenderThread, [mapInfo]() { OgreMaterialInit(mapInfo); }, materialDeps);
+}
+
+const LODSelectStats& LOD_getSelectStats()
+{
+	return _selectStats;
+}
+
+void LOD_setGeometricErrorThreshold(float pixels)
+{
+	_errorThreshold = pixels;
+}
+
+void LOD_setHorizonCulling(bool enable)
+{
+	_horizonCulling = enable;
+}
+
+bool LOD_loadPVS(const char* name)
+{
+	LOD_unloadPVS();
+	if (!_pvs.load(name))
+	{
+		Ogre::LogManager::getSingleton().logMessage("Failed to load PVS " + Ogre::String(name));
+		return false;
+	}
+	return true;
+}
+
+void LOD_unloadPVS()
+{
+	_pvs.clear();
+	_pvsCell = -1;
+	_pvsStates.clear();
+	_pvsTiles.clear();
+	_pvsHintCell = -1;
+	_pvsHintTiles.clear();
+}
+
+void LOD_setPVSPrefetchPosition(const Ogre::Vector3& position)
+{
+	_pvsHintPosition = position;
+	const int cell = _pvs.findCell(position.x, position.z);
+	if (cell == _pvsHintCell)
+		return;
+	_pvsHintCell = cell;
+	_pvsHintTiles.clear();
+	if (cell >= 0 && _tiled && _pvs.getHeader().lodLevelCount == (unsigned int)_LODLevelCount)
+	{
+		std::vector<unsigned char> states;
+		_pvs.decodeCell(cell, states);
+		collectPVSTiles(states, _pvsHintTiles);
+	}
+}
+
+void LOD_clearPVSPrefetchPosition()
+{
+	_pvsHintCell = -1;
+	_pvsHintTiles.clear();
+}
+
+void LOD_setOcclusionCulling(bool enable, int bufferWidth, int bufferHeight)
+{
+	if (!enable)
+		_occlusionBuffer.reset();
+	else if (!_occlusionBuffer)
+		_occlusionBuffer.reset(new OcclusionBuffer(bufferWidth, bufferHeight, StartupGraph::defaultThreadCount()));
+	else
+		_occlusionBuffer->resize(bufferWidth, bufferHeight);
+}
+
+int LOD_addOccluder(const float* vertices, size_t vertexCount, const unsigned int* indices, size_t indexCount)
+{
+	if (vertexCount == 0 || indexCount < 3)
+		return 0;
+	OccluderMesh& mesh = _occluders[_nextOccluderId];
+	mesh.vertices.assign(vertices, vertices + vertexCount * 3);
+	mesh.indices.assign(indices, indices + indexCount / 3 * 3);
+	return _nextOccluderId++;
+}
+
+void LOD_removeOccluder(int id)
+{
+	_occluders.erase(id);
+}
+
+const OcclusionBuffer* LOD_getOcclusionBuffer()
+{
+	return _occlusionBuffer.get();
+}
+
+int LOD_addObject(const Ogre::AxisAlignedBox& bounds, void* userData, float maxDistance)
+{
+	return _objects.add(bounds.getMinimum().ptr(), bounds.getMaximum().ptr(), userData, maxDistance);
+}
+
+void LOD_moveObject(int id, const Ogre::AxisAlignedBox& bounds)
+{
+	_objects.move(id, bounds.getMinimum().ptr(), bounds.getMaximum().ptr());
+}
+
+void LOD_removeObject(int id)
+{
+	_objects.remove(id);
+}
+
+void* LOD_getObjectUserData(int id)
+{
+	return _objects.getUserData(id);
+}
+
+const std::vector<int>& LOD_getVisibleObjects()
+{
+	return _visibleObjects;
+}
+
+void LOD_setHeightmapNoData(int height)
+{
+	_noDataHeight = height > 65535 ? -1 : height;
+}
+
+size_t LOD_getHoleTreeNodeCount()
+{
+	return _holes.getMixedNodeCount();
 }
 
 void LOD_deinit()
 {
-	while(_heightMinMax.size())
+	LOD_deinitKeyframes();
+	LOD_deinitCollision();
+	LOD_deinitScatter();
+	LOD_unloadPVS();
+	if (_tiled)
+		LOD_closeTiledHeightmap();
+	_uploadScheduler.clear();
+	TerrainQueryLock::Writer lock(_queryLock);
+	_tiled = false;
+	_heightmapVersion++;
+
+	for(int layer = 0; layer < 2; layer++)
+	{
+		LOD_freeHeightMinMax(_heightMinMax[layer]);
+		_levelBounds[layer].clear();
+	}
+	_holes.clear();
+	_objects.clear();
+	_visibleObjects.clear();
+	_selectedNodes.clear();
+	_prevSelectedNodes.clear();
+	_selectionDelta = LODSelectionDelta();
+
+	for(int layer = 0; layer < 2; layer++)
 	{
-		delete [] _heightMinMax.back();
-		_heightMinMax.pop_back();
+		_heightmaps[layer].image.unload();
+		_heightmaps[layer].dirtyRects.clear();
+		_heightmaps[layer].uploadingRects.clear();
 	}
 
 	if (!_material.isNull())
 		_material.setNull();
+	_materials.clear();
 }
\ No newline at end of file
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include "OgreGridRenderable.h"
+#include "TerrainPyramid.h"
+#include "TerrainScatter.h"
+
+namespace Ogre
+{
+	class SceneManager;
+}
+class HeightmapImage;
+class UploadScheduler;
+class StartupGraph;
+struct TerrainRay;
+struct TerrainRayHit;
+
+void LOD_init(const MapDimensions& mapInfo, int lodLevelCount, int gridDim, float morphStartRatio, const char* heightmapName, const char* hmap2Name);
+// the same as LOD_init as startup tasks, to overlap with the rest of the startup; the names are copied
+void LOD_addInitTasks(StartupGraph& graph, const MapDimensions& mapInfo, int lodLevelCount, int gridDim, float morphStartRatio, const char* heightmapName, const char* hmap2Name);
+void LOD_deinit();
+void LOD_frameStarted(Ogre::SceneManager* scnMgr, const Ogre::Camera& cam);
+float getLODSqRange(size_t lodLevel);
+
+void OgreUpdateHeightmapBlendRatio(float ratio);
+// shrinks the range of each LOD level to where the largest geometric error of the next coarser level projects to more
+// than this many pixels (0 disables); the ranges stay far enough apart for the morphs to meet the neighbors
+void LOD_setGeometricErrorThreshold(float pixels);
+// culls the nodes hidden behind nearer terrain, for cameras near the ground in hilly terrain; the selection goes
+// front to back then. Not with heightmap holes, which may be seen through.
+void LOD_setHorizonCulling(bool enable);
+// Culls the nodes hidden behind the occluders and the terrain in a software depth buffer of this size (see
+// TerrainOcclusion.h), rasterized on a thread per core before the selection; the terrain is left out in tiled mode
+void LOD_setOcclusionCulling(bool enable, int bufferWidth = 256, int bufferHeight = 128);
+// World space triangles of something solid that is always drawn, e.g. a building, copied; returns its id
+int LOD_addOccluder(const float* vertices, size_t vertexCount, const unsigned int* indices, size_t indexCount);
+void LOD_removeOccluder(int id);
+// null unless the occlusion culling is on
+class OcclusionBuffer;
+const OcclusionBuffer* LOD_getOcclusionBuffer();
+// Objects placed on the terrain, e.g. trees, rocks and buildings, culled with the quadtree (see TerrainObjects.h).
+// Added after LOD_init, which drops them; a maxDistance of 0 shows the object as far as the terrain is drawn.
+int LOD_addObject(const Ogre::AxisAlignedBox& bounds, void* userData, float maxDistance = 0);
+void LOD_moveObject(int id, const Ogre::AxisAlignedBox& bounds);
+void LOD_removeObject(int id);
+void* LOD_getObjectUserData(int id);
+// the ids of the objects in view after the last LOD_frameStarted
+const std::vector<int>& LOD_getVisibleObjects();
+// Potentially visible sets baked per viewpoint cell by tools/TerrainPVSBake (*.pvs, see TerrainPVS.h): the nodes
+// hidden from the whole cell of the camera are culled before any other test, and in tiled mode the tiles of the
+// visible ones are prefetched. They hold for cameras near the baked eye height; off the cells nothing is culled.
+bool LOD_loadPVS(const char* name);
+void LOD_unloadPVS();
+// the tiles visible from the cell of a position the camera is about to cut to are prefetched too, until cleared
+void LOD_setPVSPrefetchPosition(const Ogre::Vector3& position);
+void LOD_clearPVSPrefetchPosition();
+// Pixels of hmap1 at this height are holes, negative for none; set before LOD_init.
+// Patch quadrants without any data are not drawn; the holes follow hmap1 as loaded, not the edits or the keyframes
+void LOD_setHeightmapNoData(int height);
+// mixed nodes stored for the holes, the solid and the empty subtrees take none
+size_t LOD_getHoleTreeNodeCount();
+
+struct LODSelectStats
+{
+	int selectedNodes;
+	int frustumCulledNodes;
+	int backFacingNodes;
+	int errorTerminatedNodes;	// nodes not subdivided thanks to a small geometric error
+	int holeMaskedNodes;		// nodes visited with quadrants without data
+	int horizonCulledNodes;		// nodes hidden behind nearer terrain
+	int occlusionCulledNodes;	// nodes hidden behind the occlusion buffer
+	int occluderTriangles;		// rasterized into it this frame
+	int pvsCulledNodes;			// nodes hidden from the camera's PVS cell
+	int visibleObjects;
+	int objectBoxTests;			// object and node boxes the selection's results did not decide
+};
+const LODSelectStats& LOD_getSelectStats();
+
+// runtime heightmap edits
+const unsigned short* LOD_getHeightmapData(int layer, unsigned int* width, unsigned int* height);
+void LOD_editHeightmap(int layer, unsigned int x, unsigned int z, unsigned int w, unsigned int h, const unsigned short* heights);
+void LOD_stampHeightmap(unsigned int x, unsigned int z, unsigned int w, unsigned int h, const float* weights, float delta);
+
+// CPU queries of the blended surface as rendered, thread safe (see TerrainQuery.h); not in tiled mode.
+// Edits are seen at once. Split large batches over threads, the queries only wait for the edits, not for each other.
+bool LOD_getHeights(const float* x, const float* z, float* y, size_t count);
+size_t LOD_raycast(const TerrainRay* rays, TerrainRayHit* hits, size_t count);
+// changes whenever the heights the queries see do: edits, layer swaps and blend ratio changes
+unsigned int LOD_getHeightmapVersion();
+
+// the LOD ranges and morph constants of the last LOD_frameStarted, for selections away from the render thread
+struct LODRanges
+{
+	Ogre::Vector3 cameraPos;
+	std::vector<float> sqRanges;
+	std::vector<float> morphConsts;		// const1, const2 of each level, as the shaders get them
+};
+struct LODSphere
+{
+	Ogre::Vector3 center;
+	float radius;
+};
+void LOD_getRanges(const Ogre::Vector3& cameraPos, LODRanges& ranges);
+// The nodes LOD_select would pick from the camera position that touch any of the spheres, frustum aside; thread safe.
+// Empty in tiled mode.
+void LOD_selectInSpheres(const LODRanges& ranges, const LODSphere* spheres, size_t sphereCount, std::vector<NodeInfo>& nodes);
+// Shadow cascades: the nodes in each cascade's light frustum, from one traversal for all of them. The LODs are those of
+// the view from ranges.cameraPos, coarser by each cascade's bias, so that the near cascades cast what the view draws.
+// Thread safe; empty in tiled mode. At most 32 cascades.
+struct LODShadowCascade
+{
+	const Ogre::Plane* planes;	// the 6 of the light's orthographic frustum, normals inward as Ogre's, stretched toward the light
+	float lodBias;				// levels coarser than the view, fractions included
+	bool morph;					// false for the far cascades: every node as it is, cracks between the levels are left
+};
+struct LODCascadeSelection
+{
+	std::vector<NodeInfo> nodes;
+	std::vector<float> morphConsts;		// const1, const2 of each level to draw them with
+};
+void LOD_selectShadowCascades(const LODRanges& ranges, const LODShadowCascade* cascades, size_t cascadeCount,
+	std::vector<LODCascadeSelection>& selections);
+// Reflections, e.g. of planar water: the nodes in the frustum of the reflected camera on the positive side of all the clip
+// planes, such as the water plane facing up, with the distances multiplied by lodDistanceScale (1 or more) for a lower
+// detail. The ranges' camera position may be the main camera's, the distances to the water plane are the same.
+void LOD_selectWithClipPlanes(const LODRanges& ranges, const Ogre::Plane* frustumPlanes, const Ogre::Plane* clipPlanes, size_t clipPlaneCount,
+	float lodDistanceScale, LODCascadeSelection& selection);
+int LOD_getGridDim();
+// the nodes of the last LOD_frameStarted
+void LOD_getSelectedNodes(std::vector<NodeInfo>& nodes);
+// How the selection of the last LOD_frameStarted differs from the one before, for the consumers that keep state
+// per node: the nodes selected now and not then, the nodes no longer selected, and the nodes in both with other
+// quadrants drawn. A node is its LOD level and position; the added and changed ones are as selected now, the
+// removed ones as they were. The heights and tile slots are not compared. After LOD_init all the nodes are added.
+struct LODSelectionDelta
+{
+	std::vector<NodeInfo> added;
+	std::vector<NodeInfo> removed;
+	std::vector<NodeInfo> changed;
+
+	bool empty() const { return added.empty() && removed.empty() && changed.empty(); }
+};
+const LODSelectionDelta& LOD_getSelectionDelta();
+// called by LOD_frameStarted right after the selection when it has changed, in the order added; returns an id
+typedef std::function<void(const LODSelectionDelta&)> LODSelectionListener;
+int LOD_addSelectionListener(const LODSelectionListener& listener);
+void LOD_removeSelectionListener(int id);
+
+// collision meshes of the rendered LOD around points of interest, for physics; built on a worker thread
+struct CollisionPatch
+{
+	NodeInfo node;						// the selected node and its drawn quadrants
+	std::vector<float> vertices;		// x, y, z in world space of the node's grid, morphed like the vertex shader does
+	std::vector<unsigned int> indices;	// triangles of the drawn quadrants
+};
+typedef std::shared_ptr<const CollisionPatch> CollisionPatchPtr;
+void LOD_setCollisionPoints(const std::vector<LODSphere>& points);
+// a patch partly morphing is rebuilt once the camera has moved this far since it was built
+void LOD_setCollisionMorphTolerance(float distance);
+// starts a new update if the last one is done; called by LOD_frameStarted
+void LOD_updateCollision(const Ogre::Vector3& cameraPos);
+// Patches built and dropped since the last call. A rebuilt patch is in both, the new one in added and the old one in removed.
+void LOD_getCollisionChanges(std::vector<CollisionPatchPtr>& added, std::vector<CollisionPatchPtr>& removed);
+void LOD_deinitCollision();
+
+// instanced vegetation and detail scatter on the drawn quadrants of the selected nodes (see TerrainScatter.h),
+// generated on worker threads and cached; not in tiled mode
+struct ScatterPatch
+{
+	int layer;
+	int lodLevel;
+	unsigned int x;		// of the node, in level 0 grids
+	unsigned int z;
+	int quadrant;		// 0 TL, 1 TR, 2 BL, 3 BR
+	std::vector<ScatterInstance> instances;
+};
+typedef std::shared_ptr<const ScatterPatch> ScatterPatchPtr;
+struct ScatterStats
+{
+	size_t cachedPatches;
+	size_t cachedInstances;
+	size_t visiblePatches;
+	size_t visibleInstances;
+	size_t pendingPatches;		// queued or being generated
+	size_t generatedPatches;	// since the start
+};
+// the params and the density map are copied; returns the layer's id
+int LOD_addScatterLayer(const TerrainScatterParams& params);
+void LOD_removeScatterLayer(int layer);
+// the cache's budget in instances, the quadrants in use are kept beyond it; worker threads
+void LOD_setScatterCache(size_t maxInstances, int threads);
+// called by LOD_frameStarted after the selection
+void LOD_updateScatter(const Ogre::Vector3& cameraPos);
+// the patches ready for the drawn quadrants at the last LOD_frameStarted, the others come in later frames
+const std::vector<ScatterPatchPtr>& LOD_getScatterPatches();
+const ScatterStats& LOD_getScatterStats();
+void LOD_deinitScatter();
+
+// building blocks for replacing a heightmap layer (safe to call from a worker thread after LOD_init)
+void LOD_buildHeightMinMax(const unsigned short* pImgSrc, unsigned int width, HeightMinMaxPyramid& pyramid);
+void LOD_freeHeightMinMax(HeightMinMaxPyramid& pyramid);
+// swaps the image and its pyramid into the layer and queues the texture upload; the old ones are returned
+void LOD_swapHeightmapLayer(int layer, HeightmapImage& image, HeightMinMaxPyramid& pyramid);
+
+// texture uploads spread over frames: bytes and milliseconds per frame, 0 for no limit
+UploadScheduler& LOD_getUploadScheduler();
+void LOD_setUploadBudget(size_t bytesPerFrame, float msPerFrame);
+// true until the texture of the layer matches its image
+bool LOD_isHeightmapUploadPending(int layer);
+
+// animated terrain: a timeline of heightmap keyframes, two of them resident at a time
+void LOD_setHeightmapKeyframes(const std::vector<Ogre::String>& names);
+void LOD_setKeyframeTime(float time);
+size_t LOD_getKeyframeCount();
+void LOD_updateKeyframes();
+void LOD_deinitKeyframes();
+
+// heightmap material clones, e.g. one per GPU tile slot; cameraPos and heightBlendRatio are kept up to date on all of them
+Ogre::MaterialPtr LOD_createHeightmapMaterial(const Ogre::String& hmapName, const Ogre::String& hmap2Name, unsigned int texWidth, unsigned int texHeight, float sizeX, float sizeZ);
+void LOD_setHeightmapTexelSize(const Ogre::MaterialPtr& material, unsigned int texWidth, unsigned int texHeight, float sizeX, float sizeZ);
+// world heights the texture values 0 and 1 map to are minY and minY + sizeY; the map's range by default
+void LOD_setHeightmapRange(const Ogre::MaterialPtr& material, float minY, float sizeY);
+Ogre::MaterialPtr& GetMaterial();
+const MapDimensions& LOD_getMapInfo();
+
+// out-of-core terrain: a tiled package (*.cdlod) as hmap1, streamed through RAM and GPU tile caches
+bool LOD_isTiledHeightmap(const char* name);
+void LOD_setTileCacheLimits(size_t ramTiles, size_t gpuTiles, int uploadsPerFrame);
+void LOD_setTileLoaderThreads(int threads);
+// look-ahead of the camera path extrapolation in seconds (0 disables) and new reads per frame
+void LOD_setTilePrefetch(float seconds, int tilesPerFrame);
+// BC4 tile textures for the tiles whose error stays within maxError height units (0..65535), if the render system has them
+void LOD_setTileCompression(bool enable, float maxError);
+// what the rendered tiles may differ from the min/max pyramid by, in height units
+float LOD_getTileHeightError();
+void LOD_openTiledHeightmap(const char* name, HeightMinMaxPyramid& pyramid, int* gridPixels);
+void LOD_closeTiledHeightmap();
+void LOD_beginTileFrame();
+int LOD_requestTile(int lodLevel, unsigned int x, unsigned int z, float sqDist);
+void LOD_updateTiles();
+int LOD_getTileBaseLODLevel();
+void LOD_prefetchTiles(const Ogre::Camera& cam);
+void LOD_prefetchTile(int lodLevel, unsigned int x, unsigned int z, float sqDist);
+void LOD_selectAhead(const Ogre::Vector3& position, const Ogre::Vector3& heading);
+
+struct TileStreamStats
+{
+	size_t queuedTiles;		// waiting for a loader thread
+	size_t loadingTiles;	// being read
+	size_t cachedTiles;		// in RAM
+	size_t residentTiles;	// in GPU slots
+	size_t compressedTiles;	// of those, BC4 textures
+	float maxCompressionError;	// largest error of the compressed tiles read, in height units
+	float latencyP50;		// request to completion of the recent reads, in milliseconds
+	float latencyP95;
+	float latencyP99;
+
+	size_t demandMisses;		// tiles the selection wanted that were not in RAM
+	size_t prefetchedTiles;		// read for the prefetcher only
+	size_t prefetchHits;		// of those, later wanted by the selection
+	size_t prefetchWastedTiles;	// evicted from RAM before anybody wanted them
+	size_t prefetchWastedBytes;
+};
+const TileStreamStats& LOD_getTileStreamStats();
@@ -0,0 +1,285 @@
+#include "OgreQuadTree.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <algorithm>
+
+// Collision meshes for physics
+// The nodes LOD_select picks around the points of interest are triangulated the way OgreGridRenderable draws them,
+// with the vertices morphed by the camera distance and the heights sampled as the vertex shader does, so physics
+// collides with what is on screen. A worker thread reselects after each frame and rebuilds only the patches whose
+// node, quadrants, heights or morph changed.
+
+struct CollisionJob
+{
+	LODRanges ranges;
+	std::vector<LODSphere> points;
+	unsigned int heightmapVersion;
+};
+
+struct CollisionEntry
+{
+	CollisionPatchPtr patch;
+	unsigned int heightmapVersion;
+	Ogre::Vector3 cameraPos;	// the patch was morphed for
+	int morphState;				// 0 or 1 if no vertex or every vertex is morphed, -1 in between
+};
+
+static std::vector<LODSphere> _collisionPoints;
+static float _collisionMorphTolerance = 1.0f;
+
+static std::thread _collisionWorker;
+static std::mutex _collisionMutex;
+static std::condition_variable _collisionCond;
+static CollisionJob _collisionJob;
+static bool _collisionJobPending = false;
+static bool _collisionBusy = false;
+static bool _collisionQuit = false;
+// changes not taken by LOD_getCollisionChanges yet
+static std::vector<CollisionPatchPtr> _collisionAdded;
+static std::vector<CollisionPatchPtr> _collisionRemoved;
+// the current patches by node, the worker's own
+static std::map<unsigned long long, CollisionEntry> _collisionPatches;
+
+static unsigned long long getNodeKey(const NodeInfo& node)
+{
+	return ((unsigned long long)node.LODLevel << 56) | ((unsigned long long)node.X << 28) | node.Z;
+}
+
+static int getQuadrants(const NodeInfo& node)
+{
+	return (node.TL ? 1 : 0) | (node.TR ? 2 : 0) | (node.BL ? 4 : 0) | (node.BR ? 8 : 0);
+}
+
+// the morph of the whole node if it is the same for all its vertices, see main_vp
+static int getMorphState(const NodeInfo& node, const LODRanges& ranges)
+{
+	const MapDimensions& map = LOD_getMapInfo();
+	Ogre::AxisAlignedBox aabb(
+		map.MinX + node.X * map.gridSizeX, node.MinY * map.SizeY / 65535.0f + map.MinY, map.MinZ + node.Z * map.gridSizeZ,
+		map.MinX + (node.X + node.Size) * map.gridSizeX, node.MaxY * map.SizeY / 65535.0f + map.MinY, map.MinZ + (node.Z + node.Size) * map.gridSizeZ);
+	const float const1 = ranges.morphConsts[node.LODLevel * 2];
+	const float const2 = ranges.morphConsts[node.LODLevel * 2 + 1];
+	const Ogre::Vector3 farCorner(
+		ranges.cameraPos.x < aabb.getCenter().x ? aabb.getMaximum().x : aabb.getMinimum().x,
+		ranges.cameraPos.y < aabb.getCenter().y ? aabb.getMaximum().y : aabb.getMinimum().y,
+		ranges.cameraPos.z < aabb.getCenter().z ? aabb.getMaximum().z : aabb.getMinimum().z);
+	// morphLerpK grows with the distance
+	if (const1 - farCorner.distance(ranges.cameraPos) * const2 >= 1.0f)
+		return 0;
+	if (const1 - sqrtf(aabb.squaredDistance(ranges.cameraPos)) * const2 <= 0.0f)
+		return 1;
+	return -1;
+}
+
+static CollisionPatchPtr buildCollisionPatch(const NodeInfo& node, const LODRanges& ranges, int gridDim)
+{
+	const MapDimensions& map = LOD_getMapInfo();
+	const int n = gridDim;
+	const size_t count = (size_t)n * n;
+	const float scale = node.Size / (float)(n - 1);
+	const float const1 = ranges.morphConsts[node.LODLevel * 2];
+	const float const2 = ranges.morphConsts[node.LODLevel * 2 + 1];
+
+	std::vector<float> x(count), y(count), z(count);
+	for (int j = 0; j < n; j++)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			x[j * n + i] = map.MinX + (node.X + i * scale) * map.gridSizeX;
+			z[j * n + i] = map.MinZ + (node.Z + j * scale) * map.gridSizeZ;
+		}
+	}
+	if (!LOD_getHeights(&x[0], &z[0], &y[0], count))
+		return CollisionPatchPtr();
+
+	// morphVertex: the odd vertices slide toward their even neighbors by morphLerpK
+	for (int j = 0; j < n; j++)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			const size_t v = j * n + i;
+			const float camDistance = ranges.cameraPos.distance(Ogre::Vector3(x[v], y[v], z[v]));
+			const float morphLerpK = 1.0f - std::min(std::max(const1 - camDistance * const2, 0.0f), 1.0f);
+			x[v] = map.MinX + (node.X + (i - (i & 1) * morphLerpK) * scale) * map.gridSizeX;
+			z[v] = map.MinZ + (node.Z + (j - (j & 1) * morphLerpK) * scale) * map.gridSizeZ;
+		}
+	}
+	if (!LOD_getHeights(&x[0], &z[0], &y[0], count))
+		return CollisionPatchPtr();
+
+	std::shared_ptr<CollisionPatch> patch(new CollisionPatch());
+	patch->node = node;
+	patch->vertices.resize(count * 3);
+	for (size_t v = 0; v < count; v++)
+	{
+		patch->vertices[v * 3] = x[v];
+		patch->vertices[v * 3 + 1] = y[v];
+		patch->vertices[v * 3 + 2] = z[v];
+	}
+	// the triangles of OgreGridRenderable's index ranges, quadrant by quadrant
+	const int half = (n - 1) / 2;
+	const int quadrants = getQuadrants(node);
+	for (int q = 0; q < 4; q++)
+	{
+		if (!(quadrants & (1 << q)))
+			continue;
+		const int x0 = (q & 1) ? half : 0, x1 = (q & 1) ? n - 1 : half;
+		const int z0 = (q >> 1) ? half : 0, z1 = (q >> 1) ? n - 1 : half;
+		for (int j = z0; j < z1; j++)
+		{
+			for (int i = x0; i < x1; i++)
+			{
+				const unsigned int v = j * n + i;
+				const unsigned int triangles[6] = { v, v + n, v + 1, v + 1, v + n, v + n + 1 };
+				patch->indices.insert(patch->indices.end(), triangles, triangles + 6);
+			}
+		}
+	}
+	return patch;
+}
+
+static void updateCollisionPatches(const CollisionJob& job, std::vector<CollisionPatchPtr>& added, std::vector<CollisionPatchPtr>& removed)
+{
+	std::vector<NodeInfo> nodes;
+	if (!job.points.empty())
+		LOD_selectInSpheres(job.ranges, &job.points[0], job.points.size(), nodes);
+	const int gridDim = LOD_getGridDim();
+	const float sqTolerance = _collisionMorphTolerance * _collisionMorphTolerance;
+
+	std::map<unsigned long long, CollisionEntry> patches;
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		const NodeInfo& node = nodes[i];
+		const unsigned long long key = getNodeKey(node);
+		const int morphState = getMorphState(node, job.ranges);
+		std::map<unsigned long long, CollisionEntry>::iterator it = _collisionPatches.find(key);
+		if (it != _collisionPatches.end())
+		{
+			CollisionEntry& e = it->second;
+			const bool upToDate = getQuadrants(e.patch->node) == getQuadrants(node) &&
+				e.heightmapVersion == job.heightmapVersion && e.morphState == morphState &&
+				(morphState >= 0 || e.cameraPos.squaredDistance(job.ranges.cameraPos) <= sqTolerance);
+			if (upToDate)
+			{
+				patches[key] = e;
+				_collisionPatches.erase(it);
+				continue;
+			}
+		}
+		CollisionEntry e;
+		e.patch = buildCollisionPatch(node, job.ranges, gridDim);
+		if (!e.patch)
+			continue;
+		e.heightmapVersion = job.heightmapVersion;
+		e.cameraPos = job.ranges.cameraPos;
+		e.morphState = morphState;
+		patches[key] = e;
+		added.push_back(e.patch);
+	}
+	// what is left was rebuilt or is no longer selected
+	for (std::map<unsigned long long, CollisionEntry>::iterator it = _collisionPatches.begin(); it != _collisionPatches.end(); ++it)
+		removed.push_back(it->second.patch);
+	_collisionPatches.swap(patches);
+}
+
+static void collisionWorkerMain()
+{
+	std::unique_lock<std::mutex> lock(_collisionMutex);
+	while (!_collisionQuit)
+	{
+		if (!_collisionJobPending)
+		{
+			_collisionCond.wait(lock);
+			continue;
+		}
+		CollisionJob job;
+		std::swap(job, _collisionJob);
+		_collisionJobPending = false;
+		_collisionBusy = true;
+		lock.unlock();
+
+		std::vector<CollisionPatchPtr> added, removed;
+		updateCollisionPatches(job, added, removed);
+
+		lock.lock();
+		_collisionBusy = false;
+		// a patch dropped before anybody took it is never reported
+		for (size_t i = 0; i < removed.size(); i++)
+		{
+			std::vector<CollisionPatchPtr>::iterator it = std::find(_collisionAdded.begin(), _collisionAdded.end(), removed[i]);
+			if (it != _collisionAdded.end())
+				_collisionAdded.erase(it);
+			else
+				_collisionRemoved.push_back(removed[i]);
+		}
+		_collisionAdded.insert(_collisionAdded.end(), added.begin(), added.end());
+	}
+}
+
+// spheres around the points of interest, e.g. the physics bodies; an empty set drops all the patches
+void LOD_setCollisionPoints(const std::vector<LODSphere>& points)
+{
+	std::lock_guard<std::mutex> lock(_collisionMutex);
+	_collisionPoints = points;
+}
+
+void LOD_setCollisionMorphTolerance(float distance)
+{
+	std::lock_guard<std::mutex> lock(_collisionMutex);
+	_collisionMorphTolerance = std::max(distance, 0.0f);
+}
+
+void LOD_updateCollision(const Ogre::Vector3& cameraPos)
+{
+	std::lock_guard<std::mutex> lock(_collisionMutex);
+	if (!_collisionWorker.joinable())
+	{
+		if (_collisionPoints.empty())
+			return;
+		_collisionWorker = std::thread(collisionWorkerMain);
+	}
+	// the next update starts from the frame after the current one is done
+	if (_collisionBusy || _collisionJobPending)
+		return;
+	LOD_getRanges(cameraPos, _collisionJob.ranges);
+	_collisionJob.points = _collisionPoints;
+	_collisionJob.heightmapVersion = LOD_getHeightmapVersion();
+	_collisionJobPending = true;
+	_collisionCond.notify_one();
+}
+
+// apply the removed patches before the added ones
+void LOD_getCollisionChanges(std::vector<CollisionPatchPtr>& added, std::vector<CollisionPatchPtr>& removed)
+{
+	std::lock_guard<std::mutex> lock(_collisionMutex);
+	added.swap(_collisionAdded);
+	removed.swap(_collisionRemoved);
+	_collisionAdded.clear();
+	_collisionRemoved.clear();
+}
+
+void LOD_deinitCollision()
+{
+	if (_collisionWorker.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(_collisionMutex);
+			_collisionQuit = true;
+		}
+		_collisionCond.notify_one();
+		_collisionWorker.join();
+	}
+	_collisionQuit = false;
+	_collisionJobPending = false;
+
+	// the patches already taken are dropped, the others are never reported
+	for (std::map<unsigned long long, CollisionEntry>::iterator it = _collisionPatches.begin(); it != _collisionPatches.end(); ++it)
+	{
+		if (std::find(_collisionAdded.begin(), _collisionAdded.end(), it->second.patch) == _collisionAdded.end())
+			_collisionRemoved.push_back(it->second.patch);
+	}
+	_collisionAdded.clear();
+	_collisionPatches.clear();
+}
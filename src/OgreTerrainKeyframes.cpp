@@ -0,0 +1,320 @@
+#include "OgreQuadTree.h"
+#include "OgreHeightmapImage.h"
+#include "OgreResourceGroupManager.h"
+#include "OgreLogManager.h"
+#include "OgreStringConverter.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// Animated terrain
+// hmap1 and hmap2 hold the two keyframes around the current time and the shaders lerp them by heightBlendRatio.
+// The keyframe needed by the next interval is decoded and analyzed by a background thread,
+// so switching keyframes only costs a texture upload on the main thread.
+// A layer is replaced only while it has no weight: the other layer is drawn alone until the new texture is
+// uploaded, so neither the GPU draws a torn layer nor do the culling and the queries see data it doesn't draw.
+
+struct KeyframeData
+{
+	size_t index;
+	Ogre::DataStreamPtr stream;	// opened on the main thread, decoded by the loader
+	Ogre::String type;
+	Ogre::String rawPath;		// raw R16 keyframes are mapped by the loader instead
+	HeightmapImage image;
+	HeightMinMaxPyramid pyramid;
+	bool failed;
+};
+
+static std::vector<Ogre::String> _keyframeNames;
+// keyframes that failed to load, logged once and never requested again
+static std::vector<bool> _failedKeyframes;
+static float _keyframeTime = 0.0f;
+static float _prevKeyframeTime = 0.0f;
+// keyframe index resident in hmap1 / hmap2, -1 for none
+static int _layerKeyframe[2] = { -1, -1 };
+static float _keyframeBlendRatio = -1.0f;
+
+// decoded keyframes waiting to be swapped in
+static std::vector<KeyframeData*> _readyKeyframes;
+
+static std::thread _keyframeLoader;
+static std::mutex _keyframeMutex;
+static std::condition_variable _keyframeCond;
+static std::deque<KeyframeData*> _pendingKeyframes;
+static std::vector<KeyframeData*> _loadedKeyframes;
+static KeyframeData* _loadingKeyframe = 0;
+static bool _keyframeLoaderQuit = false;
+
+static void keyframeLoaderMain()
+{
+	unsigned int width, height;
+	LOD_getHeightmapData(0, &width, &height);
+
+	std::unique_lock<std::mutex> lock(_keyframeMutex);
+	while (!_keyframeLoaderQuit)
+	{
+		if (_pendingKeyframes.empty())
+		{
+			_keyframeCond.wait(lock);
+			continue;
+		}
+		KeyframeData* kf = _pendingKeyframes.front();
+		_pendingKeyframes.pop_front();
+		_loadingKeyframe = kf;
+		lock.unlock();
+
+		try
+		{
+			if (kf->rawPath.empty())
+				kf->image.load(kf->stream, kf->type);
+			else
+				kf->image.loadRaw(kf->rawPath);
+			kf->failed = kf->image.getWidth() != width || kf->image.getHeight() != height;
+		}
+		catch (...)
+		{
+			kf->failed = true;
+		}
+		kf->stream.setNull();
+		if (!kf->failed)
+			LOD_buildHeightMinMax((const unsigned short *)kf->image.getData(), width, kf->pyramid);
+
+		lock.lock();
+		_loadingKeyframe = 0;
+		_loadedKeyframes.push_back(kf);
+	}
+}
+
+static void freeKeyframe(KeyframeData* kf)
+{
+	LOD_freeHeightMinMax(kf->pyramid);
+	delete kf;
+}
+
+static bool isKeyframeRequested(size_t index)
+{
+	if (_layerKeyframe[0] == (int)index || _layerKeyframe[1] == (int)index)
+		return true;
+	for (size_t i = 0; i < _readyKeyframes.size(); i++)
+		if (_readyKeyframes[i]->index == index)
+			return true;
+	// the caller holds the lock
+	for (size_t i = 0; i < _pendingKeyframes.size(); i++)
+		if (_pendingKeyframes[i]->index == index)
+			return true;
+	for (size_t i = 0; i < _loadedKeyframes.size(); i++)
+		if (_loadedKeyframes[i]->index == index)
+			return true;
+	return _loadingKeyframe && _loadingKeyframe->index == index;
+}
+
+static void markKeyframeFailed(size_t index)
+{
+	Ogre::LogManager::getSingleton().logMessage("Failed to load heightmap keyframe " + _keyframeNames[index]);
+	_failedKeyframes[index] = true;
+}
+
+static void requestKeyframe(size_t index)
+{
+	if (index >= _keyframeNames.size() || _failedKeyframes[index] || isKeyframeRequested(index))
+		return;
+	KeyframeData* kf = new KeyframeData();
+	kf->index = index;
+	kf->failed = false;
+	const Ogre::String& name = _keyframeNames[index];
+	// on the render thread, a missing resource must not throw out of LOD_frameStarted
+	try
+	{
+		if (HeightmapImage::isRaw(name))
+		{
+			kf->rawPath = HeightmapImage::resolvePath(name, "General");
+		}
+		else
+		{
+			size_t dot = name.find_last_of('.');
+			kf->type = (dot == Ogre::String::npos) ? Ogre::String() : name.substr(dot + 1);
+			kf->stream = Ogre::ResourceGroupManager::getSingleton().openResource(name, "General");
+		}
+	}
+	catch (...)
+	{
+		delete kf;
+		markKeyframeFailed(index);
+		return;
+	}
+	_pendingKeyframes.push_back(kf);
+	_keyframeCond.notify_one();
+}
+
+void LOD_deinitKeyframes()
+{
+	if (_keyframeLoader.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(_keyframeMutex);
+			_keyframeLoaderQuit = true;
+		}
+		_keyframeCond.notify_one();
+		_keyframeLoader.join();
+	}
+	_keyframeLoaderQuit = false;
+
+	for (size_t i = 0; i < _pendingKeyframes.size(); i++)
+		freeKeyframe(_pendingKeyframes[i]);
+	_pendingKeyframes.clear();
+	for (size_t i = 0; i < _loadedKeyframes.size(); i++)
+		freeKeyframe(_loadedKeyframes[i]);
+	_loadedKeyframes.clear();
+	for (size_t i = 0; i < _readyKeyframes.size(); i++)
+		freeKeyframe(_readyKeyframes[i]);
+	_readyKeyframes.clear();
+
+	_keyframeNames.clear();
+	_failedKeyframes.clear();
+	_layerKeyframe[0] = _layerKeyframe[1] = -1;
+	_keyframeBlendRatio = -1.0f;
+}
+
+// replaces hmap1/hmap2 with a timeline of heightmaps; must be called after LOD_init
+void LOD_setHeightmapKeyframes(const std::vector<Ogre::String>& names)
+{
+	LOD_deinitKeyframes();
+	// keyframes replace whole heightmap layers, which a tiled terrain doesn't have
+	if (names.empty() || !LOD_getHeightmapData(0, 0, 0))
+		return;
+
+	_keyframeNames = names;
+	_failedKeyframes.assign(names.size(), false);
+	_keyframeTime = _prevKeyframeTime = 0.0f;
+	_keyframeLoader = std::thread(keyframeLoaderMain);
+}
+
+size_t LOD_getKeyframeCount()
+{
+	return _keyframeNames.size();
+}
+
+// time in keyframes, i.e. 2.5 is half way from the 3rd to the 4th keyframe
+void LOD_setKeyframeTime(float time)
+{
+	float maxTime = _keyframeNames.empty() ? 0.0f : (float)(_keyframeNames.size() - 1);
+	_keyframeTime = std::max(0.0f, std::min(time, maxTime));
+}
+
+static void setKeyframeBlendRatio(float ratio)
+{
+	if (ratio != _keyframeBlendRatio)
+	{
+		_keyframeBlendRatio = ratio;
+		OgreUpdateHeightmapBlendRatio(ratio);
+	}
+}
+
+void LOD_updateKeyframes()
+{
+	if (_keyframeNames.empty())
+		return;
+
+	const size_t count = _keyframeNames.size();
+	size_t from = (size_t)_keyframeTime;
+	if (from + 1 >= count)
+		from = (count >= 2) ? count - 2 : 0;
+	const size_t to = std::min(from + 1, count - 1);
+	const float f = std::min(_keyframeTime - from, 1.0f);
+
+	// the keyframe after the active interval in the direction of the playback
+	const bool backward = _keyframeTime < _prevKeyframeTime;
+	const size_t next = backward ? from - 1 : to + 1;	// wraps to an invalid index at the ends
+	_prevKeyframeTime = _keyframeTime;
+
+	{
+		std::lock_guard<std::mutex> lock(_keyframeMutex);
+		_readyKeyframes.insert(_readyKeyframes.end(), _loadedKeyframes.begin(), _loadedKeyframes.end());
+		_loadedKeyframes.clear();
+
+		// stale requests are cancelled before they are decoded
+		for (size_t i = 0; i < _pendingKeyframes.size(); )
+		{
+			size_t index = _pendingKeyframes[i]->index;
+			if (index != from && index != to && index != next)
+			{
+				freeKeyframe(_pendingKeyframes[i]);
+				_pendingKeyframes.erase(_pendingKeyframes.begin() + i);
+			}
+			else
+				i++;
+		}
+
+		requestKeyframe(from);
+		requestKeyframe(to);
+		requestKeyframe(next);
+	}
+
+	// at most one texture upload per frame
+	bool swapped = false;
+	for (size_t i = 0; i < _readyKeyframes.size(); )
+	{
+		KeyframeData* kf = _readyKeyframes[i];
+		bool needed = kf->index == from || kf->index == to;
+		if (kf->failed)
+		{
+			markKeyframeFailed(kf->index);
+			needed = false;
+		}
+		else if (needed && !swapped)
+		{
+			// replace the layer holding a keyframe outside of the active interval
+			int layer = (_layerKeyframe[0] != (int)from && _layerKeyframe[0] != (int)to) ? 0 : 1;
+			if (_layerKeyframe[layer] == (int)from || _layerKeyframe[layer] == (int)to)
+			{
+				// both layers are already in use (single keyframe timeline)
+				needed = false;
+			}
+			else if (LOD_isHeightmapUploadPending(1 - layer))
+			{
+				// the other layer is drawn alone meanwhile, it has to be complete first; kept for a later frame
+				needed = true;
+			}
+			else
+			{
+				// no weight for the layer from now until its upload is done, see the blend below
+				setKeyframeBlendRatio(layer == 0 ? 0.0f : 1.0f);
+				LOD_swapHeightmapLayer(layer, kf->image, kf->pyramid);
+				_layerKeyframe[layer] = (int)kf->index;
+				swapped = true;
+				needed = false;
+			}
+		}
+		else if (kf->index == next)
+		{
+			// keep the prefetched keyframe for the next interval
+			needed = true;
+		}
+
+		if (!needed)
+		{
+			freeKeyframe(kf);
+			_readyKeyframes.erase(_readyKeyframes.begin() + i);
+		}
+		else
+			i++;
+	}
+
+	// heightBlendRatio is the weight of hmap1; until both keyframes are resident and uploaded the previous blend is kept,
+	// which leaves a layer being uploaded without weight
+	const int hmap1 = LOD_isHeightmapUploadPending(0) ? -1 : _layerKeyframe[0];
+	const int hmap2 = LOD_isHeightmapUploadPending(1) ? -1 : _layerKeyframe[1];
+	float ratio;
+	if (hmap1 == (int)to && hmap2 == (int)from)
+		ratio = f;
+	else if (hmap1 == (int)from && hmap2 == (int)to)
+		ratio = 1.0f - f;
+	else if (from == to && hmap1 == (int)from)
+		ratio = 1.0f;
+	else if (from == to && hmap2 == (int)from)
+		ratio = 0.0f;
+	else
+		return;
+	setKeyframeBlendRatio(ratio);
+}
@@ -0,0 +1,326 @@
+#include "OgreQuadTree.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <set>
+#include <list>
+#include <deque>
+#include <algorithm>
+
+// Instanced vegetation and detail on the selected nodes
+// Every frame each drawn quadrant of the selected nodes asks for the instances of each layer (see TerrainScatter.h).
+// The cached ones are returned at once, the others are generated by worker threads, nearest first, and returned
+// from the frame they are ready on. The requests not taken by the next frame are dropped, so the work follows the
+// selection. The cache keeps the least recently used quadrants within its budget; after a heightmap change the
+// quadrants in use are regenerated, and their old instances returned meanwhile.
+
+struct ScatterLayer
+{
+	TerrainScatterParams params;
+	std::vector<unsigned char> density;
+};
+typedef std::shared_ptr<const ScatterLayer> ScatterLayerPtr;
+
+struct ScatterRequest
+{
+	unsigned long long key;
+	ScatterLayerPtr layer;
+	int layerId;
+	int lodLevel;
+	unsigned int x;
+	unsigned int z;
+	int quadrant;
+	float sqDistance;
+	unsigned int heightmapVersion;
+
+	bool operator<(const ScatterRequest& other) const { return sqDistance < other.sqDistance; }
+};
+
+struct ScatterResult
+{
+	unsigned long long key;
+	ScatterLayerPtr layer;
+	ScatterPatchPtr patch;
+	unsigned int heightmapVersion;
+};
+
+struct ScatterEntry
+{
+	ScatterPatchPtr patch;
+	unsigned int heightmapVersion;
+	unsigned int usedFrame;
+	std::list<unsigned long long>::iterator lru;
+};
+
+static std::map<int, ScatterLayerPtr> _scatterLayers;
+static int _nextScatterLayer = 0;
+static size_t _scatterCacheLimit = 4 << 20;
+static int _scatterThreadCount = 2;
+
+static std::vector<std::thread> _scatterWorkers;
+static std::mutex _scatterMutex;
+static std::condition_variable _scatterCond;
+static std::deque<ScatterRequest> _scatterQueue;
+static std::vector<ScatterResult> _scatterDone;
+static bool _scatterQuit = false;
+
+// the render thread's own
+static std::map<unsigned long long, ScatterEntry> _scatterCache;
+static std::list<unsigned long long> _scatterLru;		// most recently used first
+static std::set<unsigned long long> _scatterInFlight;	// queued or being generated
+static size_t _scatterCacheCost = 0;
+static unsigned int _scatterFrame = 0;
+static std::vector<ScatterPatchPtr> _scatterPatches;
+static std::vector<NodeInfo> _scatterNodes;
+static ScatterStats _scatterStats;
+
+static unsigned long long getScatterKey(int layer, int lodLevel, unsigned int x, unsigned int z, int quadrant)
+{
+	return ((unsigned long long)layer << 40) | ((unsigned long long)lodLevel << 34) | ((unsigned long long)quadrant << 32) |
+		((unsigned long long)x << 16) | z;
+}
+
+// an empty patch costs as much as an instance
+static size_t getScatterCost(const ScatterPatchPtr& patch)
+{
+	return patch->instances.size() + 1;
+}
+
+static void scatterWorkerMain()
+{
+	std::unique_lock<std::mutex> lock(_scatterMutex);
+	while (!_scatterQuit)
+	{
+		if (_scatterQueue.empty())
+		{
+			_scatterCond.wait(lock);
+			continue;
+		}
+		ScatterRequest req = _scatterQueue.front();
+		_scatterQueue.pop_front();
+		lock.unlock();
+
+		const MapDimensions& map = LOD_getMapInfo();
+		std::shared_ptr<ScatterPatch> patch(new ScatterPatch());
+		patch->layer = req.layerId;
+		patch->lodLevel = req.lodLevel;
+		patch->x = req.x;
+		patch->z = req.z;
+		patch->quadrant = req.quadrant;
+		ScatterResult result;
+		result.key = req.key;
+		result.layer = req.layer;
+		result.heightmapVersion = req.heightmapVersion;
+		// without heights, e.g. in tiled mode, empty until the heightmap changes
+		if (!scatterQuadrant(req.layer->params, map.MinX, map.MinZ, map.SizeX, map.SizeZ, map.gridSizeX, map.gridSizeZ,
+			req.lodLevel, req.x, req.z, req.quadrant, LOD_getHeights, patch->instances))
+			patch->instances.clear();
+		result.patch = patch;
+
+		lock.lock();
+		_scatterDone.push_back(result);
+	}
+}
+
+static void stopScatterWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(_scatterMutex);
+		_scatterQuit = true;
+	}
+	_scatterCond.notify_all();
+	for (size_t i = 0; i < _scatterWorkers.size(); i++)
+		_scatterWorkers[i].join();
+	_scatterWorkers.clear();
+	_scatterQuit = false;
+}
+
+static void eraseScatterEntry(std::map<unsigned long long, ScatterEntry>::iterator it)
+{
+	_scatterCacheCost -= getScatterCost(it->second.patch);
+	_scatterLru.erase(it->second.lru);
+	_scatterCache.erase(it);
+}
+
+int LOD_addScatterLayer(const TerrainScatterParams& params)
+{
+	std::shared_ptr<ScatterLayer> layer(new ScatterLayer());
+	layer->params = params;
+	if (params.density)
+	{
+		layer->density.assign(params.density, params.density + (size_t)params.densityWidth * params.densityHeight);
+		layer->params.density = &layer->density[0];
+	}
+	_scatterLayers[_nextScatterLayer] = layer;
+	return _nextScatterLayer++;
+}
+
+void LOD_removeScatterLayer(int layer)
+{
+	_scatterLayers.erase(layer);
+	for (std::map<unsigned long long, ScatterEntry>::iterator it = _scatterCache.begin(); it != _scatterCache.end(); )
+	{
+		if (it->second.patch->layer == layer)
+			eraseScatterEntry(it++);
+		else
+			++it;
+	}
+}
+
+void LOD_setScatterCache(size_t maxInstances, int threads)
+{
+	_scatterCacheLimit = maxInstances;
+	if (threads != _scatterThreadCount)
+	{
+		// started again with the new count by the next update
+		stopScatterWorkers();
+		_scatterThreadCount = std::max(threads, 1);
+	}
+}
+
+void LOD_updateScatter(const Ogre::Vector3& cameraPos)
+{
+	_scatterPatches.clear();
+	if (_scatterLayers.empty())
+		return;
+	if (_scatterWorkers.empty())
+	{
+		for (int i = 0; i < _scatterThreadCount; i++)
+			_scatterWorkers.push_back(std::thread(scatterWorkerMain));
+	}
+	_scatterFrame++;
+	const unsigned int heightmapVersion = LOD_getHeightmapVersion();
+
+	// the results since the last frame, and the requests nobody took, which are asked again if still needed
+	std::vector<ScatterResult> done;
+	{
+		std::lock_guard<std::mutex> lock(_scatterMutex);
+		done.swap(_scatterDone);
+		for (size_t i = 0; i < _scatterQueue.size(); i++)
+			_scatterInFlight.erase(_scatterQueue[i].key);
+		_scatterQueue.clear();
+	}
+	for (size_t i = 0; i < done.size(); i++)
+	{
+		const ScatterResult& result = done[i];
+		_scatterInFlight.erase(result.key);
+		// those of a layer removed or replaced meanwhile are dropped
+		std::map<int, ScatterLayerPtr>::const_iterator layer = _scatterLayers.find(result.patch->layer);
+		if (layer == _scatterLayers.end() || layer->second != result.layer)
+			continue;
+		std::map<unsigned long long, ScatterEntry>::iterator it = _scatterCache.find(result.key);
+		if (it != _scatterCache.end())
+			eraseScatterEntry(it);
+		ScatterEntry& e = _scatterCache[result.key];
+		e.patch = result.patch;
+		e.heightmapVersion = result.heightmapVersion;
+		e.usedFrame = 0;
+		e.lru = _scatterLru.insert(_scatterLru.begin(), result.key);
+		_scatterCacheCost += getScatterCost(e.patch);
+		_scatterStats.generatedPatches++;
+	}
+
+	const MapDimensions& map = LOD_getMapInfo();
+	std::vector<ScatterRequest> missing;
+	size_t visibleInstances = 0;
+	LOD_getSelectedNodes(_scatterNodes);
+	for (size_t n = 0; n < _scatterNodes.size(); n++)
+	{
+		const NodeInfo& node = _scatterNodes[n];
+		const bool drawn[4] = { node.TL, node.TR, node.BL, node.BR };
+		for (int q = 0; q < 4; q++)
+		{
+			if (!drawn[q])
+				continue;
+			const float half = node.Size * 0.5f;
+			const Ogre::AxisAlignedBox aabb(
+				map.MinX + (node.X + (q & 1) * half) * map.gridSizeX, node.MinY * map.SizeY / 65535.0f + map.MinY,
+				map.MinZ + (node.Z + (q >> 1) * half) * map.gridSizeZ,
+				map.MinX + (node.X + ((q & 1) + 1) * half) * map.gridSizeX, node.MaxY * map.SizeY / 65535.0f + map.MinY,
+				map.MinZ + (node.Z + ((q >> 1) + 1) * half) * map.gridSizeZ);
+			for (std::map<int, ScatterLayerPtr>::const_iterator layer = _scatterLayers.begin(); layer != _scatterLayers.end(); ++layer)
+			{
+				if (node.LODLevel > layer->second->params.maxLODLevel)
+					continue;
+				const unsigned long long key = getScatterKey(layer->first, node.LODLevel, node.X, node.Z, q);
+				std::map<unsigned long long, ScatterEntry>::iterator it = _scatterCache.find(key);
+				bool request = true;
+				if (it != _scatterCache.end())
+				{
+					ScatterEntry& e = it->second;
+					e.usedFrame = _scatterFrame;
+					_scatterLru.splice(_scatterLru.begin(), _scatterLru, e.lru);
+					_scatterPatches.push_back(e.patch);
+					visibleInstances += e.patch->instances.size();
+					request = e.heightmapVersion != heightmapVersion;
+				}
+				if (request && !_scatterInFlight.count(key))
+				{
+					ScatterRequest req;
+					req.key = key;
+					req.layer = layer->second;
+					req.layerId = layer->first;
+					req.lodLevel = node.LODLevel;
+					req.x = node.X;
+					req.z = node.Z;
+					req.quadrant = q;
+					req.sqDistance = aabb.squaredDistance(cameraPos);
+					req.heightmapVersion = heightmapVersion;
+					missing.push_back(req);
+				}
+			}
+		}
+	}
+	if (!missing.empty())
+	{
+		std::sort(missing.begin(), missing.end());
+		{
+			std::lock_guard<std::mutex> lock(_scatterMutex);
+			for (size_t i = 0; i < missing.size(); i++)
+			{
+				_scatterQueue.push_back(missing[i]);
+				_scatterInFlight.insert(missing[i].key);
+			}
+		}
+		_scatterCond.notify_all();
+	}
+
+	// the ones in use stay, whatever the budget
+	while (_scatterCacheCost > _scatterCacheLimit && !_scatterLru.empty())
+	{
+		std::map<unsigned long long, ScatterEntry>::iterator it = _scatterCache.find(_scatterLru.back());
+		if (it->second.usedFrame == _scatterFrame)
+			break;
+		eraseScatterEntry(it);
+	}
+
+	_scatterStats.cachedPatches = _scatterCache.size();
+	_scatterStats.cachedInstances = _scatterCacheCost - _scatterCache.size();
+	_scatterStats.visiblePatches = _scatterPatches.size();
+	_scatterStats.visibleInstances = visibleInstances;
+	_scatterStats.pendingPatches = _scatterInFlight.size();
+}
+
+const std::vector<ScatterPatchPtr>& LOD_getScatterPatches()
+{
+	return _scatterPatches;
+}
+
+const ScatterStats& LOD_getScatterStats()
+{
+	return _scatterStats;
+}
+
+void LOD_deinitScatter()
+{
+	stopScatterWorkers();
+	_scatterQueue.clear();
+	_scatterDone.clear();
+	_scatterInFlight.clear();
+	_scatterCache.clear();
+	_scatterLru.clear();
+	_scatterCacheCost = 0;
+	_scatterPatches.clear();
+	_scatterStats = ScatterStats();
+}
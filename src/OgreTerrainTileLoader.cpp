@@ -0,0 +1,266 @@
+#include "OgreTerrainTileLoader.h"
+#include "TerrainTileCodec.h"
+#include "TerrainBC4.h"
+#include <cstdio>
+#include <algorithm>
+
+static const size_t _maxLatencySamples = 256;
+
+bool readTerrainPackage(FILE* fp, unsigned long long offset, void* buffer, size_t size)
+{
+#ifdef _WIN32
+	if (_fseeki64(fp, (__int64)offset, SEEK_SET) != 0)
+#else
+	if (fseeko(fp, (off_t)offset, SEEK_SET) != 0)
+#endif
+		return false;
+	return fread(buffer, 1, size, fp) == size;
+}
+
+bool readTerrainTile(FILE* fp, const TerrainTileEntry& entry, unsigned int resolution, std::vector<unsigned short>& heights)
+{
+	const size_t pixels = (size_t)resolution * resolution;
+	if (entry.encoding == TileEncodingDelta16)
+	{
+		// decoded straight into the buffer that goes to the cache and the texture
+		std::vector<unsigned char> data(entry.size);
+		heights.resize(pixels);
+		return entry.size > 0 && readTerrainPackage(fp, entry.offset, &data[0], entry.size) &&
+			decodeTerrainTile(&data[0], data.size(), resolution, &heights[0]);
+	}
+	if (entry.encoding != TileEncodingRaw16 || entry.size != pixels * sizeof(unsigned short))
+		return false;
+	heights.resize(pixels);
+	return readTerrainPackage(fp, entry.offset, &heights[0], entry.size);
+}
+
+std::shared_ptr<BC4Tile> compressTerrainTile(std::vector<unsigned short>& heights, unsigned int resolution, float maxError, int threadCount)
+{
+	std::shared_ptr<BC4Tile> compressed = std::make_shared<BC4Tile>();
+	if (threadCount > 1)
+		encodeBC4TileParallel(&heights[0], resolution, resolution, *compressed, threadCount);
+	else
+		encodeBC4Tile(&heights[0], resolution, resolution, *compressed);
+	if (compressed->maxError > maxError)
+		return std::shared_ptr<BC4Tile>();
+	std::vector<unsigned short>().swap(heights);
+	return compressed;
+}
+
+TerrainTileLoader::TerrainTileLoader()
+	: m_resolution(0), m_compressionError(-1.0f), m_frame(0), m_quit(false), m_readers(0), m_broken(false), m_completed(0),
+	m_latencyCount(0)
+{
+}
+
+void TerrainTileLoader::start(const Ogre::String& path, const std::vector<TerrainTileEntry>& directory, unsigned int resolution, int threadCount)
+{
+	stop();
+	m_path = path;
+	m_directory = directory;
+	m_resolution = resolution;
+	m_quit = false;
+	m_readers = std::max(threadCount, 1);
+	m_broken = false;
+	for (int i = 0; i < m_readers; i++)
+		m_threads.push_back(std::thread(&TerrainTileLoader::threadMain, this));
+}
+
+void TerrainTileLoader::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_all();
+	for (size_t i = 0; i < m_threads.size(); i++)
+		m_threads[i].join();
+	m_threads.clear();
+
+	m_pending.clear();
+	m_loading.clear();
+	TileLoadResult* result = poll();
+	while (result)
+	{
+		TileLoadResult* next = result->next;
+		delete result;
+		result = next;
+	}
+	m_latencies.clear();
+	m_latencyCount = 0;
+}
+
+void TerrainTileLoader::threadMain()
+{
+	// every reader has its own handle, so that the seeks don't interfere
+	FILE* fp = fopen(m_path.c_str(), "rb");
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!fp)
+	{
+		// the others serve the requests; without any reader they are refused rather than failing one by one
+		if (--m_readers == 0)
+		{
+			m_broken = true;
+			m_pending.clear();
+		}
+		return;
+	}
+	while (!m_quit)
+	{
+		if (m_pending.empty())
+		{
+			m_cond.wait(lock);
+			continue;
+		}
+
+		// most urgent request; the queue holds at most the tiles of a few frames, a scan is cheap next to the read
+		std::unordered_map<int, PendingTile>::iterator best = m_pending.begin();
+		for (std::unordered_map<int, PendingTile>::iterator it = m_pending.begin(); it != m_pending.end(); ++it)
+		{
+			const PendingTile& a = it->second;
+			const PendingTile& b = best->second;
+			if (a.prefetch != b.prefetch)
+			{
+				if (!a.prefetch)
+					best = it;
+			}
+			else if (a.tileLevel > b.tileLevel || (a.tileLevel == b.tileLevel && a.sqDist < b.sqDist))
+				best = it;
+		}
+		const int tile = best->first;
+		const std::chrono::steady_clock::time_point requestTime = best->second.requestTime;
+		const bool prefetch = best->second.prefetch;
+		m_pending.erase(best);
+		m_loading[tile] = requestTime;
+		lock.unlock();
+
+		TileLoadResult* result = new TileLoadResult();
+		result->tile = tile;
+		result->next = 0;
+		result->prefetch = prefetch;
+		result->failed = !readTerrainTile(fp, m_directory[tile], m_resolution, result->heights);
+		// the readers are already parallel over the tiles, each tile is encoded on one thread
+		if (!result->failed && m_compressionError >= 0)
+			result->compressed = compressTerrainTile(result->heights, m_resolution, m_compressionError);
+		complete(result, requestTime);
+
+		lock.lock();
+	}
+	lock.unlock();
+
+	fclose(fp);
+}
+
+void TerrainTileLoader::complete(TileLoadResult* result, std::chrono::steady_clock::time_point requestTime)
+{
+	const int tile = result->tile;
+	TileLoadResult* head = m_completed.load(std::memory_order_relaxed);
+	do
+	{
+		result->next = head;
+	} while (!m_completed.compare_exchange_weak(head, result, std::memory_order_release, std::memory_order_relaxed));
+
+	float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - requestTime).count();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// leaves the loading set only once the result can be polled, so it is never requested twice
+	m_loading.erase(tile);
+	if (m_latencies.size() < _maxLatencySamples)
+		m_latencies.push_back(ms);
+	else
+		m_latencies[m_latencyCount % _maxLatencySamples] = ms;
+	m_latencyCount++;
+}
+
+void TerrainTileLoader::request(int tile, int tileLevel, float sqDist, bool prefetch)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_broken || m_loading.count(tile))
+		return;
+	std::unordered_map<int, PendingTile>::iterator it = m_pending.find(tile);
+	if (it == m_pending.end())
+	{
+		PendingTile& pending = m_pending[tile];
+		pending.requestTime = std::chrono::steady_clock::now();
+		pending.tileLevel = tileLevel;
+		pending.sqDist = sqDist;
+		pending.prefetch = prefetch;
+		pending.frame = m_frame;
+		m_cond.notify_one();
+		return;
+	}
+	// a prefetch never demotes a request of the selection
+	PendingTile& pending = it->second;
+	if (prefetch && !pending.prefetch && pending.frame == m_frame)
+		return;
+	pending.tileLevel = tileLevel;
+	pending.sqDist = sqDist;
+	pending.prefetch = prefetch;
+	pending.frame = m_frame;
+}
+
+bool TerrainTileLoader::isRequested(int tile)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pending.count(tile) || m_loading.count(tile);
+}
+
+void TerrainTileLoader::cancelStale()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::unordered_map<int, PendingTile>::iterator it = m_pending.begin(); it != m_pending.end(); )
+	{
+		if (it->second.frame != m_frame)
+			it = m_pending.erase(it);
+		else
+			++it;
+	}
+	m_frame++;
+}
+
+TileLoadResult* TerrainTileLoader::poll()
+{
+	TileLoadResult* result = m_completed.exchange(0, std::memory_order_acquire);
+	// the list is pushed at the head, reverse it into completion order
+	TileLoadResult* ordered = 0;
+	while (result)
+	{
+		TileLoadResult* next = result->next;
+		result->next = ordered;
+		ordered = result;
+		result = next;
+	}
+	return ordered;
+}
+
+bool TerrainTileLoader::isBroken()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_broken;
+}
+
+size_t TerrainTileLoader::getQueueDepth()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pending.size();
+}
+
+size_t TerrainTileLoader::getLoadingCount()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_loading.size();
+}
+
+float TerrainTileLoader::getLatencyPercentile(float p)
+{
+	std::vector<float> latencies;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		latencies = m_latencies;
+	}
+	if (latencies.empty())
+		return 0.0f;
+	size_t n = std::min((size_t)(p * (latencies.size() - 1) + 0.5f), latencies.size() - 1);
+	std::nth_element(latencies.begin(), latencies.begin() + n, latencies.end());
+	return latencies[n];
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdio>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include "OgreString.h"
+#include "TerrainTileFormat.h"
+
+struct BC4Tile;
+
+// 64-bit offset seek and read
+bool readTerrainPackage(FILE* fp, unsigned long long offset, void* buffer, size_t size);
+// reads the pixels of a tile into heights; false on I/O errors or an unsupported encoding
+bool readTerrainTile(FILE* fp, const TerrainTileEntry& entry, unsigned int resolution, std::vector<unsigned short>& heights);
+// BC4 blocks of the tile if its error stays within maxError height units, the heights are released then; null otherwise
+std::shared_ptr<BC4Tile> compressTerrainTile(std::vector<unsigned short>& heights, unsigned int resolution, float maxError, int threadCount = 1);
+
+struct TileLoadResult
+{
+	int tile;
+	bool failed;
+	bool prefetch;		// nobody but the prefetcher wanted the tile when it was read
+	std::vector<unsigned short> heights;	// empty if compressed
+	std::shared_ptr<BC4Tile> compressed;	// set if the tile compresses within the error bound
+	TileLoadResult* next;
+};
+
+// Pool of threads reading terrain tiles off the render thread.
+// Requests are served by priority and dropped when the selection stops asking for them;
+// finished tiles are handed back through a lock-free list so that polling never waits for a reader.
+class TerrainTileLoader
+{
+private:
+	struct PendingTile
+	{
+		int tileLevel;
+		float sqDist;
+		bool prefetch;
+		unsigned int frame;		// last frame the tile was requested
+		std::chrono::steady_clock::time_point requestTime;
+	};
+
+	Ogre::String m_path;
+	std::vector<TerrainTileEntry> m_directory;
+	unsigned int m_resolution;
+	float m_compressionError;	// negative if the tiles are not compressed
+
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::unordered_map<int, PendingTile> m_pending;
+	// tiles being read, with their request time
+	std::unordered_map<int, std::chrono::steady_clock::time_point> m_loading;
+	unsigned int m_frame;
+	bool m_quit;
+	int m_readers;		// threads that could open the package
+	bool m_broken;		// none could, the requests are refused
+
+	std::atomic<TileLoadResult*> m_completed;
+
+	// latencies of the last loads in milliseconds, a ring buffer
+	std::vector<float> m_latencies;
+	size_t m_latencyCount;
+
+	TerrainTileLoader(const TerrainTileLoader&);
+	TerrainTileLoader& operator=(const TerrainTileLoader&);
+
+	void threadMain();
+	void complete(TileLoadResult* result, std::chrono::steady_clock::time_point requestTime);
+public:
+	TerrainTileLoader();
+	~TerrainTileLoader() { stop(); }
+
+	void start(const Ogre::String& path, const std::vector<TerrainTileEntry>& directory, unsigned int resolution, int threadCount);
+	void stop();
+	// BC4 compression of the tiles on the loader threads, for the tiles whose error stays within maxError height units;
+	// negative disables. Set before start()
+	void setCompression(float maxError) { m_compressionError = maxError; }
+
+	// queues the tile or refreshes its request; the selection's requests before the prefetches,
+	// then coarser tile levels first, then the closest
+	void request(int tile, int tileLevel, float sqDist, bool prefetch = false);
+	// true if the tile is queued or being read
+	bool isRequested(int tile);
+	// true if no thread could open the package; the requests are ignored from then on
+	bool isBroken();
+	// starts a new request frame; the pending tiles not requested during the previous one are dropped
+	void cancelStale();
+	// finished loads in completion order, linked by next; the caller deletes them
+	TileLoadResult* poll();
+
+	size_t getQueueDepth();
+	size_t getLoadingCount();
+	// p in [0, 1], e.g. 0.95 for the 95th percentile
+	float getLatencyPercentile(float p);
+};
@@ -0,0 +1,608 @@
+#include "OgreQuadTree.h"
+#include "OgreHeightmapImage.h"
+#include "OgreTerrainTileLoader.h"
+#include "TerrainUploadScheduler.h"
+#include "TerrainBC4.h"
+#include "OgreTextureManager.h"
+#include "OgreHardwarePixelBuffer.h"
+#include "OgreMaterialManager.h"
+#include "OgreLogManager.h"
+#include "OgreStringConverter.h"
+#include "OgreRoot.h"
+#include "OgreRenderSystem.h"
+#include "OgreRenderSystemCapabilities.h"
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// Out-of-core terrain
+// A tiled package (*.cdlod, see TerrainTileFormat.h) replaces hmap1. Only the min/max pyramid is kept whole,
+// the heightmap tiles are loaded on demand into a bounded LRU cache in RAM and a bounded set of GPU textures.
+// The selection only refines into nodes whose tile has a GPU slot, otherwise the parent covers the area.
+// Tiles are read by a pool of loader threads, the render thread only uploads the ones already in RAM.
+// A prefetcher extrapolates the camera path and reads ahead the tiles it will need into the RAM cache.
+// Optionally the loaders compress the tiles to BC4, normalized to the range of each tile; the tiles whose error
+// stays within the bound are cached and uploaded as blocks, and the culling widens the min/max by the bound.
+
+static_assert(sizeof(HeightMinMax) == 10, "HeightMinMax is stored as is in the tiled packages");
+
+static TerrainTileLoader _tileLoader;
+static int _tileLoaderThreads = 2;
+// the loader could not open the package, logged once
+static bool _tileLoaderBroken = false;
+// tiles that failed to read, logged once and never requested again
+static std::vector<bool> _failedTiles;
+static bool _tilesOpen = false;
+static TerrainPackageHeader _tileHeader;
+static std::vector<TerrainTileEntry> _tileDirectory;
+static int _tileBaseLODLevel;
+static unsigned int _tileResolution;
+static bool _tileCompression = false;
+static float _tileCompressionMaxError = 64.0f;
+// requested and supported by the render system
+static bool _tileCompressionActive = false;
+
+// RAM cache, front is the most recently used
+struct CachedTile
+{
+	// shared with the pending upload of the tile
+	std::shared_ptr<std::vector<unsigned short> > heights;
+	std::shared_ptr<BC4Tile> compressed;	// instead of the heights if the tile compressed within the bound
+	std::list<int>::iterator lru;
+	bool prefetched;	// read for the prefetcher and not wanted by the selection yet
+};
+static std::unordered_map<int, CachedTile> _tileCache;
+static std::list<int> _tileLRU;
+static size_t _maxCachedTiles = 256;
+
+// GPU cache: one texture and one material per slot
+struct GpuTileSlot
+{
+	int tile;
+	unsigned int lastUsedFrame;
+	bool ready;		// the upload of the tile is done
+	bool compressed;	// BC4 texture, else L16
+	unsigned int textureSize;	// BC4 textures are padded to whole blocks
+	Ogre::TexturePtr texture;
+	Ogre::MaterialPtr material;
+};
+static std::vector<GpuTileSlot> _gpuTileSlots;
+static size_t _maxGpuTiles = 64;
+// GPU slot of each tile, -1 if not resident
+static std::vector<int> _tileSlots;
+static int _rootTileSlot = -1;
+static unsigned int _tileFrame = 0;
+
+// tiles wanted by the selection of this frame
+struct TileRequest
+{
+	int tile;
+	int tileLevel;
+	float sqDist;
+};
+static std::vector<TileRequest> _tileRequests;
+static int _maxTileUploadsPerFrame = 4;
+// after the edits and the whole heightmap layers
+static const float _tileUploadPriority = 2.0f;
+
+// predictive prefetch
+struct CameraSample
+{
+	Ogre::Vector3 position;
+	std::chrono::steady_clock::time_point time;
+};
+static std::deque<CameraSample> _cameraPath;
+// the velocity is averaged over this window of the camera path
+static const float _cameraPathSeconds = 0.5f;
+// predicted positions per look-ahead
+static const int _prefetchSteps = 4;
+static float _prefetchSeconds = 2.0f;
+static int _maxPrefetchesPerFrame = 8;
+static std::vector<TileRequest> _prefetchRequests;
+static std::unordered_set<int> _prefetchRequested;
+static TileStreamStats _tileStats;
+
+static const char* _tileTextureBaseName = "TerrainTile";
+
+bool LOD_isTiledHeightmap(const char* name)
+{
+	return Ogre::StringUtil::endsWith(name, ".cdlod");
+}
+
+void LOD_setTileCacheLimits(size_t ramTiles, size_t gpuTiles, int uploadsPerFrame)
+{
+	// at least the root and the four tiles below it
+	_maxCachedTiles = std::max<size_t>(ramTiles, 5);
+	_maxGpuTiles = std::max<size_t>(gpuTiles, 5);
+	_maxTileUploadsPerFrame = std::max(uploadsPerFrame, 1);
+}
+
+void LOD_setTileLoaderThreads(int threads)
+{
+	_tileLoaderThreads = std::max(threads, 1);
+}
+
+void LOD_setTilePrefetch(float seconds, int tilesPerFrame)
+{
+	_prefetchSeconds = std::max(seconds, 0.0f);
+	_maxPrefetchesPerFrame = std::max(tilesPerFrame, 0);
+}
+
+void LOD_setTileCompression(bool enable, float maxError)
+{
+	_tileCompression = enable;
+	_tileCompressionMaxError = std::max(maxError, 0.0f);
+}
+
+float LOD_getTileHeightError()
+{
+	return _tileCompressionActive ? _tileCompressionMaxError : 0.0f;
+}
+
+static CachedTile* findCachedTile(int tile)
+{
+	std::unordered_map<int, CachedTile>::iterator it = _tileCache.find(tile);
+	if (it == _tileCache.end())
+		return 0;
+	_tileLRU.splice(_tileLRU.begin(), _tileLRU, it->second.lru);
+	return &it->second;
+}
+
+static size_t getCachedTileBytes(const CachedTile& cached)
+{
+	if (cached.compressed)
+		return cached.compressed->blocks.size();
+	return cached.heights->size() * sizeof(unsigned short);
+}
+
+static const CachedTile* insertCachedTile(int tile, std::vector<unsigned short>& heights, const std::shared_ptr<BC4Tile>& compressed, bool prefetched)
+{
+	if (_tileCache.count(tile))
+		return findCachedTile(tile);
+	while (_tileCache.size() >= _maxCachedTiles)
+	{
+		CachedTile& evicted = _tileCache[_tileLRU.back()];
+		if (evicted.prefetched)
+		{
+			_tileStats.prefetchWastedTiles++;
+			_tileStats.prefetchWastedBytes += getCachedTileBytes(evicted);
+		}
+		_tileCache.erase(_tileLRU.back());
+		_tileLRU.pop_back();
+	}
+	_tileLRU.push_front(tile);
+	CachedTile& cached = _tileCache[tile];
+	cached.heights = std::make_shared<std::vector<unsigned short> >();
+	cached.heights->swap(heights);
+	cached.compressed = compressed;
+	if (compressed)
+		_tileStats.maxCompressionError = std::max(_tileStats.maxCompressionError, compressed->maxError);
+	cached.lru = _tileLRU.begin();
+	cached.prefetched = prefetched;
+	if (prefetched)
+		_tileStats.prefetchedTiles++;
+	return &cached;
+}
+
+static void getTileWorldSize(int tileLevel, float* sizeX, float* sizeZ)
+{
+	const MapDimensions& mapInfo = LOD_getMapInfo();
+	const unsigned int span = _tileHeader.tileGrids << tileLevel;
+	*sizeX = span * mapInfo.gridSizeX;
+	*sizeZ = span * mapInfo.gridSizeZ;
+}
+
+static void createTileTexture(GpuTileSlot& slot, const Ogre::String& name, bool compressed)
+{
+	slot.compressed = compressed;
+	slot.textureSize = compressed ? (_tileResolution + 3) & ~3u : _tileResolution;
+	slot.texture = Ogre::TextureManager::getSingleton().createManual(name, "General", Ogre::TEX_TYPE_2D,
+		slot.textureSize, slot.textureSize, 0, compressed ? Ogre::PF_BC4_UNORM : Ogre::PF_L16,
+		compressed ? Ogre::TU_STATIC_WRITE_ONLY : Ogre::TU_DYNAMIC_WRITE_ONLY);
+}
+
+// slot not used by this frame's selection, least recently used first; a slot still uploading may be taken too.
+// A slot of the other texture format gets a new texture of the same name.
+static int allocateGpuTileSlot(bool compressed)
+{
+	if (_gpuTileSlots.size() < _maxGpuTiles)
+	{
+		GpuTileSlot slot;
+		slot.tile = -1;
+		slot.lastUsedFrame = 0;
+		slot.ready = false;
+		Ogre::String name = _tileTextureBaseName + Ogre::StringConverter::toString(_gpuTileSlots.size());
+		createTileTexture(slot, name, compressed);
+		float sizeX, sizeZ;
+		getTileWorldSize(0, &sizeX, &sizeZ);
+		slot.material = LOD_createHeightmapMaterial(name, name, _tileResolution, _tileResolution, sizeX, sizeZ);
+		_gpuTileSlots.push_back(slot);
+		return (int)_gpuTileSlots.size() - 1;
+	}
+
+	int victim = -1;
+	for (size_t i = 0; i < _gpuTileSlots.size(); i++)
+	{
+		const GpuTileSlot& slot = _gpuTileSlots[i];
+		if ((int)i == _rootTileSlot || slot.lastUsedFrame == _tileFrame)
+			continue;
+		if (victim < 0 || slot.lastUsedFrame < _gpuTileSlots[victim].lastUsedFrame)
+			victim = (int)i;
+	}
+	if (victim >= 0 && _gpuTileSlots[victim].tile >= 0)
+	{
+		GpuTileSlot& slot = _gpuTileSlots[victim];
+		LOD_getUploadScheduler().cancel(slot.texture.get());
+		_tileSlots[slot.tile] = -1;
+		slot.tile = -1;
+		slot.ready = false;
+	}
+	if (victim >= 0 && _gpuTileSlots[victim].compressed != compressed)
+	{
+		GpuTileSlot& slot = _gpuTileSlots[victim];
+		const Ogre::String name = slot.texture->getName();
+		slot.texture.setNull();
+		Ogre::TextureManager::getSingleton().remove(name);
+		createTileTexture(slot, name, compressed);
+		Ogre::Pass* pass = slot.material->getTechnique(0)->getPass(0);
+		for (unsigned short i = 0; i < 4; i++)
+			pass->getTextureUnitState(i)->setTextureName(name);
+	}
+	return victim;
+}
+
+static bool uploadTile(const CachedTile* cached, int tile, int tileLevel)
+{
+	int index = allocateGpuTileSlot(cached->compressed != 0);
+	if (index < 0)
+		return false;
+
+	GpuTileSlot& slot = _gpuTileSlots[index];
+	const MapDimensions& mapInfo = LOD_getMapInfo();
+	if (cached->compressed)
+	{
+		// a quarter of the bytes of the heights, blitted at once and used from the next frame;
+		// the unorm values span the tile's own range
+		const BC4Tile& bc4 = *cached->compressed;
+		Ogre::PixelBox box(slot.textureSize, slot.textureSize, 1, Ogre::PF_BC4_UNORM, (void*)&bc4.blocks[0]);
+		slot.texture->getBuffer()->blitFromMemory(box);
+		slot.ready = true;
+		LOD_setHeightmapRange(slot.material, mapInfo.MinY + mapInfo.SizeY * bc4.minY / 65535.0f,
+			mapInfo.SizeY * (bc4.maxY - bc4.minY) / 65535.0f);
+	}
+	else
+	{
+		// the slot is used once the scheduler is done with it
+		UploadRect rect = { 0, 0, _tileResolution, _tileResolution };
+		LOD_getUploadScheduler().submit(slot.texture.get(), &(*cached->heights)[0], _tileResolution, rect, _tileUploadPriority, cached->heights);
+		slot.ready = false;
+		LOD_setHeightmapRange(slot.material, mapInfo.MinY, mapInfo.SizeY);
+	}
+	// the padding texels continue the spacing of the tile's texels
+	float sizeX, sizeZ;
+	getTileWorldSize(tileLevel, &sizeX, &sizeZ);
+	const float padding = (float)(slot.textureSize - 1) / (_tileResolution - 1);
+	LOD_setHeightmapTexelSize(slot.material, slot.textureSize, slot.textureSize, sizeX * padding, sizeZ * padding);
+	slot.tile = tile;
+	slot.lastUsedFrame = _tileFrame;
+	_tileSlots[tile] = index;
+	return true;
+}
+
+void LOD_openTiledHeightmap(const char* name, HeightMinMaxPyramid& pyramid, int* gridPixels)
+{
+	assert(!_tilesOpen && pyramid.empty());
+	const Ogre::String path = HeightmapImage::resolvePath(name, "General");
+	FILE* fp = fopen(path.c_str(), "rb");
+	if (!fp)
+		OGRE_EXCEPT(Ogre::Exception::ERR_FILE_NOT_FOUND, "Cannot open " + path, "LOD_openTiledHeightmap");
+
+	const MapDimensions& mapInfo = LOD_getMapInfo();
+	TerrainPackageHeader& header = _tileHeader;
+	if (!readTerrainPackage(fp, 0, &header, sizeof(header)) ||
+		memcmp(header.magic, TERRAIN_PACKAGE_MAGIC, 4) != 0 || header.version != TERRAIN_PACKAGE_VERSION ||
+		(1u << (header.lodLevelCount - 1)) != mapInfo.nGridX || mapInfo.nGridX != mapInfo.nGridZ ||
+		header.gridPixels == 0 || header.tileGrids == 0 || header.tileGrids > mapInfo.nGridX ||
+		(header.tileGrids & (header.tileGrids - 1)) != 0 ||
+		header.tileLevelCount != header.lodLevelCount - terrainTileBaseLODLevel(header) ||
+		header.tileCount != (unsigned int)terrainTileIndex(header, header.tileLevelCount, 0, 0))
+	{
+		fclose(fp);
+		OGRE_EXCEPT(Ogre::Exception::ERR_INVALIDPARAMS, path + " is not a tiled terrain package for this map", "LOD_openTiledHeightmap");
+	}
+	_tileBaseLODLevel = terrainTileBaseLODLevel(header);
+	_tileResolution = terrainTileResolution(header);
+	*gridPixels = (int)header.gridPixels;
+
+	bool ok = true;
+	unsigned long long offset = header.pyramidOffset;
+	for (unsigned int lodLevel = 0; lodLevel < header.lodLevelCount && ok; lodLevel++)
+	{
+		const size_t n = mapInfo.nGridX >> lodLevel;
+		HeightMinMax* h = new HeightMinMax[n * n];
+		pyramid.push_back(h);
+		ok = readTerrainPackage(fp, offset, h, n * n * sizeof(HeightMinMax));
+		offset += n * n * sizeof(HeightMinMax);
+	}
+	_tileDirectory.resize(header.tileCount);
+	ok = ok && readTerrainPackage(fp, header.directoryOffset, &_tileDirectory[0], header.tileCount * sizeof(TerrainTileEntry));
+	_tileSlots.assign(header.tileCount, -1);
+	_failedTiles.assign(header.tileCount, false);
+
+	_tileCompressionActive = _tileCompression;
+	if (_tileCompression && !Ogre::Root::getSingleton().getRenderSystem()->getCapabilities()->hasCapability(Ogre::RSC_TEXTURE_COMPRESSION_BC4_BC5))
+	{
+		Ogre::LogManager::getSingleton().logMessage("BC4 textures not supported, terrain tiles are not compressed");
+		_tileCompressionActive = false;
+	}
+	_tilesOpen = true;
+
+	// the root tile is always resident, so that the selection has something to fall back to;
+	// it is the only tile read on the render thread
+	const int rootTile = header.tileCount - 1;
+	std::vector<unsigned short> heights;
+	ok = ok && readTerrainTile(fp, _tileDirectory[rootTile], _tileResolution, heights);
+	std::shared_ptr<BC4Tile> compressed;
+	if (ok && _tileCompressionActive)
+		compressed = compressTerrainTile(heights, _tileResolution, _tileCompressionMaxError, std::max((int)std::thread::hardware_concurrency(), 1));
+	ok = ok && uploadTile(insertCachedTile(rootTile, heights, compressed, false), rootTile, header.tileLevelCount - 1);
+	fclose(fp);
+	if (!ok)
+	{
+		LOD_freeHeightMinMax(pyramid);
+		LOD_closeTiledHeightmap();
+		OGRE_EXCEPT(Ogre::Exception::ERR_INVALIDPARAMS, "Cannot read " + path, "LOD_openTiledHeightmap");
+	}
+	_rootTileSlot = _tileSlots[rootTile];
+	LOD_getUploadScheduler().flush();
+	_gpuTileSlots[_rootTileSlot].ready = true;
+
+	_tileLoader.setCompression(_tileCompressionActive ? _tileCompressionMaxError : -1.0f);
+	_tileLoaderBroken = false;
+	_tileLoader.start(path, _tileDirectory, _tileResolution, _tileLoaderThreads);
+}
+
+void LOD_closeTiledHeightmap()
+{
+	_tileLoader.stop();
+	_tilesOpen = false;
+	_tileCompressionActive = false;
+	for (size_t i = 0; i < _gpuTileSlots.size(); i++)
+	{
+		LOD_getUploadScheduler().cancel(_gpuTileSlots[i].texture.get());
+		Ogre::TextureManager::getSingleton().remove(_gpuTileSlots[i].texture->getName());
+	}
+	_gpuTileSlots.clear();
+	_tileSlots.clear();
+	_failedTiles.clear();
+	_tileDirectory.clear();
+	_tileCache.clear();
+	_tileLRU.clear();
+	_tileRequests.clear();
+	_prefetchRequests.clear();
+	_prefetchRequested.clear();
+	_cameraPath.clear();
+	memset(&_tileStats, 0, sizeof(_tileStats));
+	_rootTileSlot = -1;
+}
+
+void LOD_beginTileFrame()
+{
+	_tileFrame++;
+	_tileRequests.clear();
+	for (size_t i = 0; i < _gpuTileSlots.size(); i++)
+	{
+		GpuTileSlot& slot = _gpuTileSlots[i];
+		if (slot.tile >= 0 && !slot.ready)
+			slot.ready = !LOD_getUploadScheduler().isPending(slot.texture.get());
+	}
+	_prefetchRequests.clear();
+	_prefetchRequested.clear();
+}
+
+int LOD_getTileBaseLODLevel()
+{
+	return _tileBaseLODLevel;
+}
+
+// tile sampled by the node; nodes below the tile base level sample the level 0 tile containing them
+static int getNodeTile(int lodLevel, unsigned int x, unsigned int z, int* tileLevel)
+{
+	*tileLevel = std::max(0, lodLevel - _tileBaseLODLevel);
+	const unsigned int span = _tileHeader.tileGrids << *tileLevel;
+	return terrainTileIndex(_tileHeader, *tileLevel, x / span, z / span);
+}
+
+// GPU slot of the tile the node samples, marked as used by this frame; -1 and a load request if not resident
+int LOD_requestTile(int lodLevel, unsigned int x, unsigned int z, float sqDist)
+{
+	int tileLevel;
+	const int tile = getNodeTile(lodLevel, x, z, &tileLevel);
+	const int slot = _tileSlots[tile];
+	if (slot >= 0)
+	{
+		// still uploading: no request, the parent covers it meanwhile
+		_gpuTileSlots[slot].lastUsedFrame = _tileFrame;
+		return _gpuTileSlots[slot].ready ? slot : -1;
+	}
+	TileRequest request = { tile, tileLevel, sqDist };
+	_tileRequests.push_back(request);
+	return -1;
+}
+
+// called by the look-ahead selection for the nodes in range of a predicted camera position
+void LOD_prefetchTile(int lodLevel, unsigned int x, unsigned int z, float sqDist)
+{
+	int tileLevel;
+	const int tile = getNodeTile(lodLevel, x, z, &tileLevel);
+	if (_tileSlots[tile] >= 0 || !_prefetchRequested.insert(tile).second)
+		return;
+	TileRequest request = { tile, tileLevel, sqDist };
+	_prefetchRequests.push_back(request);
+}
+
+// Extrapolates the camera from its recent path and runs the look-ahead selection at a few positions along it.
+// Only when moving fast enough to leave a level 0 tile within the look-ahead, slower motion is served on demand.
+void LOD_prefetchTiles(const Ogre::Camera& cam)
+{
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	CameraSample sample = { cam.getPosition(), now };
+	_cameraPath.push_back(sample);
+	while (_cameraPath.size() > 2 &&
+		std::chrono::duration<float>(now - _cameraPath[1].time).count() >= _cameraPathSeconds)
+		_cameraPath.pop_front();
+
+	if (_prefetchSeconds <= 0 || _maxPrefetchesPerFrame == 0 || _cameraPath.size() < 2)
+		return;
+	const float dt = std::chrono::duration<float>(now - _cameraPath.front().time).count();
+	if (dt <= 0)
+		return;
+	const Ogre::Vector3 velocity = (_cameraPath.back().position - _cameraPath.front().position) / dt;
+	const float speed = velocity.length();
+	const MapDimensions& mapInfo = LOD_getMapInfo();
+	const float tileSize = _tileHeader.tileGrids * std::min(mapInfo.gridSizeX, mapInfo.gridSizeZ);
+	if (speed * _prefetchSeconds < tileSize)
+		return;
+
+	const Ogre::Vector3 heading = velocity / speed;
+	for (int i = 1; i <= _prefetchSteps; i++)
+		LOD_selectAhead(cam.getPosition() + velocity * (_prefetchSeconds * i / _prefetchSteps), heading);
+}
+
+static bool compareTileRequests(const TileRequest& a, const TileRequest& b)
+{
+	// coarse tiles first since the finer ones can only be selected below them, then the closest
+	if (a.tileLevel != b.tileLevel)
+		return a.tileLevel > b.tileLevel;
+	return a.sqDist < b.sqDist;
+}
+
+// Uploads the most wanted of the tiles requested by this frame's selection that are in RAM and queues
+// the others for the loader; they are used from the next frame. Never waits for the disk.
+void LOD_updateTiles()
+{
+	for (TileLoadResult* result = _tileLoader.poll(); result; )
+	{
+		if (result->failed)
+		{
+			Ogre::LogManager::getSingleton().logMessage("Failed to read terrain tile " + Ogre::StringConverter::toString(result->tile));
+			_failedTiles[result->tile] = true;
+		}
+		else
+			insertCachedTile(result->tile, result->heights, result->compressed, result->prefetch);
+		TileLoadResult* next = result->next;
+		delete result;
+		result = next;
+	}
+	if (!_tileLoaderBroken && _tileLoader.isBroken())
+	{
+		// the parents keep covering the missing tiles
+		Ogre::LogManager::getSingleton().logMessage("Cannot open the terrain package for the tile loader, tiles are no longer streamed");
+		_tileLoaderBroken = true;
+	}
+
+	std::sort(_tileRequests.begin(), _tileRequests.end(), compareTileRequests);
+	int uploads = 0;
+	bool slotsFull = false;
+	for (size_t i = 0; i < _tileRequests.size(); i++)
+	{
+		const TileRequest& request = _tileRequests[i];
+		if (_tileSlots[request.tile] >= 0)
+			continue;
+		CachedTile* cached = findCachedTile(request.tile);
+		if (cached && cached->prefetched)
+		{
+			_tileStats.prefetchHits++;
+			cached->prefetched = false;
+		}
+		if (!cached)
+		{
+			if (_failedTiles[request.tile])
+				continue;
+			_tileStats.demandMisses++;
+			_tileLoader.request(request.tile, request.tileLevel, request.sqDist);
+		}
+		else if (uploads < _maxTileUploadsPerFrame && !slotsFull)
+		{
+			if (uploadTile(cached, request.tile, request.tileLevel))
+				uploads++;
+			else
+				slotsFull = true;
+		}
+	}
+
+	// the prefetches only take what is left of the budget; the ones already queued are refreshed for free
+	std::sort(_prefetchRequests.begin(), _prefetchRequests.end(), compareTileRequests);
+	int prefetches = 0;
+	for (size_t i = 0; i < _prefetchRequests.size(); i++)
+	{
+		const TileRequest& request = _prefetchRequests[i];
+		if (_tileCache.count(request.tile) || _failedTiles[request.tile])
+			continue;
+		if (_tileLoader.isRequested(request.tile))
+			_tileLoader.request(request.tile, request.tileLevel, request.sqDist, true);
+		else if (prefetches < _maxPrefetchesPerFrame)
+		{
+			_tileLoader.request(request.tile, request.tileLevel, request.sqDist, true);
+			prefetches++;
+		}
+	}
+
+	// the tiles nobody wants anymore are not read
+	_tileLoader.cancelStale();
+}
+
+const TileStreamStats& LOD_getTileStreamStats()
+{
+	TileStreamStats& stats = _tileStats;
+	stats.queuedTiles = _tileLoader.getQueueDepth();
+	stats.loadingTiles = _tileLoader.getLoadingCount();
+	stats.cachedTiles = _tileCache.size();
+	// only the slots holding a tile
+	stats.residentTiles = 0;
+	stats.compressedTiles = 0;
+	for (size_t i = 0; i < _gpuTileSlots.size(); i++)
+	{
+		if (_gpuTileSlots[i].tile < 0)
+			continue;
+		stats.residentTiles++;
+		if (_gpuTileSlots[i].compressed)
+			stats.compressedTiles++;
+	}
+	stats.latencyP50 = _tileLoader.getLatencyPercentile(0.5f);
+	stats.latencyP95 = _tileLoader.getLatencyPercentile(0.95f);
+	stats.latencyP99 = _tileLoader.getLatencyPercentile(0.99f);
+	return stats;
+}
+
+const Ogre::MaterialPtr& LOD_getNodeMaterial(const NodeInfo& ni)
+{
+	if (ni.TileSlot >= 0)
+		return _gpuTileSlots[ni.TileSlot].material;
+	return GetMaterial();
+}
+
+void LOD_getNodeCoeff(const NodeInfo& ni, float coeff[])
+{
+	const MapDimensions& mapInfo = LOD_getMapInfo();
+	if (ni.TileSlot < 0)
+	{
+		coeff[0] = (float)ni.X / mapInfo.nGridX;
+		coeff[1] = (float)ni.Z / mapInfo.nGridZ;
+		coeff[2] = (float)ni.Size / mapInfo.nGridX;
+		coeff[3] = (float)ni.Size / mapInfo.nGridZ;
+		return;
+	}
+	// the tile pixels are sampled at their centers, so the tile edges map to half a texel inside
+	const int tileLevel = std::max(0, ni.LODLevel - _tileBaseLODLevel);
+	const unsigned int span = _tileHeader.tileGrids << tileLevel;
+	const float texels = (float)(_tileResolution - 1) / span;
+	const float textureSize = (float)_gpuTileSlots[ni.TileSlot].textureSize;
+	coeff[0] = ((ni.X % span) * texels + 0.5f) / textureSize;
+	coeff[1] = ((ni.Z % span) * texels + 0.5f) / textureSize;
+	coeff[2] = coeff[3] = ni.Size * texels / textureSize;
+}
@@ -0,0 +1,218 @@
+#include "TerrainBC4.h"
+#include <cmath>
+#include <algorithm>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TERRAIN_BC4_SSE2
+#include <emmintrin.h>
+#endif
+
+// endpoints lo < hi in unorm8 units and the palette position of each texel, 0 at lo and 7 at hi
+struct BlockFit
+{
+	int lo, hi;
+	float maxError;
+	float sqError;
+	int k[16];
+};
+
+static void fitBlock(const float u[16], int lo, int hi, BlockFit& fit)
+{
+	const float step = (hi - lo) / 7.0f;
+	const float inv = 7.0f / (hi - lo);
+	fit.lo = lo;
+	fit.hi = hi;
+#ifdef TERRAIN_BC4_SSE2
+	const __m128 vlo = _mm_set1_ps((float)lo);
+	const __m128 vinv = _mm_set1_ps(inv);
+	const __m128 vstep = _mm_set1_ps(step);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 seven = _mm_set1_ps(7.0f);
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	__m128 maxError = zero;
+	__m128 sqError = zero;
+	for (int i = 0; i < 16; i += 4)
+	{
+		const __m128 v = _mm_loadu_ps(u + i);
+		const __m128 t = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(v, vlo), vinv), zero), seven);
+		const __m128i k = _mm_cvtps_epi32(t);
+		const __m128 d = _mm_sub_ps(v, _mm_add_ps(vlo, _mm_mul_ps(_mm_cvtepi32_ps(k), vstep)));
+		maxError = _mm_max_ps(maxError, _mm_andnot_ps(signMask, d));
+		sqError = _mm_add_ps(sqError, _mm_mul_ps(d, d));
+		_mm_storeu_si128((__m128i*)(fit.k + i), k);
+	}
+	float m[4], s[4];
+	_mm_storeu_ps(m, maxError);
+	_mm_storeu_ps(s, sqError);
+	fit.maxError = std::max(std::max(m[0], m[1]), std::max(m[2], m[3]));
+	fit.sqError = s[0] + s[1] + s[2] + s[3];
+#else
+	fit.maxError = 0;
+	fit.sqError = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		const float t = std::min(std::max((u[i] - lo) * inv, 0.0f), 7.0f);
+		fit.k[i] = (int)floorf(t + 0.5f);
+		const float d = u[i] - (lo + fit.k[i] * step);
+		fit.maxError = std::max(fit.maxError, fabsf(d));
+		fit.sqError += d * d;
+	}
+#endif
+}
+
+// tries the endpoints around the block's range, the smallest max error wins
+static void encodeBlock(const float u[16], unsigned char* out, float& maxError, float& sqError)
+{
+	float mn = u[0], mx = u[0];
+	for (int i = 1; i < 16; i++)
+	{
+		mn = std::min(mn, u[i]);
+		mx = std::max(mx, u[i]);
+	}
+	const int floorMin = (int)floorf(mn);
+	const int ceilMax = (int)ceilf(mx);
+	BlockFit best, fit;
+	best.lo = best.hi = 0;
+	best.maxError = -1;
+	best.sqError = 0;
+	for (int lo = floorMin - 1; lo <= floorMin + 1; lo++)
+	{
+		for (int hi = ceilMax - 1; hi <= ceilMax + 1; hi++)
+		{
+			const int l = std::min(std::max(lo, 0), 254);
+			const int h = std::min(std::max(hi, l + 1), 255);
+			fitBlock(u, l, h, fit);
+			if (best.maxError < 0 || fit.maxError < best.maxError ||
+				(fit.maxError == best.maxError && fit.sqError < best.sqError))
+				best = fit;
+		}
+	}
+
+	// red0 > red1 selects the 8 value palette: index 0 is red0, 1 is red1, 2..7 in between from red0
+	out[0] = (unsigned char)best.hi;
+	out[1] = (unsigned char)best.lo;
+	unsigned long long bits = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		const int k = best.k[i];
+		const unsigned long long index = (k == 7) ? 0 : (k == 0 ? 1 : 8 - k);
+		bits |= index << (3 * i);
+	}
+	for (int i = 0; i < 6; i++)
+		out[2 + i] = (unsigned char)(bits >> (8 * i));
+	maxError = best.maxError;
+	sqError = best.sqError;
+}
+
+static void initTile(const unsigned short* heights, unsigned int width, unsigned int height, BC4Tile& tile)
+{
+	tile.width = width;
+	tile.height = height;
+	tile.blocksX = (width + 3) / 4;
+	tile.blocksZ = (height + 3) / 4;
+	const unsigned short* end = heights + (size_t)width * height;
+	tile.minY = *std::min_element(heights, end);
+	tile.maxY = *std::max_element(heights, end);
+	tile.blocks.resize((size_t)tile.blocksX * tile.blocksZ * 8);
+}
+
+// errors in unorm8 units; texels past the image repeat its edge, so they add nothing to the max error
+static void encodeBlockRows(const unsigned short* heights, BC4Tile& tile, unsigned int bzBegin, unsigned int bzEnd,
+	float& maxError, double& sqError)
+{
+	const float range = (float)(tile.maxY - tile.minY);
+	const float scale = range > 0 ? 255.0f / range : 0.0f;
+	float u[16];
+	maxError = 0;
+	sqError = 0;
+	for (unsigned int bz = bzBegin; bz < bzEnd; bz++)
+	{
+		for (unsigned int bx = 0; bx < tile.blocksX; bx++)
+		{
+			for (int i = 0; i < 16; i++)
+			{
+				const unsigned int x = std::min(bx * 4 + (i & 3), tile.width - 1);
+				const unsigned int z = std::min(bz * 4 + (i >> 2), tile.height - 1);
+				u[i] = (heights[(size_t)z * tile.width + x] - tile.minY) * scale;
+			}
+			float blockMax, blockSq;
+			encodeBlock(u, &tile.blocks[((size_t)bz * tile.blocksX + bx) * 8], blockMax, blockSq);
+			maxError = std::max(maxError, blockMax);
+			sqError += blockSq;
+		}
+	}
+}
+
+static void finishStats(BC4Tile& tile, float maxError, double sqError)
+{
+	const float unit = (tile.maxY - tile.minY) / 255.0f;
+	// over the padded texture
+	const double texels = (double)tile.blocksX * tile.blocksZ * 16;
+	tile.maxError = maxError * unit;
+	tile.rmsError = (float)sqrt(sqError / texels) * unit;
+}
+
+void encodeBC4Tile(const unsigned short* heights, unsigned int width, unsigned int height, BC4Tile& tile)
+{
+	initTile(heights, width, height, tile);
+	float maxError;
+	double sqError;
+	encodeBlockRows(heights, tile, 0, tile.blocksZ, maxError, sqError);
+	finishStats(tile, maxError, sqError);
+}
+
+void encodeBC4TileParallel(const unsigned short* heights, unsigned int width, unsigned int height, BC4Tile& tile, int threadCount)
+{
+	initTile(heights, width, height, tile);
+	const unsigned int n = (unsigned int)std::max(1, std::min(threadCount, (int)tile.blocksZ));
+	std::vector<float> maxErrors(n);
+	std::vector<double> sqErrors(n);
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < n; t++)
+	{
+		const unsigned int begin = tile.blocksZ * t / n;
+		const unsigned int end = tile.blocksZ * (t + 1) / n;
+		threads.push_back(std::thread(encodeBlockRows, heights, std::ref(tile), begin, end, std::ref(maxErrors[t]), std::ref(sqErrors[t])));
+	}
+	float maxError = 0;
+	double sqError = 0;
+	for (unsigned int t = 0; t < n; t++)
+	{
+		threads[t].join();
+		maxError = std::max(maxError, maxErrors[t]);
+		sqError += sqErrors[t];
+	}
+	finishStats(tile, maxError, sqError);
+}
+
+void decodeBC4Tile(const BC4Tile& tile, unsigned short* heights)
+{
+	const float unit = (tile.maxY - tile.minY) / 255.0f;
+	for (unsigned int bz = 0; bz < tile.blocksZ; bz++)
+	{
+		for (unsigned int bx = 0; bx < tile.blocksX; bx++)
+		{
+			const unsigned char* block = &tile.blocks[((size_t)bz * tile.blocksX + bx) * 8];
+			const float red0 = block[0], red1 = block[1];
+			float palette[8];
+			palette[0] = red0;
+			palette[1] = red1;
+			for (int i = 2; i < 8; i++)
+				palette[i] = red0 > red1 ? ((8 - i) * red0 + (i - 1) * red1) / 7.0f :
+					(i < 6 ? ((6 - i) * red0 + (i - 1) * red1) / 5.0f : (i == 6 ? 0.0f : 255.0f));
+			unsigned long long bits = 0;
+			for (int i = 0; i < 6; i++)
+				bits |= (unsigned long long)block[2 + i] << (8 * i);
+			for (int i = 0; i < 16; i++)
+			{
+				const unsigned int x = bx * 4 + (i & 3);
+				const unsigned int z = bz * 4 + (i >> 2);
+				if (x >= tile.width || z >= tile.height)
+					continue;
+				const float v = palette[(bits >> (3 * i)) & 7];
+				heights[(size_t)z * tile.width + x] = (unsigned short)(tile.minY + v * unit + 0.5f);
+			}
+		}
+	}
+}
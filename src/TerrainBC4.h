@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+
+// BC4 block compression of height tiles (no Ogre dependency)
+//
+// The heights are normalized to the range of the tile before encoding, so the 8-bit endpoints of a block
+// cover the tile's range instead of the whole 16-bit range; the shaders scale the sampled value back
+// with the tile's min and range. The image is padded to whole 4x4 blocks by repeating its last row and column.
+
+struct BC4Tile
+{
+	unsigned int width;			// pixels of the source image
+	unsigned int height;
+	unsigned int blocksX;		// the texture is blocksX * 4 texels wide
+	unsigned int blocksZ;
+	unsigned short minY;		// heights the unorm values 0 and 1 decode to
+	unsigned short maxY;
+	// against the source, in height units; measured with the exact BC4 palette
+	float maxError;
+	float rmsError;
+	std::vector<unsigned char> blocks;	// 8 bytes per block, row by row
+};
+
+void encodeBC4Tile(const unsigned short* heights, unsigned int width, unsigned int height, BC4Tile& tile);
+// the same, rows of blocks spread over threads, for large images
+void encodeBC4TileParallel(const unsigned short* heights, unsigned int width, unsigned int height, BC4Tile& tile, int threadCount);
+// heights as sampled from the texture, rounded to height units
+void decodeBC4Tile(const BC4Tile& tile, unsigned short* heights);
@@ -0,0 +1,65 @@
+#include "TerrainHoles.h"
+
+// true if any pixel of the rectangle, borders included, is not no-data
+static bool hasData(const unsigned short* pImgSrc, unsigned int width, unsigned short noData,
+	size_t x0, size_t z0, size_t x1, size_t z1)
+{
+	for (size_t z = z0; z <= z1; z++)
+	{
+		const unsigned short* row = pImgSrc + z * width;
+		for (size_t x = x0; x <= x1; x++)
+			if (row[x] != noData)
+				return true;
+	}
+	return false;
+}
+
+TerrainHoleTree::Node TerrainHoleTree::buildNode(const TerrainPyramidParams& p, const unsigned short* pImgSrc, unsigned int width,
+	unsigned short noData, int lodLevel, size_t ix, size_t iz)
+{
+	Node children[4];
+	if (lodLevel == 0)
+	{
+		// the quadrants of the patch split the grid's pixels at its middle, sharing the middle pixel
+		for (int q = 0; q < 4; q++)
+		{
+			const size_t qx = q & 1, qz = q >> 1;
+			const size_t x0 = ix * p.nPixelX + qx * p.nPixelX / 2;
+			const size_t z0 = iz * p.nPixelZ + qz * p.nPixelZ / 2;
+			const size_t x1 = ix * p.nPixelX + ((qx + 1) * p.nPixelX + 1) / 2;
+			const size_t z1 = iz * p.nPixelZ + ((qz + 1) * p.nPixelZ + 1) / 2;
+			children[q] = hasData(pImgSrc, width, noData, x0, z0, x1, z1) ? Solid : Empty;
+		}
+	}
+	else
+	{
+		const size_t n = p.nGridX >> (lodLevel - 1);
+		for (int q = 0; q < 4; q++)
+		{
+			const size_t cx = ix * 2 + (q & 1), cz = iz * 2 + (q >> 1);
+			children[q] = (cx < n && cz < (p.nGridZ >> (lodLevel - 1))) ?
+				buildNode(p, pImgSrc, width, noData, lodLevel - 1, cx, cz) : Empty;
+		}
+	}
+
+	if (children[0] == children[1] && children[1] == children[2] && children[2] == children[3] && children[0] < 0)
+		return children[0];
+	// after the children's own nodes, they are complete by now
+	const Node node = (Node)(m_children.size() / 4);
+	m_children.insert(m_children.end(), children, children + 4);
+	return node;
+}
+
+void TerrainHoleTree::build(const TerrainPyramidParams& p, const unsigned short* pImgSrc, unsigned int width, unsigned short noData)
+{
+	clear();
+	m_root = buildNode(p, pImgSrc, width, noData, p.lodLevelCount - 1, 0, 0);
+	// a map with a few holes has a small tree
+	std::vector<Node>(m_children).swap(m_children);
+}
+
+void TerrainHoleTree::clear()
+{
+	std::vector<Node>().swap(m_children);
+	m_root = Solid;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include "TerrainPyramid.h"
+
+// Sparse quadtree of where a heightmap has data (no Ogre dependency)
+//
+// Pixels equal to the no-data value are holes. The finest unit is a quadrant of a unit grid, the part of a
+// LOD level 0 patch one index range draws; a quadrant is drawn if any of its pixels has data.
+// A node is Solid if all the quadrants below it are drawn, Empty if none is, Mixed otherwise;
+// only the Mixed nodes are stored, so the size follows the length of the coastlines, not the area.
+class TerrainHoleTree
+{
+public:
+	// Solid or Empty, or the index of a Mixed node
+	typedef int Node;
+	static const Node Solid = -1;
+	static const Node Empty = -2;
+
+private:
+	// the four children of each Mixed node: TL, TR, BL, BR; those of level 0 nodes are the quadrants
+	std::vector<Node> m_children;
+	Node m_root;
+
+	Node buildNode(const TerrainPyramidParams& p, const unsigned short* pImgSrc, unsigned int width, unsigned short noData,
+		int lodLevel, size_t ix, size_t iz);
+
+public:
+	TerrainHoleTree() : m_root(Solid) {}
+
+	void build(const TerrainPyramidParams& p, const unsigned short* pImgSrc, unsigned int width, unsigned short noData);
+	// no holes, everything Solid
+	void clear();
+
+	Node getRoot() const { return m_root; }
+	// quadrant 0 TL, 1 TR, 2 BL, 3 BR; the children of a uniform node are the same as it
+	Node getChild(Node node, int quadrant) const
+	{
+		return node < 0 ? node : m_children[node * 4 + quadrant];
+	}
+	// bit per quadrant of the node's patch with data, in the order of getChild
+	int getQuadrantMask(Node node) const
+	{
+		if (node < 0)
+			return node == Solid ? 15 : 0;
+		int mask = 0;
+		for (int i = 0; i < 4; i++)
+			if (m_children[node * 4 + i] != Empty)
+				mask |= 1 << i;
+		return mask;
+	}
+	size_t getMixedNodeCount() const { return m_children.size() / 4; }
+};
@@ -0,0 +1,90 @@
+#include "TerrainHorizon.h"
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+// A monotonic stand-in for atan2 in (-2, 2], a quarter turn per unit: cheaper, and the bins only need the order.
+// The bins are not of equal angles then, by up to 1.4 times along the diagonals.
+static inline float pseudoAngle(float dx, float dz)
+{
+	const float p = dz / (fabsf(dx) + fabsf(dz));
+	return dx >= 0 ? p : (dz >= 0 ? 2 - p : -2 - p);
+}
+
+void TerrainHorizon::reset(float eyeX, float eyeY, float eyeZ)
+{
+	m_eye[0] = eyeX;
+	m_eye[1] = eyeY;
+	m_eye[2] = eyeZ;
+	std::fill(m_slopes.begin(), m_slopes.end(), -FLT_MAX);
+}
+
+bool TerrainHorizon::getSpan(float minX, float minZ, float maxX, float maxZ, float& first, float& last, float& nearest, float& farthest) const
+{
+	const float ex = m_eye[0], ez = m_eye[2];
+	if (ex >= minX && ex <= maxX && ez >= minZ && ez <= maxZ)
+		return false;
+	const float dx = std::max(std::max(minX - ex, ex - maxX), 0.0f);
+	const float dz = std::max(std::max(minZ - ez, ez - maxZ), 0.0f);
+	nearest = sqrtf(dx * dx + dz * dz);
+	const float fx = std::max(fabsf(minX - ex), fabsf(maxX - ex));
+	const float fz = std::max(fabsf(minZ - ez), fabsf(maxZ - ez));
+	farthest = sqrtf(fx * fx + fz * fz);
+
+	// the corners around the direction of the center, less than half a turn apart with the eye outside
+	const float center = pseudoAngle((minX + maxX) * 0.5f - ex, (minZ + maxZ) * 0.5f - ez);
+	const float cornerX[4] = { minX, maxX, minX, maxX };
+	const float cornerZ[4] = { minZ, minZ, maxZ, maxZ };
+	float lo = 0, hi = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		float a = pseudoAngle(cornerX[i] - ex, cornerZ[i] - ez) - center;
+		if (a > 2)
+			a -= 4;
+		else if (a < -2)
+			a += 4;
+		lo = std::min(lo, a);
+		hi = std::max(hi, a);
+	}
+	const float scale = m_slopes.size() / 4.0f;
+	first = (center + lo + 2) * scale;
+	last = (center + hi + 2) * scale;
+	return true;
+}
+
+bool TerrainHorizon::isOccluded(float minX, float minZ, float maxX, float maxZ, float maxY) const
+{
+	float first, last, nearest, farthest;
+	if (!getSpan(minX, minZ, maxX, maxZ, first, last, nearest, farthest) || nearest <= 0)
+		return false;
+	// the steepest the node can look from the eye
+	const float h = maxY - m_eye[1];
+	const float slope = h > 0 ? h / nearest : h / farthest;
+	// every bin the span touches
+	const int n = (int)m_slopes.size();
+	const int end = (int)floorf(last);
+	for (int b = (int)floorf(first); b <= end; b++)
+	{
+		if (m_slopes[((b % n) + n) % n] <= slope)
+			return false;
+	}
+	return true;
+}
+
+void TerrainHorizon::addOccluder(float minX, float minZ, float maxX, float maxZ, float minY)
+{
+	float first, last, nearest, farthest;
+	if (!getSpan(minX, minZ, maxX, maxZ, first, last, nearest, farthest) || nearest <= 0)
+		return;
+	// a ray of the eye in the span crosses the footprint somewhere within these distances, at least this steep
+	const float h = minY - m_eye[1];
+	const float slope = h > 0 ? h / farthest : h / nearest;
+	// only the bins the span covers whole
+	const int n = (int)m_slopes.size();
+	const int end = (int)floorf(last);
+	for (int b = (int)ceilf(first); b < end; b++)
+	{
+		float& s = m_slopes[((b % n) + n) % n];
+		s = std::max(s, slope);
+	}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+
+// Horizon occlusion buffer of the terrain selection (no Ogre dependency)
+//
+// For each azimuth around the eye it keeps the highest elevation, as a slope, that nearer terrain surely reaches.
+// The nodes are added front to back: a node is occluded if its highest point stays under the horizon over all the
+// azimuths it spans, then the terrain it surely has, its footprint at its min height, raises the horizon.
+class TerrainHorizon
+{
+private:
+	std::vector<float> m_slopes;
+	float m_eye[3];
+
+	// azimuth span of the footprint in bins and its nearest and farthest horizontal distance to the eye;
+	// false if the eye is over the footprint
+	bool getSpan(float minX, float minZ, float maxX, float maxZ, float& first, float& last, float& nearest, float& farthest) const;
+
+public:
+	TerrainHorizon(int bins = 1024) : m_slopes(bins) { reset(0, 0, 0); }
+
+	void reset(float eyeX, float eyeY, float eyeZ);
+	int getBinCount() const { return (int)m_slopes.size(); }
+	// a footprint in world space and the highest point over it
+	bool isOccluded(float minX, float minZ, float maxX, float maxZ, float maxY) const;
+	// a footprint in world space that is at least minY high everywhere
+	void addOccluder(float minX, float minZ, float maxX, float maxZ, float minY);
+};
@@ -0,0 +1,289 @@
+#include "TerrainObjects.h"
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+static void setEmpty(float bounds[6])
+{
+	bounds[0] = bounds[1] = bounds[2] = FLT_MAX;
+	bounds[3] = bounds[4] = bounds[5] = -FLT_MAX;
+}
+
+static void merge(float bounds[6], const float other[6])
+{
+	for (int a = 0; a < 3; a++)
+	{
+		bounds[a] = std::min(bounds[a], other[a]);
+		bounds[a + 3] = std::max(bounds[a + 3], other[a + 3]);
+	}
+}
+
+static float getSqDistance(const float p[3], const float bounds[6])
+{
+	float sqDist = 0;
+	for (int a = 0; a < 3; a++)
+	{
+		const float d = std::max(std::max(bounds[a] - p[a], p[a] - bounds[a + 3]), 0.0f);
+		sqDist += d * d;
+	}
+	return sqDist;
+}
+
+static TerrainObjectIndex::Visibility testBox(const float planes[6][4], const float bounds[6])
+{
+	bool inside = true;
+	for (int p = 0; p < 6; p++)
+	{
+		// the corners farthest along the normal and against it
+		const float* plane = planes[p];
+		float farthest = plane[3], nearest = plane[3];
+		for (int a = 0; a < 3; a++)
+		{
+			const float lo = plane[a] * bounds[a], hi = plane[a] * bounds[a + 3];
+			farthest += std::max(lo, hi);
+			nearest += std::min(lo, hi);
+		}
+		if (farthest < 0)
+			return TerrainObjectIndex::Outside;
+		if (nearest < 0)
+			inside = false;
+	}
+	return inside ? TerrainObjectIndex::Inside : TerrainObjectIndex::Intersect;
+}
+
+static unsigned int toCell(float v, float origin, float cellSize, unsigned int count)
+{
+	const float c = floorf((v - origin) / cellSize);
+	return c <= 0 ? 0 : std::min((unsigned int)c, count - 1);
+}
+
+TerrainObjectIndex::TerrainObjectIndex()
+	: m_levelCount(0), m_rootSize(0), m_frame(0), m_freeObject(-1), m_objectCount(0)
+{
+	m_origin[0] = m_origin[1] = 0;
+	m_cellSize[0] = m_cellSize[1] = 1;
+	m_stats = Stats();
+}
+
+void TerrainObjectIndex::init(int lodLevelCount, float minX, float minZ, float cellSizeX, float cellSizeZ)
+{
+	clear();
+	m_levelCount = lodLevelCount;
+	m_rootSize = 1u << (lodLevelCount - 1);
+	m_origin[0] = minX;
+	m_origin[1] = minZ;
+	m_cellSize[0] = cellSizeX;
+	m_cellSize[1] = cellSizeZ;
+	size_t nodes = 0;
+	for (int l = 0; l < lodLevelCount; l++)
+	{
+		m_levelOffsets.push_back(nodes);
+		nodes += (size_t)(m_rootSize >> l) * (m_rootSize >> l);
+	}
+	Node empty;
+	setEmpty(empty.bounds);
+	empty.first = -1;
+	empty.count = 0;
+	empty.sqMaxDistance = 0;
+	m_nodes.assign(nodes, empty);
+	m_stamps.assign(nodes, 0);
+	m_results.assign(nodes, Unknown);
+}
+
+void TerrainObjectIndex::clear()
+{
+	m_levelCount = 0;
+	m_rootSize = 0;
+	m_levelOffsets.clear();
+	std::vector<Node>().swap(m_nodes);
+	std::vector<unsigned int>().swap(m_stamps);
+	std::vector<unsigned char>().swap(m_results);
+	std::vector<Object>().swap(m_objects);
+	m_freeObject = -1;
+	m_objectCount = 0;
+}
+
+int TerrainObjectIndex::findNode(const float bounds[6], unsigned int& ix, unsigned int& iz) const
+{
+	const unsigned int x0 = toCell(bounds[0], m_origin[0], m_cellSize[0], m_rootSize);
+	const unsigned int z0 = toCell(bounds[2], m_origin[1], m_cellSize[1], m_rootSize);
+	const unsigned int x1 = toCell(bounds[3], m_origin[0], m_cellSize[0], m_rootSize);
+	const unsigned int z1 = toCell(bounds[5], m_origin[1], m_cellSize[1], m_rootSize);
+	int lodLevel = 0;
+	while (lodLevel < m_levelCount - 1 && ((x0 >> lodLevel) != (x1 >> lodLevel) || (z0 >> lodLevel) != (z1 >> lodLevel)))
+		lodLevel++;
+	ix = x0 >> lodLevel;
+	iz = z0 >> lodLevel;
+	return lodLevel;
+}
+
+void TerrainObjectIndex::link(ObjectId id, int lodLevel, unsigned int ix, unsigned int iz)
+{
+	Object& obj = m_objects[id];
+	const size_t i = getNodeIndex(lodLevel, ix, iz);
+	obj.node = (int)i;
+	obj.prev = -1;
+	obj.next = m_nodes[i].first;
+	if (obj.next >= 0)
+		m_objects[obj.next].prev = id;
+	m_nodes[i].first = id;
+	for (int l = lodLevel; l < m_levelCount; l++, ix >>= 1, iz >>= 1)
+	{
+		Node& node = m_nodes[getNodeIndex(l, ix, iz)];
+		node.count++;
+		merge(node.bounds, obj.bounds);
+		node.sqMaxDistance = std::max(node.sqMaxDistance, obj.sqMaxDistance);
+	}
+}
+
+void TerrainObjectIndex::unlink(ObjectId id)
+{
+	Object& obj = m_objects[id];
+	Node& node = m_nodes[obj.node];
+	if (obj.prev >= 0)
+		m_objects[obj.prev].next = obj.next;
+	else
+		node.first = obj.next;
+	if (obj.next >= 0)
+		m_objects[obj.next].prev = obj.prev;
+
+	// the level is the last one whose offset is not past the node
+	const int lodLevel = (int)(std::upper_bound(m_levelOffsets.begin(), m_levelOffsets.end(), (size_t)obj.node) - m_levelOffsets.begin()) - 1;
+	const unsigned int n = m_rootSize >> lodLevel;
+	const size_t local = obj.node - m_levelOffsets[lodLevel];
+	unsigned int ix = (unsigned int)(local % n), iz = (unsigned int)(local / n);
+	for (int l = lodLevel; l < m_levelCount; l++, ix >>= 1, iz >>= 1)
+		m_nodes[getNodeIndex(l, ix, iz)].count--;
+	refreshBounds(lodLevel, (unsigned int)(local % n), (unsigned int)(local / n));
+	obj.node = -1;
+}
+
+void TerrainObjectIndex::refreshBounds(int lodLevel, unsigned int ix, unsigned int iz)
+{
+	for (int l = lodLevel; l < m_levelCount; l++, ix >>= 1, iz >>= 1)
+	{
+		Node& node = m_nodes[getNodeIndex(l, ix, iz)];
+		setEmpty(node.bounds);
+		node.sqMaxDistance = 0;
+		if (node.count == 0)
+			continue;
+		for (int o = node.first; o >= 0; o = m_objects[o].next)
+		{
+			merge(node.bounds, m_objects[o].bounds);
+			node.sqMaxDistance = std::max(node.sqMaxDistance, m_objects[o].sqMaxDistance);
+		}
+		if (l == 0)
+			continue;
+		for (int q = 0; q < 4; q++)
+		{
+			const Node& child = m_nodes[getNodeIndex(l - 1, ix * 2 + (q & 1), iz * 2 + (q >> 1))];
+			if (child.count == 0)
+				continue;
+			merge(node.bounds, child.bounds);
+			node.sqMaxDistance = std::max(node.sqMaxDistance, child.sqMaxDistance);
+		}
+	}
+}
+
+TerrainObjectIndex::ObjectId TerrainObjectIndex::add(const float min[3], const float max[3], void* userData, float maxDistance)
+{
+	if (m_levelCount == 0)
+		return -1;
+	ObjectId id;
+	if (m_freeObject >= 0)
+	{
+		id = m_freeObject;
+		m_freeObject = m_objects[id].next;
+	}
+	else
+	{
+		id = (ObjectId)m_objects.size();
+		m_objects.push_back(Object());
+	}
+	Object& obj = m_objects[id];
+	std::copy(min, min + 3, obj.bounds);
+	std::copy(max, max + 3, obj.bounds + 3);
+	obj.sqMaxDistance = maxDistance > 0 ? maxDistance * maxDistance : FLT_MAX;
+	obj.userData = userData;
+	unsigned int ix, iz;
+	const int lodLevel = findNode(obj.bounds, ix, iz);
+	link(id, lodLevel, ix, iz);
+	m_objectCount++;
+	return id;
+}
+
+void TerrainObjectIndex::move(ObjectId id, const float min[3], const float max[3])
+{
+	unlink(id);
+	Object& obj = m_objects[id];
+	std::copy(min, min + 3, obj.bounds);
+	std::copy(max, max + 3, obj.bounds + 3);
+	unsigned int ix, iz;
+	const int lodLevel = findNode(obj.bounds, ix, iz);
+	link(id, lodLevel, ix, iz);
+}
+
+void TerrainObjectIndex::remove(ObjectId id)
+{
+	unlink(id);
+	Object& obj = m_objects[id];
+	obj.userData = 0;
+	obj.next = m_freeObject;
+	m_freeObject = id;
+	m_objectCount--;
+}
+
+void TerrainObjectIndex::collectNode(const CullParams& params, int lodLevel, unsigned int ix, unsigned int iz, Visibility parent,
+	std::vector<ObjectId>& visible)
+{
+	const size_t i = getNodeIndex(lodLevel, ix, iz);
+	const Node& node = m_nodes[i];
+	if (node.count == 0)
+		return;
+	Visibility visibility = parent;
+	if (visibility != Inside)
+	{
+		if (m_stamps[i] == m_frame && m_results[i] != Unknown)
+		{
+			visibility = (Visibility)m_results[i];
+			m_stats.reusedNodes++;
+		}
+		else
+		{
+			visibility = testBox(params.planes, node.bounds);
+			m_stats.testedNodes++;
+		}
+		if (visibility == Outside)
+			return;
+	}
+	if (getSqDistance(params.eye, node.bounds) > std::min(node.sqMaxDistance, params.sqRange))
+		return;
+
+	for (int o = node.first; o >= 0; o = m_objects[o].next)
+	{
+		const Object& obj = m_objects[o];
+		if (getSqDistance(params.eye, obj.bounds) > std::min(obj.sqMaxDistance, params.sqRange))
+			continue;
+		if (visibility != Inside)
+		{
+			m_stats.testedObjects++;
+			if (testBox(params.planes, obj.bounds) == Outside)
+				continue;
+		}
+		visible.push_back(o);
+	}
+	if (lodLevel > 0)
+	{
+		for (int q = 0; q < 4; q++)
+			collectNode(params, lodLevel - 1, ix * 2 + (q & 1), iz * 2 + (q >> 1), visibility, visible);
+	}
+}
+
+void TerrainObjectIndex::collect(const CullParams& params, std::vector<ObjectId>& visible)
+{
+	m_stats = Stats();
+	visible.clear();
+	if (m_levelCount > 0)
+		collectNode(params, m_levelCount - 1, 0, 0, Unknown, visible);
+	m_stats.visibleObjects = visible.size();
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// Spatial index of the objects placed on the terrain, in the nodes of the LOD quadtree (no Ogre dependency)
+//
+// An object goes into the smallest node whose footprint holds its own, and each node keeps the bounds of the
+// objects in its subtree. The selection tests the nodes with those bounds included and records the results,
+// so the objects are collected from the recorded results; only the subtrees the selection did not visit and
+// the objects of the nodes the frustum intersects are tested again.
+class TerrainObjectIndex
+{
+public:
+	typedef int ObjectId;
+	enum Visibility
+	{
+		Unknown,
+		Outside,
+		Intersect,
+		Inside
+	};
+	struct CullParams
+	{
+		float planes[6][4];		// a * x + b * y + c * z + d >= 0 inside
+		float eye[3];
+		float sqRange;			// of the objects without a distance of their own
+	};
+	struct Stats
+	{
+		size_t visibleObjects;
+		size_t reusedNodes;		// of the selection's results
+		size_t testedNodes;		// the selection did not visit
+		size_t testedObjects;
+	};
+
+private:
+	struct Object
+	{
+		float bounds[6];		// min, max
+		float sqMaxDistance;
+		void* userData;
+		int node;				// -1 for a free slot, the next free slot in next then
+		int prev;
+		int next;
+	};
+	struct Node
+	{
+		float bounds[6];		// of the objects in the subtree
+		int first;				// the objects of the node itself
+		int count;				// in the subtree
+		float sqMaxDistance;	// of the subtree
+	};
+
+	int m_levelCount;
+	unsigned int m_rootSize;	// level 0 nodes on a side
+	float m_origin[2];			// x, z of the map's corner
+	float m_cellSize[2];		// of a level 0 node
+	std::vector<size_t> m_levelOffsets;
+	std::vector<Node> m_nodes;
+	// the selection's results of the frame in m_frame
+	std::vector<unsigned int> m_stamps;
+	std::vector<unsigned char> m_results;
+	unsigned int m_frame;
+	std::vector<Object> m_objects;
+	int m_freeObject;
+	size_t m_objectCount;
+	Stats m_stats;
+
+	size_t getNodeIndex(int lodLevel, unsigned int ix, unsigned int iz) const
+	{
+		return m_levelOffsets[lodLevel] + (size_t)iz * (m_rootSize >> lodLevel) + ix;
+	}
+	// the smallest node that holds the footprint, clamped to the map; its level
+	int findNode(const float bounds[6], unsigned int& ix, unsigned int& iz) const;
+	void link(ObjectId id, int lodLevel, unsigned int ix, unsigned int iz);
+	void unlink(ObjectId id);
+	// the bounds of the node and its ancestors from their objects and children, after a removal
+	void refreshBounds(int lodLevel, unsigned int ix, unsigned int iz);
+	void collectNode(const CullParams& params, int lodLevel, unsigned int ix, unsigned int iz, Visibility parent,
+		std::vector<ObjectId>& visible);
+
+public:
+	TerrainObjectIndex();
+
+	// the quadtree's levels, the root covers level 0 nodes of cellSizeX by cellSizeZ from (minX, minZ);
+	// the objects are dropped
+	void init(int lodLevelCount, float minX, float minZ, float cellSizeX, float cellSizeZ);
+	void clear();
+	bool isInitialized() const { return m_levelCount > 0; }
+
+	// world space bounds; a maxDistance of 0 for the range of the cull params; -1 before init
+	ObjectId add(const float min[3], const float max[3], void* userData, float maxDistance = 0);
+	void move(ObjectId id, const float min[3], const float max[3]);
+	void remove(ObjectId id);
+	void* getUserData(ObjectId id) const { return m_objects[id].userData; }
+	size_t getObjectCount() const { return m_objectCount; }
+
+	// forgets the results of the last frame
+	void beginFrame() { m_frame++; }
+	bool hasObjects(int lodLevel, unsigned int ix, unsigned int iz) const
+	{
+		return m_levelCount > 0 && m_nodes[getNodeIndex(lodLevel, ix, iz)].count > 0;
+	}
+	// min, max of the objects below the node, if it has any
+	const float* getNodeBounds(int lodLevel, unsigned int ix, unsigned int iz) const
+	{
+		return m_nodes[getNodeIndex(lodLevel, ix, iz)].bounds;
+	}
+	// the frustum result of the selection for the node with the bounds of its objects included;
+	// Outside and Inside have to hold for them, Intersect is tested again
+	void record(int lodLevel, unsigned int ix, unsigned int iz, Visibility visibility)
+	{
+		const size_t i = getNodeIndex(lodLevel, ix, iz);
+		m_stamps[i] = m_frame;
+		m_results[i] = (unsigned char)visibility;
+	}
+	// the objects in the frustum and in range, from the results recorded since beginFrame
+	void collect(const CullParams& params, std::vector<ObjectId>& visible);
+	const Stats& getStats() const { return m_stats; }
+};
@@ -0,0 +1,757 @@
+#include "TerrainOcclusion.h"
+#include <cmath>
+#include <cstring>
+#include <cfloat>
+#include <algorithm>
+#include <chrono>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TERRAIN_OCCLUSION_SSE2
+#include <emmintrin.h>
+#endif
+
+// pixels of a screen tile, the unit of the rasterization jobs
+static const int TileWidth = 32;
+static const int TileHeight = 32;
+// triangles per setup job
+static const size_t SetupChunk = 1024;
+
+OcclusionBuffer::OcclusionBuffer(int width, int height, int threadCount)
+	: m_width(0), m_height(0), m_tilesX(0), m_tilesY(0), m_nearW(0),
+	m_jobItems(0), m_nextItem(0), m_busyWorkers(0), m_jobGeneration(0), m_quit(false)
+{
+	memset(m_viewProj, 0, sizeof(m_viewProj));
+	memset(&m_stats, 0, sizeof(m_stats));
+	resize(width, height);
+	for (int i = 0; i < threadCount; i++)
+		m_workers.push_back(std::thread(&OcclusionBuffer::workerMain, this, i + 1));
+	m_bins.resize(m_workers.size() + 1);
+}
+
+OcclusionBuffer::~OcclusionBuffer()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_all();
+	for (size_t i = 0; i < m_workers.size(); i++)
+		m_workers[i].join();
+}
+
+void OcclusionBuffer::resize(int width, int height)
+{
+	m_width = std::max((width + 3) & ~3, 4);
+	m_height = std::max(height, 1);
+	m_tilesX = (m_width + TileWidth - 1) / TileWidth;
+	m_tilesY = (m_height + TileHeight - 1) / TileHeight;
+	m_levels.clear();
+	m_levelWidths.clear();
+	m_levelHeights.clear();
+	int w = m_width, h = m_height;
+	for (;;)
+	{
+		m_levels.push_back(std::vector<float>((size_t)w * h, 0.0f));
+		m_levelWidths.push_back(w);
+		m_levelHeights.push_back(h);
+		if (w == 1 && h == 1)
+			break;
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+}
+
+void OcclusionBuffer::workerMain(int thread)
+{
+	unsigned int generation = 0;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;)
+	{
+		while (!m_quit && m_jobGeneration == generation)
+			m_cond.wait(lock);
+		if (m_quit)
+			break;
+		generation = m_jobGeneration;
+		lock.unlock();
+		takeItems(thread);
+		lock.lock();
+		if (--m_busyWorkers == 0)
+			m_doneCond.notify_all();
+	}
+}
+
+void OcclusionBuffer::takeItems(int thread)
+{
+	for (;;)
+	{
+		int item;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_nextItem >= m_jobItems)
+				return;
+			item = m_nextItem++;
+		}
+		m_job(item, thread);
+	}
+}
+
+void OcclusionBuffer::runParallel(int items, const std::function<void(int, int)>& job)
+{
+	if (m_workers.empty() || items <= 1)
+	{
+		for (int i = 0; i < items; i++)
+			job(i, 0);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_job = job;
+		m_jobItems = items;
+		m_nextItem = 0;
+		m_busyWorkers = (int)m_workers.size();
+		m_jobGeneration++;
+	}
+	m_cond.notify_all();
+	takeItems(0);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_busyWorkers > 0)
+		m_doneCond.wait(lock);
+	m_job = std::function<void(int, int)>();
+}
+
+void OcclusionBuffer::transform(const float p[3], float clip[4]) const
+{
+	const float* m = m_viewProj;
+	for (int i = 0; i < 4; i++)
+		clip[i] = m[i * 4] * p[0] + m[i * 4 + 1] * p[1] + m[i * 4 + 2] * p[2] + m[i * 4 + 3];
+}
+
+void OcclusionBuffer::begin(const float viewProj[16], float nearDistance)
+{
+	memcpy(m_viewProj, viewProj, sizeof(m_viewProj));
+	m_nearW = std::max(nearDistance, 1e-4f);
+	m_batches.clear();
+	m_boxVertices.clear();
+	m_boxIndices.clear();
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+void OcclusionBuffer::addTriangles(const float* vertices, const unsigned int* indices, size_t triangleCount)
+{
+	if (triangleCount == 0)
+		return;
+	Batch batch = { vertices, indices, triangleCount };
+	m_batches.push_back(batch);
+}
+
+void OcclusionBuffer::addBox(const float min[3], const float max[3], const float eye[3])
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float plane;
+		if (eye[axis] < min[axis])
+			plane = min[axis];
+		else if (eye[axis] > max[axis])
+			plane = max[axis];
+		else
+			continue;
+		// the face's corners along the other two axes
+		const int u = (axis + 1) % 3, v = (axis + 2) % 3;
+		const unsigned int base = (unsigned int)(m_boxVertices.size() / 3);
+		for (int c = 0; c < 4; c++)
+		{
+			float p[3];
+			p[axis] = plane;
+			p[u] = (c & 1) ? max[u] : min[u];
+			p[v] = (c & 2) ? max[v] : min[v];
+			m_boxVertices.insert(m_boxVertices.end(), p, p + 3);
+		}
+		const unsigned int quad[6] = { base, base + 1, base + 2, base + 2, base + 1, base + 3 };
+		m_boxIndices.insert(m_boxIndices.end(), quad, quad + 6);
+	}
+}
+
+// the pixels of the row whose centers the edges may let in, false if none
+static inline bool getRowSpan(const float edges[3][3], const float spans[3][2], const int bounds[4], float cy, int& left, int& right)
+{
+	float lo = (float)bounds[0], hi = (float)bounds[2];
+	for (int e = 0; e < 3; e++)
+	{
+		// a * (x + 0.5) + b * cy + c >= 0
+		const float a = edges[e][0];
+		if (a > 0)
+			lo = std::max(lo, spans[e][0] * cy + spans[e][1]);
+		else if (a < 0)
+			hi = std::min(hi, spans[e][0] * cy + spans[e][1]);
+		else if (edges[e][1] * cy + edges[e][2] < 0)
+			return false;
+	}
+	// a pixel either way, the edge test decides
+	left = std::max((int)floorf(lo), bounds[0]);
+	right = std::min((int)ceilf(hi), bounds[2]);
+	return left <= right;
+}
+
+bool OcclusionBuffer::setupTriangle(const float sx[3], const float sy[3], const float sz[3], bool inner, ScreenTriangle& tri) const
+{
+	int v[3] = { 0, 1, 2 };
+	float area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sx[2] - sx[0]) * (sy[1] - sy[0]);
+	if (fabsf(area) < 1e-6f)
+		return false;
+	if (area < 0)
+	{
+		std::swap(v[1], v[2]);
+		area = -area;
+	}
+	// inner: the pixels [i, i + 1] within the triangle's bounds, outer: those touching them
+	const float minX = std::max(std::min(std::min(sx[0], sx[1]), sx[2]), -1.0f);
+	const float maxX = std::min(std::max(std::max(sx[0], sx[1]), sx[2]), (float)m_width + 1);
+	const float minY = std::max(std::min(std::min(sy[0], sy[1]), sy[2]), -1.0f);
+	const float maxY = std::min(std::max(std::max(sy[0], sy[1]), sy[2]), (float)m_height + 1);
+	tri.bounds[0] = std::max((int)(inner ? ceilf(minX) : floorf(minX)), 0);
+	tri.bounds[1] = std::max((int)(inner ? ceilf(minY) : floorf(minY)), 0);
+	tri.bounds[2] = std::min((int)(inner ? floorf(maxX) : ceilf(maxX)) - 1, m_width - 1);
+	tri.bounds[3] = std::min((int)(inner ? floorf(maxY) : ceilf(maxY)) - 1, m_height - 1);
+	if (tri.bounds[0] > tri.bounds[2] || tri.bounds[1] > tri.bounds[3])
+		return false;
+
+	// tested at the pixel centers, the edges moved in or out by half a pixel
+	const float grow = inner ? -0.5f : 0.5f;
+	for (int e = 0; e < 3; e++)
+	{
+		const int va = v[e], vb = v[(e + 1) % 3];
+		const float a = sy[va] - sy[vb];
+		const float b = sx[vb] - sx[va];
+		tri.edges[e][0] = a;
+		tri.edges[e][1] = b;
+		tri.edges[e][2] = -(a * sx[va] + b * sy[va]) + (fabsf(a) + fabsf(b)) * grow;
+		tri.spans[e][0] = a != 0 ? -b / a : 0;
+		tri.spans[e][1] = a != 0 ? -tri.edges[e][2] / a - 0.5f : 0;
+	}
+	// the farthest (inner) or the nearest (outer) the plane gets over the pixel around a center
+	const float dx1 = sx[v[1]] - sx[v[0]], dy1 = sy[v[1]] - sy[v[0]], dz1 = sz[v[1]] - sz[v[0]];
+	const float dx2 = sx[v[2]] - sx[v[0]], dy2 = sy[v[2]] - sy[v[0]], dz2 = sz[v[2]] - sz[v[0]];
+	const float a = (dz1 * dy2 - dz2 * dy1) / area;
+	const float b = (dz2 * dx1 - dz1 * dx2) / area;
+	tri.depth[0] = a;
+	tri.depth[1] = b;
+	tri.depth[2] = sz[v[0]] - a * sx[v[0]] - b * sy[v[0]] + (fabsf(a) + fabsf(b)) * grow;
+	tri.nearest = std::max(std::max(sz[0], sz[1]), sz[2]);
+	return true;
+}
+
+void OcclusionBuffer::setupTriangles(int thread, size_t begin, size_t end)
+{
+	ThreadBins& bins = m_bins[thread];
+	size_t first = 0;
+	for (size_t b = 0; b < m_batches.size() && first < end; first += m_batches[b++].triangleCount)
+	{
+		const Batch& batch = m_batches[b];
+		const size_t from = std::max(begin, first), to = std::min(end, first + batch.triangleCount);
+		for (size_t t = from; t < to; t++)
+		{
+			const unsigned int* index = batch.indices + (t - first) * 3;
+			float clip[3][4];
+			for (int i = 0; i < 3; i++)
+				transform(batch.vertices + index[i] * 3, clip[i]);
+
+			// clip against the near plane, which leaves up to 4 vertices
+			float poly[4][4];
+			int n = 0;
+			for (int i = 0; i < 3; i++)
+			{
+				const float* a = clip[i];
+				const float* b = clip[(i + 1) % 3];
+				if (a[3] >= m_nearW)
+					memcpy(poly[n++], a, sizeof(poly[0]));
+				if ((a[3] >= m_nearW) != (b[3] >= m_nearW))
+				{
+					const float s = (m_nearW - a[3]) / (b[3] - a[3]);
+					for (int k = 0; k < 4; k++)
+						poly[n][k] = a[k] + (b[k] - a[k]) * s;
+					n++;
+				}
+			}
+			if (n < 3)
+				continue;
+			if ((clip[0][0] > clip[0][3] && clip[1][0] > clip[1][3] && clip[2][0] > clip[2][3]) ||
+				(clip[0][0] < -clip[0][3] && clip[1][0] < -clip[1][3] && clip[2][0] < -clip[2][3]) ||
+				(clip[0][1] > clip[0][3] && clip[1][1] > clip[1][3] && clip[2][1] > clip[2][3]) ||
+				(clip[0][1] < -clip[0][3] && clip[1][1] < -clip[1][3] && clip[2][1] < -clip[2][3]))
+				continue;
+
+			float sx[4], sy[4], sz[4];
+			for (int i = 0; i < n; i++)
+			{
+				const float iw = 1.0f / poly[i][3];
+				sx[i] = (poly[i][0] * iw * 0.5f + 0.5f) * m_width;
+				sy[i] = (0.5f - poly[i][1] * iw * 0.5f) * m_height;
+				sz[i] = iw;
+			}
+			for (int f = 1; f + 1 < n; f++)
+			{
+				const float tx[3] = { sx[0], sx[f], sx[f + 1] };
+				const float ty[3] = { sy[0], sy[f], sy[f + 1] };
+				const float tz[3] = { sz[0], sz[f], sz[f + 1] };
+				ScreenTriangle tri;
+				if (!setupTriangle(tx, ty, tz, true, tri))
+					continue;
+				const unsigned int id = (unsigned int)bins.triangles.size();
+				bins.triangles.push_back(tri);
+				bins.rasterized++;
+				for (int ty = tri.bounds[1] / TileHeight; ty <= tri.bounds[3] / TileHeight; ty++)
+					for (int tx = tri.bounds[0] / TileWidth; tx <= tri.bounds[2] / TileWidth; tx++)
+						bins.tiles[ty * m_tilesX + tx].push_back(id);
+			}
+		}
+	}
+}
+
+void OcclusionBuffer::rasterizeTile(int tile)
+{
+	const int tileX = tile % m_tilesX, tileY = tile / m_tilesX;
+	const int left = tileX * TileWidth, top = tileY * TileHeight;
+	const int right = std::min(left + TileWidth, m_width) - 1, bottom = std::min(top + TileHeight, m_height) - 1;
+	float* depth = &m_levels[0][0];
+	for (int y = top; y <= bottom; y++)
+		std::fill(depth + (size_t)y * m_width + left, depth + (size_t)y * m_width + right + 1, 0.0f);
+
+	// the farthest of the tile, refreshed now and then; the triangles behind it are hidden
+	float tileFarthest = 0;
+	int sinceRefresh = 0;
+	for (size_t t = 0; t < m_bins.size(); t++)
+	{
+		const ThreadBins& bins = m_bins[t];
+		const std::vector<unsigned int>& ids = bins.tiles[tile];
+		for (size_t i = 0; i < ids.size(); i++)
+		{
+			const ScreenTriangle& tri = bins.triangles[ids[i]];
+			if (++sinceRefresh == 32)
+			{
+				sinceRefresh = 0;
+				tileFarthest = FLT_MAX;
+				for (int y = top; y <= bottom; y++)
+					tileFarthest = std::min(tileFarthest, *std::min_element(depth + (size_t)y * m_width + left, depth + (size_t)y * m_width + right + 1));
+			}
+			if (tri.nearest < tileFarthest)
+				continue;
+			// groups of 4 pixels, the tiles are 4 aligned; the edges reject what the spans let in
+			const int x0 = std::max(tri.bounds[0], left) & ~3, x1 = std::min(tri.bounds[2], right);
+			const int y0 = std::max(tri.bounds[1], top), y1 = std::min(tri.bounds[3], bottom);
+#ifdef TERRAIN_OCCLUSION_SSE2
+			const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+			const __m128 zero = _mm_setzero_ps();
+			__m128 ea[3], eb[3], ec[3];
+			for (int e = 0; e < 3; e++)
+			{
+				ea[e] = _mm_set1_ps(tri.edges[e][0]);
+				eb[e] = _mm_set1_ps(tri.edges[e][1]);
+				ec[e] = _mm_set1_ps(tri.edges[e][2]);
+			}
+			const __m128 da = _mm_set1_ps(tri.depth[0]), db = _mm_set1_ps(tri.depth[1]), dc = _mm_set1_ps(tri.depth[2]);
+			for (int y = y0; y <= y1; y++)
+			{
+				int spanLeft, spanRight;
+				if (!getRowSpan(tri.edges, tri.spans, tri.bounds, y + 0.5f, spanLeft, spanRight))
+					continue;
+				spanLeft = std::max(spanLeft & ~3, x0);
+				spanRight = std::min(spanRight, x1);
+				const __m128 cy = _mm_set1_ps(y + 0.5f);
+				float* row = depth + (size_t)y * m_width;
+				for (int x = spanLeft; x <= spanRight; x += 4)
+				{
+					const __m128 cx = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+					__m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ea[0], cx), _mm_mul_ps(eb[0], cy)), ec[0]), zero);
+					inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ea[1], cx), _mm_mul_ps(eb[1], cy)), ec[1]), zero));
+					inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ea[2], cx), _mm_mul_ps(eb[2], cy)), ec[2]), zero));
+					if (_mm_movemask_ps(inside) == 0)
+						continue;
+					const __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(da, cx), _mm_mul_ps(db, cy)), dc);
+					const __m128 old = _mm_loadu_ps(row + x);
+					// the nearest, i.e. the largest 1/w
+					_mm_storeu_ps(row + x, _mm_max_ps(old, _mm_and_ps(inside, z)));
+				}
+			}
+#else
+			for (int y = y0; y <= y1; y++)
+			{
+				int spanLeft, spanRight;
+				if (!getRowSpan(tri.edges, tri.spans, tri.bounds, y + 0.5f, spanLeft, spanRight))
+					continue;
+				const float cy = y + 0.5f;
+				float* row = depth + (size_t)y * m_width;
+				for (int x = std::max(spanLeft, x0); x <= std::min(spanRight, x1); x++)
+				{
+					const float cx = x + 0.5f;
+					bool inside = true;
+					for (int e = 0; e < 3 && inside; e++)
+						inside = tri.edges[e][0] * cx + tri.edges[e][1] * cy + tri.edges[e][2] >= 0;
+					if (inside)
+						row[x] = std::max(row[x], tri.depth[0] * cx + tri.depth[1] * cy + tri.depth[2]);
+				}
+			}
+#endif
+		}
+	}
+}
+
+void OcclusionBuffer::buildLevels()
+{
+	for (size_t l = 1; l < m_levels.size(); l++)
+	{
+		const std::vector<float>& src = m_levels[l - 1];
+		std::vector<float>& dst = m_levels[l];
+		const int sw = m_levelWidths[l - 1], sh = m_levelHeights[l - 1];
+		const int dw = m_levelWidths[l], dh = m_levelHeights[l];
+		for (int y = 0; y < dh; y++)
+		{
+			const int sy0 = y * 2, sy1 = std::min(y * 2 + 1, sh - 1);
+			for (int x = 0; x < dw; x++)
+			{
+				const int sx0 = x * 2, sx1 = std::min(x * 2 + 1, sw - 1);
+				// the farthest, i.e. the smallest 1/w
+				dst[(size_t)y * dw + x] = std::min(
+					std::min(src[(size_t)sy0 * sw + sx0], src[(size_t)sy0 * sw + sx1]),
+					std::min(src[(size_t)sy1 * sw + sx0], src[(size_t)sy1 * sw + sx1]));
+			}
+		}
+	}
+}
+
+void OcclusionBuffer::end()
+{
+	typedef std::chrono::steady_clock Clock;
+	const Clock::time_point start = Clock::now();
+
+	if (!m_boxIndices.empty())
+		addTriangles(&m_boxVertices[0], &m_boxIndices[0], m_boxIndices.size() / 3);
+	size_t triangleCount = 0;
+	for (size_t b = 0; b < m_batches.size(); b++)
+		triangleCount += m_batches[b].triangleCount;
+	for (size_t t = 0; t < m_bins.size(); t++)
+	{
+		m_bins[t].triangles.clear();
+		m_bins[t].tiles.resize((size_t)m_tilesX * m_tilesY);
+		for (size_t i = 0; i < m_bins[t].tiles.size(); i++)
+			m_bins[t].tiles[i].clear();
+		m_bins[t].rasterized = 0;
+	}
+
+	const int chunks = (int)((triangleCount + SetupChunk - 1) / SetupChunk);
+	runParallel(chunks, [this, triangleCount](int chunk, int thread) {
+		setupTriangles(thread, chunk * SetupChunk, std::min((chunk + 1) * SetupChunk, triangleCount));
+	});
+	runParallel(m_tilesX * m_tilesY, [this](int tile, int) {
+		rasterizeTile(tile);
+	});
+	buildLevels();
+
+	m_stats.triangles = triangleCount;
+	for (size_t t = 0; t < m_bins.size(); t++)
+		m_stats.rasterized += m_bins[t].rasterized;
+	m_stats.rasterMs = std::chrono::duration<double>(Clock::now() - start).count() * 1000.0;
+}
+
+bool OcclusionBuffer::isTriangleVisible(const ScreenTriangle& tri) const
+{
+	const float* depth = &m_levels[0][0];
+#ifdef TERRAIN_OCCLUSION_SSE2
+	const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+	const __m128 zero = _mm_setzero_ps();
+	__m128 ea[3], eb[3], ec[3];
+	for (int e = 0; e < 3; e++)
+	{
+		ea[e] = _mm_set1_ps(tri.edges[e][0]);
+		eb[e] = _mm_set1_ps(tri.edges[e][1]);
+		ec[e] = _mm_set1_ps(tri.edges[e][2]);
+	}
+	const __m128 da = _mm_set1_ps(tri.depth[0]), db = _mm_set1_ps(tri.depth[1]), dc = _mm_set1_ps(tri.depth[2]);
+	for (int y = tri.bounds[1]; y <= tri.bounds[3]; y++)
+	{
+		int spanLeft, spanRight;
+		if (!getRowSpan(tri.edges, tri.spans, tri.bounds, y + 0.5f, spanLeft, spanRight))
+			continue;
+		const __m128 cy = _mm_set1_ps(y + 0.5f);
+		const float* row = depth + (size_t)y * m_width;
+		for (int x = spanLeft & ~3; x <= spanRight; x += 4)
+		{
+			const __m128 cx = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+			__m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ea[0], cx), _mm_mul_ps(eb[0], cy)), ec[0]), zero);
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ea[1], cx), _mm_mul_ps(eb[1], cy)), ec[1]), zero));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ea[2], cx), _mm_mul_ps(eb[2], cy)), ec[2]), zero));
+			const __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(da, cx), _mm_mul_ps(db, cy)), dc);
+			// as near as the occluder or nearer
+			if (_mm_movemask_ps(_mm_and_ps(inside, _mm_cmpge_ps(z, _mm_loadu_ps(row + x)))))
+				return true;
+		}
+	}
+#else
+	for (int y = tri.bounds[1]; y <= tri.bounds[3]; y++)
+	{
+		int spanLeft, spanRight;
+		if (!getRowSpan(tri.edges, tri.spans, tri.bounds, y + 0.5f, spanLeft, spanRight))
+			continue;
+		const float cy = y + 0.5f;
+		const float* row = depth + (size_t)y * m_width;
+		for (int x = spanLeft; x <= spanRight; x++)
+		{
+			const float cx = x + 0.5f;
+			bool inside = true;
+			for (int e = 0; e < 3 && inside; e++)
+				inside = tri.edges[e][0] * cx + tri.edges[e][1] * cy + tri.edges[e][2] >= 0;
+			if (inside && tri.depth[0] * cx + tri.depth[1] * cy + tri.depth[2] >= row[x])
+				return true;
+		}
+	}
+#endif
+	return false;
+}
+
+bool OcclusionBuffer::isOccluded(const float min[3], const float max[3]) const
+{
+	float sx[8], sy[8], sz[8];
+	float minSX = 1e30f, minSY = 1e30f, maxSX = -1e30f, maxSY = -1e30f, maxSZ = 0;
+	for (int c = 0; c < 8; c++)
+	{
+		const float p[3] = { (c & 1) ? max[0] : min[0], (c & 2) ? max[1] : min[1], (c & 4) ? max[2] : min[2] };
+		float clip[4];
+		transform(p, clip);
+		// crossing the near plane, in front of everything
+		if (clip[3] < m_nearW)
+			return false;
+		sz[c] = 1.0f / clip[3];
+		sx[c] = (clip[0] * sz[c] * 0.5f + 0.5f) * m_width;
+		sy[c] = (0.5f - clip[1] * sz[c] * 0.5f) * m_height;
+		minSX = std::min(minSX, sx[c]);
+		maxSX = std::max(maxSX, sx[c]);
+		minSY = std::min(minSY, sy[c]);
+		maxSY = std::max(maxSY, sy[c]);
+		maxSZ = std::max(maxSZ, sz[c]);
+	}
+	// the parts off the screen are not seen anyway
+	if (maxSX < 0 || maxSY < 0 || minSX >= m_width || minSY >= m_height)
+		return false;
+
+	// First the rectangle around the box at its nearest against the Hi-Z level where it spans up to 8x8 texels,
+	// enough for the boxes behind a wall
+	int x0 = std::max((int)floorf(minSX), 0), x1 = std::min((int)floorf(maxSX), m_width - 1);
+	int y0 = std::max((int)floorf(minSY), 0), y1 = std::min((int)floorf(maxSY), m_height - 1);
+	size_t l = 0;
+	while (l + 1 < m_levels.size() && (x1 - x0 > 7 || y1 - y0 > 7))
+	{
+		x0 >>= 1; x1 >>= 1;
+		y0 >>= 1; y1 >>= 1;
+		l++;
+	}
+	const std::vector<float>& level = m_levels[l];
+	const int w = m_levelWidths[l];
+	bool hidden = true;
+	for (int y = y0; y <= y1 && hidden; y++)
+		for (int x = x0; x <= x1 && hidden; x++)
+			hidden = level[(size_t)y * w + x] > maxSZ;
+	if (hidden)
+		return true;
+
+	// Then the faces of the box pixel by pixel, as the rectangle of a wide flat node takes in much sky:
+	// every pixel a face touches, at the face's nearest over the pixel
+	static const int faces[6][4] = {
+		{ 0, 2, 4, 6 }, { 1, 3, 5, 7 }, { 0, 1, 4, 5 }, { 2, 3, 6, 7 }, { 0, 1, 2, 3 }, { 4, 5, 6, 7 } };
+	for (int f = 0; f < 6; f++)
+	{
+		for (int t = 0; t < 2; t++)
+		{
+			const int a = faces[f][0], b = faces[f][t ? 3 : 1], c = faces[f][t ? 2 : 3];
+			const float tx[3] = { sx[a], sx[b], sx[c] };
+			const float ty[3] = { sy[a], sy[b], sy[c] };
+			const float tz[3] = { sz[a], sz[b], sz[c] };
+			ScreenTriangle tri;
+			if (setupTriangle(tx, ty, tz, false, tri) && isTriangleVisible(tri))
+				return false;
+		}
+	}
+	return true;
+}
+
+bool OcclusionBuffer::isOffScreen(const float min[3], const float max[3]) const
+{
+	int outside[5] = { 0, 0, 0, 0, 0 };
+	for (int c = 0; c < 8; c++)
+	{
+		const float p[3] = { (c & 1) ? max[0] : min[0], (c & 2) ? max[1] : min[1], (c & 4) ? max[2] : min[2] };
+		float clip[4];
+		transform(p, clip);
+		outside[0] += clip[0] < -clip[3];
+		outside[1] += clip[0] > clip[3];
+		outside[2] += clip[1] < -clip[3];
+		outside[3] += clip[1] > clip[3];
+		outside[4] += clip[3] < m_nearW;
+	}
+	for (int i = 0; i < 5; i++)
+		if (outside[i] == 8)
+			return true;
+	return false;
+}
+
+// world min and max of a node of the blended surface
+static void getNodeHeights(const TerrainQuerySource& src, int level, unsigned int ix, unsigned int iz, float& minY, float& maxY)
+{
+	const unsigned int n = src.params.nGridX >> level;
+	const HeightMinMax& h1 = (*src.pyramids[0])[level][iz * n + ix];
+	float lo = h1.minY, hi = h1.maxY;
+	if (src.pyramids[1] && src.blendRatio < 1.0f)
+	{
+		const HeightMinMax& h2 = (*src.pyramids[1])[level][iz * n + ix];
+		lo = h2.minY + (lo - h2.minY) * src.blendRatio;
+		hi = h2.maxY + (hi - h2.maxY) * src.blendRatio;
+	}
+	minY = lo * src.sizeY / 65535.0f + src.minY;
+	maxY = hi * src.sizeY / 65535.0f + src.minY;
+}
+
+// lowest blended height of the pixels in the rectangle, inclusive
+static float getPixelMin(const TerrainQuerySource& src, int left, int top, int right, int bottom)
+{
+	left = std::max(left, 0);
+	top = std::max(top, 0);
+	right = std::min(right, (int)src.width - 1);
+	bottom = std::min(bottom, (int)src.height - 1);
+	const bool blend = src.heights[1] && src.blendRatio < 1.0f;
+	float layerMin[2] = { 65535, 65535 };
+	for (int layer = 0; layer < (blend ? 2 : 1); layer++)
+	{
+		for (int iz = top; iz <= bottom; iz++)
+		{
+			const unsigned short* row = src.heights[layer] + (size_t)iz * src.width;
+			for (int ix = left; ix <= right; ix++)
+				layerMin[layer] = std::min(layerMin[layer], (float)row[ix]);
+		}
+	}
+	const float h = blend ? layerMin[1] + (layerMin[0] - layerMin[1]) * src.blendRatio : layerMin[0];
+	return h * src.sizeY / 65535.0f + src.minY;
+}
+
+struct TerrainOccluderWalk
+{
+	OcclusionBuffer* buffer;
+	const TerrainQuerySource* src;
+	const TerrainOccluderParams* params;
+	int cellShift;		// a patch has 2^cellShift pairs of cells on a side
+	size_t boxes;
+};
+
+// bottom: the min of the parent, the side faces below it are behind the neighbors' anyway
+static void addTerrainOccluders(TerrainOccluderWalk& walk, int level, unsigned int ix, unsigned int iz, float bottom)
+{
+	const TerrainQuerySource& src = *walk.src;
+	const TerrainOccluderParams& params = *walk.params;
+	if (walk.boxes >= params.maxBoxes)
+		return;
+	float boxMin[3], boxMax[3];
+	boxMin[0] = src.minX + (ix << level) * src.gridSizeX;
+	boxMin[2] = src.minZ + (iz << level) * src.gridSizeZ;
+	boxMax[0] = boxMin[0] + (1 << level) * src.gridSizeX;
+	boxMax[2] = boxMin[2] + (1 << level) * src.gridSizeZ;
+	getNodeHeights(src, level, ix, iz, boxMin[1], boxMax[1]);
+	if (walk.buffer->isOffScreen(boxMin, boxMax))
+		return;
+
+	float sqDist = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		const float d = std::max(std::max(boxMin[i] - params.eye[i], params.eye[i] - boxMax[i]), 0.0f);
+		sqDist += d * d;
+	}
+	// the coarsest LOD level LOD_select may draw here: it refines every node within the range of the next finer level
+	int drawnLevel = 0;
+	while (drawnLevel + 1 < src.params.lodLevelCount && sqDist > params.sqRanges[drawnLevel])
+		drawnLevel++;
+	const float width = (1 << level) * std::max(src.gridSizeX, src.gridSizeZ);
+	if (level > 0 && level - 1 >= drawnLevel - walk.cellShift && width > params.splitRatio * sqrtf(sqDist))
+	{
+		// nearest first
+		const int nearest = (params.eye[0] >= (boxMin[0] + boxMax[0]) * 0.5f ? 1 : 0) | (params.eye[2] >= (boxMin[2] + boxMax[2]) * 0.5f ? 2 : 0);
+		for (int i = 0; i < 4; i++)
+		{
+			const int q = nearest ^ i;
+			addTerrainOccluders(walk, level - 1, ix * 2 + (q & 1), iz * 2 + (q >> 1), boxMin[1]);
+		}
+		return;
+	}
+	const float sqLimit = params.splitRatio * params.splitRatio * sqDist;
+	if (level == 0 && width * width > sqLimit)
+	{
+		// Pixel blocks of at least two cells of the drawn mesh, one pixel around for the filtering
+		const float minPixels = 2.0f * (1 << drawnLevel) * src.params.nPixelX / (src.params.gridDim - 1);
+		const float pixelWidth = width / src.params.nPixelX;
+		int block = 1;
+		while (block < src.params.nPixelX && (block < minPixels || block * block * pixelWidth * pixelWidth > sqLimit))
+			block *= 2;
+		if (block < src.params.nPixelX)
+		{
+			const int left = ix * src.params.nPixelX, top = iz * src.params.nPixelZ;
+			const float blockX = src.gridSizeX * block / src.params.nPixelX, blockZ = src.gridSizeZ * block / src.params.nPixelZ;
+			// from the eye's side
+			const int countX = src.params.nPixelX / block, countZ = src.params.nPixelZ / block;
+			const bool flipX = params.eye[0] > (boxMin[0] + boxMax[0]) * 0.5f, flipZ = params.eye[2] > (boxMin[2] + boxMax[2]) * 0.5f;
+			for (int jz = 0; jz < countZ; jz++)
+			{
+				const int bz = (flipZ ? countZ - 1 - jz : jz) * block;
+				for (int jx = 0; jx < countX; jx++)
+				{
+					const int bx = (flipX ? countX - 1 - jx : jx) * block;
+					const float minY = getPixelMin(src, left + bx - 1, top + bz - 1, left + bx + block + 1, top + bz + block + 1);
+					const float columnMin[3] = { boxMin[0] + bx / block * blockX, std::min(boxMin[1], minY), boxMin[2] + bz / block * blockZ };
+					const float columnMax[3] = { columnMin[0] + blockX, minY, columnMin[2] + blockZ };
+					walk.buffer->addBox(columnMin, columnMax, params.eye);
+					walk.boxes++;
+				}
+			}
+			return;
+		}
+	}
+	const float columnMin[3] = { boxMin[0], std::min(bottom, boxMin[1]), boxMin[2] };
+	const float columnMax[3] = { boxMax[0], boxMin[1], boxMax[2] };
+	walk.buffer->addBox(columnMin, columnMax, params.eye);
+	walk.boxes++;
+}
+
+size_t addTerrainOccluders(OcclusionBuffer& buffer, const TerrainQuerySource& src, const TerrainOccluderParams& params)
+{
+	// The eye has to be above the drawn surface, by more than the near plane: the pixels within the near
+	// distance and two cells of the finest mesh, the morph and the interpolation of the vertices
+	const float pixelX = src.gridSizeX / src.params.nPixelX, pixelZ = src.gridSizeZ / src.params.nPixelZ;
+	const float radius = params.nearDistance + 2.0f * std::max(src.gridSizeX, src.gridSizeZ) / (src.params.gridDim - 1);
+	const int left = std::max((int)floorf((params.eye[0] - radius - src.minX) / pixelX), 0);
+	const int right = std::min((int)ceilf((params.eye[0] + radius - src.minX) / pixelX), (int)src.width - 1);
+	const int top = std::max((int)floorf((params.eye[2] - radius - src.minZ) / pixelZ), 0);
+	const int bottom = std::min((int)ceilf((params.eye[2] + radius - src.minZ) / pixelZ), (int)src.height - 1);
+	float maxY = -FLT_MAX;
+	for (int iz = top; iz <= bottom; iz++)
+	{
+		for (int ix = left; ix <= right; ix++)
+		{
+			const size_t i = (size_t)iz * src.width + ix;
+			float h = src.heights[0][i];
+			if (src.heights[1] && src.blendRatio < 1.0f)
+				h = src.heights[1][i] + (h - src.heights[1][i]) * src.blendRatio;
+			maxY = std::max(maxY, h * src.sizeY / 65535.0f + src.minY);
+		}
+	}
+	if (params.eye[1] - params.nearDistance <= maxY)
+		return 0;
+
+	TerrainOccluderWalk walk;
+	walk.buffer = &buffer;
+	walk.src = &src;
+	walk.params = &params;
+	walk.cellShift = 0;
+	while ((2 << walk.cellShift) < src.params.gridDim - 1)
+		walk.cellShift++;
+	walk.boxes = 0;
+	const int level = src.params.lodLevelCount - 1;
+	const unsigned int nX = src.params.nGridX >> level, nZ = src.params.nGridZ >> level;
+	for (unsigned int iz = 0; iz < nZ; iz++)
+		for (unsigned int ix = 0; ix < nX; ix++)
+			addTerrainOccluders(walk, level, ix, iz, src.minY);
+	return walk.boxes;
+}
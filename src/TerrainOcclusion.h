@@ -0,0 +1,138 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "TerrainQuery.h"
+
+// Software occlusion buffer with a hierarchical depth pyramid (no Ogre dependency)
+//
+// Occluders are rasterized at low resolution into a buffer of 1/w, the reciprocal view depth, which is linear
+// in screen space whatever the projection's z range. Only the pixels an occluder covers whole are written,
+// each with the farthest depth the occluder has over the pixel, so a box found behind the buffer is hidden
+// for sure. The triangles are transformed and binned into screen tiles, then the tiles are rasterized,
+// both spread over a pool of threads. The Hi-Z levels keep the farthest depth of each block of pixels.
+class OcclusionBuffer
+{
+public:
+	struct Stats
+	{
+		size_t triangles;		// submitted, boxes included
+		size_t rasterized;		// left after the near plane clipping and the screen and size rejects
+		double rasterMs;		// of end()
+	};
+
+private:
+	struct Batch
+	{
+		const float* vertices;			// x, y, z
+		const unsigned int* indices;	// 3 per triangle
+		size_t triangleCount;
+	};
+	struct ScreenTriangle
+	{
+		float edges[3][3];		// a * x + b * y + c >= 0 inside
+		float depth[3];			// 1/w plane
+		float spans[3][2];		// x of the pixel center on each edge at a row: slope and offset by the row's center
+		float nearest;			// largest 1/w of the vertices
+		int bounds[4];			// pixels, inclusive: left, top, right, bottom
+	};
+	struct ThreadBins
+	{
+		std::vector<ScreenTriangle> triangles;
+		std::vector<std::vector<unsigned int> > tiles;	// triangles overlapping each tile
+		size_t rasterized;
+	};
+
+	int m_width;			// multiple of 4
+	int m_height;
+	int m_tilesX;
+	int m_tilesY;
+	float m_viewProj[16];	// row-major, of column vectors
+	float m_nearW;			// clipping plane, w >= m_nearW
+	std::vector<Batch> m_batches;
+	std::vector<float> m_boxVertices;
+	std::vector<unsigned int> m_boxIndices;
+	std::vector<ThreadBins> m_bins;
+	// level 0 is the buffer, each next level half the size
+	std::vector<std::vector<float> > m_levels;
+	std::vector<int> m_levelWidths;
+	std::vector<int> m_levelHeights;
+	Stats m_stats;
+
+	// workers besides the calling thread, they take the items of a job from a shared counter
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::condition_variable m_doneCond;
+	std::function<void(int, int)> m_job;	// (item, thread)
+	int m_jobItems;
+	int m_nextItem;
+	int m_busyWorkers;
+	unsigned int m_jobGeneration;
+	bool m_quit;
+
+	void workerMain(int thread);
+	void runParallel(int items, const std::function<void(int, int)>& job);
+	void takeItems(int thread);
+
+	// false if the triangle covers no pixel; inner takes the pixels it covers whole at their farthest,
+	// outer those it touches at their nearest
+	bool setupTriangle(const float sx[3], const float sy[3], const float sz[3], bool inner, ScreenTriangle& tri) const;
+	void setupTriangles(int thread, size_t begin, size_t end);
+	void rasterizeTile(int tile);
+	void buildLevels();
+	// true if the outer triangle is as near as the buffer somewhere
+	bool isTriangleVisible(const ScreenTriangle& tri) const;
+	void transform(const float p[3], float clip[4]) const;
+
+public:
+	// a width of 256 to 512 pixels is enough for culling; threadCount workers besides the calling thread
+	OcclusionBuffer(int width = 256, int height = 128, int threadCount = 0);
+	~OcclusionBuffer();
+
+	void resize(int width, int height);
+	int getWidth() const { return m_width; }
+	int getHeight() const { return m_height; }
+	int getThreadCount() const { return (int)m_workers.size(); }
+
+	// starts a frame: row-major view-projection matrix of column vectors, with w the view depth, and the near plane
+	void begin(const float viewProj[16], float nearDistance);
+	// World space triangles, double sided; the arrays are read by end() and have to stay until then.
+	// Only solid and drawn things occlude: an occluder that can be seen through hides what is behind it.
+	// Roughly front to back is faster, what is behind the occluders drawn already is skipped.
+	void addTriangles(const float* vertices, const unsigned int* indices, size_t triangleCount);
+	// an axis aligned solid box, its faces toward the eye
+	void addBox(const float min[3], const float max[3], const float eye[3]);
+	// rasterizes the occluders and builds the Hi-Z levels
+	void end();
+
+	// true if the box is hidden behind the occluders of the last end()
+	bool isOccluded(const float min[3], const float max[3]) const;
+	// true if the box is wholly out of the view
+	bool isOffScreen(const float min[3], const float max[3]) const;
+
+	const Stats& getStats() const { return m_stats; }
+	// 1/w of the nearest occluder per pixel, 0 where there is none
+	const float* getDepth() const { return &m_levels[0][0]; }
+};
+
+// Occluders from the min/max pyramid: the column under the min height of each node, inside the terrain wherever
+// it is drawn, so a ray into a column has crossed the surface before. The nodes near the eye are split finer,
+// but never below half the mesh cells of the LOD the renderer may draw them at, as the drawn surface dips under
+// the min of a piece smaller than its triangles.
+struct TerrainOccluderParams
+{
+	float eye[3];
+	float nearDistance;
+	const float* sqRanges;		// of the LOD levels, as LOD_select uses them
+	float splitRatio;			// split the nodes wider than this times their distance
+	size_t maxBoxes;
+};
+
+// The boxes added, 0 if the eye is not above the surface around it, i.e. the columns can't be trusted.
+// The heights have to be in RAM for that check.
+size_t addTerrainOccluders(OcclusionBuffer& buffer, const TerrainQuerySource& src, const TerrainOccluderParams& params);
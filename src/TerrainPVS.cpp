@@ -0,0 +1,183 @@
+#include "TerrainPVS.h"
+#include <cstdio>
+#include <cstring>
+
+size_t getPVSNodeCount(int lodLevelCount)
+{
+	return getPVSNodeIndex(lodLevelCount, lodLevelCount, 0, 0);
+}
+
+size_t getPVSNodeIndex(int lodLevelCount, int lodLevel, unsigned int ix, unsigned int iz)
+{
+	// the levels below have 4 times the nodes each
+	size_t offset = 0;
+	for (int l = 0; l < lodLevel; l++)
+	{
+		const size_t n = (size_t)1 << (lodLevelCount - 1 - l);
+		offset += n * n;
+	}
+	const size_t n = lodLevel < lodLevelCount ? (size_t)1 << (lodLevelCount - 1 - lodLevel) : 0;
+	return offset + iz * n + ix;
+}
+
+struct PVSBitWriter
+{
+	std::vector<unsigned char>& data;
+	int bit;
+
+	PVSBitWriter(std::vector<unsigned char>& d) : data(d), bit(8) {}
+	void write(bool value)
+	{
+		if (bit == 8)
+		{
+			data.push_back(0);
+			bit = 0;
+		}
+		if (value)
+			data.back() |= (unsigned char)(1 << bit);
+		bit++;
+	}
+};
+
+struct PVSBitReader
+{
+	const unsigned char* data;
+	const unsigned char* end;
+	int bit;
+
+	PVSBitReader(const unsigned char* begin, const unsigned char* e) : data(begin), end(e), bit(0) {}
+	// false past the end, for a truncated cell
+	bool read()
+	{
+		if (data == end)
+			return false;
+		const bool value = (*data >> bit) & 1;
+		if (++bit == 8)
+		{
+			bit = 0;
+			data++;
+		}
+		return value;
+	}
+};
+
+static void encodeNode(int lodLevelCount, const unsigned char* flags, int lodLevel, unsigned int ix, unsigned int iz, bool drawn,
+	PVSBitWriter& bits)
+{
+	const unsigned char f = flags[getPVSNodeIndex(lodLevelCount, lodLevel, ix, iz)];
+	drawn |= (f & PVSDrawn) != 0;
+	const bool visible = drawn || (f & PVSReached);
+	bits.write(visible);
+	if (!visible || lodLevel == 0)
+		return;
+	const bool refined = (f & PVSRefined) != 0;
+	bits.write(refined);
+	if (!refined)
+		return;
+	for (int q = 0; q < 4; q++)
+		encodeNode(lodLevelCount, flags, lodLevel - 1, ix * 2 + (q & 1), iz * 2 + (q >> 1), drawn, bits);
+}
+
+void encodePVSCell(int lodLevelCount, const unsigned char* flags, std::vector<unsigned char>& data)
+{
+	PVSBitWriter bits(data);
+	encodeNode(lodLevelCount, flags, lodLevelCount - 1, 0, 0, false, bits);
+}
+
+bool writePVS(const char* path, const TerrainPVSHeader& header, const std::vector<std::vector<unsigned char> >& cells)
+{
+	TerrainPVSHeader h = header;
+	memcpy(h.magic, TERRAIN_PVS_MAGIC, 4);
+	h.version = TERRAIN_PVS_VERSION;
+	std::vector<unsigned int> offsets(1, 0);
+	for (size_t i = 0; i < cells.size(); i++)
+		offsets.push_back(offsets.back() + (unsigned int)cells[i].size());
+	h.dataSize = offsets.back();
+
+	FILE* fp = fopen(path, "wb");
+	if (!fp)
+		return false;
+	bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 && fwrite(&offsets[0], sizeof(unsigned int), offsets.size(), fp) == offsets.size();
+	for (size_t i = 0; i < cells.size() && ok; i++)
+		ok = cells[i].empty() || fwrite(&cells[i][0], 1, cells[i].size(), fp) == cells[i].size();
+	return fclose(fp) == 0 && ok;
+}
+
+TerrainPVS::TerrainPVS()
+{
+	memset(&m_header, 0, sizeof(m_header));
+}
+
+bool TerrainPVS::load(const char* path)
+{
+	clear();
+	FILE* fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+	TerrainPVSHeader h;
+	bool ok = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, TERRAIN_PVS_MAGIC, 4) == 0 && h.version == TERRAIN_PVS_VERSION &&
+		h.lodLevelCount > 0 && h.lodLevelCount <= 16 && h.cellsX > 0 && h.cellsZ > 0;
+	std::vector<unsigned int> offsets;
+	std::vector<unsigned char> data;
+	if (ok)
+	{
+		offsets.resize((size_t)h.cellsX * h.cellsZ + 1);
+		data.resize(h.dataSize);
+		ok = fread(&offsets[0], sizeof(unsigned int), offsets.size(), fp) == offsets.size() &&
+			(data.empty() || fread(&data[0], 1, data.size(), fp) == data.size()) && offsets.back() == h.dataSize;
+		for (size_t i = 1; i < offsets.size() && ok; i++)
+			ok = offsets[i - 1] <= offsets[i];
+	}
+	fclose(fp);
+	if (!ok)
+		return false;
+	m_header = h;
+	m_offsets.swap(offsets);
+	m_data.swap(data);
+	return true;
+}
+
+void TerrainPVS::clear()
+{
+	memset(&m_header, 0, sizeof(m_header));
+	m_offsets.clear();
+	m_data.clear();
+}
+
+int TerrainPVS::findCell(float x, float z) const
+{
+	if (!isLoaded())
+		return -1;
+	const float u = (x - m_header.minX) / m_header.sizeX, v = (z - m_header.minZ) / m_header.sizeZ;
+	if (!(u >= 0 && u < 1 && v >= 0 && v < 1))
+		return -1;
+	return (int)(v * m_header.cellsZ) * m_header.cellsX + (int)(u * m_header.cellsX);
+}
+
+static void decodeNode(int lodLevelCount, int lodLevel, unsigned int ix, unsigned int iz, PVSBitReader& bits, std::vector<unsigned char>& states)
+{
+	unsigned char& state = states[getPVSNodeIndex(lodLevelCount, lodLevel, ix, iz)];
+	if (!bits.read())
+	{
+		state = TerrainPVS::Hidden;
+		return;
+	}
+	if (lodLevel == 0 || !bits.read())
+	{
+		state = TerrainPVS::Visible;
+		return;
+	}
+	state = TerrainPVS::VisibleRefined;
+	for (int q = 0; q < 4; q++)
+		decodeNode(lodLevelCount, lodLevel - 1, ix * 2 + (q & 1), iz * 2 + (q >> 1), bits, states);
+}
+
+void TerrainPVS::decodeCell(int cell, std::vector<unsigned char>& states) const
+{
+	const int levels = (int)m_header.lodLevelCount;
+	states.assign(getPVSNodeCount(levels), Unknown);
+	if (cell < 0 || (size_t)cell >= getCellCount())
+		return;
+	PVSBitReader bits(&m_data[0] + m_offsets[cell], &m_data[0] + m_offsets[cell + 1]);
+	decodeNode(levels, levels - 1, 0, 0, bits, states);
+}
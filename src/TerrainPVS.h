@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// Potentially visible sets of the quadtree nodes per viewpoint cell (*.pvs), shared by the runtime and the
+// offline tool (no Ogre dependency)
+//
+//   TerrainPVSHeader
+//   unsigned int cellOffsets[cellsX * cellsZ + 1], in bytes from the start of the cell data
+//   cell data
+//
+// The map is split into cells, each baked from a few sample viewpoints over it. A node is visible for a cell if
+// any sample sees some of its area: the selection from there reaches it without culling it, or draws an ancestor
+// over it. A cell is a preorder walk of the quadtree with a bit per node, visible, and one more for the visible
+// nodes above level 0, refined: some sample went on to the children, whose bits follow. The nodes of the other
+// subtrees are not stored, their area is seen whole or not at all, so a cell takes bits along the visible cut.
+// The sets are exact at the samples only. All values are little-endian.
+
+#define TERRAIN_PVS_MAGIC	"CPVS"
+#define TERRAIN_PVS_VERSION	1
+
+struct TerrainPVSHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned int lodLevelCount;		// of the quadtree the nodes are in
+	unsigned int cellsX;
+	unsigned int cellsZ;
+	unsigned int samplesPerCell;	// viewpoints on a side of a cell
+	float minX, minZ;				// the cells cover the map
+	float sizeX, sizeZ;
+	float eyeHeight;				// of the viewpoints over the surface
+	unsigned int dataSize;			// bytes of cell data
+};
+
+// the flags the samples leave on the nodes when baking
+enum TerrainPVSFlags
+{
+	PVSReached = 1,		// reached and not culled
+	PVSRefined = 2,		// the children were visited
+	PVSDrawn = 4,		// all of the area was drawn by the node or an ancestor
+};
+
+// the flags or states of the nodes of all levels, level 0 first, as in the min/max pyramid
+size_t getPVSNodeCount(int lodLevelCount);
+size_t getPVSNodeIndex(int lodLevelCount, int lodLevel, unsigned int ix, unsigned int iz);
+
+// appends the bits of a cell, padded to a byte, from the flags the samples left
+void encodePVSCell(int lodLevelCount, const unsigned char* flags, std::vector<unsigned char>& data);
+bool writePVS(const char* path, const TerrainPVSHeader& header, const std::vector<std::vector<unsigned char> >& cells);
+
+class TerrainPVS
+{
+public:
+	// per node after decoding a cell; Unknown for those not stored, visible if their ancestors are
+	enum NodeState
+	{
+		Unknown = 0,
+		Hidden,
+		Visible,
+		VisibleRefined,
+	};
+
+private:
+	TerrainPVSHeader m_header;
+	std::vector<unsigned int> m_offsets;
+	std::vector<unsigned char> m_data;
+
+public:
+	TerrainPVS();
+
+	bool load(const char* path);
+	void clear();
+	bool isLoaded() const { return !m_offsets.empty(); }
+	const TerrainPVSHeader& getHeader() const { return m_header; }
+	size_t getCellCount() const { return m_offsets.empty() ? 0 : m_offsets.size() - 1; }
+	size_t getCellSize(int cell) const { return m_offsets[cell + 1] - m_offsets[cell]; }
+
+	// the cell over a world position, -1 off the grid
+	int findCell(float x, float z) const;
+	// the NodeState of every node for the cell, indexed as getPVSNodeIndex
+	void decodeCell(int cell, std::vector<unsigned char>& states) const;
+};
@@ -0,0 +1,316 @@
+#include "TerrainPyramid.h"
+#include <cmath>
+#include <cfloat>
+#include <cassert>
+#include <algorithm>
+
+static const float _halfPi = 1.57079632679f;
+
+static inline float dot(const float a[3], const float b[3])
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static inline void normalise(float v[3])
+{
+	float len = sqrtf(dot(v, v));
+	if (len > 0)
+	{
+		v[0] /= len;
+		v[1] /= len;
+		v[2] /= len;
+	}
+}
+
+void encodeNormalCone(HeightMinMax* h, const float axis[3], float spread)
+{
+	if (spread >= _halfPi || axis[1] <= 0)
+	{
+		h->coneX = h->coneZ = 0;
+		h->coneSpread = NoNormalCone;
+		return;
+	}
+	h->coneX = (signed char)floorf(axis[0] * 127 + 0.5f);
+	h->coneZ = (signed char)floorf(axis[2] * 127 + 0.5f);
+	// widen the cone by the error of the quantized axis so that it stays conservative
+	float q[3];
+	q[0] = h->coneX / 127.0f;
+	q[2] = h->coneZ / 127.0f;
+	q[1] = sqrtf(std::max(0.0f, 1.0f - q[0] * q[0] - q[2] * q[2]));
+	float cosError = std::min(1.0f, dot(q, axis) / sqrtf(dot(q, q)));
+	spread += acosf(cosError);
+	float s = ceilf(spread / _halfPi * 255);
+	h->coneSpread = (unsigned char)std::min(s, (float)NoNormalCone);
+}
+
+bool decodeNormalCone(const HeightMinMax& h, float axis[3], float& spread)
+{
+	if (h.coneSpread == NoNormalCone)
+		return false;
+	axis[0] = h.coneX / 127.0f;
+	axis[2] = h.coneZ / 127.0f;
+	axis[1] = sqrtf(std::max(0.0f, 1.0f - axis[0] * axis[0] - axis[2] * axis[2]));
+	normalise(axis);
+	spread = h.coneSpread * _halfPi / 255;
+	return true;
+}
+
+// The cones bound the world space gradients (dy/dx, dy/dz) of the surface by a box rather than by the normals
+// themselves: a triangle of the mesh along the grid axes takes its x gradient from one edge and its z gradient from
+// another, which may lie in different pixel quads, so any pair of the x and z gradients over its area can occur.
+// This holds for the patches of every LOD level and for the blend of two layers.
+struct GradientBox
+{
+	float minX, maxX;
+	float minZ, maxZ;
+};
+
+// the normals of the corners bound those of the whole box, the normals of a convex set of gradients form a convex cone
+static void encodeGradientBox(HeightMinMax* h, const GradientBox& box)
+{
+	float corners[4][3] = {
+		{ -box.minX, 1.0f, -box.minZ }, { -box.maxX, 1.0f, -box.minZ },
+		{ -box.minX, 1.0f, -box.maxZ }, { -box.maxX, 1.0f, -box.maxZ },
+	};
+	float axis[3] = { 0, 0, 0 };
+	for(int i = 0; i < 4; i++)
+	{
+		normalise(corners[i]);
+		axis[0] += corners[i][0];
+		axis[1] += corners[i][1];
+		axis[2] += corners[i][2];
+	}
+	normalise(axis);
+	float minCos = 1.0f;
+	for(int i = 0; i < 4; i++)
+		minCos = std::min(minCos, dot(axis, corners[i]));
+	encodeNormalCone(h, axis, acosf(std::max(-1.0f, minCos)));
+}
+
+// range of -n[i] / n[1] over the directions n of the cone, from the planes through the other axis tangent to it
+static bool getGradientRange(float axisI, float axisY, float sinSpread, float& minG, float& maxG)
+{
+	const float a = axisY * axisY - sinSpread * sinSpread;
+	if (a <= 0)
+		return false;	// the cone reaches the horizon
+	const float root = sinSpread * sqrtf(std::max(0.0f, axisI * axisI + axisY * axisY - sinSpread * sinSpread));
+	minG = -(axisI * axisY + root) / a;
+	maxG = -(axisI * axisY - root) / a;
+	return true;
+}
+
+static bool decodeGradientBox(const HeightMinMax& h, GradientBox& box)
+{
+	float axis[3], spread;
+	if (!decodeNormalCone(h, axis, spread))
+		return false;
+	const float sinSpread = sinf(spread);
+	return getGradientRange(axis[0], axis[1], sinSpread, box.minX, box.maxX) &&
+		getGradientRange(axis[2], axis[1], sinSpread, box.minZ, box.maxZ);
+}
+
+void mergeNormalCones(HeightMinMax* h, const HeightMinMax* const cones[], int count)
+{
+	GradientBox box = { FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX };
+	for(int i = 0; i < count; i++)
+	{
+		GradientBox b;
+		if (!decodeGradientBox(*cones[i], b))
+		{
+			h->coneX = h->coneZ = 0;
+			h->coneSpread = NoNormalCone;
+			return;
+		}
+		box.minX = std::min(box.minX, b.minX);
+		box.maxX = std::max(box.maxX, b.maxX);
+		box.minZ = std::min(box.minZ, b.minZ);
+		box.maxZ = std::max(box.maxZ, b.maxZ);
+	}
+	encodeGradientBox(h, box);
+}
+
+// bilinear sample at a fractional pixel position
+static inline float sampleHeightmap(const unsigned short* pImgSrc, unsigned int width, float fx, float fz)
+{
+	int x0 = (int)fx;
+	int z0 = (int)fz;
+	float tx = fx - x0;
+	float tz = fz - z0;
+	// snap to the pixel so that the sample on the last row/column does not read past it
+	if (tx > 0.999f) { x0++; tx = 0; }
+	if (tz > 0.999f) { z0++; tz = 0; }
+	if (tx < 0.001f) tx = 0;
+	if (tz < 0.001f) tz = 0;
+	const unsigned short* p = pImgSrc + z0 * width + x0;
+	int dx = (tx > 0) ? 1 : 0;
+	int dz = (tz > 0) ? width : 0;
+	float top = p[0] + (p[dx] - p[0]) * tx;
+	float bottom = p[dz] + (p[dz + dx] - p[dz]) * tx;
+	return top + (bottom - top) * tz;
+}
+
+float computeGeometricError(const TerrainPyramidParams& p, const unsigned short* pImgSrc, unsigned int width, int lodLevel, size_t ix, size_t iz,
+	std::vector<float>& scratch)
+{
+	const int gridDim = p.gridDim;
+	const int nQuads = gridDim - 1;
+	const float nodePixelsX = (float)(p.nPixelX << lodLevel);
+	const float nodePixelsZ = (float)(p.nPixelZ << lodLevel);
+	const float x0 = ix * nodePixelsX;
+	const float z0 = iz * nodePixelsZ;
+	const float quadX = nodePixelsX / nQuads;
+	const float quadZ = nodePixelsZ / nQuads;
+
+	scratch.resize(gridDim * gridDim);
+	float* patch = &scratch[0];
+	for(int z = 0; z < gridDim; z++)
+		for(int x = 0; x < gridDim; x++)
+			patch[z * gridDim + x] = sampleHeightmap(pImgSrc, width, x0 + x * quadX, z0 + z * quadZ);
+
+	// sample points: all pixels at LOD level 0, otherwise the vertices of the child patches
+	const int nSamplesX = (lodLevel == 0) ? p.nPixelX : nQuads * 2;
+	const int nSamplesZ = (lodLevel == 0) ? p.nPixelZ : nQuads * 2;
+	const float stepX = nodePixelsX / nSamplesX;
+	const float stepZ = nodePixelsZ / nSamplesZ;
+	float maxError = 0;
+	for(int z = 0; z <= nSamplesZ; z++)
+	{
+		float pz = z * stepZ;
+		int qz = std::min((int)(pz / quadZ), nQuads - 1);
+		float tz = pz / quadZ - qz;
+		for(int x = 0; x <= nSamplesX; x++)
+		{
+			float px = x * stepX;
+			int qx = std::min((int)(px / quadX), nQuads - 1);
+			float tx = px / quadX - qx;
+			const float* q = &patch[qz * gridDim + qx];
+			float top = q[0] + (q[1] - q[0]) * tx;
+			float bottom = q[gridDim] + (q[gridDim + 1] - q[gridDim]) * tx;
+			float approx = top + (bottom - top) * tz;
+			float error = fabsf(sampleHeightmap(pImgSrc, width, x0 + px, z0 + pz) - approx);
+			if (error > maxError) maxError = error;
+		}
+	}
+	return maxError;
+}
+
+unsigned short toHeightError(float error)
+{
+	return (unsigned short)std::min(ceilf(error), 65535.0f);
+}
+
+// normal cone of a unit grid; the bilinear surface of a pixel quad has the gradients between those of its edges
+static void computeNormalCone(const TerrainPyramidParams& p, HeightMinMax* h, const unsigned short* pImgSrc, unsigned int width, size_t ix, size_t iz)
+{
+	int minDX = 65535, maxDX = -65535, minDZ = 65535, maxDZ = -65535;
+	for(int z=0; z<=p.nPixelZ; z++)
+	{
+		const unsigned short *pSrc = pImgSrc + (iz * p.nPixelZ + z) * width + ix * p.nPixelX;
+		for(int x=0; x<=p.nPixelX; x++, pSrc++)
+		{
+			if (x < p.nPixelX)
+			{
+				const int dx = pSrc[1] - pSrc[0];
+				minDX = std::min(minDX, dx);
+				maxDX = std::max(maxDX, dx);
+			}
+			if (z < p.nPixelZ)
+			{
+				const int dz = pSrc[width] - pSrc[0];
+				minDZ = std::min(minDZ, dz);
+				maxDZ = std::max(maxDZ, dz);
+			}
+		}
+	}
+	GradientBox box = { minDX * p.slopeX, maxDX * p.slopeX, minDZ * p.slopeZ, maxDZ * p.slopeZ };
+	encodeGradientBox(h, box);
+}
+
+void computeHeightMinMax(const TerrainPyramidParams& p, HeightMinMax* h, const unsigned short* pImgSrc, unsigned int width, size_t ix, size_t iz,
+	std::vector<float>& scratch)
+{
+	unsigned short minY = 65535;
+	unsigned short maxY = 0;
+	for(int z=0; z<=p.nPixelZ; z++)
+	{
+		const unsigned short *pSrc = pImgSrc + (iz * p.nPixelZ + z) * width + ix * p.nPixelX;
+		for(int x=0; x<=p.nPixelX; x++, pSrc++)
+		{
+			if (*pSrc < minY) minY = *pSrc;
+			if (*pSrc > maxY) maxY = *pSrc;
+		}
+	}
+	h->minY = minY;
+	h->maxY = maxY;
+	h->maxError = toHeightError(computeGeometricError(p, pImgSrc, width, 0, ix, iz, scratch));
+	computeNormalCone(p, h, pImgSrc, width, ix, iz);
+}
+
+void mergeHeightMinMax(HeightMinMax* h, const HeightMinMax* const children[4], float nodeError)
+{
+	unsigned short minY = children[0]->minY;
+	unsigned short maxY = children[0]->maxY;
+	for(int i = 1; i < 4; i++)
+	{
+		if (minY > children[i]->minY) minY = children[i]->minY;
+		if (maxY < children[i]->maxY) maxY = children[i]->maxY;
+	}
+	h->minY = minY;
+	h->maxY = maxY;
+
+	// accumulate the error of the children so that it never decreases toward the root
+	unsigned short childError = std::max(std::max(children[0]->maxError, children[1]->maxError), std::max(children[2]->maxError, children[3]->maxError));
+	h->maxError = toHeightError(nodeError + childError);
+
+	mergeNormalCones(h, children, 4);
+}
+
+void mergeHeightMinMax(const TerrainPyramidParams& p, HeightMinMax* h, const HeightMinMaxPyramid& pyramid, const unsigned short* pImgSrc, unsigned int width, int lodLevel, size_t ix, size_t iz,
+	std::vector<float>& scratch)
+{
+	const size_t nX = p.nGridX >> (lodLevel-1);
+	const HeightMinMax* lower = pyramid[lodLevel-1] + iz*2*nX + ix*2;
+	const HeightMinMax* children[4] = { &lower[0], &lower[1], &lower[nX], &lower[nX+1] };
+	mergeHeightMinMax(h, children, computeGeometricError(p, pImgSrc, width, lodLevel, ix, iz, scratch));
+}
+
+void buildHeightMinMax(const TerrainPyramidParams& p, const unsigned short* pImgSrc, unsigned int width, HeightMinMaxPyramid& pyramid)
+{
+	assert(pyramid.empty());
+
+	std::vector<float> scratch;
+	// check all the raw data for LOD level 0
+	HeightMinMax* h = new HeightMinMax[p.nGridX * p.nGridZ];
+	pyramid.push_back(h);
+	for(size_t iz=0; iz<p.nGridZ; iz++)
+	{
+		for(size_t ix=0; ix<p.nGridX; ix++, h++)
+		{
+			computeHeightMinMax(p, h, pImgSrc, width, ix, iz, scratch);
+		}
+	}
+
+	for(int lodLevel=1; lodLevel <p.lodLevelCount; lodLevel++)
+	{
+		unsigned int nGridX = p.nGridX >> lodLevel;
+		unsigned int nGridZ = p.nGridZ >> lodLevel;
+		h = new HeightMinMax[nGridX * nGridZ];
+		pyramid.push_back(h);
+		for(size_t iz=0; iz<nGridZ; iz++)
+		{
+			for(size_t ix=0; ix<nGridX; ix++, h++)
+			{
+				mergeHeightMinMax(p, h, pyramid, pImgSrc, width, lodLevel, ix, iz, scratch);
+			}
+		}
+	}
+}
+
+void freeHeightMinMax(HeightMinMaxPyramid& pyramid)
+{
+	while(pyramid.size())
+	{
+		delete [] pyramid.back();
+		pyramid.pop_back();
+	}
+}
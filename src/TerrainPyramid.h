@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include "HeightMinMax.h"
+
+// Min/max pyramid of a heightmap, shared by the runtime and the offline tools (no Ogre dependency)
+
+// one array per LOD level, from level 0 (unit grids) to the root
+typedef std::vector<HeightMinMax *> HeightMinMaxPyramid;
+
+struct TerrainPyramidParams
+{
+	unsigned int nGridX;	// unit grids of the heightmap on a side
+	unsigned int nGridZ;
+	int lodLevelCount;		// levels of the pyramid, nGridX >> (lodLevelCount - 1) nodes on a side at the top
+	int nPixelX;			// heightmap pixels per unit grid (neighboring grids share the border pixels)
+	int nPixelZ;
+	int gridDim;			// vertices of a node patch on a side
+	float slopeX;			// world space slope of one height unit over one pixel
+	float slopeZ;
+};
+
+// normal cone of the node in world space, y up; it bounds the normals of the triangles of the patches of the node
+// and of its descendants at any LOD, see TerrainPyramid.cpp
+static const unsigned char NoNormalCone = 255;
+void encodeNormalCone(HeightMinMax* h, const float axis[3], float spread);
+bool decodeNormalCone(const HeightMinMax& h, float axis[3], float& spread);
+// bounding cone of the given cones and of the surfaces combining them, e.g. the patch of their parent or a blend
+void mergeNormalCones(HeightMinMax* h, const HeightMinMax* const cones[], int count);
+
+unsigned short toHeightError(float error);
+// Max deviation of the patch of the node from the next finer data, i.e. the heightmap pixels for LOD level 0
+// and the vertices of the child patches for the others. The patch is approximated as a bilinear surface.
+// The scratch buffer holds the patch; pass the same one to a series of calls, one per thread, to save the allocations.
+float computeGeometricError(const TerrainPyramidParams& p, const unsigned short* pImgSrc, unsigned int width, int lodLevel, size_t ix, size_t iz,
+	std::vector<float>& scratch);
+
+// a unit grid from the heightmap
+void computeHeightMinMax(const TerrainPyramidParams& p, HeightMinMax* h, const unsigned short* pImgSrc, unsigned int width, size_t ix, size_t iz,
+	std::vector<float>& scratch);
+// a node from its four children and its own geometric error
+void mergeHeightMinMax(HeightMinMax* h, const HeightMinMax* const children[4], float nodeError);
+// a node from the level below in the pyramid and the heightmap
+void mergeHeightMinMax(const TerrainPyramidParams& p, HeightMinMax* h, const HeightMinMaxPyramid& pyramid, const unsigned short* pImgSrc, unsigned int width, int lodLevel, size_t ix, size_t iz,
+	std::vector<float>& scratch);
+
+void buildHeightMinMax(const TerrainPyramidParams& p, const unsigned short* pImgSrc, unsigned int width, HeightMinMaxPyramid& pyramid);
+void freeHeightMinMax(HeightMinMaxPyramid& pyramid);
@@ -0,0 +1,434 @@
+#include "TerrainQuery.h"
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TERRAIN_QUERY_SSE2
+#include <emmintrin.h>
+#endif
+
+// weights of hmap1 and hmap2 in the blended surface, 0 for a layer not to read
+static void getLayerWeights(const TerrainQuerySource& src, float weights[2])
+{
+	const float ratio = src.heights[1] ? std::min(std::max(src.blendRatio, 0.0f), 1.0f) : 1.0f;
+	weights[0] = ratio;
+	weights[1] = 1.0f - ratio;
+}
+
+static inline float samplePixels(const unsigned short* p, unsigned int width, float fu, float fv)
+{
+	const float top = p[0] + (p[1] - p[0]) * fu;
+	const float bottom = p[width] + (p[width + 1] - p[width]) * fu;
+	return top + (bottom - top) * fv;
+}
+
+void terrainHeightAt(const TerrainQuerySource& src, const float* x, const float* z, float* y, size_t count)
+{
+	float weights[2];
+	getLayerWeights(src, weights);
+	const float scaleX = src.params.nPixelX / src.gridSizeX;
+	const float scaleZ = src.params.nPixelZ / src.gridSizeZ;
+	const float scaleY = src.sizeY / 65535.0f;
+	const float maxU = (float)(src.width - 1);
+	const float maxV = (float)(src.height - 1);
+	// the last cell of a row or a column, so that the sample never reads past the image
+	const float lastU = (float)(src.width - 2);
+	const float lastV = (float)(src.height - 2);
+
+	size_t i = 0;
+#ifdef TERRAIN_QUERY_SSE2
+	const __m128 minX = _mm_set1_ps(src.minX), minZ = _mm_set1_ps(src.minZ);
+	const __m128 vScaleX = _mm_set1_ps(scaleX), vScaleZ = _mm_set1_ps(scaleZ);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 vMaxU = _mm_set1_ps(maxU), vMaxV = _mm_set1_ps(maxV);
+	const __m128 vLastU = _mm_set1_ps(lastU), vLastV = _mm_set1_ps(lastV);
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m128 u = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(x + i), minX), vScaleX), zero), vMaxU);
+		const __m128 v = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(z + i), minZ), vScaleZ), zero), vMaxV);
+		const __m128i iu = _mm_cvttps_epi32(_mm_min_ps(u, vLastU));
+		const __m128i iv = _mm_cvttps_epi32(_mm_min_ps(v, vLastV));
+		const __m128 fu = _mm_sub_ps(u, _mm_cvtepi32_ps(iu));
+		const __m128 fv = _mm_sub_ps(v, _mm_cvtepi32_ps(iv));
+		int cu[4], cv[4];
+		_mm_storeu_si128((__m128i*)cu, iu);
+		_mm_storeu_si128((__m128i*)cv, iv);
+		size_t offsets[4];
+		for (int k = 0; k < 4; k++)
+			offsets[k] = (size_t)cv[k] * src.width + cu[k];
+
+		__m128 h = zero;
+		for (int layer = 0; layer < 2; layer++)
+		{
+			if (weights[layer] <= 0)
+				continue;
+			// SSE2 has no gather, the corners are loaded one by one
+			const unsigned short* p = src.heights[layer];
+			const size_t w = src.width;
+			const __m128 h00 = _mm_setr_ps(p[offsets[0]], p[offsets[1]], p[offsets[2]], p[offsets[3]]);
+			const __m128 h10 = _mm_setr_ps(p[offsets[0] + 1], p[offsets[1] + 1], p[offsets[2] + 1], p[offsets[3] + 1]);
+			const __m128 h01 = _mm_setr_ps(p[offsets[0] + w], p[offsets[1] + w], p[offsets[2] + w], p[offsets[3] + w]);
+			const __m128 h11 = _mm_setr_ps(p[offsets[0] + w + 1], p[offsets[1] + w + 1], p[offsets[2] + w + 1], p[offsets[3] + w + 1]);
+			const __m128 top = _mm_add_ps(h00, _mm_mul_ps(_mm_sub_ps(h10, h00), fu));
+			const __m128 bottom = _mm_add_ps(h01, _mm_mul_ps(_mm_sub_ps(h11, h01), fu));
+			const __m128 sample = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), fv));
+			h = _mm_add_ps(h, _mm_mul_ps(sample, _mm_set1_ps(weights[layer])));
+		}
+		_mm_storeu_ps(y + i, _mm_add_ps(_mm_mul_ps(h, _mm_set1_ps(scaleY)), _mm_set1_ps(src.minY)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		const float u = std::min(std::max((x[i] - src.minX) * scaleX, 0.0f), maxU);
+		const float v = std::min(std::max((z[i] - src.minZ) * scaleZ, 0.0f), maxV);
+		const int iu = (int)std::min(u, lastU);
+		const int iv = (int)std::min(v, lastV);
+		const size_t offset = (size_t)iv * src.width + iu;
+		float h = 0;
+		for (int layer = 0; layer < 2; layer++)
+			if (weights[layer] > 0)
+				h += weights[layer] * samplePixels(src.heights[layer] + offset, src.width, u - iu, v - iv);
+		y[i] = h * scaleY + src.minY;
+	}
+}
+
+// the ray in pixel space: x and z in pixels, y in height units, the same distances along it
+struct PixelRay
+{
+	float o[3];
+	float d[3];
+	float inv[3];
+};
+
+struct RayNode
+{
+	int level;
+	unsigned int ix, iz;
+	float tEnter, tExit;
+};
+
+class RayCaster
+{
+private:
+	const TerrainQuerySource& m_src;
+	float m_weights[2];
+	const unsigned short* m_single;		// the layer if the other one has no weight
+	std::vector<RayNode> m_stack;
+
+	// height bounds of the blended surface over the node
+	void getNodeHeights(int level, unsigned int ix, unsigned int iz, float& minY, float& maxY) const
+	{
+		const size_t n = m_src.params.nGridX >> level;
+		minY = 65535;
+		maxY = 0;
+		for (int layer = 0; layer < 2; layer++)
+		{
+			if (m_weights[layer] <= 0)
+				continue;
+			const HeightMinMax& h = (*m_src.pyramids[layer])[level][iz * n + ix];
+			minY = std::min(minY, (float)h.minY);
+			maxY = std::max(maxY, (float)h.maxY);
+		}
+	}
+
+	// corners of the pixel cell: TL, TR, BL, BR
+	void getCell(unsigned int cx, unsigned int cz, float h[4]) const
+	{
+		const size_t w = m_src.width;
+		const size_t offset = cz * w + cx;
+		if (m_single)
+		{
+			const unsigned short* p = m_single + offset;
+			h[0] = p[0];
+			h[1] = p[1];
+			h[2] = p[w];
+			h[3] = p[w + 1];
+			return;
+		}
+		for (int i = 0; i < 4; i++)
+			h[i] = 0;
+		for (int layer = 0; layer < 2; layer++)
+		{
+			const unsigned short* p = m_src.heights[layer] + offset;
+			h[0] += m_weights[layer] * p[0];
+			h[1] += m_weights[layer] * p[1];
+			h[2] += m_weights[layer] * p[w];
+			h[3] += m_weights[layer] * p[w + 1];
+		}
+	}
+
+	static bool intersectBox(const PixelRay& r, const float bmin[3], const float bmax[3], float tLimit, float& t0, float& t1)
+	{
+		t0 = 0;
+		t1 = tLimit;
+		for (int a = 0; a < 3; a++)
+		{
+			float ta = (bmin[a] - r.o[a]) * r.inv[a];
+			float tb = (bmax[a] - r.o[a]) * r.inv[a];
+			if (ta > tb)
+				std::swap(ta, tb);
+			t0 = std::max(t0, ta);
+			t1 = std::min(t1, tb);
+		}
+		return t0 <= t1;
+	}
+
+	// first t in [ta, tb] where the ray is at or below the bilinear surface of the cell
+	static bool intersectCell(const PixelRay& r, unsigned int cx, unsigned int cz, const float h[4], float ta, float tb, float& tHit)
+	{
+		const float h00 = h[0], h10 = h[1], h01 = h[2], h11 = h[3];
+		// y(t) - h(t) as a quadratic in t, in double as the cell coordinates are small next to the ray's
+		const double pu = (double)r.o[0] - cx, pv = (double)r.o[2] - cz;
+		const double du = r.d[0], dv = r.d[2];
+		const double b = h10 - h00, c = h01 - h00, d = (double)h00 - h10 - h01 + h11;
+		const double A = -d * du * dv;
+		const double B = r.d[1] - (b * du + c * dv + d * (pu * dv + pv * du));
+		const double C = r.o[1] - (h00 + b * pu + c * pv + d * pu * pv);
+		const double fa = (A * ta + B) * ta + C;
+		if (fa <= 0)
+		{
+			tHit = ta;
+			return true;
+		}
+		double roots[2];
+		int rootCount = 0;
+		if (fabs(A) < 1e-12)
+		{
+			if (B != 0)
+				roots[rootCount++] = -C / B;
+		}
+		else
+		{
+			const double disc = B * B - 4 * A * C;
+			if (disc < 0)
+				return false;
+			const double q = -0.5 * (B + (B < 0 ? -sqrt(disc) : sqrt(disc)));
+			if (q != 0)
+				roots[rootCount++] = C / q;
+			roots[rootCount++] = q / A;
+			if (rootCount == 2 && roots[1] < roots[0])
+				std::swap(roots[0], roots[1]);
+		}
+		for (int i = 0; i < rootCount; i++)
+		{
+			if (roots[i] >= ta && roots[i] <= tb)
+			{
+				tHit = (float)roots[i];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// walks the pixel cells of a unit grid along the ray
+	bool intersectGrid(const PixelRay& r, unsigned int ix, unsigned int iz, float t0, float t1, float& tHit) const
+	{
+		const int nPixelX = m_src.params.nPixelX, nPixelZ = m_src.params.nPixelZ;
+		const int x0 = ix * nPixelX, z0 = iz * nPixelZ;
+		float t = t0;
+		int cx = std::min(std::max((int)floorf(r.o[0] + r.d[0] * t), x0), x0 + nPixelX - 1);
+		int cz = std::min(std::max((int)floorf(r.o[2] + r.d[2] * t), z0), z0 + nPixelZ - 1);
+		const int stepX = r.d[0] > 0 ? 1 : -1;
+		const int stepZ = r.d[2] > 0 ? 1 : -1;
+		float tNextX = ((stepX > 0 ? cx + 1 : cx) - r.o[0]) * r.inv[0];
+		float tNextZ = ((stepZ > 0 ? cz + 1 : cz) - r.o[2]) * r.inv[2];
+		const float tDeltaX = fabsf(r.inv[0]), tDeltaZ = fabsf(r.inv[2]);
+		float yStart = r.o[1] + r.d[1] * t;
+		for (;;)
+		{
+			const float tEnd = std::max(std::min(std::min(tNextX, tNextZ), t1), t);
+			const float yEnd = r.o[1] + r.d[1] * tEnd;
+			float h[4];
+			getCell(cx, cz, h);
+			// the ray is above the cell's highest corner, most cells end here
+			if (std::min(yStart, yEnd) <= std::max(std::max(h[0], h[1]), std::max(h[2], h[3])) &&
+				intersectCell(r, cx, cz, h, t, tEnd, tHit))
+				return true;
+			if (tEnd >= t1)
+				return false;
+			t = tEnd;
+			yStart = yEnd;
+			if (tNextX < tNextZ)
+			{
+				cx += stepX;
+				tNextX += tDeltaX;
+			}
+			else
+			{
+				cz += stepZ;
+				tNextZ += tDeltaZ;
+			}
+			if (cx < x0 || cx >= x0 + nPixelX || cz < z0 || cz >= z0 + nPixelZ)
+				return false;
+		}
+	}
+
+	// pushes the children the ray enters before tLimit, the nearest last so that it is popped first
+	void pushChildren(const PixelRay& r, const RayNode& node, float tLimit)
+	{
+		const int level = node.level - 1;
+		const float sizeX = (float)(m_src.params.nPixelX << level);
+		const float sizeZ = (float)(m_src.params.nPixelZ << level);
+		RayNode children[4];
+		float bmin[3][4], bmax[3][4];
+		for (int q = 0; q < 4; q++)
+		{
+			RayNode& c = children[q];
+			c.level = level;
+			c.ix = node.ix * 2 + (q & 1);
+			c.iz = node.iz * 2 + (q >> 1);
+			bmin[0][q] = c.ix * sizeX;
+			bmax[0][q] = bmin[0][q] + sizeX;
+			bmin[2][q] = c.iz * sizeZ;
+			bmax[2][q] = bmin[2][q] + sizeZ;
+			getNodeHeights(level, c.ix, c.iz, bmin[1][q], bmax[1][q]);
+		}
+
+		float t0[4], t1[4];
+#ifdef TERRAIN_QUERY_SSE2
+		// the four slab tests at once
+		__m128 vt0 = _mm_setzero_ps();
+		__m128 vt1 = _mm_set1_ps(tLimit);
+		for (int a = 0; a < 3; a++)
+		{
+			const __m128 o = _mm_set1_ps(r.o[a]), inv = _mm_set1_ps(r.inv[a]);
+			const __m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bmin[a]), o), inv);
+			const __m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bmax[a]), o), inv);
+			vt0 = _mm_max_ps(vt0, _mm_min_ps(ta, tb));
+			vt1 = _mm_min_ps(vt1, _mm_max_ps(ta, tb));
+		}
+		_mm_storeu_ps(t0, vt0);
+		_mm_storeu_ps(t1, vt1);
+#else
+		for (int q = 0; q < 4; q++)
+		{
+			const float childMin[3] = { bmin[0][q], bmin[1][q], bmin[2][q] };
+			const float childMax[3] = { bmax[0][q], bmax[1][q], bmax[2][q] };
+			if (!intersectBox(r, childMin, childMax, tLimit, t0[q], t1[q]))
+				t1[q] = -1;
+		}
+#endif
+		int order[4], hitCount = 0;
+		for (int q = 0; q < 4; q++)
+		{
+			if (t0[q] > t1[q])
+				continue;
+			children[q].tEnter = t0[q];
+			children[q].tExit = t1[q];
+			order[hitCount++] = q;
+		}
+		// far to near
+		for (int i = 1; i < hitCount; i++)
+			for (int j = i; j > 0 && children[order[j]].tEnter > children[order[j - 1]].tEnter; j--)
+				std::swap(order[j], order[j - 1]);
+		for (int i = 0; i < hitCount; i++)
+			m_stack.push_back(children[order[i]]);
+	}
+
+public:
+	RayCaster(const TerrainQuerySource& src) : m_src(src)
+	{
+		getLayerWeights(src, m_weights);
+		m_single = m_weights[1] <= 0 ? src.heights[0] : m_weights[0] <= 0 ? src.heights[1] : 0;
+		m_stack.reserve(4 * src.params.lodLevelCount + 16);
+	}
+
+	bool cast(const TerrainRay& ray, TerrainRayHit& hit)
+	{
+		const float scale[3] = {
+			m_src.params.nPixelX / m_src.gridSizeX,
+			65535.0f / m_src.sizeY,
+			m_src.params.nPixelZ / m_src.gridSizeZ };
+		const float offset[3] = { m_src.minX, m_src.minY, m_src.minZ };
+		PixelRay r;
+		for (int a = 0; a < 3; a++)
+		{
+			r.o[a] = (ray.origin[a] - offset[a]) * scale[a];
+			r.d[a] = ray.direction[a] * scale[a];
+			// an axis parallel ray gets a huge but finite inverse, so that the slab tests never see 0 * inf
+			const float d = fabsf(r.d[a]) < 1e-20f ? 1e-20f : r.d[a];
+			r.inv[a] = 1.0f / d;
+		}
+
+		float best = ray.maxDistance;
+		bool found = false;
+		const int top = m_src.params.lodLevelCount - 1;
+		const unsigned int nTop = m_src.params.nGridX >> top;
+		const float topX = (float)(m_src.params.nPixelX << top);
+		const float topZ = (float)(m_src.params.nPixelZ << top);
+		m_stack.clear();
+		for (unsigned int iz = 0; iz < nTop; iz++)
+		{
+			for (unsigned int ix = 0; ix < nTop; ix++)
+			{
+				RayNode node = { top, ix, iz, 0, 0 };
+				float bmin[3] = { ix * topX, 0, iz * topZ };
+				float bmax[3] = { (ix + 1) * topX, 0, (iz + 1) * topZ };
+				getNodeHeights(top, ix, iz, bmin[1], bmax[1]);
+				if (intersectBox(r, bmin, bmax, best, node.tEnter, node.tExit))
+					m_stack.push_back(node);
+			}
+		}
+
+		while (!m_stack.empty())
+		{
+			const RayNode node = m_stack.back();
+			m_stack.pop_back();
+			if (node.tEnter > best)
+				continue;
+			if (node.level > 0)
+			{
+				pushChildren(r, node, best);
+				continue;
+			}
+			float t;
+			if (intersectGrid(r, node.ix, node.iz, node.tEnter, std::min(node.tExit, best), t) && t <= best)
+			{
+				// the nodes are visited front to back, nothing after this one can be nearer
+				best = t;
+				found = true;
+				break;
+			}
+		}
+
+		hit.hit = found;
+		hit.distance = found ? best : ray.maxDistance;
+		for (int a = 0; a < 3; a++)
+			hit.position[a] = ray.origin[a] + ray.direction[a] * hit.distance;
+		return found;
+	}
+};
+
+// spreads the low 16 bits to the even bits
+static unsigned int interleaveBits(unsigned int v)
+{
+	v &= 0xffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+size_t terrainRaycast(const TerrainQuerySource& src, const TerrainRay* rays, TerrainRayHit* hits, size_t count)
+{
+	// cast in Morton order of the origins' unit grids, so that neighboring rays find the heightmap in cache
+	std::vector<std::pair<unsigned int, unsigned int> > order(count);
+	const float scaleX = 1.0f / src.gridSizeX, scaleZ = 1.0f / src.gridSizeZ;
+	const float maxGrid = (float)(src.params.nGridX - 1);
+	for (size_t i = 0; i < count; i++)
+	{
+		const unsigned int gx = (unsigned int)std::min(std::max((rays[i].origin[0] - src.minX) * scaleX, 0.0f), maxGrid);
+		const unsigned int gz = (unsigned int)std::min(std::max((rays[i].origin[2] - src.minZ) * scaleZ, 0.0f), maxGrid);
+		order[i] = std::make_pair(interleaveBits(gx) | (interleaveBits(gz) << 1), (unsigned int)i);
+	}
+	std::sort(order.begin(), order.end());
+
+	RayCaster caster(src);
+	size_t hitCount = 0;
+	for (size_t i = 0; i < count; i++)
+		if (caster.cast(rays[order[i].second], hits[order[i].second]))
+			hitCount++;
+	return hitCount;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <condition_variable>
+#include "TerrainPyramid.h"
+
+// CPU height queries and ray casts against the heightmaps (no Ogre dependency)
+//
+// The surface is the bilinear interpolation of the heightmap pixels, blended between hmap1 and hmap2 by
+// the blend ratio like the shaders do. Ray casts descend the min/max pyramid front to back, rejecting the
+// nodes whose bounding box the ray misses, and intersect the bilinear cells of the level 0 grids exactly.
+
+struct TerrainQuerySource
+{
+	const unsigned short* heights[2];			// hmap1 and hmap2, the second may be null
+	const HeightMinMaxPyramid* pyramids[2];	// of the same layers
+	unsigned int width;				// heightmap pixels
+	unsigned int height;
+	TerrainPyramidParams params;
+	float minX, minY, minZ;			// world position of pixel (0, 0) at height 0
+	float gridSizeX, gridSizeZ;		// world size of a unit grid
+	float sizeY;					// world height of the height 65535
+	float blendRatio;				// weight of hmap1 against hmap2
+};
+
+struct TerrainRay
+{
+	float origin[3];
+	float direction[3];		// need not be normalized, the distances are in multiples of it
+	float maxDistance;		// e.g. 1 with the vector between the two ends of a line of sight
+};
+
+struct TerrainRayHit
+{
+	bool hit;
+	float distance;			// along the ray, in multiples of its direction
+	float position[3];
+};
+
+// world heights at count world positions, clamped to the map
+void terrainHeightAt(const TerrainQuerySource& src, const float* x, const float* z, float* y, size_t count);
+// first hit of each ray within its max distance and the map; returns the number of rays that hit
+size_t terrainRaycast(const TerrainQuerySource& src, const TerrainRay* rays, TerrainRayHit* hits, size_t count);
+
+// Many readers or one writer; a waiting writer blocks the new readers so that it can't starve
+class TerrainQueryLock
+{
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	int m_readers;
+	int m_waitingWriters;
+	bool m_writer;
+
+public:
+	TerrainQueryLock() : m_readers(0), m_waitingWriters(0), m_writer(false) {}
+
+	void lockRead()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_writer || m_waitingWriters > 0)
+			m_cond.wait(lock);
+		m_readers++;
+	}
+	void unlockRead()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (--m_readers == 0)
+			m_cond.notify_all();
+	}
+	void lockWrite()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_waitingWriters++;
+		while (m_writer || m_readers > 0)
+			m_cond.wait(lock);
+		m_waitingWriters--;
+		m_writer = true;
+	}
+	void unlockWrite()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_writer = false;
+		m_cond.notify_all();
+	}
+
+	// scoped locks
+	class Reader
+	{
+	private:
+		TerrainQueryLock& m_lock;
+	public:
+		Reader(TerrainQueryLock& lock) : m_lock(lock) { m_lock.lockRead(); }
+		~Reader() { m_lock.unlockRead(); }
+	};
+	class Writer
+	{
+	private:
+		TerrainQueryLock& m_lock;
+	public:
+		Writer(TerrainQueryLock& lock) : m_lock(lock) { m_lock.lockWrite(); }
+		~Writer() { m_lock.unlockWrite(); }
+	};
+};
@@ -0,0 +1,91 @@
+#include "TerrainScatter.h"
+#include <cmath>
+#include <algorithm>
+
+// integer hash with a good avalanche, the random source of the candidates
+static inline unsigned int hash32(unsigned int h)
+{
+	h ^= h >> 16;
+	h *= 0x7feb352dU;
+	h ^= h >> 15;
+	h *= 0x846ca68bU;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline float toUnit(unsigned int h)
+{
+	return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// bilinear, 0 to 1
+static float sampleDensity(const TerrainScatterParams& p, float u, float v)
+{
+	if (!p.density)
+		return 1.0f;
+	const float fx = std::min(std::max(u, 0.0f), 1.0f) * (p.densityWidth - 1);
+	const float fz = std::min(std::max(v, 0.0f), 1.0f) * (p.densityHeight - 1);
+	const unsigned int x0 = (unsigned int)fx, z0 = (unsigned int)fz;
+	const unsigned int x1 = std::min(x0 + 1, p.densityWidth - 1), z1 = std::min(z0 + 1, p.densityHeight - 1);
+	const float tx = fx - x0, tz = fz - z0;
+	const unsigned char* row0 = p.density + (size_t)z0 * p.densityWidth;
+	const unsigned char* row1 = p.density + (size_t)z1 * p.densityWidth;
+	const float top = row0[x0] + (row0[x1] - row0[x0]) * tx;
+	const float bottom = row1[x0] + (row1[x1] - row1[x0]) * tx;
+	return (top + (bottom - top) * tz) / 255.0f;
+}
+
+bool scatterQuadrant(const TerrainScatterParams& p, float minX, float minZ, float mapSizeX, float mapSizeZ, float gridSizeX, float gridSizeZ,
+	int lodLevel, unsigned int x, unsigned int z, int quadrant, ScatterHeightFunc getHeights, std::vector<ScatterInstance>& instances)
+{
+	instances.clear();
+	if (lodLevel > p.maxLODLevel || p.instancesPerArea <= 0 || p.maxInstances == 0)
+		return true;
+	// the quadrant in world space
+	const float half = (1 << lodLevel) * 0.5f;
+	const float x0 = minX + (x + (quadrant & 1) * half) * gridSizeX;
+	const float z0 = minZ + (z + (quadrant >> 1) * half) * gridSizeZ;
+	const float sizeX = half * gridSizeX, sizeZ = half * gridSizeZ;
+
+	// a candidate per cell of a grid fine enough for the full density, fewer if that is more than allowed
+	const float expected = std::min(p.instancesPerArea * sizeX * sizeZ * powf(p.lodDensityRatio, (float)lodLevel), (float)p.maxInstances);
+	const int side = std::max((int)ceilf(sqrtf(expected)), 1);
+	const float keep = expected / (side * side);
+	const float cellX = sizeX / side, cellZ = sizeZ / side;
+
+	// a seed per quadrant, then one per candidate
+	const unsigned int nodeSeed = hash32(p.seed ^ hash32(((unsigned int)lodLevel << 28) ^ hash32(x * 0x9e3779b9U ^ hash32(z + quadrant * 0x85ebca6bU))));
+	std::vector<float> px, pz;
+	std::vector<unsigned int> seeds;
+	for (int j = 0; j < side; j++)
+	{
+		for (int i = 0; i < side; i++)
+		{
+			const unsigned int h = hash32(nodeSeed + (unsigned int)(j * side + i) * 0x27d4eb2dU);
+			const float cx = x0 + (i + toUnit(hash32(h ^ 1))) * cellX;
+			const float cz = z0 + (j + toUnit(hash32(h ^ 2))) * cellZ;
+			if (toUnit(h) >= keep * sampleDensity(p, (cx - minX) / mapSizeX, (cz - minZ) / mapSizeZ))
+				continue;
+			px.push_back(cx);
+			pz.push_back(cz);
+			seeds.push_back(h);
+		}
+	}
+	if (px.empty())
+		return true;
+
+	std::vector<float> py(px.size());
+	if (!getHeights(&px[0], &pz[0], &py[0], px.size()))
+		return false;
+	instances.resize(px.size());
+	for (size_t k = 0; k < px.size(); k++)
+	{
+		ScatterInstance& inst = instances[k];
+		inst.position[0] = px[k];
+		inst.position[1] = py[k];
+		inst.position[2] = pz[k];
+		inst.yaw = (unsigned short)(hash32(seeds[k] ^ 3) >> 16);
+		inst.scale = (unsigned short)(hash32(seeds[k] ^ 4) >> 16);
+	}
+	return true;
+}
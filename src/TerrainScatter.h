@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// Instance scatter of vegetation and detail on the terrain nodes (no Ogre dependency)
+//
+// Each quadrant of a node gets a jittered grid of candidates, kept by the density map, with positions, yaws and
+// scales from a hash of the seed, the node and the candidate; the same node gives the same instances in any thread
+// and any frame. The coarser the node the lower the density, by lodDensityRatio per level: at 0.25 a node has about
+// as many instances as its children together have per child, so the count follows the selected nodes.
+
+// 16 bytes per instance, ready for an instance buffer
+struct ScatterInstance
+{
+	float position[3];
+	unsigned short yaw;		// a full turn over 65536
+	unsigned short scale;	// minScale to maxScale over 0 to 65535
+};
+
+struct TerrainScatterParams
+{
+	const unsigned char* density;	// over the whole map, row by row from (MinX, MinZ); null for 255 everywhere
+	unsigned int densityWidth;
+	unsigned int densityHeight;
+	float instancesPerArea;			// per world square unit at 255 on level 0
+	float lodDensityRatio;			// of each next level
+	int maxLODLevel;				// the coarser nodes have none
+	size_t maxInstances;			// per quadrant
+	unsigned int seed;
+	float minScale;
+	float maxScale;
+};
+
+// world heights of count positions, as LOD_getHeights; false if there are none
+typedef bool (*ScatterHeightFunc)(const float* x, const float* z, float* y, size_t count);
+
+// The instances of a quadrant (0 TL, 1 TR, 2 BL, 3 BR) of the node of the LOD level at (x, z) in level 0 grids
+// of gridSizeX by gridSizeZ from (minX, minZ), with the map mapSizeX by mapSizeZ; false if the heights failed.
+bool scatterQuadrant(const TerrainScatterParams& p, float minX, float minZ, float mapSizeX, float mapSizeZ, float gridSizeX, float gridSizeZ,
+	int lodLevel, unsigned int x, unsigned int z, int quadrant, ScatterHeightFunc getHeights, std::vector<ScatterInstance>& instances);
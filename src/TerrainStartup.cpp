@@ -0,0 +1,211 @@
+#include "TerrainStartup.h"
+#include <cassert>
+#include <cstdio>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+
+StartupGraph::TaskId StartupGraph::add(const std::string& name, Affinity affinity, const std::function<void()>& fn,
+	const std::vector<TaskId>& dependencies)
+{
+	const TaskId id = (TaskId)m_tasks.size();
+	Task task;
+	task.name = name;
+	task.affinity = affinity;
+	task.fn = fn;
+	task.waitingFor = 0;
+	m_tasks.push_back(task);
+	for (size_t i = 0; i < dependencies.size(); i++)
+	{
+		// only on tasks added before, so that the graph never has a cycle
+		assert(dependencies[i] >= 0 && dependencies[i] < id);
+		m_tasks[dependencies[i]].dependents.push_back(id);
+		m_tasks[id].waitingFor++;
+	}
+	return id;
+}
+
+StartupGraph::TaskId StartupGraph::find(const std::string& name) const
+{
+	for (size_t i = 0; i < m_tasks.size(); i++)
+		if (m_tasks[i].name == name)
+			return (TaskId)i;
+	return -1;
+}
+
+void StartupGraph::run(int threadCount)
+{
+	typedef std::chrono::steady_clock Clock;
+	const Clock::time_point start = Clock::now();
+	m_threadCount = std::max(threadCount, 0);
+
+	const size_t taskCount = m_tasks.size();
+	m_timeline.resize(taskCount);
+	std::vector<int> waitingFor(taskCount);
+	std::deque<TaskId> workerReady, renderReady;
+	for (size_t i = 0; i < taskCount; i++)
+	{
+		TaskTiming& t = m_timeline[i];
+		t.name = m_tasks[i].name;
+		t.affinity = m_tasks[i].affinity;
+		t.thread = -1;
+		t.startMs = t.endMs = 0;
+		t.ran = false;
+		waitingFor[i] = m_tasks[i].waitingFor;
+	}
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	size_t remaining = taskCount;
+	std::exception_ptr error;
+
+	// without workers everything is queued for the render thread
+	auto enqueue = [&](TaskId id)
+	{
+		if (m_tasks[id].affinity == WorkerThread && m_threadCount > 0)
+			workerReady.push_back(id);
+		else
+			renderReady.push_back(id);
+	};
+	auto execute = [&](TaskId id, int thread, std::unique_lock<std::mutex>& lock)
+	{
+		if (!error)
+		{
+			lock.unlock();
+			const double startMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+			std::exception_ptr taskError;
+			try
+			{
+				m_tasks[id].fn();
+			}
+			catch (...)
+			{
+				taskError = std::current_exception();
+			}
+			const double endMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+			lock.lock();
+			TaskTiming& t = m_timeline[id];
+			t.thread = thread;
+			t.startMs = startMs;
+			t.endMs = endMs;
+			t.ran = true;
+			if (taskError && !error)
+				error = taskError;
+		}
+		remaining--;
+		const std::vector<TaskId>& dependents = m_tasks[id].dependents;
+		for (size_t i = 0; i < dependents.size(); i++)
+			if (--waitingFor[dependents[i]] == 0)
+				enqueue(dependents[i]);
+		cond.notify_all();
+	};
+
+	std::unique_lock<std::mutex> lock(mutex);
+	for (size_t i = 0; i < taskCount; i++)
+		if (waitingFor[i] == 0)
+			enqueue((TaskId)i);
+
+	std::vector<std::thread> workers;
+	for (int w = 0; w < m_threadCount; w++)
+	{
+		workers.push_back(std::thread([&, w]()
+		{
+			std::unique_lock<std::mutex> workerLock(mutex);
+			while (remaining > 0)
+			{
+				if (workerReady.empty())
+				{
+					cond.wait(workerLock);
+					continue;
+				}
+				const TaskId id = workerReady.front();
+				workerReady.pop_front();
+				execute(id, w + 1, workerLock);
+			}
+		}));
+	}
+
+	while (remaining > 0)
+	{
+		if (renderReady.empty())
+		{
+			cond.wait(lock);
+			continue;
+		}
+		const TaskId id = renderReady.front();
+		renderReady.pop_front();
+		execute(id, 0, lock);
+	}
+	lock.unlock();
+	for (size_t w = 0; w < workers.size(); w++)
+		workers[w].join();
+
+	m_totalMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	if (error)
+		std::rethrow_exception(error);
+}
+
+int StartupGraph::defaultThreadCount()
+{
+	return std::max((int)std::thread::hardware_concurrency() - 1, 1);
+}
+
+void StartupGraph::clear()
+{
+	m_tasks.clear();
+	m_timeline.clear();
+	m_totalMs = 0;
+}
+
+// skipped tasks last
+static bool compareStart(const StartupGraph::TaskTiming* a, const StartupGraph::TaskTiming* b)
+{
+	if (a->ran != b->ran)
+		return a->ran;
+	return a->startMs < b->startMs;
+}
+
+std::string StartupGraph::formatTimeline() const
+{
+	const int barWidth = 40;
+	char line[256];
+	std::string report;
+	snprintf(line, sizeof(line), "startup %.1f ms, %d worker threads\n", m_totalMs, m_threadCount);
+	report += line;
+	snprintf(line, sizeof(line), "%9s %9s %9s  %-6s  %-*s  %s\n", "start", "end", "ms", "thread", barWidth, "", "task");
+	report += line;
+
+	std::vector<const TaskTiming*> sorted;
+	for (size_t i = 0; i < m_timeline.size(); i++)
+		sorted.push_back(&m_timeline[i]);
+	std::stable_sort(sorted.begin(), sorted.end(), compareStart);
+
+	for (size_t i = 0; i < sorted.size(); i++)
+	{
+		const TaskTiming& t = *sorted[i];
+		if (!t.ran)
+		{
+			snprintf(line, sizeof(line), "%9s %9s %9s  %-6s  %-*s  %s\n", "-", "-", "-", "-", barWidth, "", (t.name + " (skipped)").c_str());
+			report += line;
+			continue;
+		}
+		std::string bar(barWidth, ' ');
+		if (m_totalMs > 0)
+		{
+			int begin = std::min((int)(t.startMs / m_totalMs * barWidth), barWidth - 1);
+			int end = std::max(std::min((int)(t.endMs / m_totalMs * barWidth + 0.5), barWidth), begin + 1);
+			std::fill(bar.begin() + begin, bar.begin() + end, '#');
+		}
+		char thread[16];
+		if (t.thread == 0)
+			snprintf(thread, sizeof(thread), "render");
+		else
+			snprintf(thread, sizeof(thread), "w%d", t.thread);
+		snprintf(line, sizeof(line), "%9.1f %9.1f %9.1f  %-6s  %s  %s\n", t.startMs, t.endMs, t.endMs - t.startMs, thread, bar.c_str(), t.name.c_str());
+		report += line;
+	}
+	return report;
+}
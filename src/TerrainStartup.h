@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <exception>
+
+// Startup work as a dependency graph (no Ogre dependency).
+// Worker tasks run on a thread pool as soon as their dependencies are done; render thread tasks,
+// i.e. anything touching the GPU or the resource system, run on the thread that calls run().
+class StartupGraph
+{
+public:
+	typedef int TaskId;
+
+	enum Affinity
+	{
+		WorkerThread,
+		RenderThread
+	};
+
+	struct TaskTiming
+	{
+		std::string name;
+		Affinity affinity;
+		int thread;			// 0 for the render thread, workers from 1
+		double startMs;		// from the start of run()
+		double endMs;
+		bool ran;			// false if skipped after a failure
+	};
+
+private:
+	struct Task
+	{
+		std::string name;
+		Affinity affinity;
+		std::function<void()> fn;
+		std::vector<TaskId> dependents;
+		int waitingFor;		// dependencies not done yet
+	};
+
+	std::vector<Task> m_tasks;
+	std::vector<TaskTiming> m_timeline;
+	double m_totalMs;
+	int m_threadCount;
+
+public:
+	StartupGraph() : m_totalMs(0), m_threadCount(0) {}
+
+	TaskId add(const std::string& name, Affinity affinity, const std::function<void()>& fn,
+		const std::vector<TaskId>& dependencies = std::vector<TaskId>());
+	// id of the task with the given name, -1 if none
+	TaskId find(const std::string& name) const;
+
+	// Runs all the tasks with threadCount workers, 0 runs everything on the calling thread.
+	// After a failure no more tasks start; the first exception is rethrown once the running ones are done.
+	void run(int threadCount);
+	void clear();
+	// one worker per core besides the render thread
+	static int defaultThreadCount();
+
+	const std::vector<TaskTiming>& getTimeline() const { return m_timeline; }
+	double getTotalMs() const { return m_totalMs; }
+	// one line per task in start order with a bar chart of the run
+	std::string formatTimeline() const;
+};
@@ -0,0 +1,261 @@
+#include "TerrainTileCodec.h"
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TERRAIN_CODEC_SSE2
+#include <emmintrin.h>
+#endif
+
+static const unsigned int _blockSize = 16;
+// bytes of a block per width code
+static const unsigned int _blockBytes[4] = { 0, 8, 16, 32 };
+
+unsigned short terrainQuantizationStep(unsigned int maxError)
+{
+	// divisors of 65535 = 3 * 5 * 17 * 257
+	static const unsigned short steps[] = { 1, 3, 5, 15, 17, 51, 85, 255, 257, 771, 1285, 3855, 4369, 13107, 21845 };
+	unsigned short step = 1;
+	for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+		if ((steps[i] - 1u) / 2 <= maxError)
+			step = steps[i];
+	return step;
+}
+
+unsigned short quantizeHeight(unsigned short h, unsigned short step)
+{
+	return (unsigned short)((h + step / 2u) / step * step);
+}
+
+static inline unsigned short zigzag(unsigned short r)
+{
+	return (unsigned short)((r << 1) ^ (unsigned short)((short)r >> 15));
+}
+
+static inline unsigned short unzigzag(unsigned short z)
+{
+	return (unsigned short)((z >> 1) ^ (unsigned short)(-(short)(z & 1)));
+}
+
+static inline unsigned short predict(int predictor, const unsigned short* prev, const unsigned short* prev2, unsigned int x)
+{
+	return predictor == TilePredictUp ? prev[x] : (unsigned short)(2 * prev[x] - prev2[x]);
+}
+
+static inline int widthCode(unsigned short maxValue)
+{
+	return maxValue == 0 ? 0 : (maxValue < 16 ? 1 : (maxValue < 256 ? 2 : 3));
+}
+
+// residuals of a row, padded with zeros to whole blocks; returns the encoded size
+static size_t computeResiduals(int predictor, const unsigned short* row, const unsigned short* prev, const unsigned short* prev2,
+	unsigned int width, unsigned short* residuals, unsigned int blockCount)
+{
+	size_t bytes = 1 + (blockCount + 3) / 4;
+	for (unsigned int b = 0; b < blockCount; b++)
+	{
+		unsigned short maxValue = 0;
+		for (unsigned int i = b * _blockSize; i < (b + 1) * _blockSize; i++)
+		{
+			residuals[i] = i < width ? zigzag((unsigned short)(row[i] - predict(predictor, prev, prev2, i))) : 0;
+			maxValue = std::max(maxValue, residuals[i]);
+		}
+		bytes += _blockBytes[widthCode(maxValue)];
+	}
+	return bytes;
+}
+
+void encodeTerrainTile(const unsigned short* heights, unsigned int resolution, unsigned short step, std::vector<unsigned char>& out)
+{
+	if (step == 0 || 65535 % step != 0)
+		step = 1;
+	const unsigned int blockCount = (resolution + _blockSize - 1) / _blockSize;
+	const unsigned int padded = blockCount * _blockSize;
+	std::vector<unsigned short> rows(padded * 3, 0);
+	std::vector<unsigned short> residuals[2];
+	residuals[0].resize(padded);
+	residuals[1].resize(padded);
+	unsigned short* row = &rows[0];
+	unsigned short* prev = &rows[padded];
+	unsigned short* prev2 = &rows[padded * 2];
+
+	TerrainTileCodecHeader header = { step, 0 };
+	const unsigned char* h = (const unsigned char*)&header;
+	out.insert(out.end(), h, h + sizeof(header));
+
+	for (unsigned int z = 0; z < resolution; z++)
+	{
+		const unsigned short* src = heights + (size_t)z * resolution;
+		for (unsigned int x = 0; x < resolution; x++)
+			row[x] = (unsigned short)((src[x] + step / 2u) / step);
+
+		const size_t upBytes = computeResiduals(TilePredictUp, row, prev, prev2, resolution, &residuals[0][0], blockCount);
+		const size_t linearBytes = computeResiduals(TilePredictLinear, row, prev, prev2, resolution, &residuals[1][0], blockCount);
+		const int predictor = linearBytes < upBytes ? TilePredictLinear : TilePredictUp;
+		const unsigned short* r = &residuals[predictor][0];
+
+		out.push_back((unsigned char)predictor);
+		const size_t widths = out.size();
+		out.resize(out.size() + (blockCount + 3) / 4, 0);
+		for (unsigned int b = 0; b < blockCount; b++, r += _blockSize)
+		{
+			const int code = widthCode(*std::max_element(r, r + _blockSize));
+			out[widths + b / 4] |= (unsigned char)(code << ((b % 4) * 2));
+			switch (code)
+			{
+			case 1:
+				for (unsigned int i = 0; i < _blockSize; i += 2)
+					out.push_back((unsigned char)(r[i] | (r[i + 1] << 4)));
+				break;
+			case 2:
+				for (unsigned int i = 0; i < _blockSize; i++)
+					out.push_back((unsigned char)r[i]);
+				break;
+			case 3:
+				for (unsigned int i = 0; i < _blockSize; i++)
+				{
+					out.push_back((unsigned char)(r[i] & 0xFF));
+					out.push_back((unsigned char)(r[i] >> 8));
+				}
+				break;
+			}
+		}
+
+		std::swap(prev2, prev);
+		std::swap(prev, row);
+	}
+}
+
+#ifdef TERRAIN_CODEC_SSE2
+static inline __m128i unzigzag8(__m128i z)
+{
+	const __m128i one = _mm_set1_epi16(1);
+	return _mm_xor_si128(_mm_srli_epi16(z, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(z, one)));
+}
+#endif
+
+// one row of quantized heights from the encoded blocks
+static void decodeRow(int predictor, const unsigned char* widths, const unsigned char* src, unsigned int blockCount,
+	const unsigned short* prev, const unsigned short* prev2, unsigned short* row)
+{
+	for (unsigned int b = 0; b < blockCount; b++)
+	{
+		const int code = (widths[b / 4] >> ((b % 4) * 2)) & 3;
+		const unsigned int x = b * _blockSize;
+#ifdef TERRAIN_CODEC_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		__m128i lo, hi;
+		switch (code)
+		{
+		case 0:
+			lo = hi = zero;
+			break;
+		case 1:
+		{
+			const __m128i mask = _mm_set1_epi8(0x0F);
+			const __m128i packed = _mm_loadl_epi64((const __m128i*)src);
+			const __m128i nibbles = _mm_unpacklo_epi8(_mm_and_si128(packed, mask), _mm_and_si128(_mm_srli_epi16(packed, 4), mask));
+			lo = _mm_unpacklo_epi8(nibbles, zero);
+			hi = _mm_unpackhi_epi8(nibbles, zero);
+			break;
+		}
+		case 2:
+		{
+			const __m128i bytes = _mm_loadu_si128((const __m128i*)src);
+			lo = _mm_unpacklo_epi8(bytes, zero);
+			hi = _mm_unpackhi_epi8(bytes, zero);
+			break;
+		}
+		default:
+			lo = _mm_loadu_si128((const __m128i*)src);
+			hi = _mm_loadu_si128((const __m128i*)(src + 16));
+			break;
+		}
+		lo = unzigzag8(lo);
+		hi = unzigzag8(hi);
+		__m128i predLo = _mm_loadu_si128((const __m128i*)(prev + x));
+		__m128i predHi = _mm_loadu_si128((const __m128i*)(prev + x + 8));
+		if (predictor == TilePredictLinear)
+		{
+			predLo = _mm_sub_epi16(_mm_add_epi16(predLo, predLo), _mm_loadu_si128((const __m128i*)(prev2 + x)));
+			predHi = _mm_sub_epi16(_mm_add_epi16(predHi, predHi), _mm_loadu_si128((const __m128i*)(prev2 + x + 8)));
+		}
+		_mm_storeu_si128((__m128i*)(row + x), _mm_add_epi16(predLo, lo));
+		_mm_storeu_si128((__m128i*)(row + x + 8), _mm_add_epi16(predHi, hi));
+#else
+		for (unsigned int i = 0; i < _blockSize; i++)
+		{
+			unsigned short z;
+			switch (code)
+			{
+			case 0: z = 0; break;
+			case 1: z = (src[i / 2] >> ((i & 1) * 4)) & 0x0F; break;
+			case 2: z = src[i]; break;
+			default: z = (unsigned short)(src[i * 2] | (src[i * 2 + 1] << 8)); break;
+			}
+			row[x + i] = (unsigned short)(predict(predictor, prev, prev2, x + i) + unzigzag(z));
+		}
+#endif
+		src += _blockBytes[code];
+	}
+}
+
+// heights from the quantized row
+static void dequantizeRow(const unsigned short* row, unsigned int width, unsigned short step, unsigned short* dst)
+{
+	if (step == 1)
+	{
+		memcpy(dst, row, width * sizeof(unsigned short));
+		return;
+	}
+	unsigned int x = 0;
+#ifdef TERRAIN_CODEC_SSE2
+	const __m128i s = _mm_set1_epi16((short)step);
+	for (; x + 8 <= width; x += 8)
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_mullo_epi16(_mm_loadu_si128((const __m128i*)(row + x)), s));
+#endif
+	for (; x < width; x++)
+		dst[x] = (unsigned short)(row[x] * step);
+}
+
+bool decodeTerrainTile(const unsigned char* data, size_t size, unsigned int resolution, unsigned short* heights)
+{
+	TerrainTileCodecHeader header;
+	if (size < sizeof(header))
+		return false;
+	memcpy(&header, data, sizeof(header));
+	if (header.step == 0 || 65535 % header.step != 0)
+		return false;
+	const unsigned char* src = data + sizeof(header);
+	const unsigned char* end = data + size;
+
+	const unsigned int blockCount = (resolution + _blockSize - 1) / _blockSize;
+	const unsigned int padded = blockCount * _blockSize;
+	const size_t widthBytes = (blockCount + 3) / 4;
+	std::vector<unsigned short> rows(padded * 3, 0);
+	unsigned short* row = &rows[0];
+	unsigned short* prev = &rows[padded];
+	unsigned short* prev2 = &rows[padded * 2];
+
+	for (unsigned int z = 0; z < resolution; z++)
+	{
+		if ((size_t)(end - src) < 1 + widthBytes)
+			return false;
+		const int predictor = src[0];
+		const unsigned char* widths = src + 1;
+		size_t rowBytes = 0;
+		for (unsigned int b = 0; b < blockCount; b++)
+			rowBytes += _blockBytes[(widths[b / 4] >> ((b % 4) * 2)) & 3];
+		src += 1 + widthBytes;
+		if (predictor > TilePredictLinear || (size_t)(end - src) < rowBytes)
+			return false;
+
+		decodeRow(predictor, widths, src, blockCount, prev, prev2, row);
+		dequantizeRow(row, resolution, header.step, heights + (size_t)z * resolution);
+		src += rowBytes;
+
+		std::swap(prev2, prev);
+		std::swap(prev, row);
+	}
+	return src == end;
+}
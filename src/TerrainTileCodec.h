@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// Compressed heightmap tiles, TileEncodingDelta16 (no Ogre dependency)
+//
+//   TerrainTileCodecHeader
+//   rows, each:
+//     unsigned char predictor		TilePredictor, from the rows above
+//     unsigned char widths[]		2 bits per block of 16 residuals, 4 blocks per byte starting at the low bits
+//     blocks						0, 4, 8 or 16 bits per zigzag residual, 4-bit values in pairs low nibble first
+//
+// Heights are divided by the quantization step before the prediction, which is lossless with step 1.
+// The steps divide 65535 so that quantizing never overflows and is a function of the height alone,
+// i.e. the border pixels shared by neighboring tiles stay identical.
+// The prediction only looks at the rows above, so that a row is decoded 8 pixels at a time.
+
+enum TilePredictor
+{
+	TilePredictUp = 0,			// pixel above
+	TilePredictLinear = 1,		// linear extrapolation of the two pixels above
+};
+
+struct TerrainTileCodecHeader
+{
+	unsigned short step;		// quantization step, 1 for lossless
+	unsigned short reserved;
+};
+
+// largest step whose rounding error stays within maxError height units
+unsigned short terrainQuantizationStep(unsigned int maxError);
+// the height the decoder returns for h
+unsigned short quantizeHeight(unsigned short h, unsigned short step);
+
+// appends the encoded tile to out
+void encodeTerrainTile(const unsigned short* heights, unsigned int resolution, unsigned short step, std::vector<unsigned char>& out);
+// false if the data is truncated or malformed
+bool decodeTerrainTile(const unsigned char* data, size_t size, unsigned int resolution, unsigned short* heights);
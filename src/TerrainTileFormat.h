@@ -0,0 +1,79 @@
+#pragma once
+
+// Tiled terrain package (*.cdlod), shared by the runtime and the offline tools (no Ogre dependency)
+//
+//   TerrainPackageHeader
+//   min/max pyramid: HeightMinMax[] (HeightMinMax.h) per LOD level, from level 0 (unit grids) to the root
+//   TerrainTileEntry[tileCount]
+//   tile data
+//
+// Every tile has the same resolution, tileGrids * gridPixels + 1 pixels on a side; neighboring tiles
+// share their border pixels. Tile level 0 covers tileGrids unit grids with the full resolution,
+// each level above covers twice the area with every other pixel of the level below.
+// A tile of level t matches exactly the quadtree node of LOD level log2(tileGrids) + t,
+// so that LOD level and the ones above never span more than one tile.
+// All values are little-endian.
+
+#define TERRAIN_PACKAGE_MAGIC	"CDLT"
+#define TERRAIN_PACKAGE_VERSION	1
+
+enum TerrainTileEncoding
+{
+	TileEncodingRaw16 = 0,		// unsigned short pixels, row by row
+	TileEncodingDelta16 = 1,	// predicted rows, bit packed residuals (TerrainTileCodec.h)
+};
+
+struct TerrainPackageHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned int lodLevelCount;		// quadtree depth: 1 << (lodLevelCount - 1) unit grids on a side
+	unsigned int gridPixels;		// heightmap pixels per unit grid, without the shared border
+	unsigned int tileGrids;			// unit grids per tile on a side at tile level 0, a power of two
+	unsigned int tileLevelCount;
+	unsigned int tileCount;
+	unsigned int reserved;
+	float minX, minY, minZ;			// map dimensions the package was baked for
+	float sizeX, sizeY, sizeZ;
+	unsigned long long pyramidOffset;
+	unsigned long long directoryOffset;
+};
+
+struct TerrainTileEntry
+{
+	unsigned long long offset;		// from the start of the file
+	unsigned int size;				// in bytes
+	unsigned int encoding;			// TerrainTileEncoding
+};
+
+inline unsigned int terrainTileResolution(const TerrainPackageHeader& header)
+{
+	return header.tileGrids * header.gridPixels + 1;
+}
+
+// number of tiles on a side at the given tile level
+inline unsigned int terrainTilesPerSide(const TerrainPackageHeader& header, int tileLevel)
+{
+	unsigned int nGrid = 1u << (header.lodLevelCount - 1);
+	return nGrid / (header.tileGrids << tileLevel);
+}
+
+// tiles are stored level by level, starting at level 0, each level row by row
+inline int terrainTileIndex(const TerrainPackageHeader& header, int tileLevel, unsigned int tx, unsigned int tz)
+{
+	int index = 0;
+	for (int t = 0; t < tileLevel; t++)
+	{
+		unsigned int n = terrainTilesPerSide(header, t);
+		index += n * n;
+	}
+	return index + tz * terrainTilesPerSide(header, tileLevel) + tx;
+}
+
+inline int terrainTileBaseLODLevel(const TerrainPackageHeader& header)
+{
+	int level = 0;
+	while ((1u << level) < header.tileGrids)
+		level++;
+	return level;
+}
@@ -0,0 +1,140 @@
+#include "TerrainUploadScheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// band size when only the time is limited, so that the time can be checked between the bands of a large update
+static const size_t _timeBudgetBandBytes = 256 * 1024;
+
+UploadScheduler::UploadScheduler(UploadBackend* backend)
+	: m_backend(backend), m_bytesPerFrame(0), m_msPerFrame(0), m_order(0)
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+void UploadScheduler::setBudget(size_t bytesPerFrame, float msPerFrame)
+{
+	m_bytesPerFrame = bytesPerFrame;
+	m_msPerFrame = msPerFrame;
+}
+
+void UploadScheduler::submit(void* texture, const unsigned short* src, size_t pitch, const UploadRect& rect, float priority,
+	const std::shared_ptr<const void>& keepAlive)
+{
+	if (rect.right <= rect.left || rect.bottom <= rect.top)
+		return;
+	Job job;
+	job.order = m_order++;
+	job.texture = texture;
+	job.src = src;
+	job.pitch = pitch;
+	job.rect = rect;
+	job.nextRow = rect.top;
+	job.priority = priority;
+	job.keepAlive = keepAlive;
+	m_jobs.push_back(job);
+}
+
+void UploadScheduler::cancel(void* texture)
+{
+	for (size_t i = 0; i < m_jobs.size(); )
+	{
+		if (m_jobs[i].texture == texture)
+			m_jobs.erase(m_jobs.begin() + i);
+		else
+			i++;
+	}
+}
+
+bool UploadScheduler::isPending(void* texture) const
+{
+	for (size_t i = 0; i < m_jobs.size(); i++)
+		if (m_jobs[i].texture == texture)
+			return true;
+	return false;
+}
+
+bool UploadScheduler::isPending(void* texture, const UploadRect& rect) const
+{
+	for (size_t i = 0; i < m_jobs.size(); i++)
+	{
+		// the rows above nextRow are uploaded already
+		const Job& job = m_jobs[i];
+		if (job.texture == texture && job.rect.left < rect.right && rect.left < job.rect.right &&
+			job.nextRow < rect.bottom && rect.top < job.rect.bottom)
+			return true;
+	}
+	return false;
+}
+
+bool UploadScheduler::compareJobs(const Job& a, const Job& b)
+{
+	if (a.priority != b.priority)
+		return a.priority < b.priority;
+	return a.order < b.order;
+}
+
+void UploadScheduler::run(size_t bytesBudget, float msBudget)
+{
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	m_stats.frameBytes = 0;
+	m_stats.frameRects = 0;
+
+	std::sort(m_jobs.begin(), m_jobs.end(), compareJobs);
+	bool done = false;
+	for (size_t i = 0; i < m_jobs.size() && !done; i++)
+	{
+		Job& job = m_jobs[i];
+		const size_t rowBytes = (job.rect.right - job.rect.left) * sizeof(unsigned short);
+		while (job.nextRow < job.rect.bottom)
+		{
+			const float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+			const size_t remaining = bytesBudget ? (bytesBudget > m_stats.frameBytes ? bytesBudget - m_stats.frameBytes : 0) : ~(size_t)0;
+			if (m_stats.frameRects > 0 && ((msBudget > 0 && ms >= msBudget) || remaining < rowBytes))
+			{
+				done = true;
+				break;
+			}
+			const size_t bandBytes = msBudget > 0 ? std::min(remaining, _timeBudgetBandBytes) : remaining;
+			unsigned int rows = (unsigned int)std::min<size_t>(std::max<size_t>(bandBytes / rowBytes, 1), job.rect.bottom - job.nextRow);
+			UploadRect band = { job.rect.left, job.nextRow, job.rect.right, job.nextRow + rows };
+			if (m_backend)
+				m_backend->upload(job.texture, job.src, job.pitch, band);
+			job.nextRow += rows;
+			m_stats.frameBytes += rows * rowBytes;
+			m_stats.frameRects++;
+		}
+	}
+
+	size_t pendingBytes = 0;
+	for (size_t i = 0; i < m_jobs.size(); )
+	{
+		const Job& job = m_jobs[i];
+		if (job.nextRow >= job.rect.bottom)
+		{
+			m_jobs.erase(m_jobs.begin() + i);
+			continue;
+		}
+		pendingBytes += (size_t)(job.rect.right - job.rect.left) * (job.rect.bottom - job.nextRow) * sizeof(unsigned short);
+		i++;
+	}
+	m_stats.pendingJobs = m_jobs.size();
+	m_stats.pendingBytes = pendingBytes;
+	m_stats.frameMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void UploadScheduler::update()
+{
+	run(m_bytesPerFrame, m_msPerFrame);
+}
+
+void UploadScheduler::flush()
+{
+	run(0, 0);
+}
+
+void UploadScheduler::clear()
+{
+	m_jobs.clear();
+	memset(&m_stats, 0, sizeof(m_stats));
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+
+// Texture updates spread over frames within a byte and time budget (no Ogre dependency)
+
+struct UploadRect
+{
+	unsigned int left;
+	unsigned int top;
+	unsigned int right;		// exclusive
+	unsigned int bottom;	// exclusive
+};
+
+// writes pixels into textures; the scheduler only deals with opaque texture handles
+class UploadBackend
+{
+public:
+	virtual ~UploadBackend() {}
+	// copies rect of a 16-bit source image with the given row pitch in pixels into the same rect of the texture
+	virtual void upload(void* texture, const unsigned short* src, size_t pitch, const UploadRect& rect) = 0;
+};
+
+// headless backend, records the uploads instead of doing them
+class RecordingUploadBackend : public UploadBackend
+{
+public:
+	struct Upload
+	{
+		void* texture;
+		UploadRect rect;
+	};
+	std::vector<Upload> uploads;
+	size_t bytes;
+
+	RecordingUploadBackend() : bytes(0) {}
+	virtual void upload(void* texture, const unsigned short* /*src*/, size_t /*pitch*/, const UploadRect& rect)
+	{
+		Upload u = { texture, rect };
+		uploads.push_back(u);
+		bytes += (size_t)(rect.right - rect.left) * (rect.bottom - rect.top) * sizeof(unsigned short);
+	}
+};
+
+struct UploadStats
+{
+	size_t pendingJobs;
+	size_t pendingBytes;
+	size_t frameBytes;		// uploaded by the last update
+	size_t frameRects;
+	float frameMs;
+};
+
+// Queued texture updates, processed by priority (lower first, then in submission order) on each update.
+// A large update is split into bands of rows so that one frame never uploads much more than the budget;
+// at least one band is uploaded per frame so that everything completes eventually. With only a time budget
+// the bands are of a fixed size, the time is checked between them.
+class UploadScheduler
+{
+private:
+	struct Job
+	{
+		unsigned long long order;
+		void* texture;
+		const unsigned short* src;
+		size_t pitch;
+		UploadRect rect;
+		unsigned int nextRow;
+		float priority;
+		std::shared_ptr<const void> keepAlive;
+	};
+
+	UploadBackend* m_backend;
+	std::vector<Job> m_jobs;
+	size_t m_bytesPerFrame;
+	float m_msPerFrame;
+	unsigned long long m_order;
+	UploadStats m_stats;
+
+	static bool compareJobs(const Job& a, const Job& b);
+	void run(size_t bytesBudget, float msBudget);
+public:
+	UploadScheduler(UploadBackend* backend = 0);
+
+	void setBackend(UploadBackend* backend) { m_backend = backend; }
+	// 0 for no limit
+	void setBudget(size_t bytesPerFrame, float msPerFrame);
+
+	// src has to stay valid until the job is done, keepAlive may own it
+	void submit(void* texture, const unsigned short* src, size_t pitch, const UploadRect& rect, float priority,
+		const std::shared_ptr<const void>& keepAlive = std::shared_ptr<const void>());
+	// drops the pending updates of the texture, e.g. before its contents are replaced
+	void cancel(void* texture);
+	bool isPending(void* texture) const;
+	// true if some of the rect is still to be uploaded into the texture
+	bool isPending(void* texture, const UploadRect& rect) const;
+
+	// once per frame
+	void update();
+	// everything at once, e.g. at startup
+	void flush();
+	void clear();
+
+	const UploadStats& getStats() const { return m_stats; }
+};
@@ -4,6 +4,9 @@
 #include "windows.h"
 #include "OgreGridMesh.h"
 #include "OgreGridRenderable.h"
+#include "OgreQuadTree.h"
+#include "TerrainUploadScheduler.h"
+#include "TerrainStartup.h"
 #include "Ogre.h"
 #ifdef _USE_SKYX_
 #include "SkyX.h"
@@ -13,19 +16,14 @@ using namespace Ogre;
 
 void createSphere(const std::string& strName, const float r, const int nRings=16, const int nSegments=16);
 
-void LOD_init(const MapDimensions& mapInfo, int lodLevelCount, int gridDim, float morphStartRatio, const char* heightmapName, const char* hmap2Name);
-void LOD_deinit();
-void LOD_frameStarted(Ogre::SceneManager* scnMgr, const Ogre::Camera& cam);
-float getLODSqRange(size_t lodLevel);
-
-void OgreUpdateHeightmapBlendRatio(float ratio);
-
 #ifdef _USE_SKYX_
 void setSkyXPreset(int presetNo, SkyX::SkyX* skyX, SkyX::BasicController* controller, Ogre::Camera* camera);
 void getSkyXAtmosphereOptinos(int index, SkyX::AtmosphereManager::Options* options);
 #endif
 static std::vector<SceneNode*> _lodRangeSphereNodes;
 static bool _showRangeSheres = false;
+// collision patches kept around the camera, as a physics engine would around its bodies; 0 for none
+static float _collisionRadius = 0.0f;
 
 #ifdef _USE_SKYX_
 SkyX::SkyX* _skyX = 0;
@@ -59,6 +57,10 @@ class TestFrameListener : public ExampleFrameListener
 	Camera* LOD_camera;
 	// assuming the default value to be 1.0 in GPU
 	int hmapBlendRatio = 100; // = 1.0f
+	// in 1/10 keyframes, when heightmap keyframes are given
+	int keyframeTime = 0;
+	size_t collisionPatches = 0;
+	size_t collisionTriangles = 0;
 
 	GpuProgramParametersSharedPtr VPparams;
 	GpuProgramParametersSharedPtr FPparams;
@@ -72,8 +74,58 @@ public:
 	virtual bool frameStarted(const FrameEvent& evt)
 	{
 		Camera* cam = trace_main_camera ? mCamera : LOD_camera;
+		if (_collisionRadius > 0)
+		{
+			LODSphere sphere = { cam->getPosition(), _collisionRadius };
+			LOD_setCollisionPoints(std::vector<LODSphere>(1, sphere));
+		}
 		LOD_frameStarted(mSceneMgr, *cam);
 
+		std::vector<CollisionPatchPtr> added, removed;
+		LOD_getCollisionChanges(added, removed);
+		for (size_t i = 0; i < removed.size(); i++)
+			collisionTriangles -= removed[i]->indices.size() / 3;
+		for (size_t i = 0; i < added.size(); i++)
+			collisionTriangles += added[i]->indices.size() / 3;
+		collisionPatches += added.size() - removed.size();
+
+		const LODSelectStats& stats = LOD_getSelectStats();
+		mDebugText = "Nodes: " + StringConverter::toString(stats.selectedNodes) +
+			" Frustum culled: " + StringConverter::toString(stats.frustumCulledNodes) +
+			" Back-facing: " + StringConverter::toString(stats.backFacingNodes) +
+			" Error terminated: " + StringConverter::toString(stats.errorTerminatedNodes) +
+			" Hole masked: " + StringConverter::toString(stats.holeMaskedNodes) +
+			" Horizon culled: " + StringConverter::toString(stats.horizonCulledNodes) +
+			" Occlusion culled: " + StringConverter::toString(stats.occlusionCulledNodes) +
+			" PVS culled: " + StringConverter::toString(stats.pvsCulledNodes) +
+			" Objects visible: " + StringConverter::toString(stats.visibleObjects) +
+			" Nodes added/removed/changed: " + StringConverter::toString(LOD_getSelectionDelta().added.size()) + "/" +
+			StringConverter::toString(LOD_getSelectionDelta().removed.size()) + "/" +
+			StringConverter::toString(LOD_getSelectionDelta().changed.size()) +
+			" Uploads pending: " + StringConverter::toString(LOD_getUploadScheduler().getStats().pendingBytes / 1024) + " KB";
+		const TileStreamStats& tileStats = LOD_getTileStreamStats();
+		if (tileStats.residentTiles)
+		{
+			mDebugText += "\nTiles GPU/RAM: " + StringConverter::toString(tileStats.residentTiles) + "/" + StringConverter::toString(tileStats.cachedTiles) +
+				" Queued: " + StringConverter::toString(tileStats.queuedTiles + tileStats.loadingTiles) +
+				" Latency p50/p95/p99: " + StringConverter::toString(tileStats.latencyP50) + "/" +
+				StringConverter::toString(tileStats.latencyP95) + "/" + StringConverter::toString(tileStats.latencyP99) + " ms" +
+				" Prefetch hits: " + StringConverter::toString(tileStats.prefetchHits) + "/" + StringConverter::toString(tileStats.prefetchedTiles) +
+				" Wasted: " + StringConverter::toString(tileStats.prefetchWastedBytes / 1024) + " KB";
+			if (tileStats.compressedTiles)
+				mDebugText += " BC4: " + StringConverter::toString(tileStats.compressedTiles) +
+					" max error " + StringConverter::toString(tileStats.maxCompressionError);
+		}
+		const ScatterStats& scatterStats = LOD_getScatterStats();
+		if (scatterStats.cachedPatches)
+			mDebugText += "\nScatter instances: " + StringConverter::toString(scatterStats.visibleInstances) +
+				" in " + StringConverter::toString(scatterStats.visiblePatches) + " patches" +
+				" Cached: " + StringConverter::toString(scatterStats.cachedInstances) +
+				" Pending: " + StringConverter::toString(scatterStats.pendingPatches);
+		if (_collisionRadius > 0)
+			mDebugText += "\nCollision patches: " + StringConverter::toString(collisionPatches) +
+				" Triangles: " + StringConverter::toString(collisionTriangles);
+
 		if (_showRangeSheres)
 		{
 			setLodSpherePosition(cam->getPosition());
@@ -116,6 +168,25 @@ public:
 			mTimeUntilNextToggle = 1;
 		}
 
+		if (LOD_getKeyframeCount() > 0)
+		{
+			if (mKeyboard->isKeyDown(OIS::KC_0) && mTimeUntilNextToggle <= 0)
+			{
+				if (keyframeTime > 0)
+					keyframeTime--;
+				LOD_setKeyframeTime(keyframeTime * 0.1f);
+				mTimeUntilNextToggle = 0.1f;
+			}
+			if (mKeyboard->isKeyDown(OIS::KC_1) && mTimeUntilNextToggle <= 0)
+			{
+				if (keyframeTime < (int)(LOD_getKeyframeCount() - 1) * 10)
+					keyframeTime++;
+				LOD_setKeyframeTime(keyframeTime * 0.1f);
+				mTimeUntilNextToggle = 0.1f;
+			}
+			return true;
+		}
+
 		if (mKeyboard->isKeyDown(OIS::KC_0) && mTimeUntilNextToggle <= 0)
 		{
 			hmapBlendRatio -= 10;
@@ -183,7 +254,7 @@ protected:
         mRoot->addFrameListener(mFrameListener);
 	}
 
-	void load_mapinfo(int* lodLevel, float *morphRatio, int* gridDim, MapDimensions* map, char* heightmapName, char* heightmap2Name, size_t buflen, Vector3* skyXTime)
+	void load_mapinfo(int* lodLevel, float *morphRatio, int* gridDim, MapDimensions* map, char* heightmapName, char* heightmap2Name, size_t buflen, Vector3* skyXTime, StringVector* keyframeNames)
 	{
 #ifdef NORMAL_TEXT_CONFIG
 		float nearClip, farClip;
@@ -226,6 +297,42 @@ protected:
 		String hmap2Name = cfg.getSetting("Heightmap2");
 		strcpy_s(heightmap2Name, buflen, hmap2Name.c_str());
 		*skyXTime = StringConverter::parseVector3(cfg.getSetting("SkyX Time"));
+		// optional, a space separated list of heightmaps animated over time
+		*keyframeNames = StringUtil::split(cfg.getSetting("Heightmap Keyframes"));
+		LOD_setGeometricErrorThreshold(StringConverter::parseReal(cfg.getSetting("LOD Error Threshold"), 1.0f));
+		LOD_setHeightmapNoData(StringConverter::parseInt(cfg.getSetting("Heightmap No Data"), -1));
+		LOD_setHorizonCulling(StringConverter::parseBool(cfg.getSetting("Horizon Culling"), false));
+		LOD_setOcclusionCulling(StringConverter::parseBool(cfg.getSetting("Occlusion Culling"), false),
+			StringConverter::parseInt(cfg.getSetting("Occlusion Buffer Width"), 256),
+			StringConverter::parseInt(cfg.getSetting("Occlusion Buffer Height"), 128));
+		// baked for this map by tools/TerrainPVSBake
+		const String pvsName = cfg.getSetting("PVS File");
+		if (!pvsName.empty())
+			LOD_loadPVS(pvsName.c_str());
+		// used when the heightmap is a tiled package (*.cdlod)
+		LOD_setTileCacheLimits(StringConverter::parseUnsignedInt(cfg.getSetting("Tile Cache Size"), 256),
+			StringConverter::parseUnsignedInt(cfg.getSetting("GPU Tile Slots"), 64),
+			StringConverter::parseInt(cfg.getSetting("Tile Uploads Per Frame"), 4));
+		LOD_setTileLoaderThreads(StringConverter::parseInt(cfg.getSetting("Tile Loader Threads"), 2));
+		// KB and ms of texture uploads per frame, 0 for no limit
+		LOD_setUploadBudget(StringConverter::parseUnsignedInt(cfg.getSetting("Upload Budget KB"), 4096) * 1024,
+			StringConverter::parseReal(cfg.getSetting("Upload Budget ms"), 2.0f));
+		LOD_setTilePrefetch(StringConverter::parseReal(cfg.getSetting("Tile Prefetch Seconds"), 2.0f),
+			StringConverter::parseInt(cfg.getSetting("Tile Prefetches Per Frame"), 8));
+		LOD_setTileCompression(StringConverter::parseBool(cfg.getSetting("Tile Texture Compression"), false),
+			StringConverter::parseReal(cfg.getSetting("Tile Compression Max Error"), 64.0f));
+		_collisionRadius = StringConverter::parseReal(cfg.getSetting("Collision Radius"), 0.0f);
+		LOD_setCollisionMorphTolerance(StringConverter::parseReal(cfg.getSetting("Collision Morph Tolerance"), 1.0f));
+		// a uniform test layer of instances per square unit, 0 for none
+		const float scatterDensity = StringConverter::parseReal(cfg.getSetting("Scatter Density"), 0.0f);
+		if (scatterDensity > 0)
+		{
+			TerrainScatterParams scatter = { 0, 0, 0, scatterDensity, 0.25f,
+				StringConverter::parseInt(cfg.getSetting("Scatter Max LOD Level"), 2), 4096, 1, 0.8f, 1.2f };
+			LOD_addScatterLayer(scatter);
+		}
+		LOD_setScatterCache(StringConverter::parseUnsignedInt(cfg.getSetting("Scatter Cache Instances"), 4 << 20),
+			StringConverter::parseInt(cfg.getSetting("Scatter Threads"), 2));
 
 		mCamera->setPosition(campPos);
 		mCamera->setDirection(Vector3(0, -1, -1));
@@ -265,10 +372,16 @@ protected:
 
 		float morphStartRatio = 0.66f;
 		Vector3 skyXTime;
+		StringVector keyframeNames;
 
-		load_mapinfo(&lodLevel, &morphStartRatio, &gridDim, &mapInfo, heightmapName, heightmap2Name, sizeof(heightmapName), &skyXTime);
-		LOD_init(mapInfo, lodLevel, gridDim, morphStartRatio, heightmapName, heightmap2Name);
-		OgreGridRenderable::initOgreGridRenderable(gridDim);
+		load_mapinfo(&lodLevel, &morphStartRatio, &gridDim, &mapInfo, heightmapName, heightmap2Name, sizeof(heightmapName), &skyXTime, &keyframeNames);
+		// terrain data and grid mesh overlap on the startup workers
+		StartupGraph startup;
+		LOD_addInitTasks(startup, mapInfo, lodLevel, gridDim, morphStartRatio, heightmapName, heightmap2Name);
+		OgreGridRenderable::addInitTasks(startup, gridDim);
+		startup.run(StartupGraph::defaultThreadCount());
+		LogManager::getSingleton().logMessage("Terrain startup timeline\n" + startup.formatTimeline());
+		LOD_setHeightmapKeyframes(keyframeNames);
 		OgreGridRenderable::addLight(light);
 
 		createSphere("BoundingSphere", 1);
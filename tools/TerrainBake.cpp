@@ -0,0 +1,550 @@
+// Offline terrain bake: raw DEM raster -> tiled terrain package (*.cdlod, see TerrainTileFormat.h)
+//
+// The input is streamed row by row and resampled to the 2^n * gridPixels + 1 heightmap the runtime expects,
+// so rasters larger than RAM can be baked. Only one band of tile rows per tile level and the min/max pyramid
+// are kept in memory. The min/max of the tiles are computed on worker threads.
+//
+// Build (no Ogre needed):
+//   g++ -O2 -std=c++11 -pthread -I../src TerrainBake.cpp ../src/TerrainPyramid.cpp ../src/TerrainTileCodec.cpp -o terrainbake
+
+#include "TerrainTileFormat.h"
+#include "TerrainPyramid.h"
+#include "TerrainTileCodec.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+enum SampleFormat
+{
+	FormatU16,
+	FormatS16,
+	FormatF32
+};
+
+struct BakeOptions
+{
+	std::string input;
+	std::string output;
+	unsigned int width;
+	unsigned int height;
+	SampleFormat format;
+	bool hasNoData;
+	float noData;
+	bool hasRange;
+	float rangeMin, rangeMax;
+	int lodLevelCount;
+	unsigned int gridPixels;
+	unsigned int tileGrids;
+	int gridDim;
+	TerrainTileEncoding encoding;
+	unsigned short quantizationStep;
+	float minX, minY, minZ;
+	float sizeX, sizeY, sizeZ;
+	int threads;
+};
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: terrainbake -i <dem> -W <width> -H <height> -o <out.cdlod> --map-size <x> <y> <z> [options]\n"
+		"  -f u16|s16|f32          little-endian sample format of the raw DEM (default u16)\n"
+		"  --nodata <value>        samples to ignore, they get the lowest height\n"
+		"  --range <min> <max>     heights mapped to 0..65535 (default: u16 as is, otherwise scanned)\n"
+		"  --lod-levels <n>        quadtree depth, 2^(n-1) unit grids on a side (default 8)\n"
+		"  --grid-pixels <n>       heightmap pixels per unit grid (default 8)\n"
+		"  --tile-grids <n>        unit grids per tile on a side, a power of two (default: 256 pixel tiles)\n"
+		"  --grid-dim <n>          vertices of a node patch on a side, as in mapinfo.ogre.cfg (default 33)\n"
+		"  --encoding raw|delta    tile encoding (default delta, see TerrainTileCodec.h); tiles it cannot shrink stay raw\n"
+		"  --max-error <n>         height units the delta encoding may round away (default 0, lossless)\n"
+		"  --map-min <x> <y> <z>   map starting position (default 0 0 0)\n"
+		"  --threads <n>           worker threads (default: all cores)\n");
+}
+
+static bool parseArgs(int argc, char** argv, BakeOptions& o)
+{
+	o.width = o.height = 0;
+	o.format = FormatU16;
+	o.hasNoData = false;
+	o.noData = 0;
+	o.hasRange = false;
+	o.rangeMin = 0;
+	o.rangeMax = 65535;
+	o.lodLevelCount = 8;
+	o.gridPixels = 8;
+	o.tileGrids = 0;
+	o.gridDim = 33;
+	o.encoding = TileEncodingDelta16;
+	o.quantizationStep = 1;
+	o.minX = o.minY = o.minZ = 0;
+	o.sizeX = o.sizeY = o.sizeZ = 0;
+	o.threads = (int)std::thread::hardware_concurrency();
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string a = argv[i];
+		int left = argc - i - 1;
+		if (a == "-i" && left >= 1) o.input = argv[++i];
+		else if (a == "-o" && left >= 1) o.output = argv[++i];
+		else if (a == "-W" && left >= 1) o.width = (unsigned int)atoi(argv[++i]);
+		else if (a == "-H" && left >= 1) o.height = (unsigned int)atoi(argv[++i]);
+		else if (a == "-f" && left >= 1)
+		{
+			std::string f = argv[++i];
+			if (f == "u16") o.format = FormatU16;
+			else if (f == "s16") o.format = FormatS16;
+			else if (f == "f32") o.format = FormatF32;
+			else return false;
+		}
+		else if (a == "--nodata" && left >= 1) { o.hasNoData = true; o.noData = (float)atof(argv[++i]); }
+		else if (a == "--range" && left >= 2) { o.hasRange = true; o.rangeMin = (float)atof(argv[++i]); o.rangeMax = (float)atof(argv[++i]); }
+		else if (a == "--lod-levels" && left >= 1) o.lodLevelCount = atoi(argv[++i]);
+		else if (a == "--grid-pixels" && left >= 1) o.gridPixels = (unsigned int)atoi(argv[++i]);
+		else if (a == "--tile-grids" && left >= 1) o.tileGrids = (unsigned int)atoi(argv[++i]);
+		else if (a == "--grid-dim" && left >= 1) o.gridDim = atoi(argv[++i]);
+		else if (a == "--encoding" && left >= 1)
+		{
+			std::string e = argv[++i];
+			if (e == "raw") o.encoding = TileEncodingRaw16;
+			else if (e == "delta") o.encoding = TileEncodingDelta16;
+			else return false;
+		}
+		else if (a == "--max-error" && left >= 1) o.quantizationStep = terrainQuantizationStep((unsigned int)atoi(argv[++i]));
+		else if (a == "--map-min" && left >= 3) { o.minX = (float)atof(argv[++i]); o.minY = (float)atof(argv[++i]); o.minZ = (float)atof(argv[++i]); }
+		else if (a == "--map-size" && left >= 3) { o.sizeX = (float)atof(argv[++i]); o.sizeY = (float)atof(argv[++i]); o.sizeZ = (float)atof(argv[++i]); }
+		else if (a == "--threads" && left >= 1) o.threads = atoi(argv[++i]);
+		else return false;
+	}
+	if (o.input.empty() || o.output.empty() || o.width < 2 || o.height < 2 || o.sizeX <= 0 || o.sizeZ <= 0 ||
+		o.lodLevelCount < 1 || o.lodLevelCount > 16 || o.gridPixels == 0 || o.gridDim < 2)
+		return false;
+
+	const unsigned int nGrid = 1u << (o.lodLevelCount - 1);
+	if (o.tileGrids == 0)
+	{
+		o.tileGrids = 1;
+		while (o.tileGrids * 2 * o.gridPixels <= 256 && o.tileGrids * 2 <= nGrid)
+			o.tileGrids *= 2;
+	}
+	if ((o.tileGrids & (o.tileGrids - 1)) != 0 || o.tileGrids > nGrid)
+		return false;
+	if (o.encoding == TileEncodingRaw16)
+		o.quantizationStep = 1;
+	o.threads = std::max(o.threads, 1);
+	return true;
+}
+
+static bool seekTo(FILE* fp, unsigned long long offset)
+{
+#ifdef _WIN32
+	return _fseeki64(fp, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(fp, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static size_t sampleSize(SampleFormat format)
+{
+	return format == FormatF32 ? 4 : 2;
+}
+
+// DEM rows read on demand, converted to float
+class DemReader
+{
+private:
+	FILE* m_fp;
+	const BakeOptions& m_options;
+	std::vector<unsigned char> m_raw;
+public:
+	DemReader(const BakeOptions& options) : m_fp(0), m_options(options) {}
+	~DemReader() { if (m_fp) fclose(m_fp); }
+
+	bool open()
+	{
+		m_fp = fopen(m_options.input.c_str(), "rb");
+		return m_fp != 0;
+	}
+
+	// NaN for no data
+	bool readRow(unsigned int row, std::vector<float>& out)
+	{
+		const size_t rowBytes = (size_t)m_options.width * sampleSize(m_options.format);
+		m_raw.resize(rowBytes);
+		if (!seekTo(m_fp, (unsigned long long)row * rowBytes) || fread(&m_raw[0], 1, rowBytes, m_fp) != rowBytes)
+			return false;
+		out.resize(m_options.width);
+		for (unsigned int x = 0; x < m_options.width; x++)
+		{
+			float v;
+			if (m_options.format == FormatU16)
+			{
+				unsigned short s;
+				memcpy(&s, &m_raw[x * 2], 2);
+				v = s;
+			}
+			else if (m_options.format == FormatS16)
+			{
+				short s;
+				memcpy(&s, &m_raw[x * 2], 2);
+				v = s;
+			}
+			else
+				memcpy(&v, &m_raw[x * 4], 4);
+			if ((m_options.hasNoData && v == m_options.noData) || v != v)
+				v = NAN;
+			out[x] = v;
+		}
+		return true;
+	}
+};
+
+static void parallelFor(int threads, size_t count, const std::function<void(size_t)>& fn)
+{
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> pool;
+	const int n = (int)std::min<size_t>(threads, count);
+	for (int t = 0; t < n; t++)
+	{
+		pool.push_back(std::thread([&]()
+		{
+			for (size_t i = next++; i < count; i = next++)
+				fn(i);
+		}));
+	}
+	for (size_t t = 0; t < pool.size(); t++)
+		pool[t].join();
+}
+
+struct TileLevelBand
+{
+	unsigned int width;		// pixels of a row at this level
+	unsigned int tilesPerSide;
+	unsigned int rowCount;	// rows of the band filled so far
+	unsigned int tileRow;
+	std::vector<unsigned short> pixels;		// resolution rows
+};
+
+class TerrainBaker
+{
+private:
+	const BakeOptions& m_options;
+	TerrainPackageHeader m_header;
+	unsigned int m_resolution;
+	int m_baseLevel;
+	unsigned int m_outputSize;
+	TerrainPyramidParams m_tileParams;	// pyramid of a level 0 tile
+	FILE* m_out;
+	std::vector<TerrainTileEntry> m_directory;
+	std::vector<TileLevelBand> m_bands;
+	HeightMinMaxPyramid m_pyramid;
+	// geometric error of the nodes above the tile base level, measured on their tiles
+	std::vector<std::vector<float> > m_nodeErrors;
+	unsigned long long m_offset;
+
+	void emitTileRow(int tileLevel);
+public:
+	TerrainBaker(const BakeOptions& options) : m_options(options), m_out(0), m_offset(0) {}
+	~TerrainBaker()
+	{
+		if (m_out)
+			fclose(m_out);
+		freeHeightMinMax(m_pyramid);
+	}
+
+	bool run();
+};
+
+void TerrainBaker::emitTileRow(int tileLevel)
+{
+	TileLevelBand& band = m_bands[tileLevel];
+	const unsigned int R = m_resolution;
+	const unsigned int n = band.tilesPerSide;
+	const unsigned int tz = band.tileRow;
+	const int lodLevel = m_baseLevel + tileLevel;
+	const unsigned int nGrid = m_header.lodLevelCount ? 1u << (m_header.lodLevelCount - 1) : 1;
+
+	std::vector<std::vector<unsigned short> > tiles(n);
+	std::vector<std::vector<unsigned char> > encoded(n);
+	parallelFor(m_options.threads, n, [&](size_t tx)
+	{
+		std::vector<unsigned short>& tile = tiles[tx];
+		tile.resize((size_t)R * R);
+		for (unsigned int z = 0; z < R; z++)
+			memcpy(&tile[z * R], &band.pixels[(size_t)z * band.width + tx * (R - 1)], R * sizeof(unsigned short));
+
+		if (tileLevel == 0)
+		{
+			// the nodes up to the tile base level lie within the tile, same results as on the whole heightmap
+			HeightMinMaxPyramid local;
+			buildHeightMinMax(m_tileParams, &tile[0], R, local);
+			for (int l = 0; l <= m_baseLevel; l++)
+			{
+				const unsigned int localSide = m_options.tileGrids >> l;
+				const unsigned int side = nGrid >> l;
+				for (unsigned int z = 0; z < localSide; z++)
+					memcpy(m_pyramid[l] + (size_t)(tz * localSide + z) * side + tx * localSide, local[l] + z * localSide, localSide * sizeof(HeightMinMax));
+			}
+			freeHeightMinMax(local);
+		}
+		else
+		{
+			// the tile is the node: its patch against its own pixels
+			std::vector<float> scratch;
+			m_nodeErrors[lodLevel][(size_t)tz * n + tx] = computeGeometricError(m_tileParams, &tile[0], R, m_baseLevel, 0, 0, scratch);
+		}
+
+		if (m_options.encoding == TileEncodingDelta16)
+			encodeTerrainTile(&tile[0], R, m_options.quantizationStep, encoded[tx]);
+	});
+
+	for (unsigned int tx = 0; tx < n; tx++)
+	{
+		TerrainTileEntry& entry = m_directory[terrainTileIndex(m_header, tileLevel, tx, tz)];
+		entry.offset = m_offset;
+		entry.encoding = m_options.encoding;
+		// noise does not predict, such a tile is stored raw; the heights are quantized already, so nothing changes
+		if (entry.encoding == TileEncodingDelta16 && encoded[tx].size() >= (size_t)R * R * sizeof(unsigned short))
+			entry.encoding = TileEncodingRaw16;
+		if (entry.encoding == TileEncodingDelta16)
+		{
+			entry.size = (unsigned int)encoded[tx].size();
+			fwrite(&encoded[tx][0], 1, entry.size, m_out);
+		}
+		else
+		{
+			entry.size = R * R * sizeof(unsigned short);
+			fwrite(&tiles[tx][0], 1, entry.size, m_out);
+		}
+		m_offset += entry.size;
+	}
+
+	// the last row is shared with the next tile row
+	memmove(&band.pixels[0], &band.pixels[(size_t)(R - 1) * band.width], band.width * sizeof(unsigned short));
+	band.rowCount = 1;
+	band.tileRow++;
+}
+
+bool TerrainBaker::run()
+{
+	const BakeOptions& o = m_options;
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	DemReader reader(o);
+	if (!reader.open())
+	{
+		fprintf(stderr, "cannot open %s\n", o.input.c_str());
+		return false;
+	}
+
+	// height range
+	float rangeMin = o.rangeMin, rangeMax = o.rangeMax;
+	if (!o.hasRange && o.format != FormatU16)
+	{
+		rangeMin = FLT_MAX;
+		rangeMax = -FLT_MAX;
+		std::vector<float> row;
+		for (unsigned int y = 0; y < o.height; y++)
+		{
+			if (!reader.readRow(y, row))
+			{
+				fprintf(stderr, "cannot read row %u of %s\n", y, o.input.c_str());
+				return false;
+			}
+			for (unsigned int x = 0; x < o.width; x++)
+			{
+				if (row[x] != row[x])
+					continue;
+				rangeMin = std::min(rangeMin, row[x]);
+				rangeMax = std::max(rangeMax, row[x]);
+			}
+		}
+		if (rangeMin > rangeMax)
+			rangeMin = rangeMax = 0;
+		printf("height range %g .. %g\n", rangeMin, rangeMax);
+	}
+	const float rangeScale = rangeMax > rangeMin ? 65535.0f / (rangeMax - rangeMin) : 0.0f;
+
+	// package layout
+	const unsigned int nGrid = 1u << (o.lodLevelCount - 1);
+	memset(&m_header, 0, sizeof(m_header));
+	memcpy(m_header.magic, TERRAIN_PACKAGE_MAGIC, 4);
+	m_header.version = TERRAIN_PACKAGE_VERSION;
+	m_header.lodLevelCount = o.lodLevelCount;
+	m_header.gridPixels = o.gridPixels;
+	m_header.tileGrids = o.tileGrids;
+	m_baseLevel = terrainTileBaseLODLevel(m_header);
+	m_header.tileLevelCount = o.lodLevelCount - m_baseLevel;
+	m_header.tileCount = terrainTileIndex(m_header, m_header.tileLevelCount, 0, 0);
+	m_header.minX = o.minX; m_header.minY = o.minY; m_header.minZ = o.minZ;
+	m_header.sizeX = o.sizeX; m_header.sizeY = o.sizeY; m_header.sizeZ = o.sizeZ;
+	m_resolution = terrainTileResolution(m_header);
+	m_outputSize = nGrid * o.gridPixels + 1;
+	m_directory.resize(m_header.tileCount);
+
+	// same slopes as the runtime computes from MapDimensions
+	m_tileParams.nGridX = m_tileParams.nGridZ = o.tileGrids;
+	m_tileParams.lodLevelCount = m_baseLevel + 1;
+	m_tileParams.nPixelX = m_tileParams.nPixelZ = o.gridPixels;
+	m_tileParams.gridDim = o.gridDim;
+	m_tileParams.slopeX = o.sizeY / 65535.0f / (o.sizeX / nGrid / o.gridPixels);
+	m_tileParams.slopeZ = o.sizeY / 65535.0f / (o.sizeZ / nGrid / o.gridPixels);
+
+	for (int l = 0; l < o.lodLevelCount; l++)
+	{
+		const unsigned int side = nGrid >> l;
+		m_pyramid.push_back(new HeightMinMax[(size_t)side * side]);
+	}
+	m_nodeErrors.resize(o.lodLevelCount);
+	for (int l = m_baseLevel + 1; l < o.lodLevelCount; l++)
+	{
+		const unsigned int side = nGrid >> l;
+		m_nodeErrors[l].resize((size_t)side * side);
+	}
+
+	m_bands.resize(m_header.tileLevelCount);
+	for (unsigned int t = 0; t < m_header.tileLevelCount; t++)
+	{
+		TileLevelBand& band = m_bands[t];
+		band.width = ((m_outputSize - 1) >> t) + 1;
+		band.tilesPerSide = terrainTilesPerSide(m_header, t);
+		band.rowCount = 0;
+		band.tileRow = 0;
+		band.pixels.resize((size_t)m_resolution * band.width);
+	}
+
+	m_out = fopen(o.output.c_str(), "wb");
+	if (!m_out)
+	{
+		fprintf(stderr, "cannot create %s\n", o.output.c_str());
+		return false;
+	}
+	// the header is written again at the end with the offsets
+	fwrite(&m_header, 1, sizeof(m_header), m_out);
+	m_offset = sizeof(m_header);
+
+	printf("%ux%u %s -> %ux%u heightmap, %u tiles of %ux%u in %u levels, %d threads\n",
+		o.width, o.height, o.input.c_str(), m_outputSize, m_outputSize, m_header.tileCount,
+		m_resolution, m_resolution, m_header.tileLevelCount, o.threads);
+
+	// bilinear resampling, output row by row with the two source rows around it
+	std::vector<float> rows[2];
+	int rowIndex[2] = { -1, -1 };
+	std::vector<unsigned short> out(m_outputSize);
+	for (unsigned int y = 0; y < m_outputSize; y++)
+	{
+		const double sy = (double)y * (o.height - 1) / (m_outputSize - 1);
+		const int y0 = std::min((int)sy, (int)o.height - 2);
+		const float fy = (float)(sy - y0);
+		for (int k = 0; k < 2; k++)
+		{
+			if (rowIndex[k] == y0 + k)
+				continue;
+			if (rowIndex[1 - k] == y0 + k)
+			{
+				rows[k].swap(rows[1 - k]);
+				std::swap(rowIndex[k], rowIndex[1 - k]);
+				continue;
+			}
+			if (!reader.readRow(y0 + k, rows[k]))
+			{
+				fprintf(stderr, "cannot read row %d of %s\n", y0 + k, o.input.c_str());
+				return false;
+			}
+			rowIndex[k] = y0 + k;
+		}
+		for (unsigned int x = 0; x < m_outputSize; x++)
+		{
+			const double sx = (double)x * (o.width - 1) / (m_outputSize - 1);
+			const int x0 = std::min((int)sx, (int)o.width - 2);
+			const float fx = (float)(sx - x0);
+			const float s[4] = { rows[0][x0], rows[0][x0 + 1], rows[1][x0], rows[1][x0 + 1] };
+			const float w[4] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+			float v = 0, weight = 0;
+			for (int i = 0; i < 4; i++)
+			{
+				if (s[i] != s[i])
+					continue;
+				v += s[i] * w[i];
+				weight += w[i];
+			}
+			v = weight > 0 ? v / weight : rangeMin;
+			float h = (v - rangeMin) * rangeScale;
+			out[x] = (unsigned short)(h < 0 ? 0 : (h > 65535 ? 65535 : h + 0.5f));
+			// the pyramid has to bound the heights the runtime decodes
+			if (o.quantizationStep > 1)
+				out[x] = quantizeHeight(out[x], o.quantizationStep);
+		}
+
+		// every other row and pixel of the level below for each tile level
+		for (unsigned int t = 0; t < m_header.tileLevelCount; t++)
+		{
+			if (y & ((1u << t) - 1))
+				break;
+			TileLevelBand& band = m_bands[t];
+			unsigned short* dst = &band.pixels[(size_t)band.rowCount * band.width];
+			for (unsigned int x = 0; x < band.width; x++)
+				dst[x] = out[x << t];
+			if (++band.rowCount == m_resolution)
+				emitTileRow(t);
+		}
+
+		if ((y & 1023) == 0)
+			printf("row %u/%u\r", y, m_outputSize), fflush(stdout);
+	}
+
+	// the nodes above the tile base level from their children and their own error
+	for (int l = m_baseLevel + 1; l < o.lodLevelCount; l++)
+	{
+		const unsigned int side = nGrid >> l;
+		const unsigned int lowerSide = side * 2;
+		for (unsigned int z = 0; z < side; z++)
+		{
+			for (unsigned int x = 0; x < side; x++)
+			{
+				const HeightMinMax* lower = m_pyramid[l - 1] + (size_t)z * 2 * lowerSide + x * 2;
+				const HeightMinMax* children[4] = { &lower[0], &lower[1], &lower[lowerSide], &lower[lowerSide + 1] };
+				mergeHeightMinMax(m_pyramid[l] + (size_t)z * side + x, children, m_nodeErrors[l][(size_t)z * side + x]);
+			}
+		}
+	}
+
+	m_header.pyramidOffset = m_offset;
+	for (int l = 0; l < o.lodLevelCount; l++)
+	{
+		const size_t side = nGrid >> l;
+		fwrite(m_pyramid[l], sizeof(HeightMinMax), side * side, m_out);
+		m_offset += side * side * sizeof(HeightMinMax);
+	}
+	m_header.directoryOffset = m_offset;
+	fwrite(&m_directory[0], sizeof(TerrainTileEntry), m_directory.size(), m_out);
+	seekTo(m_out, 0);
+	fwrite(&m_header, 1, sizeof(m_header), m_out);
+	if (ferror(m_out))
+	{
+		fprintf(stderr, "cannot write %s\n", o.output.c_str());
+		return false;
+	}
+
+	const float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+	printf("wrote %s, %llu bytes in %.1f s\n", o.output.c_str(), m_offset + m_directory.size() * sizeof(TerrainTileEntry), seconds);
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	BakeOptions options;
+	if (!parseArgs(argc, argv, options))
+	{
+		usage();
+		return 1;
+	}
+	TerrainBaker baker(options);
+	return baker.run() ? 0 : 1;
+}
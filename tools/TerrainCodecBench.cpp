@@ -0,0 +1,216 @@
+// Tile codec benchmark: size, decode speed and error of TileEncodingDelta16 against raw R16 tiles,
+// and size, encode speed and error of the BC4 tile textures
+//
+// The heightmap is cut into tiles the way the bake tool does, each tile is encoded once per error bound
+// and decoded repeatedly; decode speed is measured in decoded bytes per second. BC4 is decoded by the GPU,
+// its bytes are those of the padded texture and its rows are encoded on one and on --threads threads.
+//
+// Build (no Ogre needed):
+//   g++ -O2 -std=c++11 -pthread -I../src TerrainCodecBench.cpp ../src/TerrainTileCodec.cpp ../src/TerrainBC4.cpp -o terraincodecbench
+
+#include "TerrainTileCodec.h"
+#include "TerrainBC4.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: terraincodecbench -i <heightmap.r16> -W <width> -H <height> [options]\n"
+		"  --tile <n>              tile resolution in pixels (default 257)\n"
+		"  --max-error <n>...      error bounds to test (default 0 1 2 8)\n"
+		"  --repeat <n>            decode passes, the fastest counts (default 5)\n"
+		"  --threads <n>           BC4 encoder threads (default: one per core)\n");
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+	std::string input;
+	unsigned int width = 0, height = 0, resolution = 257;
+	int repeat = 5;
+	int threads = std::max((int)std::thread::hardware_concurrency(), 1);
+	std::vector<unsigned int> maxErrors;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string a = argv[i];
+		if (a == "-i" && i + 1 < argc) input = argv[++i];
+		else if (a == "-W" && i + 1 < argc) width = (unsigned int)atoi(argv[++i]);
+		else if (a == "-H" && i + 1 < argc) height = (unsigned int)atoi(argv[++i]);
+		else if (a == "--tile" && i + 1 < argc) resolution = (unsigned int)atoi(argv[++i]);
+		else if (a == "--repeat" && i + 1 < argc) repeat = std::max(atoi(argv[++i]), 1);
+		else if (a == "--threads" && i + 1 < argc) threads = std::max(atoi(argv[++i]), 1);
+		else if (a == "--max-error")
+		{
+			while (i + 1 < argc && argv[i + 1][0] != '-')
+				maxErrors.push_back((unsigned int)atoi(argv[++i]));
+		}
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+	if (input.empty() || resolution < 2 || width < resolution || height < resolution)
+	{
+		usage();
+		return 1;
+	}
+	if (maxErrors.empty())
+	{
+		const unsigned int defaults[] = { 0, 1, 2, 8 };
+		maxErrors.assign(defaults, defaults + 4);
+	}
+
+	std::vector<unsigned short> heightmap((size_t)width * height);
+	FILE* fp = fopen(input.c_str(), "rb");
+	if (!fp || fread(&heightmap[0], sizeof(unsigned short), heightmap.size(), fp) != heightmap.size())
+	{
+		fprintf(stderr, "cannot read %s\n", input.c_str());
+		if (fp)
+			fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	// whole tiles only, sharing their borders
+	const unsigned int tilesX = (width - 1) / (resolution - 1);
+	const unsigned int tilesZ = (height - 1) / (resolution - 1);
+	const size_t tilePixels = (size_t)resolution * resolution;
+	std::vector<std::vector<unsigned short> > tiles;
+	for (unsigned int tz = 0; tz < tilesZ; tz++)
+	{
+		for (unsigned int tx = 0; tx < tilesX; tx++)
+		{
+			tiles.push_back(std::vector<unsigned short>(tilePixels));
+			for (unsigned int z = 0; z < resolution; z++)
+				memcpy(&tiles.back()[z * resolution], &heightmap[(size_t)(tz * (resolution - 1) + z) * width + tx * (resolution - 1)],
+					resolution * sizeof(unsigned short));
+		}
+	}
+	const double rawBytes = (double)tiles.size() * tilePixels * sizeof(unsigned short);
+	printf("%u tiles of %ux%u, %.1f MB raw R16\n\n", (unsigned int)tiles.size(), resolution, resolution, rawBytes / (1 << 20));
+	printf("%-10s %6s %12s %8s %12s %12s %10s\n", "encoding", "step", "bytes", "ratio", "encode MB/s", "decode MB/s", "max error");
+
+	std::vector<unsigned short> decoded(tilePixels);
+
+	// raw R16 baseline: the decode is a copy
+	double best = 1e9;
+	for (int r = 0; r < repeat; r++)
+	{
+		const Clock::time_point start = Clock::now();
+		for (size_t t = 0; t < tiles.size(); t++)
+			memcpy(&decoded[0], &tiles[t][0], tilePixels * sizeof(unsigned short));
+		best = std::min(best, seconds(start));
+	}
+	printf("%-10s %6d %12.0f %8.2f %12s %12.0f %10d\n", "raw16", 1, rawBytes, 1.0, "-", rawBytes / best / (1 << 20), 0);
+
+	for (size_t e = 0; e < maxErrors.size(); e++)
+	{
+		const unsigned short step = terrainQuantizationStep(maxErrors[e]);
+		std::vector<std::vector<unsigned char> > encoded(tiles.size());
+		size_t encodedBytes = 0;
+		Clock::time_point start = Clock::now();
+		for (size_t t = 0; t < tiles.size(); t++)
+		{
+			encodeTerrainTile(&tiles[t][0], resolution, step, encoded[t]);
+			encodedBytes += encoded[t].size();
+		}
+		const double encodeSeconds = seconds(start);
+
+		best = 1e9;
+		bool ok = true;
+		for (int r = 0; r < repeat && ok; r++)
+		{
+			start = Clock::now();
+			for (size_t t = 0; t < tiles.size(); t++)
+				ok = ok && decodeTerrainTile(&encoded[t][0], encoded[t].size(), resolution, &decoded[0]);
+			best = std::min(best, seconds(start));
+		}
+
+		int maxError = 0;
+		for (size_t t = 0; t < tiles.size() && ok; t++)
+		{
+			ok = decodeTerrainTile(&encoded[t][0], encoded[t].size(), resolution, &decoded[0]);
+			for (size_t i = 0; i < tilePixels; i++)
+				maxError = std::max(maxError, abs((int)decoded[i] - (int)tiles[t][i]));
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "decoding failed at max error %u\n", maxErrors[e]);
+			return 1;
+		}
+		printf("%-10s %6d %12u %8.2f %12.0f %12.0f %10d\n", "delta16", step, (unsigned int)encodedBytes, rawBytes / encodedBytes,
+			rawBytes / encodeSeconds / (1 << 20), rawBytes / best / (1 << 20), maxError);
+	}
+
+	// BC4 on one thread per tile, the way the loaders encode, then each tile spread over the threads
+	std::vector<BC4Tile> bc4(tiles.size());
+	for (int pass = 0; pass < 2; pass++)
+	{
+		const int n = pass == 0 ? 1 : threads;
+		if (pass == 1 && n == 1)
+			break;
+		size_t bc4Bytes = 0;
+		const Clock::time_point start = Clock::now();
+		for (size_t t = 0; t < tiles.size(); t++)
+		{
+			if (n == 1)
+				encodeBC4Tile(&tiles[t][0], resolution, resolution, bc4[t]);
+			else
+				encodeBC4TileParallel(&tiles[t][0], resolution, resolution, bc4[t], n);
+			bc4Bytes += bc4[t].blocks.size();
+		}
+		const double encodeSeconds = seconds(start);
+
+		// the error the encoder reports has to match the decoded texture's
+		int maxError = 0;
+		for (size_t t = 0; t < tiles.size(); t++)
+		{
+			decodeBC4Tile(bc4[t], &decoded[0]);
+			int tileError = 0;
+			for (size_t i = 0; i < tilePixels; i++)
+				tileError = std::max(tileError, abs((int)decoded[i] - (int)tiles[t][i]));
+			if (tileError > bc4[t].maxError + 1.0f)
+			{
+				fprintf(stderr, "BC4 tile %u decodes with error %d, reported %.1f\n", (unsigned int)t, tileError, bc4[t].maxError);
+				return 1;
+			}
+			maxError = std::max(maxError, tileError);
+		}
+		char name[16];
+		snprintf(name, sizeof(name), "bc4/%dt", n);
+		printf("%-10s %6s %12u %8.2f %12.0f %12s %10d\n", name, "-", (unsigned int)bc4Bytes, rawBytes / bc4Bytes,
+			rawBytes / encodeSeconds / (1 << 20), "gpu", maxError);
+	}
+
+	// the runtime keeps a tile as BC4 only if its error is within the bound
+	std::vector<float> errors(tiles.size());
+	double sqError = 0;
+	for (size_t t = 0; t < tiles.size(); t++)
+	{
+		errors[t] = bc4[t].maxError;
+		sqError += (double)bc4[t].rmsError * bc4[t].rmsError;
+	}
+	std::sort(errors.begin(), errors.end());
+	printf("\nbc4 error per tile: median %.1f, max %.1f, rms %.2f\n", errors[errors.size() / 2], errors.back(), sqrt(sqError / tiles.size()));
+	for (size_t e = 0; e < maxErrors.size(); e++)
+	{
+		const size_t within = std::upper_bound(errors.begin(), errors.end(), (float)maxErrors[e]) - errors.begin();
+		printf("  tiles within max error %u: %u/%u\n", maxErrors[e], (unsigned int)within, (unsigned int)tiles.size());
+	}
+	return 0;
+}
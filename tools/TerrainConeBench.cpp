@@ -0,0 +1,255 @@
+// Normal cone check: the cones of the min/max pyramid against the triangles the renderer draws
+//
+// Every node of every level is meshed like OgreGridRenderable: gridDim x gridDim vertices over the node, heights
+// sampled bilinearly from the heightmap, each quad split along either diagonal. The mesh is also morphed toward
+// the parent's as the vertex shader does, by the same factor over the node and by a factor going from 0 to 1
+// across it, steeper than any morph area of the runtime.
+// Each triangle normal has to lie within the cone of its node; the violations and how far out they are is printed,
+// along with how tight the cones are. Without -i, a smooth and a noisy map are generated.
+//
+// Exits with 1 if a triangle is out of its cone.
+//
+// Build (no Ogre needed):
+//   g++ -O2 -std=c++11 -pthread -I../src TerrainConeBench.cpp ../src/TerrainPyramid.cpp -o terrainconebench
+
+#include "TerrainPyramid.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: terrainconebench [options]\n"
+		"  -i <heightmap.r16>      heightmap to check (default: a generated smooth and noisy map)\n"
+		"  -W <width>              its width, 2^n * grid pixels + 1 (default 513)\n"
+		"  --grid-pixels <n>       heightmap pixels per unit grid (default 16)\n"
+		"  --grid-dim <n>          vertices of a node patch on a side (default 33)\n"
+		"  --size <x> <y> <z>      world size of the map (default 4096 256 4096)\n");
+}
+
+static const float _radToDeg = 57.2957795f;
+// float error of the normals, not a violation
+static const float _tolerance = 1e-4f;
+
+struct ConeStats
+{
+	size_t triangles;
+	size_t outside;
+	float worstExcess;		// radians out of the cone
+};
+
+struct Vertex
+{
+	float x, z;		// in pixels
+	float y;		// in world units
+};
+
+static float sampleBilinear(const std::vector<unsigned short>& heights, unsigned int width, float fx, float fz)
+{
+	const int x0 = std::min((int)fx, (int)width - 2);
+	const int z0 = std::min((int)fz, (int)width - 2);
+	const float tx = fx - x0, tz = fz - z0;
+	const unsigned short* p = &heights[(size_t)z0 * width + x0];
+	const float top = p[0] + (p[1] - p[0]) * tx;
+	const float bottom = p[width] + (p[width + 1] - p[width]) * tx;
+	return top + (bottom - top) * tz;
+}
+
+static void checkTriangle(const Vertex& a, const Vertex& b, const Vertex& c, float pixelSizeX, float pixelSizeZ,
+	const float axis[3], float spread, ConeStats& stats)
+{
+	const float e1[3] = { (b.x - a.x) * pixelSizeX, b.y - a.y, (b.z - a.z) * pixelSizeZ };
+	const float e2[3] = { (c.x - a.x) * pixelSizeX, c.y - a.y, (c.z - a.z) * pixelSizeZ };
+	float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+	const float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	// collapsed by the morph, not rasterized
+	if (len < 1e-6f * (fabsf(e1[0]) + fabsf(e1[2])) * (fabsf(e2[0]) + fabsf(e2[2])))
+		return;
+	if (n[1] < 0)
+		n[0] = -n[0], n[1] = -n[1], n[2] = -n[2];
+	const float cosAngle = (n[0] * axis[0] + n[1] * axis[1] + n[2] * axis[2]) / len;
+	const float angle = acosf(std::max(-1.0f, std::min(1.0f, cosAngle)));
+	stats.triangles++;
+	if (angle > spread + _tolerance)
+	{
+		stats.outside++;
+		stats.worstExcess = std::max(stats.worstExcess, angle - spread);
+	}
+}
+
+// the cones of all the nodes against the meshes morphed uniformly and along a gradient
+static void checkCones(const char* name, const std::vector<unsigned short>& heights, unsigned int width, const TerrainPyramidParams& p,
+	float sizeX, float sizeZ, ConeStats& uniformStats, ConeStats& gradedStats)
+{
+	HeightMinMaxPyramid pyramid;
+	buildHeightMinMax(p, &heights[0], width, pyramid);
+	const float pixelSizeX = sizeX / (width - 1), pixelSizeZ = sizeZ / (width - 1);
+	const int gridDim = p.gridDim;
+	const float morphs[] = { 0.0f, 0.5f, 1.0f };
+
+	printf("%s\n  level  nodes  no cone  mean spread\n", name);
+	std::vector<Vertex> mesh((size_t)gridDim * gridDim);
+	for (int lodLevel = 0; lodLevel < p.lodLevelCount; lodLevel++)
+	{
+		const unsigned int nX = p.nGridX >> lodLevel, nZ = p.nGridZ >> lodLevel;
+		const float nodePixelsX = (float)(p.nPixelX << lodLevel), nodePixelsZ = (float)(p.nPixelZ << lodLevel);
+		size_t noCone = 0;
+		double spreadSum = 0;
+		for (unsigned int iz = 0; iz < nZ; iz++)
+		{
+			for (unsigned int ix = 0; ix < nX; ix++)
+			{
+				float axis[3], spread;
+				if (!decodeNormalCone(pyramid[lodLevel][iz * nX + ix], axis, spread))
+				{
+					noCone++;
+					continue;
+				}
+				spreadSum += spread;
+				for (int m = 0; m < 4; m++)
+				{
+					// the odd vertices move toward the even one before them, on both axes
+					for (int z = 0; z < gridDim; z++)
+					{
+						for (int x = 0; x < gridDim; x++)
+						{
+							const float k = m < 3 ? morphs[m] : (float)(x + z) / (2 * (gridDim - 1));
+							Vertex& v = mesh[z * gridDim + x];
+							v.x = ix * nodePixelsX + ((x & 1) ? x - k : (float)x) * nodePixelsX / (gridDim - 1);
+							v.z = iz * nodePixelsZ + ((z & 1) ? z - k : (float)z) * nodePixelsZ / (gridDim - 1);
+							v.y = sampleBilinear(heights, width, v.x, v.z) * p.slopeX * pixelSizeX;
+						}
+					}
+					ConeStats& stats = m < 3 ? uniformStats : gradedStats;
+					for (int z = 0; z + 1 < gridDim; z++)
+					{
+						for (int x = 0; x + 1 < gridDim; x++)
+						{
+							const Vertex& v00 = mesh[z * gridDim + x];
+							const Vertex& v10 = mesh[z * gridDim + x + 1];
+							const Vertex& v01 = mesh[(z + 1) * gridDim + x];
+							const Vertex& v11 = mesh[(z + 1) * gridDim + x + 1];
+							checkTriangle(v00, v10, v01, pixelSizeX, pixelSizeZ, axis, spread, stats);
+							checkTriangle(v10, v11, v01, pixelSizeX, pixelSizeZ, axis, spread, stats);
+							checkTriangle(v00, v10, v11, pixelSizeX, pixelSizeZ, axis, spread, stats);
+							checkTriangle(v00, v11, v01, pixelSizeX, pixelSizeZ, axis, spread, stats);
+						}
+					}
+				}
+			}
+		}
+		const size_t nodes = (size_t)nX * nZ;
+		printf("  %5d %6u %7.1f%% %10.1f deg\n", lodLevel, (unsigned int)nodes, 100.0 * noCone / nodes,
+			nodes > noCone ? spreadSum / (nodes - noCone) * _radToDeg : 0.0);
+	}
+	freeHeightMinMax(pyramid);
+}
+
+static void printStats(const char* what, const ConeStats& stats)
+{
+	printf("  %-16s %10u triangles, %u out of their cone", what, (unsigned int)stats.triangles, (unsigned int)stats.outside);
+	if (stats.outside)
+		printf(", worst by %.3f deg", stats.worstExcess * _radToDeg);
+	printf("\n");
+}
+
+static bool check(const char* name, const std::vector<unsigned short>& heights, unsigned int width, const TerrainPyramidParams& p,
+	float sizeX, float sizeZ)
+{
+	ConeStats uniformStats = { 0, 0, 0 }, gradedStats = { 0, 0, 0 };
+	checkCones(name, heights, width, p, sizeX, sizeZ, uniformStats, gradedStats);
+	printStats("uniform morph", uniformStats);
+	printStats("graded morph", gradedStats);
+	printf("\n");
+	return uniformStats.outside == 0 && gradedStats.outside == 0;
+}
+
+int main(int argc, char** argv)
+{
+	std::string input;
+	unsigned int width = 513;
+	int gridPixels = 16, gridDim = 33;
+	float sizeX = 4096, sizeY = 256, sizeZ = 4096;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string a = argv[i];
+		if (a == "-i" && i + 1 < argc) input = argv[++i];
+		else if (a == "-W" && i + 1 < argc) width = (unsigned int)atoi(argv[++i]);
+		else if (a == "--grid-pixels" && i + 1 < argc) gridPixels = atoi(argv[++i]);
+		else if (a == "--grid-dim" && i + 1 < argc) gridDim = atoi(argv[++i]);
+		else if (a == "--size" && i + 3 < argc)
+		{
+			sizeX = (float)atof(argv[++i]);
+			sizeY = (float)atof(argv[++i]);
+			sizeZ = (float)atof(argv[++i]);
+		}
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+	if (gridPixels < 2 || gridDim < 3 || width < 2 || (width - 1) % gridPixels != 0)
+	{
+		usage();
+		return 1;
+	}
+	const unsigned int nGrid = (width - 1) / gridPixels;
+	if (nGrid & (nGrid - 1))
+	{
+		fprintf(stderr, "the width has to be 2^n * grid pixels + 1\n");
+		return 1;
+	}
+
+	TerrainPyramidParams p;
+	p.nGridX = p.nGridZ = nGrid;
+	p.lodLevelCount = 1;
+	while ((nGrid >> p.lodLevelCount) > 0)
+		p.lodLevelCount++;
+	p.nPixelX = p.nPixelZ = gridPixels;
+	p.gridDim = gridDim;
+	p.slopeX = sizeY / 65535.0f / (sizeX / (width - 1));
+	p.slopeZ = sizeY / 65535.0f / (sizeZ / (width - 1));
+
+	std::vector<unsigned short> heights((size_t)width * width);
+	bool ok = true;
+	if (!input.empty())
+	{
+		FILE* fp = fopen(input.c_str(), "rb");
+		if (!fp || fread(&heights[0], sizeof(unsigned short), heights.size(), fp) != heights.size())
+		{
+			fprintf(stderr, "cannot read %s\n", input.c_str());
+			if (fp)
+				fclose(fp);
+			return 1;
+		}
+		fclose(fp);
+		ok = check(input.c_str(), heights, width, p, sizeX, sizeZ);
+	}
+	else
+	{
+		// rolling hills
+		for (unsigned int z = 0; z < width; z++)
+			for (unsigned int x = 0; x < width; x++)
+				heights[(size_t)z * width + x] = (unsigned short)(32767.5f + 16000 * sinf(x * 0.013f) * cosf(z * 0.021f) +
+					8000 * sinf((x + 2 * z) * 0.041f) + 4000 * cosf((3 * x - z) * 0.067f));
+		ok = check("smooth", heights, width, p, sizeX, sizeZ);
+
+		std::mt19937 rng(42);
+		std::uniform_int_distribution<int> noise(-2000, 2000);
+		for (size_t i = 0; i < heights.size(); i++)
+			heights[i] = (unsigned short)std::min(std::max((int)heights[i] + noise(rng), 0), 65535);
+		ok = check("noisy", heights, width, p, sizeX, sizeZ) && ok;
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "triangles out of their cone\n");
+		return 1;
+	}
+	return 0;
+}
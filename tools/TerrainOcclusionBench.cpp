@@ -0,0 +1,399 @@
+// Occlusion culling benchmark and check: the CDLOD selection with and without the software Hi-Z buffer
+//
+// Cameras are dropped at random a little above a raw heightmap, looking around near the horizon, with random
+// box buildings around them as designated occluders. Each frame rasterizes the terrain columns and the buildings,
+// then runs the range based selection of LOD_select twice: frustum culling only, and with the boxes of the nodes
+// tested against the buffer. The culled nodes are checked by casting rays from the eye to points of their
+// surface: a point on screen that a ray reaches unblocked is a false cull, and the exit code is 1 then.
+//
+// Build (no Ogre needed):
+//   g++ -O2 -std=c++11 -pthread -I../src TerrainOcclusionBench.cpp ../src/TerrainOcclusion.cpp ../src/TerrainQuery.cpp ../src/TerrainPyramid.cpp -o terrainocclusionbench
+
+#include "TerrainOcclusion.h"
+#include "TerrainQuery.h"
+#include "TerrainPyramid.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <algorithm>
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: terrainocclusionbench -i <heightmap.r16> -W <width> [options]\n"
+		"  --grid-pixels <n>       heightmap pixels per unit grid (default 64)\n"
+		"  --grid-dim <n>          vertices of a patch on a side (default 33)\n"
+		"  --size <x> <y> <z>      world size of the map (default 16384 1024 16384)\n"
+		"  --range <d>             LOD range of level 0, doubling per level (default 256)\n"
+		"  --buffer <w> <h>        occlusion buffer size (default 256 128)\n"
+		"  --threads <n>           rasterizer workers besides the main thread (default: one per core - 1)\n"
+		"  --frames <n>            random cameras (default 50)\n"
+		"  --clearance <y>         camera height above the surface (default 2)\n"
+		"  --buildings <n>         random box buildings around each camera (default 200)\n"
+		"  --verify <n>            rays per culled node (default 64)\n");
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double milliseconds(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count() * 1000.0;
+}
+
+struct Box
+{
+	float min[3];
+	float max[3];
+};
+
+struct Frame
+{
+	const TerrainQuerySource* src;
+	const std::vector<float>* sqRanges;
+	const OcclusionBuffer* buffer;
+	float eye[3];
+	bool occlusion;
+	size_t selected;
+	std::vector<Box> culled;
+};
+
+// LOD_select without the morph, the holes and the error termination: OutOfFrustum 0, OutOfRange 1, Selected 2
+static int select(Frame& f, int level, unsigned int ix, unsigned int iz)
+{
+	const TerrainQuerySource& src = *f.src;
+	const unsigned int n = src.params.nGridX >> level;
+	const HeightMinMax& h = (*src.pyramids[0])[level][iz * n + ix];
+	Box box;
+	box.min[0] = src.minX + (ix << level) * src.gridSizeX;
+	box.min[1] = h.minY * src.sizeY / 65535.0f + src.minY;
+	box.min[2] = src.minZ + (iz << level) * src.gridSizeZ;
+	box.max[0] = box.min[0] + (1 << level) * src.gridSizeX;
+	box.max[1] = h.maxY * src.sizeY / 65535.0f + src.minY;
+	box.max[2] = box.min[2] + (1 << level) * src.gridSizeZ;
+	if (f.buffer->isOffScreen(box.min, box.max))
+		return 0;
+	if (f.occlusion && f.buffer->isOccluded(box.min, box.max))
+	{
+		f.culled.push_back(box);
+		return 0;
+	}
+	float sqDist = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		const float d = std::max(std::max(box.min[i] - f.eye[i], f.eye[i] - box.max[i]), 0.0f);
+		sqDist += d * d;
+	}
+	if (sqDist > (*f.sqRanges)[level])
+		return 1;
+	int sub[4] = { 1, 1, 1, 1 };
+	if (level > 0 && sqDist <= (*f.sqRanges)[level - 1])
+	{
+		for (int q = 0; q < 4; q++)
+			sub[q] = select(f, level - 1, ix * 2 + (q & 1), iz * 2 + (q >> 1));
+	}
+	bool anySelected = false, anyDrawn = false;
+	for (int q = 0; q < 4; q++)
+	{
+		anySelected |= sub[q] == 2;
+		anyDrawn |= sub[q] == 1;
+	}
+	if (anyDrawn)
+	{
+		f.selected++;
+		return 2;
+	}
+	return anySelected ? 2 : 0;
+}
+
+static bool rayHitsBox(const float origin[3], const float dir[3], float maxT, const Box& box)
+{
+	float t0 = 0, t1 = maxT;
+	for (int i = 0; i < 3; i++)
+	{
+		if (fabsf(dir[i]) < 1e-12f)
+		{
+			if (origin[i] < box.min[i] || origin[i] > box.max[i])
+				return false;
+			continue;
+		}
+		float a = (box.min[i] - origin[i]) / dir[i], b = (box.max[i] - origin[i]) / dir[i];
+		if (a > b)
+			std::swap(a, b);
+		t0 = std::max(t0, a);
+		t1 = std::min(t1, b);
+		if (t0 > t1)
+			return false;
+	}
+	return true;
+}
+
+// row-major view-projection of column vectors, like Ogre's, with w the view depth
+static void lookAt(const float eye[3], float yaw, float pitch, float fovY, float aspect, float nearDist, float farDist, float m[16])
+{
+	const float fwd[3] = { cosf(pitch) * sinf(yaw), sinf(pitch), -cosf(pitch) * cosf(yaw) };
+	float right[3] = { -fwd[2], 0, fwd[0] };
+	const float rl = sqrtf(right[0] * right[0] + right[2] * right[2]);
+	right[0] /= rl;
+	right[2] /= rl;
+	const float up[3] = { right[1] * fwd[2] - right[2] * fwd[1], right[2] * fwd[0] - right[0] * fwd[2], right[0] * fwd[1] - right[1] * fwd[0] };
+	const float* axes[3] = { right, up, fwd };
+	float view[3][4];
+	for (int r = 0; r < 3; r++)
+	{
+		for (int c = 0; c < 3; c++)
+			view[r][c] = axes[r][c];
+		view[r][3] = -(axes[r][0] * eye[0] + axes[r][1] * eye[1] + axes[r][2] * eye[2]);
+	}
+	const float fy = 1.0f / tanf(fovY * 0.5f), fx = fy / aspect;
+	const float a = (farDist + nearDist) / (farDist - nearDist), b = -2 * farDist * nearDist / (farDist - nearDist);
+	for (int c = 0; c < 4; c++)
+	{
+		m[c] = fx * view[0][c];
+		m[4 + c] = fy * view[1][c];
+		m[8 + c] = a * view[2][c] + (c == 3 ? b : 0);
+		m[12 + c] = view[2][c];
+	}
+}
+
+static void boxMesh(const Box& box, std::vector<float>& vertices, std::vector<unsigned int>& indices)
+{
+	const unsigned int base = (unsigned int)(vertices.size() / 3);
+	for (int c = 0; c < 8; c++)
+	{
+		vertices.push_back((c & 1) ? box.max[0] : box.min[0]);
+		vertices.push_back((c & 2) ? box.max[1] : box.min[1]);
+		vertices.push_back((c & 4) ? box.max[2] : box.min[2]);
+	}
+	static const unsigned int faces[36] = {
+		0, 2, 1, 1, 2, 3,  4, 5, 6, 5, 7, 6,  0, 1, 4, 1, 5, 4,
+		2, 6, 3, 3, 6, 7,  0, 4, 2, 2, 4, 6,  1, 3, 5, 3, 7, 5 };
+	for (int i = 0; i < 36; i++)
+		indices.push_back(base + faces[i]);
+}
+
+int main(int argc, char** argv)
+{
+	std::string input;
+	unsigned int width = 0;
+	int gridPixels = 64, gridDim = 33, bufferWidth = 256, bufferHeight = 128, frames = 50, buildings = 200, verifyRays = 64;
+	float sizeX = 16384, sizeY = 1024, sizeZ = 16384, range = 256, clearance = 2;
+	int threads = std::max((int)std::thread::hardware_concurrency() - 1, 0);
+	for (int i = 1; i < argc; i++)
+	{
+		std::string a = argv[i];
+		if (a == "-i" && i + 1 < argc) input = argv[++i];
+		else if (a == "-W" && i + 1 < argc) width = (unsigned int)atoi(argv[++i]);
+		else if (a == "--grid-pixels" && i + 1 < argc) gridPixels = atoi(argv[++i]);
+		else if (a == "--grid-dim" && i + 1 < argc) gridDim = atoi(argv[++i]);
+		else if (a == "--size" && i + 3 < argc)
+		{
+			sizeX = (float)atof(argv[++i]);
+			sizeY = (float)atof(argv[++i]);
+			sizeZ = (float)atof(argv[++i]);
+		}
+		else if (a == "--range" && i + 1 < argc) range = (float)atof(argv[++i]);
+		else if (a == "--buffer" && i + 2 < argc)
+		{
+			bufferWidth = std::max(atoi(argv[++i]), 4);
+			bufferHeight = std::max(atoi(argv[++i]), 4);
+		}
+		else if (a == "--threads" && i + 1 < argc) threads = std::max(atoi(argv[++i]), 0);
+		else if (a == "--frames" && i + 1 < argc) frames = std::max(atoi(argv[++i]), 1);
+		else if (a == "--clearance" && i + 1 < argc) clearance = (float)atof(argv[++i]);
+		else if (a == "--buildings" && i + 1 < argc) buildings = std::max(atoi(argv[++i]), 0);
+		else if (a == "--verify" && i + 1 < argc) verifyRays = std::max(atoi(argv[++i]), 0);
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+	if (input.empty() || gridPixels < 2 || width < 2 || (width - 1) % gridPixels != 0)
+	{
+		usage();
+		return 1;
+	}
+	const unsigned int nGrid = (width - 1) / gridPixels;
+	if (nGrid & (nGrid - 1))
+	{
+		fprintf(stderr, "the width has to be 2^n * grid pixels + 1\n");
+		return 1;
+	}
+
+	std::vector<unsigned short> heightmap((size_t)width * width);
+	FILE* fp = fopen(input.c_str(), "rb");
+	if (!fp || fread(&heightmap[0], sizeof(unsigned short), heightmap.size(), fp) != heightmap.size())
+	{
+		fprintf(stderr, "cannot read %s\n", input.c_str());
+		if (fp)
+			fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	TerrainPyramidParams p;
+	p.nGridX = p.nGridZ = nGrid;
+	p.lodLevelCount = 1;
+	while ((nGrid >> p.lodLevelCount) > 0)
+		p.lodLevelCount++;
+	p.nPixelX = p.nPixelZ = gridPixels;
+	p.gridDim = gridDim;
+	p.slopeX = sizeY / 65535.0f / (sizeX / (width - 1));
+	p.slopeZ = sizeY / 65535.0f / (sizeZ / (width - 1));
+	HeightMinMaxPyramid pyramid;
+	buildHeightMinMax(p, &heightmap[0], width, pyramid);
+
+	TerrainQuerySource src;
+	src.heights[0] = &heightmap[0];
+	src.heights[1] = 0;
+	src.pyramids[0] = &pyramid;
+	src.pyramids[1] = 0;
+	src.width = src.height = width;
+	src.params = p;
+	src.minX = -sizeX / 2;
+	src.minY = 0;
+	src.minZ = -sizeZ / 2;
+	src.gridSizeX = sizeX / nGrid;
+	src.gridSizeZ = sizeZ / nGrid;
+	src.sizeY = sizeY;
+	src.blendRatio = 1;
+
+	std::vector<float> sqRanges;
+	for (int l = 0; l < p.lodLevelCount; l++)
+		sqRanges.push_back(range * range * (float)(1 << l) * (float)(1 << l));
+	const float farDist = range * (1 << (p.lodLevelCount - 1));
+	const float nearDist = 0.5f;
+
+	OcclusionBuffer buffer(bufferWidth, bufferHeight, threads);
+	printf("%ux%u heightmap, %u levels, %dx%d buffer, %d worker(s), %d buildings\n\n",
+		width, width, p.lodLevelCount, buffer.getWidth(), buffer.getHeight(), buffer.getThreadCount(), buildings);
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> ux(src.minX * 0.9f, -src.minX * 0.9f), uz(src.minZ * 0.9f, -src.minZ * 0.9f);
+	std::uniform_real_distribution<float> uyaw(0, 6.2831853f), upitch(-0.2f, 0.1f), unit(0, 1);
+	size_t selectedPlain = 0, selectedCulled = 0, boxCount = 0, triangles = 0, falseCulls = 0, skippedFrames = 0;
+	double rasterMs = 0, selectPlainMs = 0, selectCulledMs = 0;
+	for (int frame = 0; frame < frames; frame++)
+	{
+		Frame f;
+		f.src = &src;
+		f.sqRanges = &sqRanges;
+		f.buffer = &buffer;
+		f.eye[0] = ux(rng);
+		f.eye[2] = uz(rng);
+		terrainHeightAt(src, &f.eye[0], &f.eye[2], &f.eye[1], 1);
+		f.eye[1] += clearance;
+		float viewProj[16];
+		lookAt(f.eye, uyaw(rng), upitch(rng), 1.0f, (float)bufferWidth / bufferHeight, nearDist, farDist, viewProj);
+
+		// buildings standing on the ground within a few hundred units
+		std::vector<Box> houses;
+		std::vector<float> vertices;
+		std::vector<unsigned int> indices;
+		for (int b = 0; b < buildings; b++)
+		{
+			const float angle = unit(rng) * 6.2831853f, dist = 30 + unit(rng) * 600;
+			Box box;
+			box.min[0] = f.eye[0] + cosf(angle) * dist;
+			box.min[2] = f.eye[2] + sinf(angle) * dist;
+			box.max[0] = box.min[0] + 10 + unit(rng) * 30;
+			box.max[2] = box.min[2] + 10 + unit(rng) * 30;
+			float x[4] = { box.min[0], box.max[0], box.min[0], box.max[0] };
+			float z[4] = { box.min[2], box.min[2], box.max[2], box.max[2] };
+			float y[4];
+			terrainHeightAt(src, x, z, y, 4);
+			box.min[1] = std::min(std::min(y[0], y[1]), std::min(y[2], y[3])) - 2;
+			box.max[1] = std::max(std::max(y[0], y[1]), std::max(y[2], y[3])) + 8 + unit(rng) * 40;
+			// the camera stays out of the buildings
+			if (f.eye[0] >= box.min[0] - 1 && f.eye[0] <= box.max[0] + 1 && f.eye[2] >= box.min[2] - 1 && f.eye[2] <= box.max[2] + 1)
+				continue;
+			houses.push_back(box);
+			boxMesh(box, vertices, indices);
+		}
+
+		Clock::time_point start = Clock::now();
+		buffer.begin(viewProj, nearDist);
+		if (!indices.empty())
+			buffer.addTriangles(&vertices[0], &indices[0], indices.size() / 3);
+		TerrainOccluderParams params;
+		for (int i = 0; i < 3; i++)
+			params.eye[i] = f.eye[i];
+		params.nearDistance = nearDist;
+		params.sqRanges = &sqRanges[0];
+		params.splitRatio = 0.25f;
+		params.maxBoxes = 4096;
+		const size_t boxes = addTerrainOccluders(buffer, src, params);
+		buffer.end();
+		rasterMs += milliseconds(start);
+		if (boxes == 0)
+			skippedFrames++;
+		boxCount += boxes;
+		triangles += buffer.getStats().triangles;
+
+		const int top = p.lodLevelCount - 1;
+		f.occlusion = false;
+		f.selected = 0;
+		start = Clock::now();
+		select(f, top, 0, 0);
+		selectPlainMs += milliseconds(start);
+		selectedPlain += f.selected;
+
+		f.occlusion = true;
+		f.selected = 0;
+		start = Clock::now();
+		select(f, top, 0, 0);
+		selectCulledMs += milliseconds(start);
+		selectedCulled += f.selected;
+
+		// a culled node must not be seen anywhere on screen
+		for (size_t c = 0; c < f.culled.size(); c++)
+		{
+			const Box& box = f.culled[c];
+			for (int r = 0; r < verifyRays; r++)
+			{
+				float target[3] = { box.min[0] + (box.max[0] - box.min[0]) * unit(rng), 0, box.min[2] + (box.max[2] - box.min[2]) * unit(rng) };
+				terrainHeightAt(src, &target[0], &target[2], &target[1], 1);
+				target[1] += 0.01f;
+				float clip[4];
+				for (int i = 0; i < 4; i++)
+					clip[i] = viewProj[i * 4] * target[0] + viewProj[i * 4 + 1] * target[1] + viewProj[i * 4 + 2] * target[2] + viewProj[i * 4 + 3];
+				if (clip[3] < nearDist || fabsf(clip[0]) > clip[3] || fabsf(clip[1]) > clip[3])
+					continue;
+				TerrainRay ray;
+				for (int i = 0; i < 3; i++)
+				{
+					ray.origin[i] = f.eye[i];
+					ray.direction[i] = target[i] - f.eye[i];
+				}
+				ray.maxDistance = 0.999f;
+				TerrainRayHit hit;
+				if (terrainRaycast(src, &ray, &hit, 1))
+					continue;
+				bool blocked = false;
+				for (size_t h = 0; h < houses.size() && !blocked; h++)
+					blocked = rayHitsBox(ray.origin, ray.direction, ray.maxDistance, houses[h]);
+				if (!blocked)
+				{
+					falseCulls++;
+					break;
+				}
+			}
+		}
+	}
+
+	printf("occluders  %8.0f terrain boxes, %8.0f triangles per frame (%u frames with the eye too low for the terrain)\n",
+		(double)boxCount / frames, (double)triangles / frames, (unsigned int)skippedFrames);
+	printf("raster     %8.3f ms per frame\n", rasterMs / frames);
+	printf("frustum    %8.1f nodes, %.3f ms per frame\n", (double)selectedPlain / frames, selectPlainMs / frames);
+	printf("occlusion  %8.1f nodes, %.3f ms per frame, %.1f%% fewer\n", (double)selectedCulled / frames, selectCulledMs / frames,
+		selectedPlain ? 100.0 * (selectedPlain - selectedCulled) / selectedPlain : 0.0);
+	printf("verified   %u false culls\n", (unsigned int)falseCulls);
+
+	freeHeightMinMax(pyramid);
+	return falseCulls ? 1 : 0;
+}
@@ -0,0 +1,423 @@
+// Offline potentially visible set bake: the quadtree nodes each viewpoint cell of the map may see (see TerrainPVS.h)
+//
+// The map is split into --cells by --cells cells with --samples by --samples viewpoints over each, corners included,
+// --eye-height above the surface. From each viewpoint the range based selection of LOD_select runs in every
+// direction with the horizon occlusion, the nodes visited front to back: the nodes it reaches, refines and draws
+// are merged over the samples of the cell and written as its set. The cells are split over --threads threads.
+// With --verify, random viewpoints within each cell are checked against the set: a node that the selection from
+// there reaches but the set hides is a miss, as the PVS is exact at the samples only.
+//
+// Build (no Ogre needed):
+//   g++ -O2 -std=c++11 -pthread -I../src TerrainPVSBake.cpp ../src/TerrainPVS.cpp ../src/TerrainHorizon.cpp ../src/TerrainQuery.cpp ../src/TerrainPyramid.cpp -o terrainpvsbake
+
+#include "TerrainPVS.h"
+#include "TerrainHorizon.h"
+#include "TerrainQuery.h"
+#include "TerrainPyramid.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: terrainpvsbake -i <heightmap.r16> -W <width> -o <out.pvs> [options]\n"
+		"  --grid-pixels <n>       heightmap pixels per unit grid (default 64)\n"
+		"  --grid-dim <n>          vertices of a patch on a side (default 33)\n"
+		"  --size <x> <y> <z>      world size of the map (default 16384 1024 16384)\n"
+		"  --origin <x> <y> <z>    map starting position (default: centered at 0 on x and z, 0 on y)\n"
+		"  --range <d>             LOD range of level 0, doubling per level (default 256)\n"
+		"  --cells <n>             viewpoint cells on a side of the map (default 32)\n"
+		"  --samples <n>           viewpoints on a side of a cell (default 3)\n"
+		"  --eye-height <y>        viewpoint height above the surface (default 2)\n"
+		"  --bins <n>              horizon bins (default 1024)\n"
+		"  --threads <n>           bake threads (default: one per core)\n"
+		"  --verify <n>            random viewpoints checked per cell (default 0)\n");
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double milliseconds(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count() * 1000.0;
+}
+
+struct Baker
+{
+	const TerrainQuerySource* src;
+	const std::vector<float>* sqRanges;
+	int lodLevelCount;
+	int cellShift;				// levels an occluder is split down at most, keeping it two mesh cells wide
+	float nearDistance;
+};
+
+struct Sample
+{
+	const Baker* baker;
+	TerrainHorizon horizon;
+	float eye[3];
+	unsigned char* flags;				// merged over the samples; null when verifying
+	const unsigned char* states;		// the set to restrict the selection with, or null
+	bool occlusion;
+	size_t reached;
+	size_t selected;
+	size_t misses;
+
+	Sample(const Baker* b, int bins) : baker(b), horizon(bins), flags(0), states(0), occlusion(true), reached(0), selected(0), misses(0) {}
+};
+
+static void getFootprint(const TerrainQuerySource& src, int level, unsigned int ix, unsigned int iz, float& x0, float& z0, float& x1, float& z1)
+{
+	x0 = src.minX + (ix << level) * src.gridSizeX;
+	z0 = src.minZ + (iz << level) * src.gridSizeZ;
+	x1 = x0 + (1 << level) * src.gridSizeX;
+	z1 = z0 + (1 << level) * src.gridSizeZ;
+}
+
+static float getWorldHeight(const TerrainQuerySource& src, unsigned short h)
+{
+	return h * src.sizeY / 65535.0f + src.minY;
+}
+
+// addHorizonOccluders of the runtime, through the pyramid only
+static void addOccluders(Sample& s, int level, unsigned int ix, unsigned int iz, int minLevel)
+{
+	const TerrainQuerySource& src = *s.baker->src;
+	float x0, z0, x1, z1;
+	getFootprint(src, level, ix, iz, x0, z0, x1, z1);
+	const float dx = std::max(std::max(x0 - s.eye[0], s.eye[0] - x1), 0.0f);
+	const float dz = std::max(std::max(z0 - s.eye[2], s.eye[2] - z1), 0.0f);
+	const float dist = sqrtf(dx * dx + dz * dz);
+	if (dist <= s.baker->nearDistance)
+		return;
+	const float maxWidth = 16.0f * 6.2831853f * dist / s.horizon.getBinCount();
+	if (x1 - x0 > maxWidth && level > minLevel)
+	{
+		for (int q = 0; q < 4; q++)
+			addOccluders(s, level - 1, ix * 2 + (q & 1), iz * 2 + (q >> 1), minLevel);
+		return;
+	}
+	const unsigned int n = src.params.nGridX >> level;
+	s.horizon.addOccluder(x0, z0, x1, z1, getWorldHeight(src, (*src.pyramids[0])[level][iz * n + ix].minY));
+}
+
+// LOD_select in every direction without the morph, the holes and the error termination:
+// OutOfFrustum 0, OutOfRange 1, Selected 2
+static int select(Sample& s, int level, unsigned int ix, unsigned int iz)
+{
+	const Baker& b = *s.baker;
+	const TerrainQuerySource& src = *b.src;
+	const size_t node = getPVSNodeIndex(b.lodLevelCount, level, ix, iz);
+	if (s.states && s.states[node] == TerrainPVS::Hidden)
+		return 0;
+	const unsigned int n = src.params.nGridX >> level;
+	const HeightMinMax& h = (*src.pyramids[0])[level][iz * n + ix];
+	float x0, z0, x1, z1;
+	getFootprint(src, level, ix, iz, x0, z0, x1, z1);
+	const float minY = getWorldHeight(src, h.minY), maxY = getWorldHeight(src, h.maxY);
+	if (s.occlusion && s.horizon.isOccluded(x0, z0, x1, z1, maxY))
+		return 0;
+	s.reached++;
+	if (s.flags)
+		s.flags[node] |= PVSReached;
+	const float dx = std::max(std::max(x0 - s.eye[0], s.eye[0] - x1), 0.0f);
+	const float dy = std::max(std::max(minY - s.eye[1], s.eye[1] - maxY), 0.0f);
+	const float dz = std::max(std::max(z0 - s.eye[2], s.eye[2] - z1), 0.0f);
+	const float sqDist = dx * dx + dy * dy + dz * dz;
+	if (sqDist > (*b.sqRanges)[level])
+		return 1;
+	int sub[4] = { 1, 1, 1, 1 };
+	const bool refine = level > 0 && sqDist <= (*b.sqRanges)[level - 1];
+	if (refine)
+	{
+		if (s.flags)
+			s.flags[node] |= PVSRefined;
+		const int nearest = (s.eye[0] >= (x0 + x1) * 0.5f ? 1 : 0) | (s.eye[2] >= (z0 + z1) * 0.5f ? 2 : 0);
+		for (int i = 0; i < 4; i++)
+		{
+			const int q = nearest ^ i;
+			sub[q] = select(s, level - 1, ix * 2 + (q & 1), iz * 2 + (q >> 1));
+		}
+	}
+	bool anySelected = false, anyDrawn = false;
+	for (int q = 0; q < 4; q++)
+	{
+		anySelected |= sub[q] == 2;
+		anyDrawn |= sub[q] == 1;
+		// the area of a quadrant drawn by this node is seen whole
+		if (sub[q] == 1 && refine && s.flags)
+			s.flags[getPVSNodeIndex(b.lodLevelCount, level - 1, ix * 2 + (q & 1), iz * 2 + (q >> 1))] |= PVSDrawn;
+	}
+	if (anyDrawn)
+	{
+		s.selected++;
+		if (s.occlusion)
+			addOccluders(s, level, ix, iz, std::max(level - b.cellShift, 0));
+		return 2;
+	}
+	return anySelected ? 2 : 0;
+}
+
+// the nodes reached from the viewpoint that the states hide
+static void countMisses(Sample& s, const std::vector<unsigned char>& reached, const std::vector<unsigned char>& states)
+{
+	for (size_t i = 0; i < reached.size(); i++)
+	{
+		if (reached[i] && states[i] == TerrainPVS::Hidden)
+			s.misses++;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string input, output;
+	unsigned int width = 0;
+	int gridPixels = 64, gridDim = 33, cells = 32, samples = 3, bins = 1024, verify = 0;
+	float sizeX = 16384, sizeY = 1024, sizeZ = 16384, range = 256, eyeHeight = 2;
+	float origin[3] = { 0, 0, 0 };
+	bool centered = true;
+	int threads = std::max((int)std::thread::hardware_concurrency(), 1);
+	for (int i = 1; i < argc; i++)
+	{
+		std::string a = argv[i];
+		if (a == "-i" && i + 1 < argc) input = argv[++i];
+		else if (a == "-W" && i + 1 < argc) width = (unsigned int)atoi(argv[++i]);
+		else if (a == "-o" && i + 1 < argc) output = argv[++i];
+		else if (a == "--grid-pixels" && i + 1 < argc) gridPixels = atoi(argv[++i]);
+		else if (a == "--grid-dim" && i + 1 < argc) gridDim = atoi(argv[++i]);
+		else if (a == "--size" && i + 3 < argc)
+		{
+			sizeX = (float)atof(argv[++i]);
+			sizeY = (float)atof(argv[++i]);
+			sizeZ = (float)atof(argv[++i]);
+		}
+		else if (a == "--origin" && i + 3 < argc)
+		{
+			for (int c = 0; c < 3; c++)
+				origin[c] = (float)atof(argv[++i]);
+			centered = false;
+		}
+		else if (a == "--range" && i + 1 < argc) range = (float)atof(argv[++i]);
+		else if (a == "--cells" && i + 1 < argc) cells = std::max(atoi(argv[++i]), 1);
+		else if (a == "--samples" && i + 1 < argc) samples = std::max(atoi(argv[++i]), 1);
+		else if (a == "--eye-height" && i + 1 < argc) eyeHeight = (float)atof(argv[++i]);
+		else if (a == "--bins" && i + 1 < argc) bins = std::max(atoi(argv[++i]), 16);
+		else if (a == "--threads" && i + 1 < argc) threads = std::max(atoi(argv[++i]), 1);
+		else if (a == "--verify" && i + 1 < argc) verify = std::max(atoi(argv[++i]), 0);
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+	if (input.empty() || output.empty() || gridPixels < 2 || gridDim < 5 || width < 2 || (width - 1) % gridPixels != 0)
+	{
+		usage();
+		return 1;
+	}
+	const unsigned int nGrid = (width - 1) / gridPixels;
+	if (nGrid & (nGrid - 1))
+	{
+		fprintf(stderr, "the width has to be 2^n * grid pixels + 1\n");
+		return 1;
+	}
+
+	std::vector<unsigned short> heightmap((size_t)width * width);
+	FILE* fp = fopen(input.c_str(), "rb");
+	if (!fp || fread(&heightmap[0], sizeof(unsigned short), heightmap.size(), fp) != heightmap.size())
+	{
+		fprintf(stderr, "cannot read %s\n", input.c_str());
+		if (fp)
+			fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	TerrainPyramidParams p;
+	p.nGridX = p.nGridZ = nGrid;
+	p.lodLevelCount = 1;
+	while ((nGrid >> p.lodLevelCount) > 0)
+		p.lodLevelCount++;
+	p.nPixelX = p.nPixelZ = gridPixels;
+	p.gridDim = gridDim;
+	p.slopeX = sizeY / 65535.0f / (sizeX / (width - 1));
+	p.slopeZ = sizeY / 65535.0f / (sizeZ / (width - 1));
+	HeightMinMaxPyramid pyramid;
+	buildHeightMinMax(p, &heightmap[0], width, pyramid);
+
+	TerrainQuerySource src;
+	src.heights[0] = &heightmap[0];
+	src.heights[1] = 0;
+	src.pyramids[0] = &pyramid;
+	src.pyramids[1] = 0;
+	src.width = src.height = width;
+	src.params = p;
+	src.minX = centered ? -sizeX / 2 : origin[0];
+	src.minY = origin[1];
+	src.minZ = centered ? -sizeZ / 2 : origin[2];
+	src.gridSizeX = sizeX / nGrid;
+	src.gridSizeZ = sizeZ / nGrid;
+	src.sizeY = sizeY;
+	src.blendRatio = 1;
+
+	std::vector<float> sqRanges;
+	for (int l = 0; l < p.lodLevelCount; l++)
+		sqRanges.push_back(range * range * (float)(1 << l) * (float)(1 << l));
+
+	Baker baker;
+	baker.src = &src;
+	baker.sqRanges = &sqRanges;
+	baker.lodLevelCount = p.lodLevelCount;
+	baker.cellShift = 0;
+	while ((4 << baker.cellShift) <= gridDim - 1)
+		baker.cellShift++;
+	baker.nearDistance = 0.5f;
+
+	const size_t nodeCount = getPVSNodeCount(p.lodLevelCount);
+	const int cellCount = cells * cells;
+	const float cellX = sizeX / cells, cellZ = sizeZ / cells;
+	printf("%ux%u heightmap, %u levels, %u nodes, %dx%d cells of %dx%d samples, %d thread(s)\n\n",
+		width, width, p.lodLevelCount, (unsigned int)nodeCount, cells, cells, samples, samples, threads);
+
+	// the cells are taken in turn by the threads, each with its own flags and horizon
+	std::vector<std::vector<unsigned char> > data(cellCount);
+	std::vector<size_t> selectedPerThread(threads, 0);
+	std::atomic<int> nextCell(0);
+	Clock::time_point start = Clock::now();
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+	{
+		workers.push_back(std::thread([&, t]()
+		{
+			std::vector<unsigned char> flags(nodeCount);
+			Sample s(&baker, bins);
+			s.flags = &flags[0];
+			for (int c = nextCell++; c < cellCount; c = nextCell++)
+			{
+				std::fill(flags.begin(), flags.end(), 0);
+				const float cx = src.minX + (c % cells) * cellX, cz = src.minZ + (c / cells) * cellZ;
+				for (int j = 0; j < samples; j++)
+				{
+					for (int i = 0; i < samples; i++)
+					{
+						const float u = samples > 1 ? (float)i / (samples - 1) : 0.5f, v = samples > 1 ? (float)j / (samples - 1) : 0.5f;
+						// the far edges of the map are not on it
+						s.eye[0] = std::min(cx + u * cellX, src.minX + sizeX * 0.9999f);
+						s.eye[2] = std::min(cz + v * cellZ, src.minZ + sizeZ * 0.9999f);
+						terrainHeightAt(src, &s.eye[0], &s.eye[2], &s.eye[1], 1);
+						s.eye[1] += eyeHeight;
+						s.horizon.reset(s.eye[0], s.eye[1], s.eye[2]);
+						select(s, p.lodLevelCount - 1, 0, 0);
+					}
+				}
+				encodePVSCell(p.lodLevelCount, &flags[0], data[c]);
+			}
+			selectedPerThread[t] = s.selected;
+		}));
+	}
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+	const double bakeMs = milliseconds(start);
+
+	TerrainPVSHeader header;
+	header.lodLevelCount = p.lodLevelCount;
+	header.cellsX = header.cellsZ = cells;
+	header.samplesPerCell = samples;
+	header.minX = src.minX;
+	header.minZ = src.minZ;
+	header.sizeX = sizeX;
+	header.sizeZ = sizeZ;
+	header.eyeHeight = eyeHeight;
+	if (!writePVS(output.c_str(), header, data))
+	{
+		fprintf(stderr, "cannot write %s\n", output.c_str());
+		freeHeightMinMax(pyramid);
+		return 1;
+	}
+	TerrainPVS pvs;
+	if (!pvs.load(output.c_str()))
+	{
+		fprintf(stderr, "cannot read back %s\n", output.c_str());
+		freeHeightMinMax(pyramid);
+		return 1;
+	}
+
+	size_t bytes = 0, selected = 0;
+	for (int c = 0; c < cellCount; c++)
+		bytes += pvs.getCellSize(c);
+	for (int t = 0; t < threads; t++)
+		selected += selectedPerThread[t];
+	// against a bitset of all the nodes per cell
+	const double rawBytes = (double)cellCount * ((nodeCount + 7) / 8);
+	printf("bake       %8.1f ms, %.3f ms per sample, %.1f nodes selected per sample\n", bakeMs,
+		bakeMs / ((double)cellCount * samples * samples), (double)selected / ((double)cellCount * samples * samples));
+	printf("size       %8u bytes of cells, %.1f per cell, %.1fx smaller than node bitsets\n",
+		(unsigned int)bytes, (double)bytes / cellCount, bytes ? rawBytes / bytes : 0.0);
+
+	// random viewpoints per cell: the nodes reached by range only, with the horizon and with the set only, and the misses
+	if (verify > 0)
+	{
+		std::mt19937 rng(1234);
+		std::uniform_real_distribution<float> unit(0, 1);
+		std::vector<unsigned char> states, reached(nodeCount);
+		Sample s(&baker, bins);
+		size_t reachedRange = 0, reachedHorizon = 0, reachedPVS = 0, selectedRange = 0, selectedHorizon = 0, selectedPVS = 0, checked = 0;
+		for (int c = 0; c < cellCount; c++)
+		{
+			pvs.decodeCell(c, states);
+			for (int r = 0; r < verify; r++)
+			{
+				s.eye[0] = src.minX + ((c % cells) + unit(rng) * 0.9999f) * cellX;
+				s.eye[2] = src.minZ + ((c / cells) + unit(rng) * 0.9999f) * cellZ;
+				terrainHeightAt(src, &s.eye[0], &s.eye[2], &s.eye[1], 1);
+				s.eye[1] += eyeHeight;
+
+				s.flags = 0;
+				s.states = 0;
+				s.occlusion = false;
+				s.reached = s.selected = 0;
+				select(s, p.lodLevelCount - 1, 0, 0);
+				reachedRange += s.reached;
+				selectedRange += s.selected;
+
+				// reached with the horizon, recorded through the flags
+				std::fill(reached.begin(), reached.end(), 0);
+				s.flags = &reached[0];
+				s.states = 0;
+				s.occlusion = true;
+				s.reached = s.selected = 0;
+				s.horizon.reset(s.eye[0], s.eye[1], s.eye[2]);
+				select(s, p.lodLevelCount - 1, 0, 0);
+				reachedHorizon += s.reached;
+				selectedHorizon += s.selected;
+				for (size_t i = 0; i < nodeCount; i++)
+					reached[i] &= PVSReached;
+				countMisses(s, reached, states);
+
+				// the set without the horizon, as a cheaper runtime would
+				s.flags = 0;
+				s.states = &states[0];
+				s.occlusion = false;
+				s.reached = s.selected = 0;
+				select(s, p.lodLevelCount - 1, 0, 0);
+				reachedPVS += s.reached;
+				selectedPVS += s.selected;
+				checked++;
+			}
+		}
+		printf("range only %8.1f nodes reached, %.1f selected per viewpoint\n", (double)reachedRange / checked, (double)selectedRange / checked);
+		printf("horizon    %8.1f nodes reached, %.1f selected per viewpoint\n", (double)reachedHorizon / checked, (double)selectedHorizon / checked);
+		printf("pvs only   %8.1f nodes reached, %.1f selected per viewpoint\n", (double)reachedPVS / checked, (double)selectedPVS / checked);
+		printf("verified   %u nodes missed over %u viewpoints\n", (unsigned int)s.misses, (unsigned int)checked);
+	}
+
+	freeHeightMinMax(pyramid);
+	return 0;
+}
@@ -0,0 +1,236 @@
+// CPU terrain query benchmark: batched heightAt and line of sight ray casts against a raw heightmap
+//
+// The heightmap has to be 2^n * gridPixels + 1 pixels on a side like the runtime's. Query points are spread
+// uniformly over the map; rays go between two random points within --range of each other a little above the
+// surface, like the lines of sight between units. The batches are split over --threads threads sharing the
+// source, as the game would. A sample of the rays is checked against a brute force march along the ray.
+//
+// Build (no Ogre needed):
+//   g++ -O2 -std=c++11 -pthread -I../src TerrainQueryBench.cpp ../src/TerrainQuery.cpp ../src/TerrainPyramid.cpp -o terrainquerybench
+
+#include "TerrainQuery.h"
+#include "TerrainPyramid.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <algorithm>
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: terrainquerybench -i <heightmap.r16> -W <width> [options]\n"
+		"  --grid-pixels <n>       heightmap pixels per unit grid (default 64)\n"
+		"  --size <x> <y> <z>      world size of the map (default 16384 1024 16384)\n"
+		"  --count <n>             queries and rays per batch (default 100000)\n"
+		"  --range <d>             max horizontal length of a ray (default 2048)\n"
+		"  --clearance <y>         height of the rays' ends above the surface (default 10)\n"
+		"  --threads <n>           threads sharing a batch (default: one per core)\n"
+		"  --verify <n>            rays checked against a brute force march (default 2000)\n");
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// runs f(begin, end) over the batch on the threads
+template <typename F>
+static void parallelFor(size_t count, int threads, F f)
+{
+	std::vector<std::thread> workers;
+	const size_t chunk = (count + threads - 1) / threads;
+	for (int t = 0; t < threads; t++)
+	{
+		const size_t begin = std::min(count, t * chunk), end = std::min(count, begin + chunk);
+		workers.push_back(std::thread(f, begin, end));
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+}
+
+int main(int argc, char** argv)
+{
+	std::string input;
+	unsigned int width = 0;
+	int gridPixels = 64;
+	float sizeX = 16384, sizeY = 1024, sizeZ = 16384, range = 2048, clearance = 10;
+	size_t count = 100000, verifyCount = 2000;
+	int threads = std::max((int)std::thread::hardware_concurrency(), 1);
+	for (int i = 1; i < argc; i++)
+	{
+		std::string a = argv[i];
+		if (a == "-i" && i + 1 < argc) input = argv[++i];
+		else if (a == "-W" && i + 1 < argc) width = (unsigned int)atoi(argv[++i]);
+		else if (a == "--grid-pixels" && i + 1 < argc) gridPixels = atoi(argv[++i]);
+		else if (a == "--size" && i + 3 < argc)
+		{
+			sizeX = (float)atof(argv[++i]);
+			sizeY = (float)atof(argv[++i]);
+			sizeZ = (float)atof(argv[++i]);
+		}
+		else if (a == "--count" && i + 1 < argc) count = (size_t)std::max(atoi(argv[++i]), 1);
+		else if (a == "--range" && i + 1 < argc) range = (float)atof(argv[++i]);
+		else if (a == "--clearance" && i + 1 < argc) clearance = (float)atof(argv[++i]);
+		else if (a == "--threads" && i + 1 < argc) threads = std::max(atoi(argv[++i]), 1);
+		else if (a == "--verify" && i + 1 < argc) verifyCount = (size_t)std::max(atoi(argv[++i]), 0);
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+	if (input.empty() || gridPixels < 2 || width < 2 || (width - 1) % gridPixels != 0)
+	{
+		usage();
+		return 1;
+	}
+	const unsigned int nGrid = (width - 1) / gridPixels;
+	if (nGrid & (nGrid - 1))
+	{
+		fprintf(stderr, "the width has to be 2^n * grid pixels + 1\n");
+		return 1;
+	}
+
+	std::vector<unsigned short> heightmap((size_t)width * width);
+	FILE* fp = fopen(input.c_str(), "rb");
+	if (!fp || fread(&heightmap[0], sizeof(unsigned short), heightmap.size(), fp) != heightmap.size())
+	{
+		fprintf(stderr, "cannot read %s\n", input.c_str());
+		if (fp)
+			fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	TerrainPyramidParams p;
+	p.nGridX = p.nGridZ = nGrid;
+	p.lodLevelCount = 1;
+	while ((nGrid >> p.lodLevelCount) > 0)
+		p.lodLevelCount++;
+	p.nPixelX = p.nPixelZ = gridPixels;
+	p.gridDim = 33;
+	p.slopeX = sizeY / 65535.0f / (sizeX / (width - 1));
+	p.slopeZ = sizeY / 65535.0f / (sizeZ / (width - 1));
+	HeightMinMaxPyramid pyramid;
+	buildHeightMinMax(p, &heightmap[0], width, pyramid);
+
+	TerrainQuerySource src;
+	src.heights[0] = &heightmap[0];
+	src.heights[1] = 0;
+	src.pyramids[0] = &pyramid;
+	src.pyramids[1] = 0;
+	src.width = src.height = width;
+	src.params = p;
+	src.minX = -sizeX / 2;
+	src.minY = 0;
+	src.minZ = -sizeZ / 2;
+	src.gridSizeX = sizeX / nGrid;
+	src.gridSizeZ = sizeZ / nGrid;
+	src.sizeY = sizeY;
+	src.blendRatio = 1;
+	printf("%ux%u heightmap, %u levels, %d thread(s), batches of %u\n\n", width, width, p.lodLevelCount, threads, (unsigned int)count);
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> ux(src.minX, src.minX + sizeX), uz(src.minZ, src.minZ + sizeZ);
+	std::vector<float> x(count), z(count), y(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		x[i] = ux(rng);
+		z[i] = uz(rng);
+	}
+
+	// heightAt
+	double best = 1e9;
+	for (int r = 0; r < 5; r++)
+	{
+		const Clock::time_point start = Clock::now();
+		parallelFor(count, threads, [&](size_t begin, size_t end) {
+			terrainHeightAt(src, &x[begin], &z[begin], &y[begin], end - begin);
+		});
+		best = std::min(best, seconds(start));
+	}
+	printf("heightAt   %10.1f M queries/s\n", count / best / 1e6);
+
+	// lines of sight between points above the surface
+	std::vector<float> ends(count);
+	std::vector<float> x2(count), z2(count);
+	std::uniform_real_distribution<float> offset(-range / sqrtf(2), range / sqrtf(2));
+	for (size_t i = 0; i < count; i++)
+	{
+		// the map ends at its borders for the rays, not for the heights
+		x2[i] = std::min(std::max(x[i] + offset(rng), src.minX), src.minX + sizeX);
+		z2[i] = std::min(std::max(z[i] + offset(rng), src.minZ), src.minZ + sizeZ);
+	}
+	terrainHeightAt(src, &x2[0], &z2[0], &ends[0], count);
+	std::vector<TerrainRay> rays(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		TerrainRay& ray = rays[i];
+		ray.origin[0] = x[i];
+		ray.origin[1] = y[i] + clearance;
+		ray.origin[2] = z[i];
+		ray.direction[0] = x2[i] - x[i];
+		ray.direction[1] = ends[i] + clearance - ray.origin[1];
+		ray.direction[2] = z2[i] - z[i];
+		ray.maxDistance = 1;
+	}
+	std::vector<TerrainRayHit> hits(count);
+	best = 1e9;
+	for (int r = 0; r < 5; r++)
+	{
+		const Clock::time_point start = Clock::now();
+		parallelFor(count, threads, [&](size_t begin, size_t end) {
+			terrainRaycast(src, &rays[begin], &hits[begin], end - begin);
+		});
+		best = std::min(best, seconds(start));
+	}
+	size_t hitCount = 0;
+	for (size_t i = 0; i < count; i++)
+		if (hits[i].hit)
+			hitCount++;
+	printf("raycast    %10.1f M rays/s, %.1f ms per batch, %.1f%% blocked\n", count / best / 1e6, best * 1000, 100.0 * hitCount / count);
+
+	// brute force: march the ray in steps of a tenth of a pixel
+	size_t mismatches = 0;
+	double maxGap = 0;
+	verifyCount = std::min(verifyCount, count);
+	const float pixel = src.gridSizeX / gridPixels;
+	for (size_t i = 0; i < verifyCount; i++)
+	{
+		const TerrainRay& ray = rays[i];
+		const float length = sqrtf(ray.direction[0] * ray.direction[0] + ray.direction[2] * ray.direction[2]);
+		const int steps = std::max((int)(length / pixel * 10), 1);
+		float marched = -1;
+		for (int s = 0; s <= steps && marched < 0; s++)
+		{
+			const float t = (float)s / steps;
+			const float px = ray.origin[0] + ray.direction[0] * t, pz = ray.origin[2] + ray.direction[2] * t;
+			float h;
+			terrainHeightAt(src, &px, &pz, &h, 1);
+			if (ray.origin[1] + ray.direction[1] * t <= h)
+				marched = t;
+		}
+		// a march can step over a grazing contact, a cast can't stop later than the march
+		if (marched >= 0 && (!hits[i].hit || hits[i].distance > marched + 1e-4f))
+			mismatches++;
+		if (hits[i].hit)
+		{
+			// the hit has to be on the surface
+			float h;
+			terrainHeightAt(src, &hits[i].position[0], &hits[i].position[2], &h, 1);
+			maxGap = std::max(maxGap, (double)fabsf(hits[i].position[1] - h));
+		}
+	}
+	printf("verified   %u rays, %u mismatches, max height of a hit above the surface %.4f\n",
+		(unsigned int)verifyCount, (unsigned int)mismatches, maxGap);
+
+	freeHeightMinMax(pyramid);
+	return mismatches ? 1 : 0;
+}
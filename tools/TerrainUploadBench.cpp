@@ -0,0 +1,312 @@
+// Upload scheduler check: drives UploadScheduler with the headless RecordingUploadBackend and verifies
+// the band splitting under the byte budget, the pending rows, the priority order, cancel and the byte and time limits,
+// then reports how many frames a full heightmap upload takes for a few budgets.
+//
+// Prints the failed checks and exits with 1 if there are any.
+//
+// Build (no Ogre needed):
+//   g++ -O2 -std=c++11 -pthread -I../src TerrainUploadBench.cpp ../src/TerrainUploadScheduler.cpp -o terrainuploadbench
+
+#include "TerrainUploadScheduler.h"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+
+static int _failures = 0;
+
+#define CHECK(cond) \
+	do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); _failures++; } } while (0)
+
+// a backend whose uploads take a while, for the time limit
+class SlowUploadBackend : public RecordingUploadBackend
+{
+public:
+	float ms;
+
+	SlowUploadBackend(float uploadMs) : ms(uploadMs) {}
+	virtual void upload(void* texture, const unsigned short* src, size_t pitch, const UploadRect& rect)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds((long long)(ms * 1000)));
+		RecordingUploadBackend::upload(texture, src, pitch, rect);
+	}
+};
+
+static UploadRect makeRect(unsigned int left, unsigned int top, unsigned int right, unsigned int bottom)
+{
+	UploadRect r = { left, top, right, bottom };
+	return r;
+}
+
+static size_t rectBytes(const UploadRect& r)
+{
+	return (size_t)(r.right - r.left) * (r.bottom - r.top) * sizeof(unsigned short);
+}
+
+// the bands of a texture cover its rect once, top to bottom
+static bool coversRect(const RecordingUploadBackend& backend, void* texture, const UploadRect& rect)
+{
+	unsigned int row = rect.top;
+	for (size_t i = 0; i < backend.uploads.size(); i++)
+	{
+		const RecordingUploadBackend::Upload& u = backend.uploads[i];
+		if (u.texture != texture)
+			continue;
+		if (u.rect.left != rect.left || u.rect.right != rect.right || u.rect.top != row || u.rect.bottom <= u.rect.top)
+			return false;
+		row = u.rect.bottom;
+	}
+	return row == rect.bottom;
+}
+
+static void checkBudgetSplitting()
+{
+	std::vector<unsigned short> image(256 * 256);
+	RecordingUploadBackend backend;
+	UploadScheduler scheduler(&backend);
+	// 16 rows of 256 pixels per frame
+	const size_t budget = 16 * 256 * sizeof(unsigned short);
+	scheduler.setBudget(budget, 0);
+	int tex;
+	const UploadRect rect = makeRect(0, 0, 256, 256);
+	scheduler.submit(&tex, &image[0], 256, rect, 0);
+	CHECK(scheduler.isPending(&tex));
+	CHECK(scheduler.getStats().pendingJobs == 0);	// stats are those of the last update
+
+	int frames = 0;
+	while (scheduler.isPending(&tex) && frames < 100)
+	{
+		scheduler.update();
+		CHECK(scheduler.getStats().frameBytes <= budget);
+		frames++;
+		// the rows uploaded so far are no longer pending, the others are
+		const unsigned int done = std::min(frames * 16, 256);
+		CHECK(!scheduler.isPending(&tex, makeRect(0, 0, 256, done)));
+		CHECK(scheduler.isPending(&tex, makeRect(100, done - 1, 101, 256)) == (done < 256));
+	}
+	CHECK(frames == 16);
+	CHECK(backend.uploads.size() == 16);
+	CHECK(backend.bytes == rectBytes(rect));
+	CHECK(coversRect(backend, &tex, rect));
+	CHECK(scheduler.getStats().pendingJobs == 0 && scheduler.getStats().pendingBytes == 0);
+}
+
+static void checkByteLimit()
+{
+	std::vector<unsigned short> image(64 * 64);
+	RecordingUploadBackend backend;
+	UploadScheduler scheduler(&backend);
+	int tex;
+	const UploadRect rect = makeRect(8, 4, 40, 60);
+	const size_t rowBytes = (rect.right - rect.left) * sizeof(unsigned short);
+
+	// a budget below a row still uploads one row per frame
+	scheduler.setBudget(rowBytes / 2, 0);
+	scheduler.submit(&tex, &image[0], 64, rect, 0);
+	scheduler.update();
+	CHECK(backend.uploads.size() == 1);
+	CHECK(scheduler.getStats().frameBytes == rowBytes);
+	CHECK(scheduler.getStats().pendingBytes == rectBytes(rect) - rowBytes);
+
+	// the budget is cut down to whole rows
+	scheduler.setBudget(rowBytes * 5 + rowBytes / 2, 0);
+	scheduler.update();
+	CHECK(scheduler.getStats().frameBytes == rowBytes * 5);
+
+	// flush ignores the budget
+	scheduler.flush();
+	CHECK(!scheduler.isPending(&tex));
+	CHECK(backend.bytes == rectBytes(rect));
+	CHECK(coversRect(backend, &tex, rect));
+
+	// an empty rect is not queued
+	scheduler.submit(&tex, &image[0], 64, makeRect(4, 4, 4, 8), 0);
+	CHECK(!scheduler.isPending(&tex));
+}
+
+static void checkPriorityOrder()
+{
+	std::vector<unsigned short> image(32 * 32);
+	RecordingUploadBackend backend;
+	UploadScheduler scheduler(&backend);
+	int a, b, c, d;
+	const UploadRect rect = makeRect(0, 0, 32, 32);
+	scheduler.submit(&a, &image[0], 32, rect, 2.0f);
+	scheduler.submit(&b, &image[0], 32, rect, 0.5f);
+	scheduler.submit(&c, &image[0], 32, rect, 2.0f);
+	scheduler.submit(&d, &image[0], 32, rect, -1.0f);
+	// one texture per frame
+	scheduler.setBudget(rectBytes(rect), 0);
+	void* expected[] = { &d, &b, &a, &c };
+	for (int i = 0; i < 4; i++)
+	{
+		scheduler.update();
+		CHECK(backend.uploads.size() == (size_t)i + 1);
+		CHECK(backend.uploads.back().texture == expected[i]);
+		CHECK(scheduler.getStats().pendingJobs == (size_t)(3 - i));
+	}
+
+	// a higher priority submitted later goes first, the partly uploaded job resumes after it
+	backend.uploads.clear();
+	scheduler.setBudget(rectBytes(rect) / 2, 0);
+	scheduler.submit(&a, &image[0], 32, rect, 1.0f);
+	scheduler.update();
+	scheduler.submit(&b, &image[0], 32, rect, 0.0f);
+	scheduler.update();
+	scheduler.update();
+	scheduler.update();
+	CHECK(backend.uploads.size() == 4);
+	if (backend.uploads.size() == 4)
+	{
+		CHECK(backend.uploads[0].texture == &a && backend.uploads[0].rect.top == 0);
+		CHECK(backend.uploads[1].texture == &b && backend.uploads[2].texture == &b);
+		CHECK(backend.uploads[3].texture == &a && backend.uploads[3].rect.top == 16);
+	}
+	CHECK(coversRect(backend, &a, rect) && coversRect(backend, &b, rect));
+}
+
+static void checkCancel()
+{
+	std::vector<unsigned short> image(64 * 64);
+	RecordingUploadBackend backend;
+	UploadScheduler scheduler(&backend);
+	int a, b;
+	const UploadRect rect = makeRect(0, 0, 64, 64);
+	scheduler.setBudget(rectBytes(rect) / 4, 0);
+	scheduler.submit(&a, &image[0], 64, rect, 0);
+	scheduler.submit(&a, &image[0], 64, makeRect(0, 0, 8, 8), 1);
+	scheduler.submit(&b, &image[0], 64, rect, 1);
+	scheduler.update();
+	CHECK(backend.uploads.size() == 1 && backend.uploads[0].texture == &a);
+
+	// every pending update of the texture goes, the others stay
+	scheduler.cancel(&a);
+	CHECK(!scheduler.isPending(&a));
+	CHECK(scheduler.isPending(&b));
+	scheduler.flush();
+	CHECK(backend.uploads.size() == 2 && backend.uploads[1].texture == &b);
+	CHECK(coversRect(backend, &b, rect));
+	CHECK(!scheduler.isPending(&b));
+
+	// keepAlive is released with the job, done or cancelled
+	std::shared_ptr<const void> owner = std::make_shared<std::vector<unsigned short> >(image);
+	scheduler.submit(&a, &image[0], 64, rect, 0, owner);
+	CHECK(owner.use_count() == 2);
+	scheduler.cancel(&a);
+	CHECK(owner.use_count() == 1);
+	scheduler.submit(&a, &image[0], 64, rect, 0, owner);
+	scheduler.flush();
+	CHECK(owner.use_count() == 1);
+
+	// clear drops everything
+	scheduler.submit(&a, &image[0], 64, rect, 0);
+	scheduler.submit(&b, &image[0], 64, rect, 0);
+	scheduler.clear();
+	CHECK(!scheduler.isPending(&a) && !scheduler.isPending(&b));
+}
+
+static void checkTimeLimit()
+{
+	std::vector<unsigned short> image(16 * 16);
+	SlowUploadBackend backend(2.0f);
+	UploadScheduler scheduler(&backend);
+	int tex[10];
+	for (int i = 0; i < 10; i++)
+		scheduler.submit(&tex[i], &image[0], 16, makeRect(0, 0, 16, 16), 0);
+
+	// no byte limit, each upload takes 2 ms: the 5 ms budget is used up after 3 at most
+	scheduler.setBudget(0, 5.0f);
+	scheduler.update();
+	const size_t first = backend.uploads.size();
+	CHECK(first >= 1 && first <= 3);
+	CHECK(scheduler.getStats().frameRects == first);
+
+	// a budget below one upload still uploads one per frame
+	scheduler.setBudget(0, 0.5f);
+	scheduler.update();
+	CHECK(backend.uploads.size() == first + 1);
+
+	int frames = 0;
+	while (scheduler.getStats().pendingJobs > 0 && frames < 100)
+	{
+		scheduler.update();
+		frames++;
+	}
+	CHECK(backend.uploads.size() == 10);
+	for (int i = 0; i < 10; i++)
+		CHECK(!scheduler.isPending(&tex[i]));
+
+	// a large update is split into bands all the same, the time is checked between them
+	std::vector<unsigned short> large(2048 * 1024);
+	const UploadRect rect = makeRect(0, 0, 2048, 1024);
+	int big;
+	backend.uploads.clear();
+	backend.bytes = 0;
+	scheduler.setBudget(0, 5.0f);
+	scheduler.submit(&big, &large[0], 2048, rect, 0);
+	scheduler.update();
+	CHECK(backend.uploads.size() >= 1 && backend.uploads.size() <= 3);
+	CHECK(backend.bytes < rectBytes(rect));
+	CHECK(scheduler.isPending(&big));
+
+	// flush has no time budget, the rest goes at once
+	scheduler.flush();
+	CHECK(!scheduler.isPending(&big));
+	CHECK(backend.uploads.back().rect.top < 1024 - 128);
+	CHECK(coversRect(backend, &big, rect));
+}
+
+// frames and time per frame to upload a heightmap of the given size under a few byte budgets
+static void reportBudgets(unsigned int size)
+{
+	std::vector<unsigned short> image((size_t)size * size);
+	const size_t budgets[] = { 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+	printf("%ux%u heightmap (%.1f MB)\n", size, size, image.size() * sizeof(unsigned short) / (1024.0 * 1024.0));
+	for (int b = 0; b < 3; b++)
+	{
+		RecordingUploadBackend backend;
+		UploadScheduler scheduler(&backend);
+		scheduler.setBudget(budgets[b], 0);
+		int tex;
+		scheduler.submit(&tex, &image[0], size, makeRect(0, 0, size, size), 0);
+		int frames = 0;
+		size_t maxBytes = 0;
+		float maxMs = 0;
+		while (scheduler.isPending(&tex))
+		{
+			scheduler.update();
+			maxBytes = std::max(maxBytes, scheduler.getStats().frameBytes);
+			maxMs = std::max(maxMs, scheduler.getStats().frameMs);
+			frames++;
+		}
+		printf("  budget %5u KB: %4d frames, at most %5u KB and %.3f ms scheduling per frame\n",
+			(unsigned int)(budgets[b] / 1024), frames, (unsigned int)(maxBytes / 1024), maxMs);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const unsigned int size = argc > 1 ? (unsigned int)atoi(argv[1]) : 4097;
+	if (size < 2)
+	{
+		fprintf(stderr, "usage: terrainuploadbench [heightmap size (default 4097)]\n");
+		return 1;
+	}
+
+	checkBudgetSplitting();
+	checkByteLimit();
+	checkPriorityOrder();
+	checkCancel();
+	checkTimeLimit();
+	if (_failures)
+	{
+		fprintf(stderr, "%d checks failed\n", _failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+
+	reportBudgets(size);
+	return 0;
+}